@@ -7,6 +7,10 @@
 
 #include "rtbkit/common/account_key.h"
 #include "jml/db/persistent.h"
+#include "jml/arch/spinlock.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 using namespace ML;
@@ -50,4 +54,224 @@ reconstitute(ML::DB::Store_Reader & store)
     store.load(static_cast<AccountKeyBase &>(*this));
 }
 
+
+/*****************************************************************************/
+/* ACCOUNT PATHS                                                             */
+/*****************************************************************************/
+
+const AccountPathId AccountPaths::ROOT;
+const AccountPathId AccountPaths::NONE;
+
+namespace {
+
+struct PathEntry {
+    AccountKey key;
+    uint64_t hash;
+    AccountPathId parent;
+    int depth;
+    std::string str;
+    std::string dotted;
+};
+
+/** Entries are allocated in chunks that never move, so that they can be
+    read while others are added. */
+const size_t CHUNK_BITS = 12;
+const size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+const size_t MAX_CHUNKS = 1 << 16;
+
+/** Open addressing table from the hash of a key to its id.  It's replaced
+    by a larger one when it's half full; the old ones are kept, as readers
+    may still be looking into them.
+*/
+struct PathIndex {
+    PathIndex(size_t size)
+        : slots(new std::atomic<AccountPathId>[size]),
+          mask(size - 1)
+    {
+        for (size_t i = 0;  i < size;  ++i)
+            slots[i].store(AccountPaths::NONE, std::memory_order_relaxed);
+    }
+
+    std::unique_ptr<std::atomic<AccountPathId>[]> slots;
+    size_t mask;
+};
+
+struct PathTable {
+    PathTable()
+        : numPaths(0), numIndexed(0)
+    {
+        for (auto & c: chunks)
+            c.store(0, std::memory_order_relaxed);
+        indexes.emplace_back(new PathIndex(1024));
+        index.store(indexes.back().get(), std::memory_order_release);
+
+        AccountKey root;
+        add(root, root.hash(), AccountPaths::ROOT);
+    }
+
+    std::atomic<PathEntry *> chunks[MAX_CHUNKS];
+    std::atomic<uint32_t> numPaths;
+
+    std::atomic<PathIndex *> index;
+
+    typedef ML::Spinlock Lock;
+    typedef std::unique_lock<Lock> Guard;
+    Lock lock;                                      ///< Serializes writers
+    std::vector<std::unique_ptr<PathIndex> > indexes;
+    size_t numIndexed;
+
+    const PathEntry & entry(AccountPathId path) const
+    {
+        if (path >= numPaths.load(std::memory_order_acquire))
+            throw ML::Exception("unknown account path %d", (int)path);
+        return chunks[path >> CHUNK_BITS].load(std::memory_order_acquire)
+            [path & (CHUNK_SIZE - 1)];
+    }
+
+    AccountPathId find(const AccountKey & key, uint64_t hash) const
+    {
+        const PathIndex * idx = index.load(std::memory_order_acquire);
+        for (size_t i = hash & idx->mask;;  i = (i + 1) & idx->mask) {
+            AccountPathId path = idx->slots[i].load(std::memory_order_acquire);
+            if (path == AccountPaths::NONE)
+                return AccountPaths::NONE;
+            const PathEntry & e = entry(path);
+            if (e.hash == hash && e.key == key)
+                return path;
+        }
+    }
+
+    AccountPathId intern(const AccountKey & key)
+    {
+        uint64_t hash = key.hash();
+        AccountPathId result = find(key, hash);
+        if (result != AccountPaths::NONE)
+            return result;
+
+        AccountPathId parent = intern(key.parent());
+
+        Guard guard(lock);
+        // Someone else may have got there first
+        result = find(key, hash);
+        if (result != AccountPaths::NONE)
+            return result;
+        return add(key, hash, parent);
+    }
+
+    /** Add a new entry.  Must be called with the lock held. */
+    AccountPathId add(const AccountKey & key, uint64_t hash,
+                      AccountPathId parent)
+    {
+        AccountPathId path = numPaths.load(std::memory_order_relaxed);
+        size_t chunk = path >> CHUNK_BITS;
+        if (chunk >= MAX_CHUNKS)
+            throw ML::Exception("too many account paths");
+
+        PathEntry * entries = chunks[chunk].load(std::memory_order_relaxed);
+        if (!entries) {
+            entries = new PathEntry[CHUNK_SIZE];
+            chunks[chunk].store(entries, std::memory_order_release);
+        }
+
+        PathEntry & e = entries[path & (CHUNK_SIZE - 1)];
+        e.key = key;
+        e.hash = hash;
+        e.parent = parent;
+        e.depth = key.size();
+        e.str = key.toString();
+        e.dotted = key.toString('.');
+        numPaths.store(path + 1, std::memory_order_release);
+
+        PathIndex * idx = index.load(std::memory_order_relaxed);
+        if ((numIndexed + 1) * 2 > idx->mask + 1) {
+            indexes.emplace_back(new PathIndex(2 * (idx->mask + 1)));
+            PathIndex * newIdx = indexes.back().get();
+            for (AccountPathId p = 0;  p < path;  ++p)
+                insert(newIdx, p, entry(p).hash);
+            index.store(newIdx, std::memory_order_release);
+            idx = newIdx;
+        }
+
+        // Publishing the id is what makes the entry visible to find()
+        insert(idx, path, hash);
+        ++numIndexed;
+
+        return path;
+    }
+
+    static void insert(PathIndex * idx, AccountPathId path, uint64_t hash)
+    {
+        size_t i = hash & idx->mask;
+        while (idx->slots[i].load(std::memory_order_relaxed)
+               != AccountPaths::NONE)
+            i = (i + 1) & idx->mask;
+        idx->slots[i].store(path, std::memory_order_release);
+    }
+};
+
+PathTable & pathTable()
+{
+    // Never destroyed, as ids can be used during exit
+    static PathTable * table = new PathTable();
+    return *table;
+}
+
+} // file scope
+
+AccountPathId
+AccountPaths::
+intern(const AccountKey & key)
+{
+    return pathTable().intern(key);
+}
+
+AccountPathId
+AccountPaths::
+find(const AccountKey & key)
+{
+    return pathTable().find(key, key.hash());
+}
+
+const AccountKey &
+AccountPaths::
+key(AccountPathId path)
+{
+    return pathTable().entry(path).key;
+}
+
+AccountPathId
+AccountPaths::
+parent(AccountPathId path)
+{
+    return pathTable().entry(path).parent;
+}
+
+int
+AccountPaths::
+depth(AccountPathId path)
+{
+    return pathTable().entry(path).depth;
+}
+
+const std::string &
+AccountPaths::
+str(AccountPathId path)
+{
+    return pathTable().entry(path).str;
+}
+
+const std::string &
+AccountPaths::
+dotted(AccountPathId path)
+{
+    return pathTable().entry(path).dotted;
+}
+
+size_t
+AccountPaths::
+size()
+{
+    return pathTable().numPaths.load(std::memory_order_acquire);
+}
+
 } // namespace RTBKIT
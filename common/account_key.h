@@ -9,6 +9,7 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 #include "jml/utils/string_functions.h"
 #include "jml/arch/exception.h"
 #include "jml/db/persistent_fwd.h"
@@ -115,7 +116,7 @@ struct AccountKey : public AccountKeyBase {
     uint64_t hash() const
     {
         uint64_t res = 1232134;
-        for (auto s: *this)
+        for (const std::string & s: *this)
             res = CityHash64WithSeed(s.c_str(), s.size(), res);
         return res;
     }
@@ -141,6 +142,71 @@ operator << (std::ostream & stream, const AccountKey & key)
     return stream << key.toString();
 }
 
+
+/*****************************************************************************/
+/* ACCOUNT PATHS                                                             */
+/*****************************************************************************/
+
+/** Compact id of an account key, given by AccountPaths. */
+typedef uint32_t AccountPathId;
+
+/** Process wide table that gives each distinct account key a small integer
+    id, so that containers of accounts can be keyed on an integer instead of
+    a vector of strings.  AccountKey stays the form that accounts are known
+    by outside of the process.
+
+    Every path is interned along with its ancestors, and knows the id of its
+    parent, its depth and its joined forms, so that walking up the tree and
+    naming an account in metrics cost nothing more than a lookup.
+
+    Paths are never removed; there are only as many as there are accounts
+    that the process has ever seen.  Looking up an id, or a key that is
+    already interned, takes no lock.
+*/
+
+struct AccountPaths {
+
+    /** Id of the empty key, which is the parent of the top level
+        accounts. */
+    static const AccountPathId ROOT = 0;
+
+    /** Returned by find() for a key that was never interned. */
+    static const AccountPathId NONE = (AccountPathId)-1;
+
+    /** Id of the given key, interning it and its ancestors if it's new. */
+    static AccountPathId intern(const AccountKey & key);
+
+    /** Id of the given key, or NONE if it was never interned. */
+    static AccountPathId find(const AccountKey & key);
+
+    static const AccountKey & key(AccountPathId path);
+    static AccountPathId parent(AccountPathId path);
+    static int depth(AccountPathId path);
+
+    /** The key joined with ':', as given by AccountKey::toString(). */
+    static const std::string & str(AccountPathId path);
+
+    /** The key joined with '.', as used in metric names. */
+    static const std::string & dotted(AccountPathId path);
+
+    static const std::string & dotted(const AccountKey & key)
+    {
+        return dotted(intern(key));
+    }
+
+    /** Is prefix the given path or one of its ancestors? */
+    static bool hasPrefix(AccountPathId path, AccountPathId prefix)
+    {
+        int prefixDepth = depth(prefix);
+        while (depth(path) > prefixDepth)
+            path = parent(path);
+        return path == prefix;
+    }
+
+    /** Number of paths interned, including the root. */
+    static size_t size();
+};
+
 } // namespace RTBKIT
 
 namespace std {
@@ -188,6 +188,47 @@ Auction(HandleAuction handleAuction,
 
 Auction::
 ~Auction()
+{
+    freeData();
+
+    ML::atomic_add(destroyed, 1);
+}
+
+void
+Auction::
+reset(HandleAuction handleAuction,
+      std::shared_ptr<BidRequest> request,
+      const std::string & requestStr,
+      const std::string & requestStrFormat,
+      Date start,
+      Date expiry)
+{
+    freeData();
+
+    isZombie = false;
+    this->start = start;
+    this->expiry = expiry;
+    lossAssumed = Date();
+    doneParsing = inPrepro = outOfPrepro = doneAugmenting = Date();
+    inStartBidding = Date();
+
+    // Assigning rather than swapping in new strings keeps their buffers
+    this->request = request;
+    this->requestStr = requestStr;
+    this->requestStrFormat = requestStrFormat;
+    this->requestSerialized = request->serializeToString();
+    this->id = request->auctionId;
+
+    augmentations.clear();
+    agentAugmentations.clear();
+
+    this->handleAuction = handleAuction;
+    data = new Data(numSpots());
+}
+
+void
+Auction::
+freeData()
 {
     // Clean up the chain of data pointers
     Data * d = data;
@@ -196,8 +237,7 @@ Auction::
         delete d;
         d = d2;
     }
-
-    ML::atomic_add(destroyed, 1);
+    data = 0;
 }
 
 long long Auction::created = 0;
@@ -49,6 +49,17 @@ struct Auction : public std::enable_shared_from_this<Auction> {
     
     ~Auction();
 
+    /** Put the auction back into the state that it would have had if it had
+        just been constructed with the given arguments.  Used to recycle
+        auctions (see AuctionPool); the auction must not be in use.
+    */
+    void reset(HandleAuction handleAuction,
+               std::shared_ptr<BidRequest> request,
+               const std::string & requestStr,
+               const std::string & requestStrFormat,
+               Date start,
+               Date expiry);
+
     bool isZombie;  ///< Auction was externally cancelled
 
     Date start;
@@ -258,6 +269,9 @@ struct Auction : public std::enable_shared_from_this<Auction> {
 private:
     Data * data;
 
+    /** Free the chain of data pointers. */
+    void freeData();
+
 public:
     /// Memory leak tracking
     static long long created;
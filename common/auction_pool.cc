@@ -0,0 +1,186 @@
+/* auction_pool.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Pool of recycled Auction objects.
+*/
+
+#include "auction_pool.h"
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* AUCTION POOL                                                              */
+/*****************************************************************************/
+
+AuctionPool::
+AuctionPool(size_t maxPooled)
+    : maxPooled_(maxPooled),
+      shutdown_(false),
+      allocated(0), reused(0), released(0), freed(0)
+{
+    pooled.reserve(maxPooled);
+}
+
+AuctionPool::
+~AuctionPool()
+{
+    {
+        std::unique_lock<std::mutex> guard(deleteLock);
+        shutdown_ = true;
+    }
+    deleteCond.notify_one();
+    if (deleter)
+        deleter->join();
+
+    for (auto a: toDelete)
+        delete a;
+    for (auto a: pooled)
+        delete a;
+}
+
+std::shared_ptr<Auction>
+AuctionPool::
+create(Auction::HandleAuction handleAuction,
+       std::shared_ptr<BidRequest> request,
+       const std::string & requestStr,
+       const std::string & requestStrFormat,
+       Date start,
+       Date expiry)
+{
+    Auction * auction = 0;
+
+    if (maxPooled_) {
+        Guard guard(lock);
+        if (!pooled.empty()) {
+            auction = pooled.back();
+            pooled.pop_back();
+        }
+    }
+
+    if (auction) {
+        ++reused;
+        try {
+            auction->reset(handleAuction, request, requestStr,
+                           requestStrFormat, start, expiry);
+        } catch (...) {
+            delete auction;
+            throw;
+        }
+    }
+    else {
+        ++allocated;
+        auction = new Auction(handleAuction, request, requestStr,
+                              requestStrFormat, start, expiry);
+    }
+
+    if (!maxPooled_)
+        return std::shared_ptr<Auction>(auction);
+
+    return std::shared_ptr<Auction>(auction,
+                                    [=] (Auction * a) { this->release(a); });
+}
+
+void
+AuctionPool::
+release(Auction * auction)
+{
+    ++released;
+
+    // Don't keep the request and augmentations alive while pooled.  The
+    // callback goes too, as it may hold on to the router.
+    auction->request.reset();
+    auction->augmentations.clear();
+    auction->agentAugmentations.clear();
+    auction->handleAuction = Auction::HandleAuction();
+
+    {
+        Guard guard(lock);
+        if (pooled.size() < maxPooled_) {
+            pooled.push_back(auction);
+            return;
+        }
+    }
+
+    ++freed;
+    deleteLater(auction);
+}
+
+void
+AuctionPool::
+deleteLater(Auction * auction)
+{
+    {
+        std::unique_lock<std::mutex> guard(deleteLock);
+        toDelete.push_back(auction);
+        if (!deleter)
+            deleter.reset(new boost::thread([=] () { this->runDeleter(); }));
+    }
+    deleteCond.notify_one();
+}
+
+void
+AuctionPool::
+runDeleter()
+{
+    std::vector<Auction *> current;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(deleteLock);
+            while (toDelete.empty() && !shutdown_)
+                deleteCond.wait(guard);
+            if (toDelete.empty())
+                return;
+            current.swap(toDelete);
+        }
+
+        for (auto a: current)
+            delete a;
+        current.clear();
+    }
+}
+
+AuctionPool::Stats
+AuctionPool::
+stats() const
+{
+    Stats result;
+    result.allocated = allocated;
+    result.reused = reused;
+    result.released = released;
+    result.freed = freed;
+
+    Guard guard(lock);
+    result.pooled = pooled.size();
+    return result;
+}
+
+Json::Value
+AuctionPool::Stats::
+toJson() const
+{
+    Json::Value result;
+    result["allocated"] = (double)allocated;
+    result["reused"] = (double)reused;
+    result["released"] = (double)released;
+    result["freed"] = (double)freed;
+    result["pooled"] = (double)pooled;
+    return result;
+}
+
+AuctionPool &
+AuctionPool::
+global()
+{
+    // Never destroyed, as auctions can be given back during exit
+    static AuctionPool * pool = new AuctionPool();
+    return *pool;
+}
+
+} // namespace RTBKIT
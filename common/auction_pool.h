@@ -0,0 +1,114 @@
+/* auction_pool.h                                                  -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Pool of recycled Auction objects.
+*/
+
+#pragma once
+
+#include "rtbkit/common/auction.h"
+#include "jml/arch/spinlock.h"
+#include "soa/jsoncpp/json.h"
+#include <boost/thread/thread.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* AUCTION POOL                                                              */
+/*****************************************************************************/
+
+/** Hands out auctions that are returned to the pool instead of being
+    destroyed when their last reference goes away.
+
+    Giving an auction back is cheap whatever thread does it.  The auction
+    lets go of its request and augmentations, so that a pooled auction
+    doesn't keep them alive, and the pointer is pushed onto a free list.
+    The rest of the auction (its responses and string buffers) is cleared
+    out when it's next handed out, by the thread that wants a new auction.
+    That moves most of the cost of tearing down auctions off the router's
+    main loop, where the last reference is normally dropped, and onto the
+    exchange connector threads, which are about to allocate anyway.
+
+    When the pool is full, the auctions that don't fit are deleted by a
+    background thread rather than by the thread that gave them back.
+
+    An auction can be given back after the pool is destroyed only if the
+    pool is the global one, which is never destroyed.
+*/
+
+struct AuctionPool {
+
+    /** Keep up to maxPooled auctions for reuse.  Zero turns off pooling;
+        the auctions are then created and destroyed as usual. */
+    AuctionPool(size_t maxPooled = 4096);
+
+    ~AuctionPool();
+
+    /** Same as constructing an Auction with the given arguments. */
+    std::shared_ptr<Auction>
+    create(Auction::HandleAuction handleAuction,
+           std::shared_ptr<BidRequest> request,
+           const std::string & requestStr,
+           const std::string & requestStrFormat,
+           Date start,
+           Date expiry);
+
+    struct Stats {
+        Stats()
+            : allocated(0), reused(0), released(0), freed(0), pooled(0)
+        {
+        }
+
+        uint64_t allocated;   ///< Auctions that had to be allocated
+        uint64_t reused;      ///< Auctions handed out from the pool
+        uint64_t released;    ///< Auctions given back to the pool
+        uint64_t freed;       ///< Given back but freed as the pool was full
+                              ///< (possibly still waiting to be deleted)
+        uint64_t pooled;      ///< Auctions currently in the pool
+
+        Json::Value toJson() const;
+    };
+
+    Stats stats() const;
+
+    size_t maxPooled() const { return maxPooled_; }
+
+    /** Pool shared by the exchange connectors and the router. */
+    static AuctionPool & global();
+
+private:
+    void release(Auction * auction);
+
+    /** Hand the auction to the deleter thread, starting it if needed. */
+    void deleteLater(Auction * auction);
+
+    /** Body of the deleter thread. */
+    void runDeleter();
+
+    size_t maxPooled_;
+
+    typedef ML::Spinlock Lock;
+    typedef std::unique_lock<Lock> Guard;
+    mutable Lock lock;
+    std::vector<Auction *> pooled;
+
+    std::mutex deleteLock;
+    std::condition_variable deleteCond;
+    std::vector<Auction *> toDelete;   ///< Waiting for the deleter thread
+    bool shutdown_;
+    std::unique_ptr<boost::thread> deleter;
+
+    std::atomic<uint64_t> allocated;
+    std::atomic<uint64_t> reused;
+    std::atomic<uint64_t> released;
+    std::atomic<uint64_t> freed;
+};
+
+} // namespace RTBKIT
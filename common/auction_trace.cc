@@ -0,0 +1,395 @@
+/* auction_trace.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Sampled, always-on tracing of the phases that an auction goes through.
+*/
+
+#include "auction_trace.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <map>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* AUCTION PHASE                                                             */
+/*****************************************************************************/
+
+namespace {
+
+const char * phaseNames[AP_NUM_PHASES] = {
+    "NONE",
+    "EXCHANGE_REQUEST",
+    "EXCHANGE_PARSED",
+    "EXCHANGE_DROPPED",
+    "EXCHANGE_RESPONSE",
+    "ROUTER_NEW",
+    "AUGMENTATION_START",
+    "AUGMENTOR_SENT",
+    "AUGMENTOR_RESPONSE",
+    "AUGMENTATION_DONE",
+    "START_BIDDING",
+    "AGENT_AUCTION",
+    "AGENT_BID",
+    "AUCTION_EXPIRED",
+    "SUBMITTED",
+    "PAL_SUBMITTED",
+    "PAL_WIN",
+    "PAL_LOSS",
+    "PAL_CAMPAIGN_EVENT"
+};
+
+} // file scope
+
+const char * print(AuctionPhase phase)
+{
+    if (phase < 0 || phase >= AP_NUM_PHASES)
+        throw ML::Exception("unknown auction phase %d", (int)phase);
+    return phaseNames[phase];
+}
+
+AuctionPhase parseAuctionPhase(const std::string & str)
+{
+    for (unsigned i = 0;  i < AP_NUM_PHASES;  ++i)
+        if (str == phaseNames[i])
+            return (AuctionPhase)i;
+    throw ML::Exception("unknown auction phase " + str);
+}
+
+
+/*****************************************************************************/
+/* AUCTION TRACE RECORD                                                      */
+/*****************************************************************************/
+
+Json::Value
+AuctionTraceRecord::
+toJson() const
+{
+    Json::Value result;
+    result["auction"] = ML::format("%016llx", (unsigned long long)auction);
+    result["timestamp"] = timestamp;
+    result["phase"] = print((AuctionPhase)phase);
+    result["agentSlot"] = agentSlot;
+    result["payload"] = (double)payload;
+    result["thread"] = thread;
+    return result;
+}
+
+AuctionTraceRecord
+AuctionTraceRecord::
+fromJson(const Json::Value & val)
+{
+    AuctionTraceRecord result;
+    result.auction = strtoull(val["auction"].asString().c_str(), 0, 16);
+    result.timestamp = val["timestamp"].asDouble();
+    result.phase = parseAuctionPhase(val["phase"].asString());
+    result.agentSlot = val["agentSlot"].asInt();
+    result.payload = val["payload"].asDouble();
+    result.thread = val["thread"].asInt();
+    return result;
+}
+
+
+/*****************************************************************************/
+/* TRACE BUFFER                                                              */
+/*****************************************************************************/
+
+namespace {
+
+/** Ring buffer written by a single thread and read by any thread.  A record
+    is published by incrementing writeIndex; readers check the index again
+    after copying to find out which records were overwritten in the
+    meantime.
+*/
+
+struct TraceBuffer {
+    TraceBuffer(size_t size, uint32_t thread)
+        : records(size), mask(size - 1), writeIndex(0), readFrom(0),
+          thread(thread)
+    {
+    }
+
+    void write(const AuctionTraceRecord & record)
+    {
+        uint64_t index = writeIndex.load(std::memory_order_relaxed);
+        records[index & mask] = record;
+        writeIndex.store(index + 1, std::memory_order_release);
+    }
+
+    void read(std::vector<AuctionTraceRecord> & result, uint64_t auction,
+              bool allAuctions) const
+    {
+        uint64_t end = writeIndex.load(std::memory_order_acquire);
+        uint64_t size = records.size();
+        uint64_t begin = std::max<uint64_t>(readFrom, end > size ? end - size : 0);
+
+        std::vector<std::pair<uint64_t, AuctionTraceRecord> > copied;
+        for (uint64_t i = begin;  i < end;  ++i) {
+            const AuctionTraceRecord & record = records[i & mask];
+            if (allAuctions || record.auction == auction)
+                copied.push_back(make_pair(i, record));
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = writeIndex.load(std::memory_order_relaxed);
+
+        // Anything that the writer could have reached since is garbage
+        for (auto & c: copied)
+            if (c.first + size > after)
+                result.push_back(c.second);
+    }
+
+    void clear()
+    {
+        readFrom = writeIndex.load(std::memory_order_acquire);
+    }
+
+    std::vector<AuctionTraceRecord> records;
+    uint64_t mask;
+    std::atomic<uint64_t> writeIndex;
+    std::atomic<uint64_t> readFrom;
+    uint32_t thread;
+};
+
+std::mutex buffersLock;
+std::vector<TraceBuffer *> buffers;  // never freed, as threads hold them
+size_t bufferSize = 16384;
+
+__thread TraceBuffer * threadBuffer = 0;
+
+TraceBuffer * getThreadBuffer()
+{
+    if (JML_UNLIKELY(!threadBuffer)) {
+        std::unique_lock<std::mutex> guard(buffersLock);
+        threadBuffer = new TraceBuffer(bufferSize, buffers.size());
+        buffers.push_back(threadBuffer);
+    }
+    return threadBuffer;
+}
+
+std::vector<AuctionTraceRecord>
+readBuffers(uint64_t auction, bool allAuctions)
+{
+    std::vector<TraceBuffer *> toRead;
+    {
+        std::unique_lock<std::mutex> guard(buffersLock);
+        toRead = buffers;
+    }
+
+    std::vector<AuctionTraceRecord> result;
+    for (auto b: toRead)
+        b->read(result, auction, allAuctions);
+
+    auto byTime = [] (const AuctionTraceRecord & r1,
+                      const AuctionTraceRecord & r2)
+        {
+            return r1.timestamp < r2.timestamp;
+        };
+
+    std::stable_sort(result.begin(), result.end(), byTime);
+    return result;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* AUCTION TRACE                                                             */
+/*****************************************************************************/
+
+// Default is to trace one auction in a hundred
+uint64_t AuctionTrace::sampleThreshold = (uint64_t)-1 / 100;
+
+void
+AuctionTrace::
+recordImpl(uint64_t hash, AuctionPhase phase, Date timestamp,
+           int agentSlot, uint64_t payload)
+{
+    TraceBuffer * buffer = getThreadBuffer();
+
+    AuctionTraceRecord record;
+    record.auction = hash;
+    record.timestamp = timestamp.secondsSinceEpoch();
+    record.payload = payload;
+    record.phase = phase;
+    record.agentSlot = agentSlot;
+    record.thread = buffer->thread;
+
+    buffer->write(record);
+}
+
+void
+AuctionTrace::
+setSampleRate(double rate)
+{
+    if (rate <= 0.0)
+        sampleThreshold = 0;
+    else if (rate >= 1.0)
+        sampleThreshold = (uint64_t)-1;
+    else sampleThreshold = rate * 18446744073709551616.0;
+}
+
+double
+AuctionTrace::
+sampleRate()
+{
+    return sampleThreshold / 18446744073709551616.0;
+}
+
+void
+AuctionTrace::
+setBufferSize(size_t numRecords)
+{
+    if (numRecords == 0 || (numRecords & (numRecords - 1)))
+        throw ML::Exception("trace buffer size %zd isn't a power of two",
+                            numRecords);
+
+    std::unique_lock<std::mutex> guard(buffersLock);
+    bufferSize = numRecords;
+}
+
+std::vector<AuctionTraceRecord>
+AuctionTrace::
+records()
+{
+    return readBuffers(0, true);
+}
+
+std::vector<AuctionTraceRecord>
+AuctionTrace::
+records(const Id & auction)
+{
+    return readBuffers(auction.hash(), false);
+}
+
+void
+AuctionTrace::
+clear()
+{
+    std::unique_lock<std::mutex> guard(buffersLock);
+    for (auto b: buffers)
+        b->clear();
+}
+
+Json::Value
+AuctionTrace::
+toJson(const std::vector<AuctionTraceRecord> & records)
+{
+    Json::Value result(Json::arrayValue);
+    for (auto & r: records)
+        result.append(r.toJson());
+    return result;
+}
+
+std::vector<AuctionTraceRecord>
+AuctionTrace::
+fromJson(const Json::Value & val)
+{
+    std::vector<AuctionTraceRecord> result;
+    for (unsigned i = 0;  i < val.size();  ++i)
+        result.push_back(AuctionTraceRecord::fromJson(val[i]));
+    return result;
+}
+
+Json::Value
+AuctionTrace::
+toChromeTrace(const std::vector<AuctionTraceRecord> & records,
+              const std::string & processName)
+{
+    // Chrome wants microseconds
+    auto micros = [] (double seconds) { return seconds * 1000000.0; };
+
+    // Auction tracks go after the threads
+    static const int auctionTrackBase = 100000;
+
+    Json::Value events(Json::arrayValue);
+
+    auto addMetadata = [&] (const char * name, int tid,
+                            const std::string & value)
+        {
+            Json::Value event;
+            event["name"] = name;
+            event["ph"] = "M";
+            event["pid"] = 1;
+            event["tid"] = tid;
+            event["args"]["name"] = value;
+            events.append(event);
+        };
+
+    auto recordArgs = [] (const AuctionTraceRecord & record)
+        {
+            Json::Value args;
+            args["auction"] = ML::format("%016llx",
+                                         (unsigned long long)record.auction);
+            if (record.agentSlot != -1)
+                args["agentSlot"] = record.agentSlot;
+            args["payload"] = (double)record.payload;
+            return args;
+        };
+
+    addMetadata("process_name", 0, processName);
+
+    std::map<uint64_t, std::vector<const AuctionTraceRecord *> > byAuction;
+    std::map<uint32_t, bool> threads;
+
+    for (auto & r: records) {
+        byAuction[r.auction].push_back(&r);
+        threads[r.thread] = true;
+
+        Json::Value event;
+        event["name"] = print((AuctionPhase)r.phase);
+        event["cat"] = "phase";
+        event["ph"] = "i";
+        event["s"] = "t";
+        event["ts"] = micros(r.timestamp);
+        event["pid"] = 1;
+        event["tid"] = r.thread;
+        event["args"] = recordArgs(r);
+        events.append(event);
+    }
+
+    for (auto & t: threads)
+        addMetadata("thread_name", t.first,
+                    ML::format("thread %d", (int)t.first));
+
+    int track = auctionTrackBase;
+    for (auto & a: byAuction) {
+        auto & auctionRecords = a.second;
+        addMetadata("thread_name", track,
+                    ML::format("auction %016llx", (unsigned long long)a.first));
+
+        for (unsigned i = 0;  i + 1 < auctionRecords.size();  ++i) {
+            const AuctionTraceRecord & r = *auctionRecords[i];
+            const AuctionTraceRecord & next = *auctionRecords[i + 1];
+
+            Json::Value event;
+            event["name"] = print((AuctionPhase)r.phase);
+            event["cat"] = "auction";
+            event["ph"] = "X";
+            event["ts"] = micros(r.timestamp);
+            event["dur"] = micros(next.timestamp - r.timestamp);
+            event["pid"] = 1;
+            event["tid"] = track;
+            event["args"] = recordArgs(r);
+            events.append(event);
+        }
+
+        ++track;
+    }
+
+    Json::Value result;
+    result["traceEvents"] = events;
+    result["displayTimeUnit"] = "ms";
+    return result;
+}
+
+} // namespace RTBKIT
@@ -0,0 +1,180 @@
+/* auction_trace.h                                                 -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Sampled, always-on tracing of the phases that an auction goes through.
+*/
+
+#pragma once
+
+#include "soa/types/id.h"
+#include "soa/types/date.h"
+#include "soa/jsoncpp/json.h"
+#include "jml/compiler/compiler.h"
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+
+namespace RTBKIT {
+
+using Datacratic::Id;
+using Datacratic::Date;
+
+
+/*****************************************************************************/
+/* AUCTION PHASE                                                             */
+/*****************************************************************************/
+
+/** Points in the life of an auction that are traced.  The agentSlot and
+    payload recorded with each phase are described next to it.
+*/
+
+enum AuctionPhase {
+    AP_NONE,
+
+    // Exchange connector
+    AP_EXCHANGE_REQUEST,       ///< Request came in (at the auction start)
+    AP_EXCHANGE_PARSED,        ///< Request was parsed
+    AP_EXCHANGE_DROPPED,       ///< Dropped before the router
+    AP_EXCHANGE_RESPONSE,      ///< payload: number of spots with a bid
+
+    // Router
+    AP_ROUTER_NEW,             ///< Auction got to the router
+    AP_AUGMENTATION_START,     ///< payload: number of augmentors
+    AP_AUGMENTOR_SENT,         ///< Sent to one augmentor
+    AP_AUGMENTOR_RESPONSE,     ///< Got a response from one augmentor
+    AP_AUGMENTATION_DONE,      ///< payload: 1 if it timed out
+    AP_START_BIDDING,          ///< payload: number of agents sent to
+    AP_AGENT_AUCTION,          ///< agentSlot: agent the auction was sent to
+    AP_AGENT_BID,              ///< agentSlot: bidder, payload: valid bids
+    AP_AUCTION_EXPIRED,        ///< Expired while waiting for the agents
+    AP_SUBMITTED,              ///< payload: number of spots submitted
+
+    // Post auction loop
+    AP_PAL_SUBMITTED,          ///< One spot got to the post auction loop
+    AP_PAL_WIN,                ///< payload: win price in micros
+    AP_PAL_LOSS,               ///< Loss (explicit or timed out)
+    AP_PAL_CAMPAIGN_EVENT,     ///< payload: PostAuctionEventType
+
+    AP_NUM_PHASES
+};
+
+const char * print(AuctionPhase phase);
+AuctionPhase parseAuctionPhase(const std::string & str);
+
+
+/*****************************************************************************/
+/* AUCTION TRACE RECORD                                                      */
+/*****************************************************************************/
+
+/** Fixed size binary record of an auction having gone through a phase. */
+
+struct AuctionTraceRecord {
+    uint64_t auction;      ///< Hash of the auction id
+    double timestamp;      ///< Seconds since the epoch
+    uint64_t payload;      ///< Depends on the phase
+    uint16_t phase;        ///< AuctionPhase
+    int16_t agentSlot;     ///< -1 if there is no agent involved
+    uint32_t thread;       ///< Index of the thread that recorded it
+
+    Json::Value toJson() const;
+    static AuctionTraceRecord fromJson(const Json::Value & val);
+};
+
+static_assert(sizeof(AuctionTraceRecord) == 32,
+              "trace records must stay small");
+
+
+/*****************************************************************************/
+/* AUCTION TRACE                                                             */
+/*****************************************************************************/
+
+/** Process wide recorder for auction phases.
+
+    Each thread that records writes to its own fixed-size ring buffer, so
+    recording takes no locks and does no allocation once the thread's
+    buffer exists.  Old records are overwritten, so the buffers only hold
+    the recent history.
+
+    Only a sample of the auctions are traced, chosen by the hash of their
+    id.  This makes all of the components in all of the processes agree
+    on which auctions are traced, so that the complete history of a traced
+    auction is available, and makes recording an untraced auction cost no
+    more than hashing its id.
+
+    The records can be read (from any thread) while they are being
+    written; a record that is overwritten while being read is skipped.
+*/
+
+struct AuctionTrace {
+
+    /** Record that the given auction went through the given phase now. */
+    static void record(const Id & auction, AuctionPhase phase,
+                       int agentSlot = -1, uint64_t payload = 0)
+    {
+        uint64_t hash = auction.hash();
+        if (JML_LIKELY(!sampled(hash))) return;
+        recordImpl(hash, phase, Date::now(), agentSlot, payload);
+    }
+
+    /** Record that the given auction went through the given phase at the
+        given time. */
+    static void record(const Id & auction, AuctionPhase phase,
+                       Date timestamp, int agentSlot = -1,
+                       uint64_t payload = 0)
+    {
+        uint64_t hash = auction.hash();
+        if (JML_LIKELY(!sampled(hash))) return;
+        recordImpl(hash, phase, timestamp, agentSlot, payload);
+    }
+
+    /** Is the auction with the given id hash traced? */
+    static bool sampled(uint64_t hash)
+    {
+        // Mix the bits, as ids that are small integers hash to themselves
+        return hash * 0x9e3779b97f4a7c15ULL < sampleThreshold;
+    }
+
+    static bool sampled(const Id & auction)
+    {
+        return sampled(auction.hash());
+    }
+
+    /** Set the proportion of auctions to trace, from 0 (off) to 1. */
+    static void setSampleRate(double rate);
+    static double sampleRate();
+
+    /** Set the number of records in each thread's ring buffer.  Only
+        affects threads that haven't recorded anything yet.  Must be a
+        power of two. */
+    static void setBufferSize(size_t numRecords);
+
+    /** All of the records in all of the buffers, sorted by time. */
+    static std::vector<AuctionTraceRecord> records();
+
+    /** The records of the given auction, sorted by time. */
+    static std::vector<AuctionTraceRecord> records(const Id & auction);
+
+    /** Forget everything that's been recorded. */
+    static void clear();
+
+    static Json::Value toJson(const std::vector<AuctionTraceRecord> & records);
+    static std::vector<AuctionTraceRecord> fromJson(const Json::Value & val);
+
+    /** Convert records to the Chrome trace event format (as loaded by
+        chrome://tracing).  Each auction gets its own track, with a slice
+        for the time between each phase and the next; the phases are also
+        shown as instant events on the thread that recorded them.
+    */
+    static Json::Value
+    toChromeTrace(const std::vector<AuctionTraceRecord> & records,
+                  const std::string & processName = "rtbkit");
+
+private:
+    static void recordImpl(uint64_t hash, AuctionPhase phase, Date timestamp,
+                           int agentSlot, uint64_t payload);
+
+    static uint64_t sampleThreshold;
+};
+
+} // namespace RTBKIT
@@ -169,4 +169,89 @@ fromJson(const Json::Value& json)
     return list;
 }
 
+
+/******************************************************************************/
+/* AUGMENTATION TAG TABLE                                                     */
+/******************************************************************************/
+
+unsigned
+AugmentationTagTable::
+intern(const string& tag)
+{
+    auto res = ids.insert(make_pair(tag, (unsigned)ids.size()));
+    return res.first->second;
+}
+
+
+/******************************************************************************/
+/* AUGMENTATION PROJECTION                                                    */
+/******************************************************************************/
+
+AugmentationProjection::
+AugmentationProjection(const AugmentationList& list,
+                       const AugmentationTagTable& tags)
+{
+    nodes.push_back(Node());
+
+    for (auto it = list.begin(), end = list.end(); it != end; ++it) {
+        int node = 0;
+        for (auto jt = it->first.begin(); jt != it->first.end(); ++jt) {
+            int child = findChild(node, *jt);
+            if (child == -1) {
+                child = nodes.size();
+                nodes.push_back(Node());
+                nodes[child].parent = node;
+                nodes[node].children.push_back(make_pair(*jt, child));
+            }
+            node = child;
+        }
+
+        nodes[node].aug = &it->second;
+    }
+
+    // Parents are always created before their children, so a single pass in
+    // creation order sees every parent's tags before its children's.
+    for (unsigned i = 0; i < nodes.size(); ++i) {
+        Node& node = nodes[i];
+        if (node.parent != -1) node.tags = nodes[node.parent].tags;
+        if (node.aug) node.tags.insert(tags.lookup(node.aug->tags));
+    }
+}
+
+int
+AugmentationProjection::
+findNode(const AccountKey& account) const
+{
+    int node = 0;
+    for (auto it = account.begin(), end = account.end(); it != end; ++it) {
+        int child = findChild(node, *it);
+        if (child == -1) break;
+        node = child;
+    }
+    return node;
+}
+
+const string&
+AugmentationProjection::
+serializedForAccount(const AccountKey& account)
+{
+    Node& node = nodes[findNode(account)];
+
+    if (!node.serialized) {
+        Augmentation aug;
+        for (int i = &node - &nodes[0]; i != -1; i = nodes[i].parent)
+            if (nodes[i].aug) aug.mergeWith(*nodes[i].aug);
+
+        node.json = aug.toJson().toString();
+
+        // Strip the trailing newline added by the writer
+        while (!node.json.empty() && node.json[node.json.size() - 1] == '\n')
+            node.json.erase(node.json.size() - 1);
+
+        node.serialized = true;
+    }
+
+    return node.json;
+}
+
 } // namespace RTBKIT
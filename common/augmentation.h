@@ -11,9 +11,13 @@
 
 #include "rtbkit/common/account_key.h"
 #include "soa/jsoncpp/value.h"
+#include "jml/utils/compact_vector.h"
 
+#include <algorithm>
+#include <unordered_map>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace RTBKIT {
 
@@ -87,6 +91,201 @@ struct AugmentationList : public AugmentationListBase
 };
 
 
+/******************************************************************************/
+/* AUGMENTATION TAG SET                                                       */
+/******************************************************************************/
+
+/** Set of augmentation tags, as a bitmask over the ids given to the tags by
+    an AugmentationTagTable.
+ */
+struct AugmentationTagSet
+{
+    void insert(unsigned id)
+    {
+        unsigned word = id / 64;
+        while (bits.size() <= word) bits.push_back(0);
+        bits[word] |= 1ULL << (id % 64);
+    }
+
+    bool count(unsigned id) const
+    {
+        unsigned word = id / 64;
+        return word < bits.size() && (bits[word] & (1ULL << (id % 64)));
+    }
+
+    /** Union with the given set. */
+    void insert(const AugmentationTagSet& other)
+    {
+        while (bits.size() < other.bits.size()) bits.push_back(0);
+        for (unsigned i = 0; i < other.bits.size(); ++i)
+            bits[i] |= other.bits[i];
+    }
+
+    bool intersects(const AugmentationTagSet& other) const
+    {
+        unsigned n = std::min(bits.size(), other.bits.size());
+        for (unsigned i = 0; i < n; ++i)
+            if (bits[i] & other.bits[i]) return true;
+        return false;
+    }
+
+    bool empty() const
+    {
+        for (unsigned i = 0; i < bits.size(); ++i)
+            if (bits[i]) return false;
+        return true;
+    }
+
+private:
+    ML::compact_vector<uint64_t, 2> bits;
+};
+
+
+/******************************************************************************/
+/* AUGMENTATION TAG TABLE                                                     */
+/******************************************************************************/
+
+/** Gives each tag that is used by a filter a small dense id.
+
+    Only the tags that appear in filters need an id: a tag that no filter
+    mentions can't change the outcome of a filter, so it is left out of the
+    tag sets.  This keeps the table bounded by the agent configurations
+    rather than by what the augmentors return.
+
+    Not thread safe; meant to be owned by the thread doing the filtering.
+ */
+struct AugmentationTagTable
+{
+    /** Returns the id of the tag, giving it one if needed. */
+    unsigned intern(const std::string& tag);
+
+    /** Returns the id of the tag or -1 if it doesn't have one. */
+    int find(const std::string& tag) const
+    {
+        auto it = ids.find(tag);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    /** Set of the ids of the given tags that have an id. */
+    template<typename Tags>
+    AugmentationTagSet lookup(const Tags& tags) const
+    {
+        AugmentationTagSet result;
+        for (auto it = tags.begin(), end = tags.end(); it != end; ++it) {
+            int id = find(*it);
+            if (id != -1) result.insert(id);
+        }
+        return result;
+    }
+
+    size_t size() const { return ids.size(); }
+
+private:
+    std::unordered_map<std::string, unsigned> ids;
+};
+
+
+/******************************************************************************/
+/* AUGMENTATION TAG FILTER                                                    */
+/******************************************************************************/
+
+/** Include/exclude filter on augmentation tags compiled down to bitmasks.
+
+    Passes when the include list is empty or any tag is included, and no tag
+    is excluded; the same as IncludeExclude<std::string>::anyIsIncluded.
+ */
+struct AugmentationTagFilter
+{
+    AugmentationTagFilter() : includeAll(true) {}
+
+    template<typename Tags>
+    void compile(const Tags& includeTags, const Tags& excludeTags,
+                 AugmentationTagTable& table)
+    {
+        include = exclude = AugmentationTagSet();
+        includeAll = includeTags.empty();
+        for (auto it = includeTags.begin(); it != includeTags.end(); ++it)
+            include.insert(table.intern(*it));
+        for (auto it = excludeTags.begin(); it != excludeTags.end(); ++it)
+            exclude.insert(table.intern(*it));
+    }
+
+    bool passes(const AugmentationTagSet& tags) const
+    {
+        if (!includeAll && !tags.intersects(include)) return false;
+        return !tags.intersects(exclude);
+    }
+
+private:
+    bool includeAll;
+    AugmentationTagSet include;
+    AugmentationTagSet exclude;
+};
+
+
+/******************************************************************************/
+/* AUGMENTATION PROJECTION                                                    */
+/******************************************************************************/
+
+/** Index over the account prefixes of an AugmentationList, built once per
+    auction so that the per account projections of the list are computed
+    once per distinct account instead of once per agent.
+
+    The index is a trie over the elements of the account keys.  Every node
+    holds the tags of its prefix and all of its ancestors, so the tags of an
+    account are those of the deepest node that the account reaches.  The
+    serialized augmentation of a node is computed the first time it's asked
+    for and reused by every account that ends up on that node.
+
+    The list must outlive the projection.
+ */
+struct AugmentationProjection
+{
+    AugmentationProjection(const AugmentationList& list,
+                           const AugmentationTagTable& tags);
+
+    /** Same tags as AugmentationList::tagsForAccount, restricted to the tags
+        that have an id in the table.
+     */
+    const AugmentationTagSet& tagsForAccount(const AccountKey& account) const
+    {
+        return nodes[findNode(account)].tags;
+    }
+
+    /** Serialized form of AugmentationList::filterForAccount. */
+    const std::string& serializedForAccount(const AccountKey& account);
+
+    size_t numNodes() const { return nodes.size(); }
+
+private:
+    struct Node
+    {
+        Node() : parent(-1), aug(0), serialized(false) {}
+
+        int parent;
+        std::vector<std::pair<std::string, int> > children;
+        const Augmentation* aug;   ///< Augmentation for exactly this prefix
+        AugmentationTagSet tags;   ///< Tags of this prefix and its ancestors
+
+        bool serialized;
+        std::string json;
+    };
+
+    int findChild(int node, const std::string& element) const
+    {
+        auto& children = nodes[node].children;
+        for (auto it = children.begin(), end = children.end(); it != end; ++it)
+            if (it->first == element) return it->second;
+        return -1;
+    }
+
+    /** Deepest node along the path of the given account. */
+    int findNode(const AccountKey& account) const;
+
+    std::vector<Node> nodes;
+};
+
+
 } // namespace RTBKIT
 
 #endif // __rtb__augmentation_h__
@@ -677,6 +677,91 @@ toJsonStr() const
     return boost::trim_copy(toJson().toString());
 }
 
+namespace {
+
+/** Fields of a BidRequest that can be projected, in the order of their bits
+    in parseFields(). */
+enum BidRequestField {
+    BRF_ID,
+    BRF_TIMESTAMP,
+    BRF_IS_TEST,
+    BRF_URL,
+    BRF_IP_ADDRESS,
+    BRF_USER_AGENT,
+    BRF_LANGUAGE,
+    BRF_PROTOCOL_VERSION,
+    BRF_EXCHANGE,
+    BRF_PROVIDER,
+    BRF_META,
+    BRF_CREATIVE,
+    BRF_WIN_SURCHARGES,
+    BRF_LOCATION,
+    BRF_SPOTS,
+    BRF_SEGMENTS,
+    BRF_RESTRICTIONS,
+    BRF_USER_IDS,
+    BRF_NUM_FIELDS
+};
+
+const char * bidRequestFieldNames[BRF_NUM_FIELDS] = {
+    "id", "timestamp", "isTest", "url", "ipAddress", "userAgent", "language",
+    "protocolVersion", "exchange", "provider", "meta", "creative",
+    "winSurcharges", "location", "spots", "segments", "restrictions",
+    "userIds"
+};
+
+} // file scope
+
+uint32_t
+BidRequest::
+parseFields(const std::vector<std::string> & fields)
+{
+    uint32_t result = 1 << BRF_ID;
+
+    for (auto & field: fields) {
+        int i = 0;
+        while (i < BRF_NUM_FIELDS && field != bidRequestFieldNames[i])
+            ++i;
+        if (i == BRF_NUM_FIELDS)
+            throw ML::Exception("unknown bid request field '%s'",
+                                field.c_str());
+        result |= 1 << i;
+    }
+
+    return result;
+}
+
+BidRequest
+BidRequest::
+projected(uint32_t fields) const
+{
+    auto has = [=] (BidRequestField field)
+        {
+            return fields & (1 << field);
+        };
+
+    BidRequest result;
+    result.auctionId = auctionId;
+    if (has(BRF_TIMESTAMP)) result.timestamp = timestamp;
+    if (has(BRF_IS_TEST)) result.isTest = isTest;
+    if (has(BRF_URL)) result.url = url;
+    if (has(BRF_IP_ADDRESS)) result.ipAddress = ipAddress;
+    if (has(BRF_USER_AGENT)) result.userAgent = userAgent;
+    if (has(BRF_LANGUAGE)) result.language = language;
+    if (has(BRF_PROTOCOL_VERSION)) result.protocolVersion = protocolVersion;
+    if (has(BRF_EXCHANGE)) result.exchange = exchange;
+    if (has(BRF_PROVIDER)) result.provider = provider;
+    if (has(BRF_META)) result.meta = meta;
+    if (has(BRF_CREATIVE)) result.creative = creative;
+    if (has(BRF_WIN_SURCHARGES)) result.winSurcharges = winSurcharges;
+    if (has(BRF_LOCATION)) result.location = location;
+    if (has(BRF_SPOTS)) result.spots = spots;
+    if (has(BRF_SEGMENTS)) result.segments = segments;
+    if (has(BRF_RESTRICTIONS)) result.restrictions = restrictions;
+    if (has(BRF_USER_IDS)) result.userIds = userIds;
+    return result;
+}
+
 BidRequest
 BidRequest::
 createFromJson(const Json::Value & json)
@@ -794,11 +879,21 @@ struct CanonicalParser {
     }
 };
 
+struct BinaryParser {
+    static BidRequest * parse(const std::string & str)
+    {
+        auto_ptr<BidRequest> result(new BidRequest());
+        *result = BidRequest::createFromString(str);
+        return result.release();
+    }
+};
+
 struct AtInit {
     AtInit()
     {
         BidRequest::registerParser("recoset", CanonicalParser::parse);
         BidRequest::registerParser("datacratic", CanonicalParser::parse);
+        BidRequest::registerParser("datacratic-binary", BinaryParser::parse);
     }
 } atInit;
 } // file scope
@@ -282,6 +282,17 @@ struct BidRequest {
     /** Create a new BidRequest from a canonical JSON value. */
     static BidRequest createFromJson(const Json::Value & json);
 
+    /** Bitmask of the given fields of a bid request, named as they are in
+        the canonical JSON, for projected().  The "id" field is always part
+        of it, so the result is never zero.  Throws on an unknown field.
+    */
+    static uint32_t parseFields(const std::vector<std::string> & fields);
+
+    /** Return a copy of the bid request with only the given fields, as
+        returned by parseFields().  The rest are left empty.
+    */
+    BidRequest projected(uint32_t fields) const;
+
     /** Return the ID for the given domain. */
     Id getUserId(IdDomain domain) const;
     Id getUserId(const std::string & domain) const;
@@ -316,6 +327,9 @@ struct BidRequest {
 
     /** Parse the given bid request from the given source.  The correct
         parser will be looked up in a registry based upon the source.
+
+        The "datacratic-binary" source is the output of serializeToString(),
+        which is much cheaper to decode than any of the text formats.
     */
     static BidRequest *
     parse(const std::string & source, const std::string & bidRequest);
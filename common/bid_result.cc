@@ -0,0 +1,69 @@
+/* bid_result.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Compact binary encoding of the result of a bid.
+*/
+
+#include "rtbkit/common/bid_result.h"
+#include "jml/db/persistent.h"
+#include <sstream>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* BINARY BID RESULT                                                         */
+/*****************************************************************************/
+
+void
+BinaryBidResult::
+serialize(ML::DB::Store_Writer & store) const
+{
+    unsigned char version = 0;
+    store << version << timestamp.secondsSinceEpoch() << confidence
+          << auctionId << DB::compact_size_t(spotNum + 1);
+    price.serialize(store);
+}
+
+void
+BinaryBidResult::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("invalid BinaryBidResult version");
+
+    double seconds;
+    store >> seconds >> confidence >> auctionId;
+    timestamp = Date::fromSecondsSinceEpoch(seconds);
+    spotNum = (int)DB::compact_size_t(store) - 1;
+    price.reconstitute(store);
+}
+
+std::string
+BinaryBidResult::
+serializeToString() const
+{
+    ostringstream stream;
+    DB::Store_Writer store(stream);
+    serialize(store);
+    return stream.str();
+}
+
+BinaryBidResult
+BinaryBidResult::
+createFromString(const std::string & str)
+{
+    DB::Store_Reader store(str.c_str(), str.size());
+    BinaryBidResult result;
+    result.reconstitute(store);
+    return result;
+}
+
+} // namespace RTBKIT
@@ -0,0 +1,53 @@
+/* bid_result.h                                                    -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Compact binary encoding of the result of a bid.
+*/
+
+#pragma once
+
+#include "soa/types/id.h"
+#include "soa/types/date.h"
+#include "rtbkit/common/currency.h"
+#include "jml/db/persistent_fwd.h"
+#include <string>
+
+
+namespace RTBKIT {
+    using namespace Datacratic;
+
+
+/*****************************************************************************/
+/* BINARY BID RESULT                                                         */
+/*****************************************************************************/
+
+/** Result of a bid (WIN, LOSS, TOOLATE, ...) as it's sent to an agent that
+    configured the "binary" BidResultFormat for it.  The message is the
+    result type and the date, as for the other formats, followed by the
+    output of serializeToString() in a single frame.
+
+    Only what the agent doesn't already have is sent.  The bid request, the
+    agent's own bid and metadata and the augmentations it was sent with the
+    request aren't; the agent finds them from the auction id.
+*/
+
+struct BinaryBidResult {
+    BinaryBidResult()
+        : spotNum(-1)
+    {
+    }
+
+    Date timestamp;             ///< When the result was known
+    std::string confidence;     ///< "guaranteed" or "inferred"
+    Id auctionId;               ///< Auction that was bid on
+    int spotNum;                ///< Index of the spot in the request
+    Amount price;               ///< Price paid, for a win
+
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+
+    std::string serializeToString() const;
+    static BinaryBidResult createFromString(const std::string & str);
+};
+
+} // namespace RTBKIT
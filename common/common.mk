@@ -5,6 +5,7 @@ LIBBIDREQUEST_SOURCES := \
 	segments.cc \
 	json_holder.cc \
 	currency.cc \
+	bid_result.cc \
 
 LIBBIDREQUEST_LINK := \
 	types boost_regex db
@@ -14,7 +15,9 @@ $(eval $(call library,bid_request,$(LIBBIDREQUEST_SOURCES),$(LIBBIDREQUEST_LINK)
 LIBRTB_SOURCES := \
 	auction.cc \
 	augmentation.cc \
-	account_key.cc
+	account_key.cc \
+	auction_trace.cc \
+	auction_pool.cc
 
 LIBRTB_LINK := \
 	ACE arch utils jsoncpp boost_thread endpoint boost_regex zmq opstats bid_request
@@ -352,6 +352,15 @@ operator += (const LineItems & other)
     return *this;
 }
 
+LineItems &
+LineItems::
+operator -= (const LineItems & other)
+{
+    for (auto & e: other.entries)
+        (*this)[e.first] -= e.second;
+    return *this;
+}
+
 void
 LineItems::
 serialize(ML::DB::Store_Writer & store) const
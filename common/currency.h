@@ -479,6 +479,7 @@ struct LineItems {
     }
 
     LineItems & operator += (const LineItems & other);
+    LineItems & operator -= (const LineItems & other);
 
     void serialize(ML::DB::Store_Writer & store) const;
     void reconstitute(ML::DB::Store_Reader & store);
@@ -410,6 +410,7 @@ Json::Value toJson(BidResultFormat fmt)
     case BRF_FULL:         return "full";
     case BRF_LIGHTWEIGHT:  return "lightweight";
     case BRF_NONE:         return "none";
+    case BRF_BINARY:       return "binary";
     default:
         throw ML::Exception("unknown BidResultFormat");
     }
@@ -424,8 +425,10 @@ void fromJson(BidResultFormat & fmt, const Json::Value & j)
         fmt = BRF_LIGHTWEIGHT;
     else if (s == "none")
         fmt = BRF_NONE;
+    else if (s == "binary")
+        fmt = BRF_BINARY;
     else throw ML::Exception("unknown BidResultFormat " + s + ": accepted "
-                             "full, lightweight, none");
+                             "full, lightweight, none, binary");
 }
 
 void
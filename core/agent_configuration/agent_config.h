@@ -158,7 +158,8 @@ enum BidControlType {
 enum BidResultFormat {
     BRF_FULL,         ///< Full message
     BRF_LIGHTWEIGHT,  ///< Lightweight message
-    BRF_NONE          ///< No message
+    BRF_NONE,         ///< No message
+    BRF_BINARY        ///< Lightweight message as a BinaryBidResult
 };
 
 Json::Value toJson(BidResultFormat fmt);
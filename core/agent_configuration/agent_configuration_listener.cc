@@ -36,7 +36,7 @@ forEachAccountAgent(const AccountKey & account,
     const AllAgentConfig * ac = allAgents;
     if (!ac) return;
 
-    auto it = ac->accountIndex.find(account);
+    auto it = ac->accountIndex.find(AccountPaths::find(account));
     if (it == ac->accountIndex.end())
         return;
 
@@ -103,7 +103,8 @@ onMessage(const std::vector<std::string> & message)
 
         int i = newConfig->size() - 1;
         newConfig->agentIndex[c.name] = i;
-        newConfig->accountIndex[newConfig->back().config->account].push_back(i);
+        newConfig->accountIndex[AccountPaths::intern(newConfig->back().config->account)]
+            .push_back(i);
     }
     if (!found && config) {
         AgentConfigEntry ce;
@@ -113,7 +114,8 @@ onMessage(const std::vector<std::string> & message)
 
         int i = newConfig->size() - 1;
         newConfig->agentIndex[agent] = i;
-        newConfig->accountIndex[newConfig->back().config->account].push_back(i);
+        newConfig->accountIndex[AccountPaths::intern(newConfig->back().config->account)]
+            .push_back(i);
     }
 
     if (ML::cmp_xchg(allAgents, ac, (AllAgentConfig *)newConfig.get())) {
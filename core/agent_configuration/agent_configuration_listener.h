@@ -37,7 +37,7 @@ struct AgentConfigEntry {
 */
 struct AllAgentConfig : public std::vector<AgentConfigEntry> {
     std::unordered_map<std::string, int> agentIndex;
-    std::unordered_map<AccountKey, std::vector<int> > accountIndex;
+    std::unordered_map<AccountPathId, std::vector<int> > accountIndex;
 };
 
 
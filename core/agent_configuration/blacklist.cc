@@ -7,167 +7,389 @@
 
 #include "blacklist.h"
 #include "agent_config.h"
+#include <functional>
+#include <limits>
+#include <cmath>
+
+
+using namespace std;
+
 
 namespace RTBKIT {
 
-Date
-BlacklistInfo::
-add(const BidRequest & bidRequest,
-    const std::string & agent,
-    const AgentConfig & config)
+
+/*****************************************************************************/
+/* BLACKLIST STORE                                                           */
+/*****************************************************************************/
+
+namespace {
+
+/** Never reached by a tick, as slots keep them in 32 bits. */
+const int64_t MAX_TICK = std::numeric_limits<uint32_t>::max();
+
+/** The table never shrinks below this number of slots. */
+const size_t MIN_SLOTS = 1024;
+
+} // file scope
+
+BlacklistStore::
+BlacklistStore(double bucketSeconds, size_t numBuckets)
+    : bucketSeconds(bucketSeconds),
+      buckets(numBuckets),
+      numEntries_(0),
+      numUsers_(0)
 {
-    Entry entry;
-    entry.agent = agent;
-    entry.campaign = config.campaign;
-    entry.strategy = config.strategy;
-    entry.site = bidRequest.url.toString();
-    entry.expiry = Date::now().plusSeconds(config.blacklistTime);
+    if (bucketSeconds <= 0.0 || numBuckets < 2)
+        throw ML::Exception("invalid BlacklistStore expiry ring");
+    currentTick = tickFor(Date::now());
+}
+
+void
+BlacklistStore::
+add(uint64_t user, const BlacklistEntry & entry, Date expiry)
+{
+    user = userKey(user);
+
+    // Round up, so that nothing expires early
+    int64_t tick = tickFor(expiry);
+    if (tick < MAX_TICK && tick * bucketSeconds < expiry.secondsSinceEpoch())
+        ++tick;
 
-    entries.push_back(entry);
+    if ((numEntries_ + 1) * 10 > slots.size() * 7)
+        resize(std::max(slots.size() * 2, MIN_SLOTS));
 
-    if (entries.size() == 1 || entry.expiry < earliestExpiry) {
-        earliestExpiry = entry.expiry;
-        return earliestExpiry;
+    size_t mask = slots.size() - 1;
+    bool knownUser = false;
+
+    size_t i = mix(user) & mask;
+    for (;  slots[i].user;  i = (i + 1) & mask) {
+        Slot & s = slots[i];
+        if (s.user != user)
+            continue;
+        knownUser = true;
+        if (s.entry == entry) {
+            if (tick > s.expiry) {
+                s.expiry = tick;
+                linkBucket(user, tick);
+            }
+            return;
+        }
     }
 
-    return Date(); // no need to reset the expiry
+    Slot & s = slots[i];
+    s.user = user;
+    s.entry = entry;
+    s.expiry = tick;
+
+    ++numEntries_;
+    if (!knownUser)
+        ++numUsers_;
+
+    linkBucket(user, tick);
 }
 
-Date
-BlacklistInfo::
+size_t
+BlacklistStore::
 expire(Date now)
 {
-    Date result = Date();
-    for (unsigned i = 0;  i < entries.size();  /* no inc */) {
-        if (entries[i].expiry <= now) {
-            std::swap(entries[i], entries.back());
-            entries.pop_back();
-            // no increment
-        }
-        else {
-            if (result == Date())
-                result = entries[i].expiry;
-            else result = std::min(result, entries[i].expiry);
-            ++i;
+    // As in PendingStore: if time has gone backwards only the current
+    // bucket can contain anything expired, and if we fell behind by more
+    // than a turn of the ring every bucket is visited exactly once.
+    int64_t nowTick = std::max(tickFor(now), currentTick);
+    int64_t firstTick = std::max(currentTick,
+                                 nowTick - (int64_t)buckets.size() + 1);
+    currentTick = nowTick;
+
+    size_t removed = 0;
+    std::vector<uint64_t> users;
+
+    for (int64_t tick = firstTick;  tick <= nowTick;  ++tick) {
+        std::vector<uint64_t> & bucket = buckets[tick % buckets.size()];
+
+        // Detach the bucket, as users can be linked back into it
+        users.swap(bucket);
+        for (uint64_t user: users)
+            removed += expireUser(user, nowTick);
+
+        // Keep the bucket's memory around for the next turn of the ring
+        if (bucket.empty()) {
+            users.clear();
+            users.swap(bucket);
         }
+        users.clear();
     }
+
+    if (slots.size() > MIN_SLOTS && numEntries_ * 8 < slots.size()) {
+        size_t newSize = slots.size();
+        while (newSize > MIN_SLOTS && numEntries_ * 4 < newSize)
+            newSize /= 2;
+        resize(newSize);
+    }
+
+    return removed;
+}
+
+size_t
+BlacklistStore::
+memUsage() const
+{
+    size_t result = slots.capacity() * sizeof(Slot)
+        + buckets.capacity() * sizeof(std::vector<uint64_t>);
+    for (auto & b: buckets)
+        result += b.capacity() * sizeof(uint64_t);
     return result;
 }
 
-bool
-BlacklistInfo::
-matches(const BidRequest & bidRequest,
-        const std::string & agent,
-        const AgentConfig & config) const
+int64_t
+BlacklistStore::
+tickFor(Date date) const
 {
-    auto matchesEntry = [&] (const Entry & entry) -> bool
-        {
-            switch (config.blacklistScope) {
-                case BL_AGENT:
-                    return entry.agent == agent;
-                case BL_STRATEGY:
-                    return entry.strategy == config.strategy;
-                case BL_CAMPAIGN:
-                    return entry.campaign == config.campaign;
-            default:
-                throw ML::Exception("invalid blacklist scope");
-            }
-        };
+    double tick = std::floor(date.secondsSinceEpoch() / bucketSeconds);
+    if (!std::isfinite(tick) || tick >= MAX_TICK)
+        return tick < 0 ? 0 : MAX_TICK;
+    return std::max(tick, 0.0);
+}
+
+void
+BlacklistStore::
+linkBucket(uint64_t user, int64_t tick)
+{
+    tick = std::max(tick, currentTick);
+    tick = std::min<int64_t>(tick, currentTick + buckets.size() - 1);
+    buckets[tick % buckets.size()].push_back(user);
+}
+
+size_t
+BlacklistStore::
+expireUser(uint64_t user, int64_t tick)
+{
+    if (slots.empty())
+        return 0;
 
-    switch (config.blacklistType) {
-    case BL_OFF:
-        return false;  // shouldn't happen
+    size_t mask = slots.size() - 1;
+    size_t removed = 0;
+    bool found = false;
+    int64_t nextExpiry = MAX_TICK;
 
-    case BL_USER:  // fall through
-        for (unsigned i = 0;  i < entries.size();  ++i) {
-            const Entry & entry = entries[i];
-            if (matchesEntry(entry)) return true;
+    for (size_t i = mix(user) & mask;  slots[i].user;  /* no inc */) {
+        Slot & s = slots[i];
+        if (s.user != user) {
+            i = (i + 1) & mask;
+            continue;
         }
 
-    case BL_USER_SITE:
-        for (unsigned i = 0;  i < entries.size();  ++i) {
-            const Entry & entry = entries[i];
-            if (!matchesEntry(entry)) continue;
-            if (entry.site != "" && entry.site == bidRequest.url.toString())
-                return true;
+        found = true;
+        if (s.expiry <= tick) {
+            // Something from further on is shifted into slot i
+            eraseSlot(i);
+            ++removed;
+            continue;
         }
-        return false;
 
-    default:
-        throw ML::Exception("unknown blacklist type");
+        nextExpiry = std::min<int64_t>(nextExpiry, s.expiry);
+        i = (i + 1) & mask;
     }
+
+    numEntries_ -= removed;
+
+    // The entries that are left may have been put in a bucket before
+    // their own if they expire past the ring's horizon, so look at the
+    // user again when the next one comes up.
+    if (nextExpiry != MAX_TICK)
+        linkBucket(user, nextExpiry);
+    else if (found)
+        --numUsers_;
+
+    return removed;
 }
 
 void
-Blacklist::
-doExpiries()
+BlacklistStore::
+eraseSlot(size_t i)
 {
-    Date start = Date::now();
+    // Shift back the following entries of the probe sequence so that no
+    // tombstones are needed
+    size_t mask = slots.size() - 1;
+    size_t j = i;
+    for (;;) {
+        slots[i].user = 0;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!slots[j].user)
+                return;
+            size_t home = mix(slots[j].user) & mask;
+            // Can the entry at j move to i?  Only if its home slot isn't
+            // cyclically within (i, j].
+            if (i <= j ? (i < home && home <= j)
+                       : (i < home || home <= j))
+                continue;
+            break;
+        }
+        slots[i] = slots[j];
+        i = j;
+    }
+}
 
-    auto onBlacklistFinished = [&] (const Id & userId,
-                                    BlacklistInfo & info)
-        {
-            return info.expire(start);
-        };
+void
+BlacklistStore::
+resize(size_t newSize)
+{
+    std::vector<Slot> newSlots(newSize);
+    size_t mask = newSize - 1;
+    for (auto & s: slots) {
+        if (!s.user) continue;
+        size_t i = mix(s.user) & mask;
+        while (newSlots[i].user)
+            i = (i + 1) & mask;
+        newSlots[i] = s;
+    }
+    slots.swap(newSlots);
+}
+
+
+/*****************************************************************************/
+/* BLACKLIST                                                                 */
+/*****************************************************************************/
 
-    entries.expire(onBlacklistFinished, start);
+namespace {
+
+/** Returned by find() for names that were never interned. */
+const uint32_t UNKNOWN_NAME = (uint32_t)-1;
+
+} // file scope
+
+void
+Blacklist::
+doExpiries()
+{
+    entries.expire(Date::now());
 }
 
 bool
 Blacklist::
 matches(const BidRequest & bidRequest, const std::string & agentName,
         const AgentConfig & config) const
-{  
-    bool blocked = false;
-    const Id & exchangeId = bidRequest.userIds.exchangeId;
-    if (!blocked && exchangeId) {
-        // TODO: read lock
-        auto bit = entries.find(exchangeId);
-        if (bit != entries.end()) {
-            const BlacklistInfo & binfo = bit->second;
-            if (binfo.matches(bidRequest, agentName, config))
-                blocked = true;
-        }
+{
+    if (config.blacklistType != BL_USER
+        && config.blacklistType != BL_USER_SITE) {
+        if (config.blacklistType == BL_OFF)
+            return false;  // shouldn't happen
+        throw ML::Exception("unknown blacklist type");
     }
+
+    // Only looked up once a user has been found, which is the rare case
+    bool resolved = false;
+    uint32_t scope = 0;
+    uint32_t site = 0;
+
+    auto matchesEntry = [&] (const BlacklistEntry & entry) -> bool
+        {
+            if (!resolved) {
+                switch (config.blacklistScope) {
+                case BL_AGENT:     scope = find(agentName);        break;
+                case BL_STRATEGY:  scope = find(config.strategy);  break;
+                case BL_CAMPAIGN:  scope = find(config.campaign);  break;
+                default:
+                    throw ML::Exception("invalid blacklist scope");
+                }
+                if (config.blacklistType == BL_USER_SITE)
+                    site = hashSite(bidRequest);
+                resolved = true;
+            }
+
+            uint32_t entryScope;
+            switch (config.blacklistScope) {
+            case BL_AGENT:     entryScope = entry.agent;     break;
+            case BL_STRATEGY:  entryScope = entry.strategy;  break;
+            default:           entryScope = entry.campaign;  break;
+            }
+
+            if (entryScope != scope)
+                return false;
+            if (config.blacklistType == BL_USER)
+                return true;
+            return site && entry.site == site;
+        };
+
+    const Id & exchangeId = bidRequest.userIds.exchangeId;
+    if (exchangeId && entries.any(exchangeId.hash(), matchesEntry))
+        return true;
+
     const Id & providerId = bidRequest.userIds.providerId;
-    if (!blocked && providerId) {
-        // TODO: read lock
-        auto bit = entries.find(providerId);
-        if (bit != entries.end()) {
-            const BlacklistInfo & binfo = bit->second;
-            if (binfo.matches(bidRequest, agentName, config))
-                blocked = true;
-        }
-    }
+    if (providerId && entries.any(providerId.hash(), matchesEntry))
+        return true;
 
-    return blocked;
+    return false;
 }
 
 void
 Blacklist::
 add(const BidRequest & bidRequest, const std::string & agent,
-    const AgentConfig & agentConfig)
+    const AgentConfig & config)
 {
-    auto addToBlacklist = [&] (const Id & id)
-        {
-            if (!id) return;
-
-            auto it = this->entries.find(id);
-            if (it != this->entries.end()) {
-                Date newExpiry
-                    = it->second.add(bidRequest, agent, agentConfig);
-                if (newExpiry != Date())
-                    this->entries.updateTimeout(it, newExpiry);
-            }
-            else {
-                BlacklistInfo binfo;
-                Date timeout = binfo.add(bidRequest, agent, agentConfig);
-                this->entries.insert(id, binfo, timeout);
-            }
-        };
-    
-    addToBlacklist(bidRequest.userIds.exchangeId);
-    addToBlacklist(bidRequest.userIds.providerId);
+    BlacklistEntry entry;
+    entry.agent = intern(agent);
+    entry.campaign = intern(config.campaign);
+    entry.strategy = intern(config.strategy);
+    entry.site = hashSite(bidRequest);
+
+    Date expiry = Date::now().plusSeconds(config.blacklistTime);
+
+    const Id & exchangeId = bidRequest.userIds.exchangeId;
+    if (exchangeId)
+        entries.add(exchangeId.hash(), entry, expiry);
+
+    const Id & providerId = bidRequest.userIds.providerId;
+    if (providerId)
+        entries.add(providerId.hash(), entry, expiry);
+}
+
+size_t
+Blacklist::
+memUsage() const
+{
+    size_t result = entries.memUsage();
+    for (auto & n: names)
+        result += sizeof(n) + n.first.capacity() + 2 * sizeof(void *);
+    return result;
+}
+
+uint32_t
+Blacklist::
+intern(const std::string & name)
+{
+    if (name.empty())
+        return 0;
+    auto it = names.find(name);
+    if (it != names.end())
+        return it->second;
+    uint32_t id = names.size() + 1;
+    names.insert(make_pair(name, id));
+    return id;
+}
+
+uint32_t
+Blacklist::
+find(const std::string & name) const
+{
+    if (name.empty())
+        return 0;
+    auto it = names.find(name);
+    if (it == names.end())
+        return UNKNOWN_NAME;
+    return it->second;
+}
+
+uint32_t
+Blacklist::
+hashSite(const BidRequest & bidRequest)
+{
+    std::string site = bidRequest.url.toString();
+    if (site.empty())
+        return 0;
+    uint64_t h = std::hash<std::string>()(site);
+    uint32_t result = h ^ (h >> 32);
+    return result ? result : 1;
 }
 
 } // namespace RTBKIT
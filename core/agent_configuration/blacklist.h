@@ -10,9 +10,9 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include "rtbkit/common/bid_request.h"
 #include "rtbkit/core/router/router_types.h"
-#include "soa/service/timeout_map.h"
 
 
 namespace RTBKIT {
@@ -21,40 +21,144 @@ struct AgentConfig;
 
 
 /*****************************************************************************/
-/* BLACKLIST INFO                                                            */
+/* BLACKLIST ENTRY                                                           */
 /*****************************************************************************/
 
-/** For the given user, contains information on who has blacklisted them
-    for how much time.
+/** Who blacklisted a user.  The agent, campaign and strategy are names
+    interned by the Blacklist; the site is a hash of the page's URL.  Zero
+    means none for all of them.
 */
-struct BlacklistInfo {
-    struct Entry {
-        std::string agent;
-        std::string campaign;
-        std::string strategy;
-        std::string site;
-        Date expiry;
-    };
-    std::vector<Entry> entries;
-    Date earliestExpiry;
+struct BlacklistEntry {
+    BlacklistEntry()
+        : agent(0), campaign(0), strategy(0), site(0)
+    {
+    }
+
+    uint32_t agent;
+    uint32_t campaign;
+    uint32_t strategy;
+    uint32_t site;
+
+    bool operator == (const BlacklistEntry & other) const
+    {
+        return agent == other.agent
+            && campaign == other.campaign
+            && strategy == other.strategy
+            && site == other.site;
+    }
+};
 
-    /* Does the given agent and bid request match the blacklist? */
-    bool matches(const BidRequest & request,
-                 const std::string & agent,
-                 const AgentConfig & agentConfig) const;
-        
-    /** Add the given entry to the blacklist.  Returns Date() if the
-        entry is not the earliest expiring entry, or the date of the
-        new expiry if not.
+
+/*****************************************************************************/
+/* BLACKLIST STORE                                                           */
+/*****************************************************************************/
+
+/** Blacklist entries of every user, in a single open-addressing table
+    (linear probing) of fixed size slots.
+
+    Each slot holds a 64 bit hash of the user id, one BlacklistEntry and
+    the tick of its expiry, for 32 bytes per entry with no allocation per
+    user.  All of the entries of a user are in the probe sequence of its
+    hash, so a lookup is a short scan of integer compares.
+
+    Expiry is driven by a ring of time buckets as in PendingStore.  Each
+    bucket holds the users with an entry expiring in it, and only the
+    buckets that have elapsed since the last call are visited.  Expiries
+    are rounded up to the next bucket, so an entry can outlive its expiry
+    by up to bucketSeconds.
+
+    Users are only known by their hash; two users with the same 64 bit
+    hash would share a blacklist.
+
+    Not thread safe; it is designed to be owned by a single message loop.
+*/
+
+struct BlacklistStore {
+
+    /** Create a store whose expiry ring has numBuckets buckets of
+        bucketSeconds each.  Entries that expire further out than that are
+        revisited when the last bucket comes around.
     */
-    Date add(const BidRequest & bidRequest,
-             const std::string & agent,
-             const AgentConfig & agentConfig);
-        
-    /* Expire any that need to be expired, and return the next lowest
-       expiry date or an empty date if none.
+    BlacklistStore(double bucketSeconds = 1.0,
+                   size_t numBuckets = 4096);
+
+    /** Number of users with at least one entry. */
+    size_t numUsers() const { return numUsers_; }
+
+    /** Number of entries over all users. */
+    size_t numEntries() const { return numEntries_; }
+
+    /** Add an entry for the given user.  If the user already has the same
+        entry, its expiry is pushed back instead.
     */
-    Date expire(Date now);
+    void add(uint64_t user, const BlacklistEntry & entry, Date expiry);
+
+    /** Call fn(entry) for each of the user's entries until it returns
+        true.  Returns whether it did. */
+    template<typename Fn>
+    bool any(uint64_t user, const Fn & fn) const
+    {
+        if (slots.empty())
+            return false;
+        user = userKey(user);
+        size_t mask = slots.size() - 1;
+        for (size_t i = mix(user) & mask;  slots[i].user;
+             i = (i + 1) & mask) {
+            if (slots[i].user == user && fn(slots[i].entry))
+                return true;
+        }
+        return false;
+    }
+
+    /** Remove every entry that expired at or before now.  Returns the
+        number of entries removed. */
+    size_t expire(Date now = Date::now());
+
+    /** Approximate number of bytes used by the store. */
+    size_t memUsage() const;
+
+private:
+    struct Slot {
+        Slot()
+            : user(0), expiry(0)
+        {
+        }
+
+        uint64_t user;            ///< User hash; zero if the slot is empty
+        BlacklistEntry entry;
+        uint32_t expiry;          ///< Tick at which the entry expires
+    };
+
+    double bucketSeconds;
+    std::vector<std::vector<uint64_t> > buckets;  ///< Users by expiry tick
+    int64_t currentTick;
+
+    std::vector<Slot> slots;
+    size_t numEntries_;
+    size_t numUsers_;
+
+    /** Zero marks an empty slot, so a user with a zero hash is given
+        another one. */
+    static uint64_t userKey(uint64_t user)
+    {
+        return user ? user : 0x9e3779b97f4a7c15ULL;
+    }
+
+    static uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    int64_t tickFor(Date date) const;
+    void linkBucket(uint64_t user, int64_t tick);
+    size_t expireUser(uint64_t user, int64_t tick);
+    void eraseSlot(size_t i);
+    void resize(size_t newSize);
 };
 
 
@@ -66,8 +170,9 @@ struct BlacklistInfo {
 struct Blacklist {
     void doExpiries();
 
-    size_t size() const { return entries.size(); }
-    
+    /** Number of blacklisted users. */
+    size_t size() const { return entries.numUsers(); }
+
     bool matches(const BidRequest & request,
                  const std::string & agentName,
                  const AgentConfig & config) const;
@@ -75,9 +180,24 @@ struct Blacklist {
     void add(const BidRequest & bidRequest,
              const std::string & agent,
              const AgentConfig & agentConfig);
-    
-    typedef TimeoutMap<Id, BlacklistInfo> Entries;
-    Entries entries;
+
+    /** Approximate number of bytes used by the blacklist. */
+    size_t memUsage() const;
+
+    BlacklistStore entries;
+
+private:
+    /** Agent, campaign and strategy names to their ids.  These come from
+        the agent configurations, so the table stays small. */
+    std::unordered_map<std::string, uint32_t> names;
+
+    uint32_t intern(const std::string & name);
+
+    /** Id of the given name; zero for an empty name, and an id that no
+        entry has if it's never been interned. */
+    uint32_t find(const std::string & name) const;
+
+    static uint32_t hashSite(const BidRequest & request);
 };
 
 } // namespace RTBKIT
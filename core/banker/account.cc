@@ -107,6 +107,43 @@ getRemainingBudget()
             + adjustmentsIn - adjustmentsOut);
 }
 
+void
+Account::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << (unsigned char)0  // version
+          << (int)type
+          << budgetIncreases << budgetDecreases
+          << recycledIn << recycledOut
+          << allocatedIn << allocatedOut
+          << commitmentsMade << commitmentsRetired
+          << adjustmentsIn << adjustmentsOut
+          << spent << available
+          << lineItems << adjustmentLineItems;
+}
+
+void
+Account::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("invalid version reconstituting Account");
+
+    int typeInt;
+    store >> typeInt;
+    type = (AccountType)typeInt;
+
+    store >> budgetIncreases >> budgetDecreases
+          >> recycledIn >> recycledOut
+          >> allocatedIn >> allocatedOut
+          >> commitmentsMade >> commitmentsRetired
+          >> adjustmentsIn >> adjustmentsOut
+          >> spent >> available
+          >> lineItems >> adjustmentLineItems;
+}
+
 std::ostream & operator << (std::ostream & stream, const Account & account)
 {
     std::set<CurrencyCode> currencies;
@@ -338,7 +375,7 @@ logBidEvents(const Datacratic::EventRecorder & eventRecorder)
         attachedBids += account.attachedBids;
         detachedBids += account.detachedBids;
         commitments += account.commitments.size();
-        account.logBidEvents(eventRecorder, it.first.toString('.'));
+        account.logBidEvents(eventRecorder, AccountPaths::dotted(it.first));
         expired += account.lastExpiredCommitments;
     }
 
@@ -11,6 +11,8 @@
 #include <unordered_map>
 #include <memory>
 #include <unordered_set>
+#include <algorithm>
+#include <functional>
 #include "rtbkit/common/currency.h"
 #include "rtbkit/common/account_key.h"
 #include "soa/types/date.h"
@@ -190,6 +192,11 @@ public:
         return result;
     }
 
+    /** Compact binary form, used by LocalBankerPersistence.  Unlike the
+        JSON form it keeps available as is. */
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+
     /*************************************************************************/
     /* DERIVED QUANTITIES                                                    */
     /*************************************************************************/
@@ -396,6 +403,8 @@ public:
     }
 };
 
+IMPL_SERIALIZE_RECONSTITUTE(Account);
+
 
 /*****************************************************************************/
 /* SHADOW ACCOUNT                                                            */
@@ -825,6 +834,56 @@ struct AccountSimpleSummaries
     }
 };
 
+/*****************************************************************************/
+/* ACCOUNT ROLLUP                                                            */
+/*****************************************************************************/
+
+/** The amounts of an account that are aggregated over its sub-accounts in
+    summaries.
+*/
+
+struct AccountRollup {
+    CurrencyPool budget;         ///< Remaining budget
+    CurrencyPool spent;
+    CurrencyPool inFlight;       ///< Commitments made but not retired
+    LineItems lineItems;
+    LineItems adjustmentLineItems;
+
+    /** The amounts of the given account on its own. */
+    static AccountRollup of(const Account & account)
+    {
+        AccountRollup result;
+        result.budget = account.getRemainingBudget();
+        result.spent = account.spent;
+        result.inFlight
+            = account.commitmentsMade - account.commitmentsRetired;
+        result.lineItems = account.lineItems;
+        result.adjustmentLineItems = account.adjustmentLineItems;
+        return result;
+    }
+
+    AccountRollup & operator += (const AccountRollup & other)
+    {
+        budget += other.budget;
+        spent += other.spent;
+        inFlight += other.inFlight;
+        lineItems += other.lineItems;
+        adjustmentLineItems += other.adjustmentLineItems;
+        return *this;
+    }
+
+    AccountRollup & operator -= (const AccountRollup & other)
+    {
+        budget -= other.budget;
+        spent -= other.spent;
+        inFlight -= other.inFlight;
+        lineItems -= other.lineItems;
+        adjustmentLineItems -= other.adjustmentLineItems;
+        return *this;
+    }
+};
+
+
 /*****************************************************************************/
 /* ACCOUNTS                                                                  */
 /*****************************************************************************/
@@ -838,10 +897,23 @@ struct Accounts {
     Datacratic::Date sessionStart;
 
     struct AccountInfo: public Account {
+        AccountInfo()
+            : height(0)
+        {
+        }
+
         std::set<AccountKey> children;
 
         /* spend tracking across sessions */
         CurrencyPool initialSpent;
+
+        /* Summaries read these instead of walking the tree.  They are
+           brought up to date by updateRollups() whenever an account
+           changes, which costs one step per level above it.
+        */
+        AccountRollup own;      ///< This account's amounts when last seen
+        AccountRollup subtree;  ///< Sum of own over the whole subtree
+        int height;             ///< Levels of sub-accounts underneath
     };
 
     const Account createAccount(const AccountKey & account,
@@ -862,24 +934,15 @@ struct Accounts {
         //     throw ML::Exception("an account already exists with that name");
         // }
 
-        Account validAccount = validAccount.fromJson(jsonValue);
-        AccountInfo & newAccount = ensureAccount(accountKey, validAccount.type);
-        newAccount.type = AT_SPEND;
-        newAccount.type = validAccount.type;
-        newAccount.budgetIncreases = validAccount.budgetIncreases;
-        newAccount.budgetDecreases = validAccount.budgetDecreases;
-        newAccount.spent = validAccount.spent;
-        newAccount.recycledIn = validAccount.recycledIn;
-        newAccount.recycledOut = validAccount.recycledOut;
-        newAccount.allocatedIn = validAccount.allocatedIn;
-        newAccount.allocatedOut = validAccount.allocatedOut;
-        newAccount.commitmentsMade = validAccount.commitmentsMade;
-        newAccount.commitmentsRetired = validAccount.commitmentsRetired;
-        newAccount.adjustmentsIn = validAccount.adjustmentsIn;
-        newAccount.adjustmentsOut = validAccount.adjustmentsOut;
-        newAccount.available = validAccount.available;
-        newAccount.lineItems = validAccount.lineItems;
-        newAccount.adjustmentLineItems = validAccount.adjustmentLineItems;
+        restoreAccountImpl(accountKey, Account::fromJson(jsonValue));
+    }
+
+    /** Same as above, for an account that was saved in binary form. */
+    void restoreAccount(const AccountKey & accountKey,
+                        const Account & validAccount)
+    {
+        Guard guard(lock);
+        restoreAccountImpl(accountKey, validAccount);
     }
 
     const Account createBudgetAccount(const AccountKey & account)
@@ -918,7 +981,7 @@ struct Accounts {
 
         Guard guard(lock);
         for (auto & a: accounts) {
-            result[a.first.toString()] = a.second.toJson();
+            result[AccountPaths::str(a.first)] = a.second.toJson();
         }
 
         return result;
@@ -943,6 +1006,7 @@ struct Accounts {
             throw ML::Exception("can't setBudget except at top level");
         auto & a = ensureAccount(topLevelAccount, AT_BUDGET);
         a.setBudget(newBudget);
+        updateRollups(topLevelAccount);
         return a;
     }
 
@@ -958,9 +1022,11 @@ struct Accounts {
     {
         Guard guard(lock);
 
-        if (typeToCreate != AT_NONE && !accounts.count(account)) {
+        if (typeToCreate != AT_NONE && !hasAccountImpl(account)) {
             auto & a = ensureAccount(account, typeToCreate);
             a.setAvailable(getParentAccount(account), amount);
+            updateRollups(account);
+            updateRollups(account.parent());
             return a;
         }
         else {
@@ -975,6 +1041,8 @@ struct Accounts {
 #endif
 
             a.setAvailable(getParentAccount(account), amount);
+            updateRollups(account);
+            updateRollups(account.parent());
             return a;
         }
     }
@@ -982,7 +1050,7 @@ struct Accounts {
     const CurrencyPool getAvailable(const AccountKey & account) const
     {
         Guard guard(lock);
-        auto it = accounts.find(account);
+        auto it = accounts.find(AccountPaths::find(account));
         if (it == accounts.end())
             return CurrencyPool();
         return it->second.available;
@@ -1001,6 +1069,8 @@ struct Accounts {
     {
         Guard guard(lock);
         getAccountImpl(account).recuperateTo(getParentAccount(account));
+        updateRollups(account);
+        updateRollups(account.parent());
     }
 
     AccountSummary getAccountSummary(const AccountKey & account,
@@ -1017,13 +1087,9 @@ struct Accounts {
 
         AccountSimpleSummaries summaries;
 
-        for (auto & it: accounts) {
-            const AccountKey & key = it.first;
-            if (key.size() == 1) {
-                summaries.insert({key.toString(),
-                            getAccountSimpleSummaryImpl(key, 0,
-                                                        maxDepth)});
-            }
+        for (auto & key: topLevelAccounts) {
+            summaries.insert({key.toString(),
+                        getAccountSimpleSummaryImpl(key, 0, maxDepth)});
         }
 
         return summaries;
@@ -1035,6 +1101,7 @@ struct Accounts {
         Guard guard(lock);
         auto & a = getAccountImpl(account);
         a.importSpend(amount);
+        updateRollups(account);
         return a;
     }
                       
@@ -1058,10 +1125,16 @@ struct Accounts {
         // In the case that an account was added and the banker crashed
         // before it could be written to persistent storage, we need to
         // create the empty account here.
-        if (!accounts.count(account))
-            return shadow.syncToMaster(ensureAccount(account, AT_SPEND));
-        
-        return shadow.syncToMaster(getAccountImpl(account));
+        if (!hasAccountImpl(account)) {
+            Account result
+                = shadow.syncToMaster(ensureAccount(account, AT_SPEND));
+            updateRollups(account);
+            return result;
+        }
+
+        Account result = shadow.syncToMaster(getAccountImpl(account));
+        updateRollups(account);
+        return result;
     }
 
     /* "Out of sync" here means that the in-memory version of the relevant
@@ -1071,14 +1144,14 @@ struct Accounts {
     {
         Guard guard(lock);
 
-        outOfSyncAccounts.insert(account);
+        outOfSyncAccounts.insert(AccountPaths::intern(account));
     }
 
     bool isAccountOutOfSync(const AccountKey & account) const
     {
         Guard guard(lock);
         
-        return (outOfSyncAccounts.count(account) > 0);
+        return (outOfSyncAccounts.count(AccountPaths::find(account)) > 0);
     }
 
 private:
@@ -1088,10 +1161,15 @@ private:
     typedef std::unique_lock<Lock> Guard;
     mutable Lock lock;
 
-    typedef std::map<AccountKey, AccountInfo> AccountMap;
+    /** Keyed on the interned path of each account; the tree is walked
+        through topLevelAccounts and the children of each account when
+        the accounts are needed in order. */
+    typedef std::unordered_map<AccountPathId, AccountInfo> AccountMap;
     AccountMap accounts;
 
-    typedef std::unordered_set<AccountKey> AccountSet;
+    std::set<AccountKey> topLevelAccounts;
+
+    typedef std::unordered_set<AccountPathId> AccountSet;
     AccountSet outOfSyncAccounts;
 
 public:
@@ -1103,11 +1181,12 @@ public:
 
         std::vector<AccountKey> result;
 
-        for (auto it = accounts.lower_bound(prefix), end = accounts.end();
-             it != accounts.end() && it->first.hasPrefix(prefix);  ++it) {
-            if (maxDepth == -1 || it->first.size() <= maxDepth)
-                result.push_back(it->first);
-        }
+        auto onAccount = [&] (const AccountKey & key, const AccountInfo &)
+            {
+                result.push_back(key);
+            };
+        forEachInSubtree(prefix, maxDepth, onAccount);
+
         return result;
     }
 
@@ -1117,10 +1196,7 @@ public:
                    & onAccount) const
     {
         Guard guard(lock);
-        
-        for (auto & a: accounts) {
-            onAccount(a.first, a.second);
-        }
+        forEachInSubtree(AccountKey(), -1, onAccount);
     }
                         
     size_t size() const
@@ -1144,10 +1220,17 @@ public:
         std::function<void (const AccountKey &, int, int)> doAccount
             = [&] (const AccountKey & key, int depth, int maxDepth)
             {
-                auto it = accounts.find(key);
+                auto it = accounts.find(AccountPaths::find(key));
                 if (it == accounts.end())
                     return;
-                result.ensureAccount(it->first, it->second.type) = it->second;
+
+                // Only the account itself is copied; the result has its
+                // own tree and so its own rollups
+                AccountInfo & copy
+                    = result.ensureAccount(key, it->second.type);
+                static_cast<Account &>(copy) = it->second;
+                copy.initialSpent = it->second.initialSpent;
+                result.updateRollups(it->first);
 
                 if (depth >= maxDepth)
                     return;
@@ -1168,7 +1251,8 @@ private:
     {
         ExcAssertGreaterEqual(accountKey.size(), 1);
 
-        auto it = accounts.find(accountKey);
+        AccountPathId path = AccountPaths::intern(accountKey);
+        auto it = accounts.find(path);
         if (it != accounts.end()) {
             ExcAssertEqual(it->second.type, type);
             return it->second;
@@ -1176,30 +1260,102 @@ private:
         else {
             if (accountKey.size() == 1) {
                 ExcAssertEqual(type, AT_BUDGET);
+                topLevelAccounts.insert(accountKey);
             }
             else {
                 AccountInfo & parent
                     = ensureAccount(accountKey.parent(), AT_BUDGET);
                 parent.children.insert(accountKey);
+
+                // A new leaf; the ancestors may now be higher
+                int height = 1;
+                for (AccountPathId p = AccountPaths::parent(path);
+                     p != AccountPaths::ROOT;
+                     p = AccountPaths::parent(p), ++height) {
+                    AccountInfo & ancestor = getAccountImpl(p);
+                    if (ancestor.height >= height)
+                        break;
+                    ancestor.height = height;
+                }
             }
 
-            auto & result = accounts[accountKey];
+            auto & result = accounts[path];
             result.type = type;
             return result;
         }
     }
 
+    void restoreAccountImpl(const AccountKey & accountKey,
+                            const Account & validAccount)
+    {
+        AccountInfo & newAccount = ensureAccount(accountKey, validAccount.type);
+        newAccount.type = AT_SPEND;
+        newAccount.type = validAccount.type;
+        newAccount.budgetIncreases = validAccount.budgetIncreases;
+        newAccount.budgetDecreases = validAccount.budgetDecreases;
+        newAccount.spent = validAccount.spent;
+        newAccount.recycledIn = validAccount.recycledIn;
+        newAccount.recycledOut = validAccount.recycledOut;
+        newAccount.allocatedIn = validAccount.allocatedIn;
+        newAccount.allocatedOut = validAccount.allocatedOut;
+        newAccount.commitmentsMade = validAccount.commitmentsMade;
+        newAccount.commitmentsRetired = validAccount.commitmentsRetired;
+        newAccount.adjustmentsIn = validAccount.adjustmentsIn;
+        newAccount.adjustmentsOut = validAccount.adjustmentsOut;
+        newAccount.available = validAccount.available;
+        newAccount.lineItems = validAccount.lineItems;
+        newAccount.adjustmentLineItems = validAccount.adjustmentLineItems;
+        updateRollups(accountKey);
+    }
+
+    /** Bring the rollups of the given account and its ancestors up to
+        date with its current state. */
+    void updateRollups(const AccountKey & accountKey)
+    {
+        updateRollups(AccountPaths::find(accountKey));
+    }
+
+    void updateRollups(AccountPathId path)
+    {
+        AccountInfo & info = getAccountImpl(path);
+        AccountRollup now = AccountRollup::of(info);
+
+        for (AccountPathId p = path;  p != AccountPaths::ROOT;
+             p = AccountPaths::parent(p)) {
+            AccountRollup & subtree = getAccountImpl(p).subtree;
+            subtree -= info.own;
+            subtree += now;
+        }
+
+        info.own = std::move(now);
+    }
+
+    bool hasAccountImpl(const AccountKey & account) const
+    {
+        return accounts.count(AccountPaths::find(account));
+    }
+
     AccountInfo & getAccountImpl(const AccountKey & account)
     {
-        auto it = accounts.find(account);
+        return getAccountImpl(AccountPaths::find(account));
+    }
+
+    const AccountInfo & getAccountImpl(const AccountKey & account) const
+    {
+        return getAccountImpl(AccountPaths::find(account));
+    }
+
+    AccountInfo & getAccountImpl(AccountPathId path)
+    {
+        auto it = accounts.find(path);
         if (it == accounts.end())
             throw ML::Exception("couldn't get account");
         return it->second;
     }
 
-    const AccountInfo & getAccountImpl(const AccountKey & account) const
+    const AccountInfo & getAccountImpl(AccountPathId path) const
     {
-        auto it = accounts.find(account);
+        auto it = accounts.find(path);
         if (it == accounts.end())
             throw ML::Exception("couldn't get account");
         return it->second;
@@ -1210,14 +1366,44 @@ private:
         if (accountKey.size() < 2)
             throw ML::Exception("account has no parent");
 
-        AccountKey parentKey = accountKey;
-        parentKey.pop_back();
+        AccountPathId path = AccountPaths::find(accountKey);
+        AccountPathId parent = path == AccountPaths::NONE
+            ? AccountPaths::find(accountKey.parent())
+            : AccountPaths::parent(path);
 
-        Account & result = getAccountImpl(parentKey);
+        Account & result = getAccountImpl(parent);
         ExcAssertEqual(result.type, AT_BUDGET);
         return result;
     }
 
+    /** Call onAccount(key, info) for root and all of the accounts under
+        it, down to maxDepth levels (-1 for all), in key order.  An empty
+        root means every account.
+    */
+    template<typename Fn>
+    void forEachInSubtree(const AccountKey & root, int maxDepth,
+                          const Fn & onAccount) const
+    {
+        std::function<void (const AccountKey &)> doAccount
+            = [&] (const AccountKey & key)
+            {
+                if (maxDepth != -1 && key.size() > maxDepth)
+                    return;
+                auto it = accounts.find(AccountPaths::find(key));
+                if (it == accounts.end())
+                    return;
+                onAccount(key, it->second);
+                for (const AccountKey & ch: it->second.children)
+                    doAccount(ch);
+            };
+
+        if (root.empty()) {
+            for (const AccountKey & key: topLevelAccounts)
+                doAccount(key);
+        }
+        else doAccount(root);
+    }
+
     void forEachChildAccount(const AccountKey & account,
                              std::function<void (const AccountKey & key)> cb) const
     {
@@ -1231,26 +1417,26 @@ private:
     {
         AccountSummary result;
 
-        const Account & a = getAccountImpl(account);
+        const AccountInfo & a = getAccountImpl(account);
 
         result.account = a;
-        result.spent = a.spent;
-        result.budget = a.getRemainingBudget();
-        result.lineItems = a.lineItems;
-        result.adjustmentLineItems = a.adjustmentLineItems;
+        result.spent = a.subtree.spent;
+        result.budget = a.subtree.budget;
+        result.lineItems = a.subtree.lineItems;
+        result.adjustmentLineItems = a.subtree.adjustmentLineItems;
         result.allocated = a.allocatedOut - a.allocatedIn;
-        result.inFlight = a.commitmentsMade - a.commitmentsRetired;
-
-        auto doChildAccount = [&] (const AccountKey & key) {
-            auto childSummary = getAccountSummaryImpl(key, depth + 1,
-                                                      maxDepth);
-            result.addChild(key.back(), childSummary,
-                            maxDepth == -1 || depth < maxDepth);
-        };
-        result.available = result.budget - result.spent - result.inFlight;
+        result.inFlight = a.subtree.inFlight;
+        result.available = a.own.budget - a.own.spent - a.own.inFlight;
+
+        if (maxDepth == -1 || depth < maxDepth) {
+            auto doChildAccount = [&] (const AccountKey & key) {
+                result.subAccounts[key.back()]
+                    = getAccountSummaryImpl(key, depth + 1, maxDepth);
+            };
+
+            forEachChildAccount(account, doChildAccount);
+        }
 
-        forEachChildAccount(account, doChildAccount);
-        
         return result;
     }
 
@@ -1259,11 +1445,21 @@ private:
     {
         AccountSimpleSummary result;
 
-        const Account & a = getAccountImpl(account);
+        const AccountInfo & a = getAccountImpl(account);
+
+        if (depth < maxDepth && a.height <= maxDepth - depth) {
+            // The whole subtree is within reach
+            result.budget = a.subtree.budget;
+            result.spent = a.subtree.spent;
+            result.inFlight = a.subtree.inFlight;
+            result.available
+                = result.budget - result.spent - result.inFlight;
+            return result;
+        }
 
-        result.budget = a.getRemainingBudget();
-        result.spent = a.spent;
-        result.inFlight = a.commitmentsMade - a.commitmentsRetired;
+        result.budget = a.own.budget;
+        result.spent = a.own.spent;
+        result.inFlight = a.own.inFlight;
 
         if (depth < maxDepth) {
             auto doChildAccount = [&] (const AccountKey & key)
@@ -1344,7 +1540,7 @@ struct ShadowAccounts {
     bool accountExists(const AccountKey & accountKey) const
     {
         Guard guard(lock);
-        return accounts.count(accountKey);
+        return accounts.count(AccountPaths::find(accountKey));
     }
 
     bool createAccountAtomic(const AccountKey & accountKey)
@@ -1369,8 +1565,10 @@ struct ShadowAccounts {
         Guard guard1(lock);
         Guard guard2(master.lock);
 
-        for (auto & a: accounts)
+        for (auto & a: accounts) {
             a.second.syncToMaster(master.getAccountImpl(a.first));
+            master.updateRollups(a.first);
+        }
     }
 
     void syncFrom(const Accounts & master)
@@ -1393,6 +1591,7 @@ struct ShadowAccounts {
 
         for (auto & a: accounts) {
             a.second.syncToMaster(master.getAccountImpl(a.first));
+            master.updateRollups(a.first);
             a.second.syncFromMaster(master.getAccountImpl(a.first));
         }
     }
@@ -1412,8 +1611,9 @@ struct ShadowAccounts {
                       Amount amount)
     {
         Guard guard(lock);
-        return (outOfSyncAccounts.count(accountKey) == 0
-                && getAccountImpl(accountKey).authorizeBid(item, amount));
+        AccountPathId path = AccountPaths::intern(accountKey);
+        return (outOfSyncAccounts.count(path) == 0
+                && getAccountImpl(path).authorizeBid(item, amount));
     }
     
     void commitBid(const AccountKey & accountKey,
@@ -1493,11 +1693,17 @@ private:
     AccountEntry & getAccountImpl(const AccountKey & account,
                                   bool callOnNewAccount = true)
     {
-        auto it = accounts.find(account);
+        return getAccountImpl(AccountPaths::intern(account), callOnNewAccount);
+    }
+
+    AccountEntry & getAccountImpl(AccountPathId path,
+                                  bool callOnNewAccount = true)
+    {
+        auto it = accounts.find(path);
         if (it == accounts.end()) {
             if (callOnNewAccount && onNewAccount)
-                onNewAccount(account);
-            it = accounts.insert(std::make_pair(account, AccountEntry()))
+                onNewAccount(AccountPaths::key(path));
+            it = accounts.insert(std::make_pair(path, AccountEntry()))
                 .first;
         }
         return it->second;
@@ -1505,7 +1711,7 @@ private:
 
     const AccountEntry & getAccountImpl(const AccountKey & account) const
     {
-        auto it = accounts.find(account);
+        auto it = accounts.find(AccountPaths::find(account));
         if (it == accounts.end())
             throw ML::Exception("getting unknown account " + account.toString());
         return it->second;
@@ -1515,10 +1721,11 @@ private:
     typedef std::unique_lock<Lock> Guard;
     mutable Lock lock;
 
-    typedef std::map<AccountKey, AccountEntry> AccountMap;
+    /** Keyed on the interned path of each account. */
+    typedef std::unordered_map<AccountPathId, AccountEntry> AccountMap;
     AccountMap accounts;
 
-    typedef std::unordered_set<AccountKey> AccountSet;
+    typedef std::unordered_set<AccountPathId> AccountSet;
     AccountSet outOfSyncAccounts;
 
 public:
@@ -1529,36 +1736,39 @@ public:
 
         std::vector<AccountKey> result;
 
-        for (auto it = accounts.lower_bound(prefix), end = accounts.end();
-             it != accounts.end() && it->first.hasPrefix(prefix);  ++it) {
-            result.push_back(it->first);
+        AccountPathId prefixPath = AccountPaths::find(prefix);
+        if (prefixPath == AccountPaths::NONE)
+            return result;
+
+        for (auto & a: accounts) {
+            if (AccountPaths::hasPrefix(a.first, prefixPath))
+                result.push_back(AccountPaths::key(a.first));
         }
+        std::sort(result.begin(), result.end(), std::less<AccountKey>());
         return result;
     }
 
+    /** Call onAccount for each account, in the order of their keys. */
     void
     forEachAccount(const std::function<void (const AccountKey &,
                                              const ShadowAccount &)> &
                    onAccount) const
     {
         Guard guard(lock);
-        
-        for (auto & a: accounts) {
-            onAccount(a.first, a.second);
-        }
+
+        for (auto & a: sortedAccounts(false))
+            onAccount(a.first, *a.second);
     }
 
+    /** Same as forEachAccount, but skipping the uninitialized accounts. */
     void
     forEachInitializedAccount(const std::function<void (const AccountKey &,
                                                         const ShadowAccount &)> & onAccount)
     {
         Guard guard(lock);
-        
-        for (auto & a: accounts) {
-            if (a.second.uninitialized)
-                continue;
-            onAccount(a.first, a.second);
-        }
+
+        for (auto & a: sortedAccounts(true))
+            onAccount(a.first, *a.second);
     }
 
     size_t size() const
@@ -1572,6 +1782,30 @@ public:
         Guard guard(lock);
         return accounts.empty();
     }
+
+private:
+    /** The accounts sorted by key, as the hash map has no order.  Must be
+        called with the lock held. */
+    std::vector<std::pair<AccountKey, const ShadowAccount *> >
+    sortedAccounts(bool initializedOnly) const
+    {
+        std::vector<std::pair<AccountKey, const ShadowAccount *> > result;
+        result.reserve(accounts.size());
+        for (auto & a: accounts) {
+            if (initializedOnly && a.second.uninitialized)
+                continue;
+            result.push_back(std::make_pair(AccountPaths::key(a.first),
+                                            &a.second));
+        }
+
+        std::sort(result.begin(), result.end(),
+                  [] (const std::pair<AccountKey, const ShadowAccount *> & a1,
+                      const std::pair<AccountKey, const ShadowAccount *> & a2)
+                  {
+                      return a1.first < a2.first;
+                  });
+        return result;
+    }
 };
 
 } // namespace RTBKIT
@@ -6,6 +6,7 @@ LIBBANKER_SOURCES := \
 	null_banker.cc \
 	slave_banker.cc \
 	master_banker.cc \
+	local_banker_persistence.cc \
 
 LIBBANKER_LINK := \
 	types zeromq boost_thread logger opstats crypto++ leveldb services redis rtb monitor
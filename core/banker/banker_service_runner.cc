@@ -16,6 +16,7 @@
 #include <boost/make_shared.hpp>
 
 #include "rtbkit/core/banker/master_banker.h"
+#include "rtbkit/core/banker/local_banker_persistence.h"
 #include "jml/utils/pair_utils.h"
 #include "jml/arch/timers.h"
 #include "jml/arch/futex.h"
@@ -37,6 +38,7 @@ int main(int argc, char ** argv)
     std::string installation;
     std::string nodeName;
     std::string redisUri;  ///< TODO: zookeeper
+    std::string persistenceDir;
 
     std::vector<std::string> carbonUris;  ///< TODO: zookeeper
     std::vector<std::string> fixedHttpBindAddresses;
@@ -52,6 +54,8 @@ int main(int argc, char ** argv)
          "URI of connection to carbon daemon")
         ("redis-uri,r", value<string>(&redisUri),
          "URI of connection to redis")
+        ("persistence-dir,d", value<string>(&persistenceDir),
+         "Directory to persist to on the local disk instead of redis")
         ("fixed-http-bind-address,a", value(&fixedHttpBindAddresses),
          "Fixed address (host:port or *:port) at which we will always listen");
 
@@ -93,7 +97,10 @@ int main(int argc, char ** argv)
     std::shared_ptr<Redis::AsyncConnection> redis;
 
 
-    if (redisUri != "nopersistence") {
+    if (!persistenceDir.empty()) {
+        banker.init(std::make_shared<LocalBankerPersistence>(persistenceDir));
+    }
+    else if (redisUri != "nopersistence") {
         auto address = Redis::Address(redisUri);
         redis = std::make_shared<Redis::AsyncConnection>(redisUri);
         redis->test();
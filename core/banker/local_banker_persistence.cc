@@ -0,0 +1,541 @@
+/* local_banker_persistence.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Banker persistence to a log and snapshot on the local disk.
+*/
+
+#include "local_banker_persistence.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+#include <boost/algorithm/string.hpp>
+#include <boost/crc.hpp>
+#include <sstream>
+#include <mutex>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+#include <errno.h>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* LOCAL BANKER PERSISTENCE                                                  */
+/*****************************************************************************/
+
+namespace {
+
+const char MAGIC[8] = { 'R', 'T', 'B', 'K', 'B', 'A', 'N', 'K' };
+const uint32_t VERSION = 1;
+
+/** Magic, version and generation. */
+const size_t HEADER_BYTES = sizeof(MAGIC) + sizeof(uint32_t) + sizeof(uint64_t);
+
+/** Length and checksum of the payload. */
+const size_t RECORD_HEADER_BYTES = 2 * sizeof(uint32_t);
+
+/** Larger records can only come from a corrupt file. */
+const uint32_t MAX_RECORD_BYTES = 64 * 1024 * 1024;
+
+uint32_t checksum(const char * data, size_t size)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(data, size);
+    return crc.checksum();
+}
+
+void appendHeader(std::string & out, uint64_t generation)
+{
+    out.append(MAGIC, sizeof(MAGIC));
+    out.append((const char *)&VERSION, sizeof(VERSION));
+    out.append((const char *)&generation, sizeof(generation));
+}
+
+/** Check the header at the start of data; returns its generation. */
+bool parseHeader(const std::string & data, uint64_t & generation)
+{
+    if (data.size() < HEADER_BYTES
+        || memcmp(data.c_str(), MAGIC, sizeof(MAGIC)) != 0)
+        return false;
+    uint32_t version;
+    memcpy(&version, data.c_str() + sizeof(MAGIC), sizeof(version));
+    if (version != VERSION)
+        return false;
+    memcpy(&generation, data.c_str() + sizeof(MAGIC) + sizeof(version),
+           sizeof(generation));
+    return true;
+}
+
+void appendRecord(std::string & out, const std::string & key,
+                  const std::string & accountBytes)
+{
+    std::ostringstream stream;
+    {
+        ML::DB::Store_Writer store(stream);
+        store << key << accountBytes;
+    }
+    std::string payload = stream.str();
+
+    uint32_t length = payload.size();
+    uint32_t crc = checksum(payload.c_str(), payload.size());
+    out.append((const char *)&length, sizeof(length));
+    out.append((const char *)&crc, sizeof(crc));
+    out.append(payload);
+}
+
+/** Parse the record at offset, moving offset past it.  Returns false,
+    leaving offset alone, if there is no complete and intact record there.
+*/
+bool parseRecord(const std::string & data, size_t & offset,
+                 std::string & key, std::string & accountBytes)
+{
+    if (data.size() - offset < RECORD_HEADER_BYTES)
+        return false;
+
+    uint32_t length, crc;
+    memcpy(&length, data.c_str() + offset, sizeof(length));
+    memcpy(&crc, data.c_str() + offset + sizeof(length), sizeof(crc));
+    if (length > MAX_RECORD_BYTES
+        || data.size() - offset - RECORD_HEADER_BYTES < length)
+        return false;
+
+    const char * payload = data.c_str() + offset + RECORD_HEADER_BYTES;
+    if (checksum(payload, length) != crc)
+        return false;
+
+    try {
+        ML::DB::Store_Reader store(payload, length);
+        store >> key >> accountBytes;
+    } catch (const std::exception & exc) {
+        return false;
+    }
+
+    offset += RECORD_HEADER_BYTES + length;
+    return true;
+}
+
+/** Read the whole of the file into data.  Returns false if it doesn't
+    exist. */
+bool readFile(const std::string & filename, std::string & data)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return false;
+        throw ML::Exception(errno, "open " + filename);
+    }
+
+    data.clear();
+    char buf[65536];
+    for (;;) {
+        ssize_t res = ::read(fd, buf, sizeof(buf));
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1) {
+            int err = errno;
+            ::close(fd);
+            throw ML::Exception(err, "read " + filename);
+        }
+        if (res == 0)
+            break;
+        data.append(buf, res);
+    }
+
+    ::close(fd);
+    return true;
+}
+
+void writeAll(int fd, const std::string & data, const std::string & what)
+{
+    const char * p = data.c_str();
+    size_t left = data.size();
+    while (left) {
+        ssize_t res = ::write(fd, p, left);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
+            throw ML::Exception(errno, "write " + what);
+        p += res;
+        left -= res;
+    }
+}
+
+/** Write data to filename atomically: it's written to a temporary file
+    that is synced and renamed over it. */
+void replaceFile(const std::string & directory, const std::string & filename,
+                 const std::string & data)
+{
+    std::string tmpName = filename + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw ML::Exception(errno, "open " + tmpName);
+
+    try {
+        writeAll(fd, data, tmpName);
+        if (::fsync(fd) == -1)
+            throw ML::Exception(errno, "fsync " + tmpName);
+    } catch (...) {
+        ::close(fd);
+        ::unlink(tmpName.c_str());
+        throw;
+    }
+    ::close(fd);
+
+    if (::rename(tmpName.c_str(), filename.c_str()) == -1)
+        throw ML::Exception(errno, "rename " + tmpName);
+
+    // Make the rename itself durable
+    int dirFd = ::open(directory.c_str(), O_RDONLY);
+    if (dirFd != -1) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+}
+
+} // file scope
+
+struct LocalBankerPersistence::Itl {
+    Itl(const std::string & directory, bool syncWrites,
+        size_t minSnapshotBytes)
+        : directory(directory),
+          snapshotFile(directory + "/snapshot"),
+          logFile(directory + "/log"),
+          syncWrites(syncWrites),
+          minSnapshotBytes(minSnapshotBytes),
+          logFd(-1), generation(0),
+          logBytes(0), snapshotBytes(0), numSnapshots(0)
+    {
+    }
+
+    ~Itl()
+    {
+        if (logFd != -1)
+            ::close(logFd);
+    }
+
+    /** Last saved state of an account, and its binary form. */
+    struct SavedAccount {
+        Account account;
+        std::string bytes;
+    };
+
+    std::string directory;
+    std::string snapshotFile;
+    std::string logFile;
+    bool syncWrites;
+    size_t minSnapshotBytes;
+
+    mutable std::mutex lock;
+    std::map<std::string, SavedAccount> saved;
+
+    int logFd;
+    uint64_t generation;
+    size_t logBytes;
+    size_t snapshotBytes;
+    size_t numSnapshots;
+
+    /** Why the files could not be loaded; nothing is saved if set. */
+    PersistenceCallbackStatus loadStatus;
+    std::string loadError;
+
+    void open()
+    {
+        loadStatus = SUCCESS;
+
+        if (::mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST)
+            throw ML::Exception(errno, "mkdir " + directory);
+
+        std::string data;
+        if (readFile(snapshotFile, data)) {
+            if (!parseHeader(data, generation)) {
+                fail(DATA_INCONSISTENCY, "invalid snapshot header");
+                return;
+            }
+            size_t offset = HEADER_BYTES;
+            std::string key, bytes;
+            for (size_t next = offset;
+                 parseRecord(data, next, key, bytes) && restore(key, bytes);)
+                offset = next;
+            if (offset != data.size()) {
+                fail(DATA_INCONSISTENCY,
+                     ML::format("corrupt snapshot record at offset %zd",
+                                offset));
+                return;
+            }
+            snapshotBytes = data.size();
+        }
+
+        // The log is always replaced whole by a rename, so a log without a
+        // valid header, or that is newer than the snapshot, means that
+        // files went missing or were damaged.
+        bool haveLog = readFile(logFile, data);
+        uint64_t logGeneration = generation;
+        if (haveLog && (!parseHeader(data, logGeneration)
+                        || logGeneration > generation)) {
+            fail(DATA_INCONSISTENCY, "log doesn't match the snapshot");
+            return;
+        }
+
+        if (haveLog && logGeneration == generation) {
+            size_t offset = HEADER_BYTES;
+            std::string key, bytes;
+            for (size_t next = offset;
+                 parseRecord(data, next, key, bytes) && restore(key, bytes);)
+                offset = next;
+
+            logFd = ::open(logFile.c_str(), O_WRONLY | O_APPEND);
+            if (logFd == -1)
+                throw ML::Exception(errno, "open " + logFile);
+
+            // Whatever follows the last intact record was being written
+            // when we went down
+            if (offset != data.size()) {
+                cerr << "LocalBankerPersistence: dropping "
+                     << data.size() - offset << " bytes of torn log" << endl;
+                if (::ftruncate(logFd, offset) == -1)
+                    throw ML::Exception(errno, "ftruncate " + logFile);
+            }
+            logBytes = offset;
+        }
+        else {
+            // No log, or one that the snapshot already covers
+            startLog();
+        }
+    }
+
+    void fail(PersistenceCallbackStatus status, const std::string & error)
+    {
+        loadStatus = status;
+        loadError = directory + ": " + error;
+        saved.clear();
+    }
+
+    bool restore(const std::string & key, const std::string & bytes)
+    {
+        SavedAccount account;
+        try {
+            ML::DB::Store_Reader store(bytes.c_str(), bytes.size());
+            account.account.reconstitute(store);
+        } catch (const std::exception & exc) {
+            return false;
+        }
+        account.bytes = bytes;
+        saved[key] = account;
+        return true;
+    }
+
+    void startLog()
+    {
+        std::string header;
+        appendHeader(header, generation);
+        if (logFd != -1) {
+            ::close(logFd);
+            logFd = -1;
+        }
+
+        replaceFile(directory, logFile, header);
+        logFd = ::open(logFile.c_str(), O_WRONLY | O_APPEND);
+        if (logFd == -1)
+            throw ML::Exception(errno, "open " + logFile);
+        logBytes = header.size();
+    }
+
+    /** Append the records to the log.  On failure the log is cut back so
+        that nothing of them is left. */
+    void appendLog(const std::string & records)
+    {
+        // A failed snapshot can leave us without a log of the current
+        // generation
+        if (logFd == -1)
+            startLog();
+
+        try {
+            writeAll(logFd, records, logFile);
+            if (syncWrites && ::fdatasync(logFd) == -1)
+                throw ML::Exception(errno, "fdatasync " + logFile);
+        } catch (...) {
+            if (::ftruncate(logFd, logBytes) == -1)
+                cerr << "LocalBankerPersistence: can't truncate "
+                     << logFile << ": " << strerror(errno) << endl;
+            throw;
+        }
+        logBytes += records.size();
+    }
+
+    void writeSnapshot()
+    {
+        std::string data;
+        appendHeader(data, generation + 1);
+        for (auto & s: saved)
+            appendRecord(data, s.first, s.second.bytes);
+
+        // The new snapshot covers the old log; once it's in place the log
+        // is ignored until it has been restarted with the new generation.
+        replaceFile(directory, snapshotFile, data);
+        ++generation;
+        snapshotBytes = data.size();
+        ++numSnapshots;
+
+        startLog();
+    }
+};
+
+LocalBankerPersistence::
+LocalBankerPersistence(const std::string & directory,
+                       bool syncWrites,
+                       size_t minSnapshotBytes)
+{
+    itl = make_shared<Itl>(directory, syncWrites, minSnapshotBytes);
+    itl->open();
+}
+
+LocalBankerPersistence::
+~LocalBankerPersistence()
+{
+}
+
+void
+LocalBankerPersistence::
+loadAll(const string & topLevelKey, OnLoadedCallback onLoaded)
+{
+    shared_ptr<Accounts> newAccounts;
+    PersistenceCallbackStatus status;
+    string info;
+
+    {
+        std::unique_lock<std::mutex> guard(itl->lock);
+        status = itl->loadStatus;
+        if (status == SUCCESS) {
+            newAccounts = make_shared<Accounts>();
+            for (auto & s: itl->saved)
+                newAccounts->restoreAccount(AccountKey(s.first),
+                                            s.second.account);
+        }
+        else info = itl->loadError;
+    }
+
+    onLoaded(newAccounts, status, info);
+}
+
+void
+LocalBankerPersistence::
+saveAll(const Accounts & toSave, OnSavedCallback onSaved)
+{
+    // Accounts are collected first, as the accounts are locked while
+    // forEachAccount() runs.
+    vector<pair<AccountKey, Account> > accounts;
+    toSave.forEachAccount([&] (const AccountKey & key,
+                               const Account & account)
+                          {
+                              accounts.push_back(make_pair(key, account));
+                          });
+
+    PersistenceCallbackStatus status = SUCCESS;
+    string info;
+
+    {
+        std::unique_lock<std::mutex> guard(itl->lock);
+
+        if (itl->loadStatus != SUCCESS) {
+            guard.unlock();
+            onSaved(BACKEND_ERROR, itl->loadError);
+            return;
+        }
+
+        Json::Value badAccounts(Json::arrayValue);
+        vector<pair<string, Itl::SavedAccount> > changed;
+        string records;
+
+        for (auto & a: accounts) {
+            string key = a.first.toString();
+            if (toSave.isAccountOutOfSync(a.first)) {
+                cerr << "account '" << key
+                     << "' is out of sync and will not be saved" << endl;
+                continue;
+            }
+
+            Itl::SavedAccount account;
+            account.account = a.second;
+            {
+                std::ostringstream stream;
+                {
+                    ML::DB::Store_Writer store(stream);
+                    a.second.serialize(store);
+                }
+                account.bytes = stream.str();
+            }
+
+            auto it = itl->saved.find(key);
+            if (it != itl->saved.end()) {
+                if (it->second.bytes == account.bytes)
+                    continue;
+                if (!account.account.isSameOrPastVersion(it->second.account)) {
+                    badAccounts.append(Json::Value(key));
+                    continue;
+                }
+            }
+
+            appendRecord(records, key, account.bytes);
+            changed.push_back(make_pair(key, account));
+        }
+
+        if (badAccounts.size() > 0) {
+            /* As with Redis, nothing is saved when at least one account is
+               inconsistent. */
+            status = DATA_INCONSISTENCY;
+            info = boost::trim_copy(badAccounts.toString());
+        }
+        else if (!records.empty()) {
+            try {
+                itl->appendLog(records);
+                for (auto & c: changed)
+                    itl->saved[c.first] = c.second;
+
+                if (itl->logBytes
+                    > std::max(itl->minSnapshotBytes, itl->snapshotBytes))
+                    itl->writeSnapshot();
+            } catch (const std::exception & exc) {
+                status = BACKEND_ERROR;
+                info = exc.what();
+            }
+        }
+    }
+
+    onSaved(status, info);
+}
+
+void
+LocalBankerPersistence::
+snapshot()
+{
+    std::unique_lock<std::mutex> guard(itl->lock);
+    if (itl->loadStatus != SUCCESS)
+        throw ML::Exception("can't snapshot: " + itl->loadError);
+    itl->writeSnapshot();
+}
+
+size_t
+LocalBankerPersistence::
+numSnapshots() const
+{
+    std::unique_lock<std::mutex> guard(itl->lock);
+    return itl->numSnapshots;
+}
+
+size_t
+LocalBankerPersistence::
+logBytes() const
+{
+    std::unique_lock<std::mutex> guard(itl->lock);
+    return itl->logBytes;
+}
+
+} // namespace RTBKIT
@@ -0,0 +1,68 @@
+/* local_banker_persistence.h                                      -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Banker persistence to a log and snapshot on the local disk.
+*/
+
+#ifndef __banker__local_banker_persistence_h__
+#define __banker__local_banker_persistence_h__
+
+#include "master_banker.h"
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* LOCAL BANKER PERSISTENCE                                                  */
+/*****************************************************************************/
+
+/** Persists the banker's accounts to a directory on the local disk, with no
+    external service.
+
+    The directory holds a snapshot of every account and a log that is only
+    ever appended to.  Each saveAll() appends one record per account that
+    changed since it was last saved, in the binary form of Account, with a
+    single write (and an fdatasync if syncWrites is set).  Once the log has
+    grown larger than the snapshot (and minSnapshotBytes), a new snapshot is
+    written beside the old one and renamed over it, and the log is started
+    again.
+
+    Both files start with a generation number; a log is only replayed over
+    the snapshot of the same generation, so a crash at any point leaves a
+    consistent state.  Every record carries a checksum, and a log that was
+    cut short by a crash is truncated back to its last complete record.
+
+    As with RedisBankerPersistence, an account that went back in time
+    compared to what was last saved is reported as DATA_INCONSISTENCY and
+    nothing is saved.  The spend tracking that the Redis backend keeps for
+    top level accounts is not kept.
+
+    The callbacks are called before loadAll() and saveAll() return.
+*/
+
+struct LocalBankerPersistence : public BankerPersistence {
+    LocalBankerPersistence(const std::string & directory,
+                           bool syncWrites = true,
+                           size_t minSnapshotBytes = 1024 * 1024);
+    ~LocalBankerPersistence();
+
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+
+    void loadAll(const std::string & topLevelKey, OnLoadedCallback onLoaded);
+    void saveAll(const Accounts & toSave, OnSavedCallback onDone);
+
+    /** Write a snapshot of the last saved state now and start a new log. */
+    void snapshot();
+
+    /** Number of snapshots written since this object was created. */
+    size_t numSnapshots() const;
+
+    /** Current size of the log file in bytes. */
+    size_t logBytes() const;
+};
+
+} // namespace RTBKIT
+
+#endif /* __banker__local_banker_persistence_h__ */
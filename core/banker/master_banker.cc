@@ -213,7 +213,8 @@ saveAll(const Accounts & toSave, OnSavedCallback onSaved)
 
                 if (saveAccount) {
                     if (isParentAccount) {
-                        const AccountSummary & summary = toSave.getAccountSummary(key);
+                        const AccountSummary & summary
+                            = toSave.getAccountSummary(key, 0);
                         if (summary.spent != bankerAccount.initialSpent) {
                             // cerr << "adding tracking entry" << endl;
                             string sessionStartStr = toSave.sessionStart.printClassic();
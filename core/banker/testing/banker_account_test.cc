@@ -18,6 +18,7 @@
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/timers.h"
 #include "jml/utils/ring_buffer.h"
+#include <map>
 
 
 using namespace std;
@@ -25,6 +26,9 @@ using namespace ML;
 using namespace Datacratic;
 using namespace RTBKIT;
 
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
 BOOST_AUTO_TEST_CASE( test_account_set_budget )
 {
     Account account;
@@ -336,6 +340,115 @@ BOOST_AUTO_TEST_CASE( test_accounts )
     cerr << accounts.getAccountSummary(budget) << endl;
 }
 
+/* Checks the summaries, which come from the rollups, against sums taken
+   over the accounts themselves.
+*/
+BOOST_AUTO_TEST_CASE( test_account_rollups )
+{
+    Accounts accounts;
+    ShadowAccounts shadow;
+
+    AccountKey campaign("campaign");
+    AccountKey strategy("campaign:strategy");
+    AccountKey strategy2("campaign:strategy2");
+    AccountKey commitment("campaign:strategy:commitment");
+    AccountKey spend("campaign:strategy:spend");
+
+    auto checkSummaries = [&] (const std::string & where)
+        {
+            BOOST_TEST_CHECKPOINT(where);
+
+            for (const AccountKey & key: accounts.getAccountKeys()) {
+                CurrencyPool budget, spent, inFlight, shallowSpent;
+                LineItems lineItems;
+                for (const AccountKey & sub: accounts.getAccountKeys(key)) {
+                    Account a = accounts.getAccount(sub);
+                    budget += a.getRemainingBudget();
+                    spent += a.spent;
+                    inFlight += a.commitmentsMade - a.commitmentsRetired;
+                    lineItems += a.lineItems;
+                    if (sub.size() <= key.size() + 1)
+                        shallowSpent += a.spent;
+                }
+
+                AccountSummary summary = accounts.getAccountSummary(key, 0);
+                BOOST_CHECK_EQUAL(summary.budget, budget);
+                BOOST_CHECK_EQUAL(summary.spent, spent);
+                BOOST_CHECK_EQUAL(summary.inFlight, inFlight);
+                BOOST_CHECK(summary.lineItems == lineItems);
+                BOOST_CHECK(summary.subAccounts.empty());
+
+                if (key.size() != 1)
+                    continue;
+
+                auto simple = accounts.getAccountSimpleSummaries(3);
+                BOOST_CHECK_EQUAL(simple[key.toString()].spent, spent);
+                BOOST_CHECK_EQUAL(simple[key.toString()].available,
+                                  budget - spent - inFlight);
+
+                // Only down to the strategies
+                simple = accounts.getAccountSimpleSummaries(1);
+                BOOST_CHECK_EQUAL(simple[key.toString()].spent,
+                                  shallowSpent);
+            }
+        };
+
+    accounts.setBudget(campaign, USD(10));
+    accounts.setAvailable(strategy, USD(4), AT_BUDGET);
+    accounts.setAvailable(strategy2, USD(1), AT_BUDGET);
+    accounts.setAvailable(commitment, USD(2), AT_SPEND);
+    accounts.createSpendAccount(spend);
+    checkSummaries("setup");
+
+    shadow.activateAccount(commitment);
+    shadow.activateAccount(spend);
+
+    for (unsigned i = 0;  i < 3;  ++i) {
+        shadow.syncFrom(accounts);
+
+        BOOST_CHECK(shadow.authorizeBid(commitment, "ad1", USD(1)));
+        BOOST_CHECK(shadow.authorizeBid(commitment, "ad2", USD(0.50)));
+        Amount detached = shadow.detachBid(commitment, "ad1");
+        LineItems lineItems;
+        lineItems["creative"] = USD(0.25);
+        shadow.commitDetachedBid(spend, detached, USD(0.25), lineItems);
+
+        // ad2 is still in flight
+        shadow.syncTo(accounts);
+        checkSummaries("bids");
+
+        shadow.cancelBid(commitment, "ad2");
+        shadow.syncTo(accounts);
+        checkSummaries("cancel");
+
+        accounts.recuperate(spend);
+        checkSummaries("recuperate");
+
+        accounts.setAvailable(commitment, USD(2), AT_SPEND);
+        checkSummaries("setAvailable");
+    }
+
+    accounts.importSpend(spend, USD(0.10));
+    checkSummaries("importSpend");
+
+    accounts.setBudget(campaign, USD(20));
+    checkSummaries("setBudget");
+
+    // A subtree copy has rollups of its own
+    Accounts copy = accounts.getAccounts(campaign, 1);
+    AccountSummary summary = copy.getAccountSummary(campaign, 0);
+    BOOST_CHECK_EQUAL(summary.spent,
+                      accounts.getAccount(campaign).spent
+                      + accounts.getAccount(strategy).spent
+                      + accounts.getAccount(strategy2).spent);
+
+    AccountSummary full = accounts.getAccountSummary(campaign);
+    BOOST_CHECK_EQUAL(full.subAccounts.size(), 2);
+    BOOST_CHECK_EQUAL(full.subAccounts["strategy"].subAccounts.size(), 2);
+    BOOST_CHECK_EQUAL(full.subAccounts["strategy"].spent,
+                      accounts.getAccountSummary(strategy, 0).spent);
+}
+
 BOOST_AUTO_TEST_CASE( test_multiple_bidder_threads )
 {
     Accounts master;
@@ -513,3 +626,122 @@ BOOST_AUTO_TEST_CASE( test_multiple_bidder_threads )
     //BOOST_CHECK_EQUAL(status["available"].
 #endif
 }
+
+BOOST_AUTO_TEST_CASE( test_account_paths )
+{
+    AccountKey key("paths_a:b:c");
+    BOOST_CHECK_EQUAL(AccountPaths::find(key), AccountPaths::NONE);
+
+    AccountPathId path = AccountPaths::intern(key);
+    BOOST_CHECK_EQUAL(AccountPaths::intern(key), path);
+    BOOST_CHECK_EQUAL(AccountPaths::find(key), path);
+    BOOST_CHECK_EQUAL(AccountPaths::key(path), key);
+    BOOST_CHECK_EQUAL(AccountPaths::depth(path), 3);
+    BOOST_CHECK_EQUAL(AccountPaths::str(path), "paths_a:b:c");
+    BOOST_CHECK_EQUAL(AccountPaths::dotted(path), "paths_a.b.c");
+
+    // Ancestors come along
+    AccountPathId parent = AccountPaths::find(AccountKey("paths_a:b"));
+    AccountPathId top = AccountPaths::find(AccountKey("paths_a"));
+    BOOST_CHECK_EQUAL(AccountPaths::parent(path), parent);
+    BOOST_CHECK_EQUAL(AccountPaths::parent(parent), top);
+    BOOST_CHECK_EQUAL(AccountPaths::parent(top), AccountPaths::ROOT);
+
+    BOOST_CHECK(AccountPaths::hasPrefix(path, top));
+    BOOST_CHECK(AccountPaths::hasPrefix(path, path));
+    BOOST_CHECK(AccountPaths::hasPrefix(path, AccountPaths::ROOT));
+    BOOST_CHECK(!AccountPaths::hasPrefix(top, path));
+    BOOST_CHECK(!AccountPaths::hasPrefix
+                (path, AccountPaths::intern(AccountKey("paths_b"))));
+
+    // Accounts keep returning their keys in order
+    Accounts accounts;
+    accounts.createSpendAccount(AccountKey("paths_z:b"));
+    accounts.createSpendAccount(AccountKey("paths_z:a"));
+    accounts.createSpendAccount(AccountKey("paths_y:c"));
+    vector<AccountKey> keys = accounts.getAccountKeys();
+    BOOST_REQUIRE_EQUAL(keys.size(), 5);
+    BOOST_CHECK_EQUAL(keys[0], AccountKey("paths_y"));
+    BOOST_CHECK_EQUAL(keys[1], AccountKey("paths_y:c"));
+    BOOST_CHECK_EQUAL(keys[2], AccountKey("paths_z"));
+    BOOST_CHECK_EQUAL(keys[3], AccountKey("paths_z:a"));
+    BOOST_CHECK_EQUAL(keys[4], AccountKey("paths_z:b"));
+    BOOST_CHECK_EQUAL(accounts.getAccountKeys(AccountKey("paths_z")).size(), 3);
+
+    ShadowAccounts shadow;
+    shadow.activateAccount(AccountKey("paths_z:b"));
+    shadow.activateAccount(AccountKey("paths_z:a"));
+    shadow.activateAccount(AccountKey("paths_y:c"));
+    keys = shadow.getAccountKeys(AccountKey("paths_z"));
+    BOOST_REQUIRE_EQUAL(keys.size(), 2);
+    BOOST_CHECK_EQUAL(keys[0], AccountKey("paths_z:a"));
+    BOOST_CHECK_EQUAL(keys[1], AccountKey("paths_z:b"));
+}
+
+/* Cost of finding an account from its key, which is paid by every bid
+   operation of the shadow accounts.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_account_lookups )
+{
+    if (!runBenchmarks)
+        return;
+
+    int numCampaigns = 1000, numStrategies = 10, numOps = 1000000;
+
+    vector<AccountKey> keys;
+    std::map<AccountKey, int> byKey;
+    ShadowAccounts shadow;
+    Accounts master;
+
+    for (int i = 0;  i < numCampaigns;  ++i) {
+        AccountKey campaign("campaign" + to_string(i));
+        master.createBudgetAccount(campaign);
+        master.setBudget(campaign, USD(100));
+        for (int j = 0;  j < numStrategies;  ++j) {
+            AccountKey key = campaign.childKey("strategy" + to_string(j));
+            byKey[key] = keys.size();
+            keys.push_back(key);
+            master.setAvailable(key, USD(1), AT_SPEND);
+            shadow.activateAccount(key);
+        }
+    }
+    shadow.syncFrom(master);
+
+    // Spread over the accounts as bids would be
+    vector<int> order;
+    for (int i = 0;  i < numOps;  ++i)
+        order.push_back((i * 7919) % keys.size());
+
+    Date before = Date::now();
+    size_t total = 0;
+    for (int i: order)
+        total += byKey.find(keys[i])->second;
+    double mapTime = Date::now().secondsSince(before);
+
+    before = Date::now();
+    for (int i: order)
+        total += AccountPaths::find(keys[i]);
+    double pathTime = Date::now().secondsSince(before);
+
+    before = Date::now();
+    int numAuthorized = 0;
+    for (int i: order) {
+        if (!shadow.authorizeBid(keys[i], "item", MicroUSD(1)))
+            continue;
+        ++numAuthorized;
+        shadow.cancelBid(keys[i], "item");
+    }
+    double bidTime = Date::now().secondsSince(before);
+    BOOST_CHECK_EQUAL(numAuthorized, numOps);
+
+    cerr << ML::format("%zd accounts: %5.0fns/lookup in map, "
+                       "%5.0fns/lookup of path, "
+                       "%5.0fns/authorize and cancel",
+                       keys.size(),
+                       1e9 * mapTime / numOps,
+                       1e9 * pathTime / numOps,
+                       1e9 * bidTime / numOps)
+         << " (" << total << ")" << endl;
+
+    shadow.checkInvariants();
+}
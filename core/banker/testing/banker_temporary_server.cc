@@ -18,6 +18,7 @@
 #include <jml/arch/exception.h>
 #include <jml/arch/timers.h>
 #include "rtbkit/core/banker/master_banker.h"
+#include "rtbkit/core/banker/local_banker_persistence.h"
 
 #include "banker_temporary_server.h"
 
@@ -46,6 +47,18 @@ BankerTemporaryServer(const Redis::Address & redisAddress,
     start();
 }
 
+BankerTemporaryServer::
+BankerTemporaryServer(const std::string & persistenceDir,
+                      const std::string & zookeeperUri,
+                      const std::string & zookeeperPath)
+    : persistenceDir_(persistenceDir),
+      zookeeperUri_(zookeeperUri),
+      zookeeperPath_(zookeeperPath),
+      serverPid_(-1)
+{
+    start();
+}
+
 BankerTemporaryServer::
 ~BankerTemporaryServer()
 {
@@ -64,10 +77,18 @@ start()
         signal(SIGTERM, handleSIGTERM);
         signal(SIGKILL, SIG_DFL);
 
-        auto redis = make_shared<Redis::AsyncConnection>(redisAddress_);
-        redis->test();
+        std::shared_ptr<BankerPersistence> storage;
+        if (persistenceDir_.empty()) {
+            auto redis = make_shared<Redis::AsyncConnection>(redisAddress_);
+            redis->test();
 
-        // cerr << "tested redis" << endl;
+            // cerr << "tested redis" << endl;
+
+            storage = make_shared<RedisBankerPersistence>(redis);
+        }
+        else {
+            storage = make_shared<LocalBankerPersistence>(persistenceDir_);
+        }
 
         auto proxies = std::make_shared<ServiceProxies>();
         proxies->useZookeeper(zookeeperUri_, zookeeperPath_);
@@ -77,7 +98,7 @@ start()
 
         // cerr << "initializing banker" << endl;
 
-        banker->init(make_shared<RedisBankerPersistence>(redis));
+        banker->init(storage);
 
         // cerr << "binding banker" << endl;
 
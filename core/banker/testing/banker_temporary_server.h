@@ -29,6 +29,12 @@ struct BankerTemporaryServer : boost::noncopyable {
     BankerTemporaryServer(const Redis::Address & redisAddress,
                           const std::string & zookeeperUri,
                           const std::string & zookeeperPath);
+
+    /** Banker that persists to a LocalBankerPersistence in the given
+        directory instead of redis. */
+    BankerTemporaryServer(const std::string & persistenceDir,
+                          const std::string & zookeeperUri,
+                          const std::string & zookeeperPath);
     ~BankerTemporaryServer();
 
     void start();
@@ -37,6 +43,7 @@ struct BankerTemporaryServer : boost::noncopyable {
     void exterminate(); /* SIGKILL */
 
     Redis::Address redisAddress_;
+    std::string persistenceDir_;
     std::string zookeeperUri_;
     std::string zookeeperPath_;
     int serverPid_;
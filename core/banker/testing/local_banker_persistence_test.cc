@@ -0,0 +1,449 @@
+/* local_banker_persistence_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Tests and benchmark for the LocalBankerPersistence class.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <jml/arch/futex.h>
+#include "jml/arch/format.h"
+#include "jml/arch/timers.h"
+#include "jml/utils/environment.h"
+#include "soa/service/redis.h"
+#include "soa/service/testing/redis_temporary_server.h"
+
+#include "rtbkit/core/banker/account.h"
+#include "rtbkit/core/banker/master_banker.h"
+#include "rtbkit/core/banker/slave_banker.h"
+#include "rtbkit/core/banker/local_banker_persistence.h"
+
+#include "banker_temporary_server.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+using namespace Redis;
+
+Env_Option<string> tmpDir("TMP", "./tmp");
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+std::string makeDbPath(const std::string & name)
+{
+    string dir = tmpDir;
+    string path = dir + "/" + name;
+    int res = system(("rm -rf " + path + " && mkdir -p " + dir).c_str());
+    if (res != 0)
+        throw ML::Exception("couldn't clear " + path);
+    return path;
+}
+
+AccountKey spendKey(int campaign, int strategy)
+{
+    return AccountKey({ "campaign" + to_string(campaign),
+                        "strategy" + to_string(strategy),
+                        "spend" });
+}
+
+/** A campaign per top level account, each with numStrategies strategies
+    that have a spend account under them. */
+void makeAccounts(Accounts & accounts, int numCampaigns, int numStrategies)
+{
+    for (int i = 0;  i < numCampaigns;  ++i) {
+        AccountKey campaign("campaign" + to_string(i));
+        accounts.createAccount(campaign, AT_BUDGET);
+        accounts.setBudget(campaign, MicroUSD(1000000000));
+        for (int j = 0;  j < numStrategies;  ++j) {
+            AccountKey spend = spendKey(i, j);
+            accounts.setAvailable(spend.parent(), MicroUSD(100000000),
+                                  AT_BUDGET);
+            accounts.setAvailable(spend, MicroUSD(10000000), AT_SPEND);
+        }
+    }
+}
+
+BankerPersistence::PersistenceCallbackStatus
+saveSync(BankerPersistence & storage, const Accounts & accounts,
+         std::string * info = 0)
+{
+    int done(false);
+    BankerPersistence::PersistenceCallbackStatus result;
+
+    auto onSaved = [&] (BankerPersistence::PersistenceCallbackStatus status,
+                        const string & saveInfo)
+        {
+            result = status;
+            if (info)
+                *info = saveInfo;
+            done = true;
+            ML::futex_wake(done);
+        };
+    storage.saveAll(accounts, onSaved);
+    while (!done) {
+        ML::futex_wait(done, false);
+    }
+
+    return result;
+}
+
+std::shared_ptr<Accounts>
+loadSync(BankerPersistence & storage)
+{
+    int done(false);
+    std::shared_ptr<Accounts> result;
+
+    auto onLoaded = [&] (std::shared_ptr<Accounts> accounts,
+                         BankerPersistence::PersistenceCallbackStatus status,
+                         const string & info)
+        {
+            BOOST_CHECK_EQUAL(status, BankerPersistence::SUCCESS);
+            BOOST_CHECK_EQUAL(info, "");
+            result = accounts;
+            done = true;
+            ML::futex_wake(done);
+        };
+    storage.loadAll("", onLoaded);
+    while (!done) {
+        ML::futex_wait(done, false);
+    }
+
+    return result;
+}
+
+void checkSameAccounts(const Accounts & expected, const Accounts & loaded)
+{
+    auto keys = expected.getAccountKeys();
+    BOOST_REQUIRE_EQUAL(loaded.getAccountKeys().size(), keys.size());
+    for (auto & key: keys) {
+        Account e = expected.getAccount(key);
+        Account l = loaded.getAccount(key);
+        BOOST_CHECK_EQUAL(l.toJson(), e.toJson());
+        BOOST_CHECK_EQUAL(l.available, e.available);
+    }
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_local_persistence_save_and_load )
+{
+    string path = makeDbPath("local_persistence_save_and_load");
+
+    Accounts accounts;
+    makeAccounts(accounts, 10, 3);
+
+    {
+        // Small enough to need a snapshot after a few saves
+        LocalBankerPersistence storage(path, true, 4096);
+        BOOST_CHECK_EQUAL(loadSync(storage)->getAccountKeys().size(), 0);
+
+        for (int i = 0;  i < 20;  ++i) {
+            accounts.importSpend(spendKey(i % 10, i % 3), MicroUSD(10));
+            BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                              BankerPersistence::SUCCESS);
+        }
+        BOOST_CHECK_GT(storage.numSnapshots(), 0);
+
+        // Nothing changed; nothing is written
+        size_t logBytes = storage.logBytes();
+        BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                          BankerPersistence::SUCCESS);
+        BOOST_CHECK_EQUAL(storage.logBytes(), logBytes);
+
+        checkSameAccounts(accounts, *loadSync(storage));
+    }
+
+    // From the snapshot and the log
+    {
+        LocalBankerPersistence storage(path);
+        checkSameAccounts(accounts, *loadSync(storage));
+    }
+
+    // From the snapshot only
+    {
+        LocalBankerPersistence storage(path);
+        storage.snapshot();
+    }
+    {
+        LocalBankerPersistence storage(path);
+        checkSameAccounts(accounts, *loadSync(storage));
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_local_persistence_torn_log )
+{
+    string path = makeDbPath("local_persistence_torn_log");
+
+    Accounts accounts;
+    makeAccounts(accounts, 2, 2);
+
+    size_t logBytes;
+    {
+        LocalBankerPersistence storage(path);
+        BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                          BankerPersistence::SUCCESS);
+        logBytes = storage.logBytes();
+    }
+
+    // Half of a record, as left by a crash in the middle of a write
+    {
+        int fd = open((path + "/log").c_str(), O_WRONLY | O_APPEND);
+        BOOST_REQUIRE(fd != -1);
+        BOOST_REQUIRE_EQUAL(write(fd, "\x40\x00\x00\x00\x12\x34", 6), 6);
+        close(fd);
+    }
+
+    {
+        LocalBankerPersistence storage(path);
+        BOOST_CHECK_EQUAL(storage.logBytes(), logBytes);
+        checkSameAccounts(accounts, *loadSync(storage));
+
+        accounts.importSpend(spendKey(1, 1), MicroUSD(5));
+        BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                          BankerPersistence::SUCCESS);
+    }
+
+    {
+        LocalBankerPersistence storage(path);
+        checkSameAccounts(accounts, *loadSync(storage));
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_local_persistence_inconsistency )
+{
+    string path = makeDbPath("local_persistence_inconsistency");
+    LocalBankerPersistence storage(path);
+
+    Accounts accounts;
+    makeAccounts(accounts, 2, 1);
+    accounts.importSpend(spendKey(1, 0), MicroUSD(100));
+    BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                      BankerPersistence::SUCCESS);
+    size_t logBytes = storage.logBytes();
+
+    // Same accounts, with less spent than was saved
+    Accounts older;
+    makeAccounts(older, 2, 1);
+    older.importSpend(spendKey(0, 0), MicroUSD(100));
+
+    string info;
+    BOOST_CHECK_EQUAL(saveSync(storage, older, &info),
+                      BankerPersistence::DATA_INCONSISTENCY);
+    Json::Value badKeys = Json::parse(info);
+    BOOST_REQUIRE_EQUAL(badKeys.size(), 1);
+    BOOST_CHECK_EQUAL(badKeys[0].asString(), spendKey(1, 0).toString());
+    BOOST_CHECK_EQUAL(storage.logBytes(), logBytes);
+
+    // Out of sync accounts are left alone
+    older.markAccountOutOfSync(spendKey(1, 0));
+    BOOST_CHECK_EQUAL(saveSync(storage, older),
+                      BankerPersistence::SUCCESS);
+
+    auto loaded = loadSync(storage);
+    BOOST_CHECK_EQUAL(loaded->getAccount(spendKey(1, 0)).spent,
+                      CurrencyPool(MicroUSD(100)));
+    BOOST_CHECK_EQUAL(loaded->getAccount(spendKey(0, 0)).spent,
+                      CurrencyPool(MicroUSD(100)));
+}
+
+/* A process saves more spend every round and tells us about every save
+   that returned; it is killed while it does so.  Everything it was told was
+   saved has to be there when we reload.
+*/
+BOOST_AUTO_TEST_CASE( test_local_persistence_crash_recovery )
+{
+    string path = makeDbPath("local_persistence_crash_recovery");
+    int numCampaigns = 20, numStrategies = 2;
+
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+
+    pid_t pid = fork();
+    BOOST_REQUIRE(pid != -1);
+
+    if (pid == 0) {
+        close(fds[0]);
+        Accounts accounts;
+        makeAccounts(accounts, numCampaigns, numStrategies);
+        LocalBankerPersistence storage(path, true, 16384);
+        for (int round = 1;;  ++round) {
+            for (int i = 0;  i < numCampaigns;  ++i)
+                for (int j = 0;  j < numStrategies;  ++j)
+                    accounts.importSpend(spendKey(i, j), MicroUSD(1));
+            if (saveSync(storage, accounts) != BankerPersistence::SUCCESS)
+                _exit(1);
+            if (write(fds[1], &round, sizeof(round)) != sizeof(round))
+                _exit(1);
+        }
+    }
+
+    close(fds[1]);
+
+    // Let it go through a few snapshots
+    int saved = 0;
+    while (saved < 200) {
+        BOOST_REQUIRE_EQUAL(read(fds[0], &saved, sizeof(saved)),
+                            sizeof(saved));
+    }
+    kill(pid, SIGKILL);
+
+    int status;
+    BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+    BOOST_REQUIRE(WIFSIGNALED(status));
+    BOOST_CHECK_EQUAL(WTERMSIG(status), SIGKILL);
+
+    int round;
+    while (read(fds[0], &round, sizeof(round)) == sizeof(round))
+        saved = round;
+    close(fds[0]);
+
+    LocalBankerPersistence storage(path);
+    auto accounts = loadSync(storage);
+    BOOST_REQUIRE_EQUAL(accounts->getAccountKeys().size(),
+                        numCampaigns * (1 + 2 * numStrategies));
+
+    // The save that was under way may have been partly written
+    int minSpent = INT_MAX, maxSpent = 0;
+    for (int i = 0;  i < numCampaigns;  ++i) {
+        for (int j = 0;  j < numStrategies;  ++j) {
+            CurrencyPool spent = accounts->getAccount(spendKey(i, j)).spent;
+            int value = spent.getAvailable(CurrencyCode::CC_USD).value;
+            minSpent = std::min(minSpent, value);
+            maxSpent = std::max(maxSpent, value);
+        }
+    }
+    BOOST_CHECK_GE(minSpent, saved);
+    BOOST_CHECK_LE(maxSpent - minSpent, 1);
+
+    // And we carry on from there
+    for (int i = 0;  i < numCampaigns;  ++i)
+        accounts->importSpend(spendKey(i, 0), MicroUSD(1));
+    BOOST_CHECK_EQUAL(saveSync(storage, *accounts),
+                      BankerPersistence::SUCCESS);
+}
+
+/* A master banker persisting locally is killed after a slave banker has
+   created its spend account; the account is there on restart.
+*/
+BOOST_AUTO_TEST_CASE( test_local_persistence_banker_restart )
+{
+    string zookeeperAddress = "localhost:2181";
+    string zookeeperPath = "CWD";
+    string path = makeDbPath("local_persistence_banker_restart");
+
+    auto proxies = std::make_shared<ServiceProxies>();
+    proxies->useZookeeper(zookeeperAddress, zookeeperPath);
+
+    {
+        Accounts accounts;
+        accounts.createAccount({"top"}, AT_BUDGET);
+        accounts.setBudget({"top"}, MicroUSD(1000000));
+        accounts.setAvailable({"top", "sub"}, MicroUSD(100000), AT_BUDGET);
+        LocalBankerPersistence storage(path);
+        BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                          BankerPersistence::SUCCESS);
+    }
+
+    {
+        BankerTemporaryServer master(path, zookeeperAddress, zookeeperPath);
+
+        SlaveBanker slave(proxies->zmqContext);
+        slave.init(proxies->config, "slaveBanker");
+        slave.start();
+        slave.addSpendAccountSync({"top", "sub"});
+
+        // Leave time for a save, then die without a clean shutdown
+        ML::sleep(2);
+        master.exterminate();
+    }
+
+    LocalBankerPersistence storage(path);
+    auto accounts = loadSync(storage);
+    auto account = accounts->getAccount({"top", "sub", "slaveBanker"});
+    BOOST_CHECK_EQUAL(account.type, AT_SPEND);
+}
+
+/* Time for the master banker's once a second save of all accounts when a
+   tenth of them have changed, and to load them all back, for redis and for
+   the local log.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_banker_persistence )
+{
+    if (!runBenchmarks)
+        return;
+
+    int numCampaigns = 1000, numStrategies = 3, numRounds = 20;
+
+    RedisTemporaryServer redis;
+    auto connection = std::make_shared<AsyncConnection>(redis);
+    string path = makeDbPath("local_persistence_benchmark");
+
+    auto run = [&] (const string & name, BankerPersistence & storage)
+        {
+            Accounts accounts;
+            makeAccounts(accounts, numCampaigns, numStrategies);
+
+            Date before = Date::now();
+            BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                              BankerPersistence::SUCCESS);
+            double initialTime = Date::now().secondsSince(before);
+
+            double saveTime = 0.0;
+            for (int round = 0;  round < numRounds;  ++round) {
+                for (int i = round % 10;  i < numCampaigns;  i += 10)
+                    for (int j = 0;  j < numStrategies;  ++j)
+                        accounts.importSpend(spendKey(i, j), MicroUSD(1));
+
+                before = Date::now();
+                BOOST_CHECK_EQUAL(saveSync(storage, accounts),
+                                  BankerPersistence::SUCCESS);
+                saveTime += Date::now().secondsSince(before);
+            }
+
+            before = Date::now();
+            auto loaded = loadSync(storage);
+            double loadTime = Date::now().secondsSince(before);
+            BOOST_CHECK_EQUAL(loaded->getAccountKeys().size(),
+                              accounts.getAccountKeys().size());
+
+            cerr << ML::format("%-6s %zd accounts: first save %7.2fms, "
+                               "save %7.2fms, load %7.2fms",
+                               name.c_str(), accounts.getAccountKeys().size(),
+                               1000.0 * initialTime,
+                               1000.0 * saveTime / numRounds,
+                               1000.0 * loadTime)
+                 << endl;
+        };
+
+    {
+        RedisBankerPersistence storage(connection);
+        run("redis", storage);
+    }
+
+    {
+        LocalBankerPersistence storage(path);
+        run("local", storage);
+    }
+
+    // A restart has to read the snapshot and replay the log
+    Date before = Date::now();
+    LocalBankerPersistence storage(path);
+    auto loaded = loadSync(storage);
+    cerr << ML::format("local reopen: %7.2fms, %zd log bytes",
+                       1000.0 * Date::now().secondsSince(before),
+                       storage.logBytes())
+         << endl;
+}
@@ -13,7 +13,8 @@ LIBMONITOR_SOURCES := \
 	monitor_proxy.cc
 
 LIBMONITOR_LINK := \
-	services
+	services \
+	rtb
 
 $(eval $(call library,monitor,$(LIBMONITOR_SOURCES),$(LIBMONITOR_LINK)))
 
@@ -8,6 +8,8 @@
 #include <iostream>
 #include <boost/algorithm/string/trim.hpp>
 #include "soa/service/service_base.h"
+#include "soa/service/rest_request_binding.h"
+#include "rtbkit/common/auction_trace.h"
 
 #include "monitor_provider.h"
 
@@ -61,6 +63,47 @@ init()
     router_.addRoute("/status", "GET", "Return the status of the service",
                      statusRoute, Json::Value());
 
+    /* auction traces */
+    auto & traceNode
+        = router_.addSubRouter("/trace", "Auction traces of this process");
+
+    addRouteSyncReturn(traceNode,
+                       "/",
+                       {"GET"},
+                       "Return all of the recorded auction traces",
+                       "Array of trace records",
+                       [] (const Json::Value & records) { return records; },
+                       &MonitorProviderEndpoint::restGetTrace,
+                       this);
+
+    auto & auctionNode
+        = traceNode.addSubRouter(Rx("/([^/]*)", "/<auctionId>"),
+                                 "trace of an individual auction");
+
+    RequestParam<std::string> auctionIdParam(-2, "<auctionId>",
+                                             "auction to trace");
+
+    addRouteSyncReturn(auctionNode,
+                       "/records",
+                       {"GET"},
+                       "Return the trace records of the given auction",
+                       "Array of trace records",
+                       [] (const Json::Value & records) { return records; },
+                       &MonitorProviderEndpoint::restGetAuctionTrace,
+                       this,
+                       auctionIdParam);
+
+    addRouteSyncReturn(auctionNode,
+                       "/chrome",
+                       {"GET"},
+                       "Return the trace of the given auction in the format "
+                       "of chrome://tracing",
+                       "Chrome trace event object",
+                       [] (const Json::Value & trace) { return trace; },
+                       &MonitorProviderEndpoint::restGetAuctionChromeTrace,
+                       this,
+                       auctionIdParam);
+
     /* refresh timer */
     addPeriodic("MonitorProviderEndpoint::refreshStatus", 1.0,
                 std::bind(&MonitorProviderEndpoint::refreshStatus, this),
@@ -82,6 +125,28 @@ restGetServiceStatus()
     return boost::trim_copy(lastStatus_.toString());
 }
 
+Json::Value
+MonitorProviderEndpoint::
+restGetTrace()
+{
+    return AuctionTrace::toJson(AuctionTrace::records());
+}
+
+Json::Value
+MonitorProviderEndpoint::
+restGetAuctionTrace(const std::string & auctionId)
+{
+    return AuctionTrace::toJson(AuctionTrace::records(Id(auctionId)));
+}
+
+Json::Value
+MonitorProviderEndpoint::
+restGetAuctionChromeTrace(const std::string & auctionId)
+{
+    return AuctionTrace::toChromeTrace(AuctionTrace::records(Id(auctionId)),
+                                       endpointName_);
+}
+
 void
 MonitorProviderEndpoint::
 refreshStatus()
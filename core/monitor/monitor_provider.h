@@ -50,6 +50,12 @@ struct MonitorProviderEndpoint
        returned by MonitorProvider::serviceStatus */
     void refreshStatus();
 
+    /* these methods return the auction traces recorded in this process (see
+       AuctionTrace) */
+    Json::Value restGetTrace();
+    Json::Value restGetAuctionTrace(const std::string & auctionId);
+    Json::Value restGetAuctionChromeTrace(const std::string & auctionId);
+
     std::string endpointName_;
 
     RestRequestRouter router_;
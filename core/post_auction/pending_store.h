@@ -0,0 +1,604 @@
+/* pending_store.h                                                 -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Store for the (auction, spot) keyed state of the post auction loop.
+*/
+
+#ifndef __post_auction__pending_store_h__
+#define __post_auction__pending_store_h__
+
+#include "soa/service/pending_list.h"
+#include "soa/types/id.h"
+#include "soa/types/date.h"
+#include "jml/arch/exception.h"
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <limits>
+
+
+namespace RTBKIT {
+
+using Datacratic::Id;
+using Datacratic::Date;
+
+
+/*****************************************************************************/
+/* PENDING STORE                                                             */
+/*****************************************************************************/
+
+/** Replacement for PendingList<std::pair<Id, Id>, Value> specialized for the
+    access patterns of the post auction loop, where millions of entries are
+    live at any one time and a good fraction of them expire every second.
+
+    - Lookups go through an open-addressing table (linear probing) whose
+      slots hold a 128 bit hash of the (auction, spot) key.  A mismatch is
+      detected without touching the record, and the key in the record is
+      only compared on a full hash match.
+    - Records live in fixed size slabs that are never freed or moved; freed
+      records go onto a free list and are recycled.  No allocation is done
+      per entry once the store has warmed up.
+    - Expiry is driven by a ring of time buckets, each of which is an
+      intrusive list of records.  Expiring only visits the buckets that
+      have elapsed since the last call rather than the whole set.  Entries
+      with a timeout beyond the ring's horizon sit in the last bucket and
+      are moved on when it comes up.
+    - A secondary table keyed by auction id chains together the spots of
+      each auction so that a request with a null spot id can be completed.
+
+    The interface mirrors the subset of PendingList that is used by the
+    post auction loop, including persistence via PendingPersistenceT (or
+    anything else with the same set(), erase() and scan() methods, such as
+    WriteBehindPersistence).
+
+    Not thread safe; it is designed to be owned by a single message loop.
+*/
+
+template<typename Value,
+         typename Persistence
+             = Datacratic::PendingPersistenceT<std::pair<Id, Id>, Value> >
+struct PendingStore {
+
+    typedef std::pair<Id, Id> Key;
+
+    /** Accept function when loading entries from persistence; can modify
+        the key, value and timeout, and returns false to skip the entry. */
+    typedef std::function<bool (Key &, Value &, Date &)> AcceptEntry;
+
+    enum {
+        RECORDS_PER_SLAB = 4096
+    };
+
+    /** Create a store.  The expiry ring has numBuckets buckets of
+        bucketSeconds each; entries with timeouts further out than that
+        are simply revisited when the last bucket comes around.  The
+        default gives a horizon of a little over one hour, which covers
+        all of the post auction loop's timeouts.
+    */
+    PendingStore(double bucketSeconds = 1.0,
+                 size_t numBuckets = 4096)
+        : bucketSeconds(bucketSeconds),
+          buckets(numBuckets, NONE),
+          numRecords(0),
+          freeList(NONE)
+    {
+        if (bucketSeconds <= 0.0 || numBuckets < 2)
+            throw ML::Exception("invalid PendingStore expiry ring");
+        currentTick = tickFor(Date::now());
+    }
+
+    ~PendingStore()
+    {
+    }
+
+    size_t size() const
+    {
+        return numRecords;
+    }
+
+    bool empty() const
+    {
+        return numRecords == 0;
+    }
+
+    bool count(const Key & key) const
+    {
+        return findRecord(key) != NONE;
+    }
+
+    /** Return the value at the given key.  Throws if it doesn't exist. */
+    const Value & get(const Key & key) const
+    {
+        uint32_t rec = findRecord(key);
+        if (rec == NONE)
+            throw ML::Exception("PendingStore::get(): key not found");
+        return record(rec).value;
+    }
+
+    /** Remove the given key and return its value.  Throws if it doesn't
+        exist. */
+    Value pop(const Key & key)
+    {
+        uint32_t rec = findRecord(key);
+        if (rec == NONE)
+            throw ML::Exception("PendingStore::pop(): key not found");
+        Value result = std::move(record(rec).value);
+        removeRecord(rec);
+        if (persistence)
+            persistence->erase(key);
+        return result;
+    }
+
+    /** Remove the given key.  Returns false if it didn't exist. */
+    bool erase(const Key & key)
+    {
+        uint32_t rec = findRecord(key);
+        if (rec == NONE)
+            return false;
+        removeRecord(rec);
+        if (persistence)
+            persistence->erase(key);
+        return true;
+    }
+
+    /** Insert the given value, which must not already be present. */
+    void insert(const Key & key, const Value & value, Date timeout)
+    {
+        if (findRecord(key) != NONE)
+            throw ML::Exception("PendingStore::insert(): key already present");
+        insertRecord(key, value, timeout);
+        if (persistence)
+            persistence->set(key, value);
+    }
+
+    /** Replace the value for an existing key, keeping its timeout. */
+    void update(const Key & key, const Value & value)
+    {
+        uint32_t rec = findRecord(key);
+        if (rec == NONE)
+            throw ML::Exception("PendingStore::update(): key not found");
+        record(rec).value = value;
+        if (persistence)
+            persistence->set(key, value);
+    }
+
+    /** Find the lowest spot id that exists for the given auction.  Returns
+        a null pair if there is none.  This gives the same answer as
+        PendingList::completePrefix() with IsPrefixPair.
+    */
+    Key completePrefix(const Id & auctionId) const
+    {
+        uint32_t rec = findAuctionHead(auctionId);
+        if (rec == NONE)
+            return Key();
+
+        const Key * best = &record(rec).key;
+        for (rec = record(rec).spotNext;  rec != NONE;
+             rec = record(rec).spotNext) {
+            if (record(rec).key.second < best->second)
+                best = &record(rec).key;
+        }
+        return *best;
+    }
+
+    /** Expire everything whose timeout is at or before now.  For each
+        expired entry, fn(key, value) is called; if it returns a null Date
+        then the entry is removed, otherwise the entry is kept with the
+        returned date as its new timeout.
+
+        Only the buckets that have elapsed since the last call are
+        visited.
+    */
+    template<typename Fn>
+    void expire(const Fn & fn, Date now = Date::now())
+    {
+        // Anything with an earlier timeout than the current tick was put
+        // in the current tick's bucket, so if time has gone backwards
+        // that's the only one that can contain expired entries.
+        int64_t nowTick = std::max(tickFor(now), currentTick);
+
+        // If we fell behind by more than a turn of the ring, every bucket
+        // needs to be looked at exactly once.
+        int64_t firstTick = std::max(currentTick,
+                                     nowTick - (int64_t)buckets.size() + 1);
+
+        // The new horizon is used for relinking, so that nothing is put
+        // back into a bucket behind the one we're walking.
+        currentTick = nowTick;
+
+        for (int64_t tick = firstTick;  tick <= nowTick;  ++tick) {
+            uint32_t & head = buckets[tick % buckets.size()];
+
+            // Detach the whole list so that relinked entries aren't
+            // visited twice
+            uint32_t rec = head;
+            head = NONE;
+
+            while (rec != NONE) {
+                Record & r = record(rec);
+                uint32_t next = r.bucketNext;
+
+                if (r.timeout > now) {
+                    linkBucket(rec);
+                    rec = next;
+                    continue;
+                }
+
+                Date newTimeout = fn(const_cast<const Key &>(r.key),
+                                     const_cast<const Value &>(r.value));
+                if (newTimeout == Date()) {
+                    Key key = r.key;
+                    r.bucketPrev = r.bucketNext = NONE;
+                    removeRecord(rec, false /* unlinkBucket */);
+                    if (persistence)
+                        persistence->erase(key);
+                }
+                else {
+                    r.timeout = newTimeout;
+                    linkBucket(rec);
+                }
+
+                rec = next;
+            }
+        }
+    }
+
+    /** Load entries from the given persistence store, and record all
+        further changes to it.
+    */
+    void initFromStore(std::shared_ptr<Persistence> store,
+                       AcceptEntry acceptEntry,
+                       Date timeout)
+    {
+        auto onEntry = [&] (Key & key, Value & value)
+            {
+                Date entryTimeout = timeout;
+                if (!acceptEntry(key, value, entryTimeout))
+                    return;
+                loadEntry(key, value, entryTimeout);
+            };
+
+        store->scan(onEntry);
+
+        persistence = store;
+    }
+
+    /** Add an entry that was read back from persistence, replacing the
+        value of any existing entry with the same key.  Nothing is written
+        to the persistence.  This allows a store shared between several
+        PendingStores to be scanned once, with the entries handed out to
+        the store that owns them before setting each one's persistence.
+    */
+    void loadEntry(const Key & key, const Value & value, Date timeout)
+    {
+        uint32_t rec = findRecord(key);
+        if (rec != NONE) {
+            record(rec).value = value;
+            return;
+        }
+        insertRecord(key, value, timeout);
+    }
+
+    /** Approximate number of bytes of memory used by the store's own
+        structures (not including anything the values point to). */
+    size_t memUsage() const
+    {
+        return slabs.size() * RECORDS_PER_SLAB * sizeof(Record)
+            + table.capacity() * sizeof(Slot)
+            + auctionTable.capacity() * sizeof(Slot)
+            + buckets.capacity() * sizeof(uint32_t);
+    }
+
+    std::shared_ptr<Persistence> persistence;
+
+private:
+    static const uint32_t NONE = (uint32_t)-1;
+
+    struct Record {
+        Record()
+            : bucket(0), bucketPrev(NONE), bucketNext(NONE),
+              spotPrev(NONE), spotNext(NONE)
+        {
+        }
+
+        Key key;
+        Value value;
+        Date timeout;
+        uint32_t bucket;                  ///< Expiry bucket we're linked in
+        uint32_t bucketPrev, bucketNext;  ///< Links in the expiry bucket
+        uint32_t spotPrev, spotNext;      ///< Links to the auction's spots
+    };
+
+    struct Slot {
+        Slot()
+            : h1(0), h2(0), rec(NONE)
+        {
+        }
+
+        uint64_t h1, h2;
+        uint32_t rec;
+    };
+
+    double bucketSeconds;
+    std::vector<uint32_t> buckets;
+    int64_t currentTick;
+
+    std::vector<std::unique_ptr<Record[]> > slabs;
+    size_t numRecords;
+    uint32_t freeList;            ///< Chained through bucketNext
+
+    std::vector<Slot> table;         ///< (auction, spot) -> record
+    std::vector<Slot> auctionTable;  ///< auction -> first spot record
+
+    Record & record(uint32_t rec)
+    {
+        return slabs[rec / RECORDS_PER_SLAB][rec % RECORDS_PER_SLAB];
+    }
+
+    const Record & record(uint32_t rec) const
+    {
+        return slabs[rec / RECORDS_PER_SLAB][rec % RECORDS_PER_SLAB];
+    }
+
+    static uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static void hashKey(const Key & key, uint64_t & h1, uint64_t & h2)
+    {
+        uint64_t a = key.first.hash(), s = key.second.hash();
+        h1 = mix(a ^ (s * 0x9e3779b97f4a7c15ULL));
+        h2 = mix(s + (a << 17 | a >> 47));
+    }
+
+    static uint64_t hashAuction(const Id & auctionId)
+    {
+        return mix(auctionId.hash());
+    }
+
+    int64_t tickFor(Date date) const
+    {
+        double tick = std::floor(date.secondsSinceEpoch() / bucketSeconds);
+        if (!std::isfinite(tick))
+            return tick < 0 ? 0 : std::numeric_limits<int64_t>::max() / 2;
+        return tick;
+    }
+
+    /* Expiry ring */
+
+    void linkBucket(uint32_t rec)
+    {
+        Record & r = record(rec);
+        int64_t tick = tickFor(r.timeout);
+        tick = std::max(tick, currentTick);
+        tick = std::min<int64_t>(tick, currentTick + buckets.size() - 1);
+
+        r.bucket = tick % buckets.size();
+        uint32_t & head = buckets[r.bucket];
+        r.bucketPrev = NONE;
+        r.bucketNext = head;
+        if (head != NONE)
+            record(head).bucketPrev = rec;
+        head = rec;
+    }
+
+    void unlinkBucket(uint32_t rec)
+    {
+        Record & r = record(rec);
+        if (r.bucketPrev != NONE)
+            record(r.bucketPrev).bucketNext = r.bucketNext;
+        else buckets[r.bucket] = r.bucketNext;
+        if (r.bucketNext != NONE)
+            record(r.bucketNext).bucketPrev = r.bucketPrev;
+        r.bucketPrev = r.bucketNext = NONE;
+    }
+
+    /* Records */
+
+    uint32_t allocRecord()
+    {
+        if (freeList == NONE) {
+            uint32_t base = slabs.size() * RECORDS_PER_SLAB;
+            slabs.emplace_back(new Record[RECORDS_PER_SLAB]);
+            for (int i = RECORDS_PER_SLAB - 1;  i >= 0;  --i) {
+                record(base + i).bucketNext = freeList;
+                freeList = base + i;
+            }
+        }
+
+        uint32_t rec = freeList;
+        freeList = record(rec).bucketNext;
+        record(rec).bucketNext = NONE;
+        return rec;
+    }
+
+    void freeRecord(uint32_t rec)
+    {
+        Record & r = record(rec);
+        r.key = Key();
+        r.value = Value();
+        r.spotPrev = r.spotNext = r.bucketPrev = NONE;
+        r.bucketNext = freeList;
+        freeList = rec;
+    }
+
+    void insertRecord(const Key & key, const Value & value, Date timeout)
+    {
+        if ((numRecords + 1) * 2 > table.size())
+            growTables();
+
+        uint32_t rec = allocRecord();
+        Record & r = record(rec);
+        r.key = key;
+        r.value = value;
+        r.timeout = timeout;
+
+        uint64_t h1, h2;
+        hashKey(key, h1, h2);
+        size_t mask = table.size() - 1;
+        size_t i = h1 & mask;
+        while (table[i].rec != NONE)
+            i = (i + 1) & mask;
+        table[i].h1 = h1;
+        table[i].h2 = h2;
+        table[i].rec = rec;
+
+        // Chain it in with the other spots of the auction
+        uint32_t head = findAuctionHead(key.first);
+        if (head == NONE)
+            insertAuctionHead(key.first, rec);
+        else {
+            Record & h = record(head);
+            r.spotPrev = head;
+            r.spotNext = h.spotNext;
+            if (h.spotNext != NONE)
+                record(h.spotNext).spotPrev = rec;
+            h.spotNext = rec;
+        }
+
+        linkBucket(rec);
+        ++numRecords;
+    }
+
+    void removeRecord(uint32_t rec, bool unlinkFromBucket = true)
+    {
+        Record & r = record(rec);
+
+        if (unlinkFromBucket)
+            unlinkBucket(rec);
+
+        // Unchain from the auction's spots
+        if (r.spotPrev == NONE) {
+            if (r.spotNext == NONE)
+                eraseSlot(auctionTable, findAuctionSlot(r.key.first));
+            else {
+                auctionTable[findAuctionSlot(r.key.first)].rec = r.spotNext;
+                record(r.spotNext).spotPrev = NONE;
+            }
+        }
+        else {
+            record(r.spotPrev).spotNext = r.spotNext;
+            if (r.spotNext != NONE)
+                record(r.spotNext).spotPrev = r.spotPrev;
+        }
+
+        eraseSlot(table, findSlot(r.key));
+        freeRecord(rec);
+        --numRecords;
+    }
+
+    /* Hash tables */
+
+    size_t findSlot(const Key & key) const
+    {
+        if (table.empty())
+            return NONE;
+        uint64_t h1, h2;
+        hashKey(key, h1, h2);
+        size_t mask = table.size() - 1;
+        for (size_t i = h1 & mask;  table[i].rec != NONE;  i = (i + 1) & mask) {
+            const Slot & s = table[i];
+            if (s.h1 == h1 && s.h2 == h2 && record(s.rec).key == key)
+                return i;
+        }
+        return NONE;
+    }
+
+    uint32_t findRecord(const Key & key) const
+    {
+        size_t slot = findSlot(key);
+        return slot == NONE ? NONE : table[slot].rec;
+    }
+
+    size_t findAuctionSlot(const Id & auctionId) const
+    {
+        if (auctionTable.empty())
+            return NONE;
+        uint64_t h = hashAuction(auctionId);
+        size_t mask = auctionTable.size() - 1;
+        for (size_t i = h & mask;  auctionTable[i].rec != NONE;
+             i = (i + 1) & mask) {
+            const Slot & s = auctionTable[i];
+            if (s.h1 == h && record(s.rec).key.first == auctionId)
+                return i;
+        }
+        return NONE;
+    }
+
+    uint32_t findAuctionHead(const Id & auctionId) const
+    {
+        size_t slot = findAuctionSlot(auctionId);
+        return slot == NONE ? NONE : auctionTable[slot].rec;
+    }
+
+    void insertAuctionHead(const Id & auctionId, uint32_t rec)
+    {
+        uint64_t h = hashAuction(auctionId);
+        size_t mask = auctionTable.size() - 1;
+        size_t i = h & mask;
+        while (auctionTable[i].rec != NONE)
+            i = (i + 1) & mask;
+        auctionTable[i].h1 = h;
+        auctionTable[i].rec = rec;
+    }
+
+    /** Remove the given slot, shifting back any following entries of the
+        probe sequence so that no tombstones are needed. */
+    static void eraseSlot(std::vector<Slot> & slots, size_t i)
+    {
+        if (i == NONE)
+            throw ML::Exception("PendingStore: erasing missing slot");
+
+        size_t mask = slots.size() - 1;
+        size_t j = i;
+        for (;;) {
+            slots[i].rec = NONE;
+            for (;;) {
+                j = (j + 1) & mask;
+                if (slots[j].rec == NONE)
+                    return;
+                size_t home = slots[j].h1 & mask;
+                // Can the entry at j move to i?  Only if its home slot
+                // isn't cyclically within (i, j].
+                if (i <= j ? (i < home && home <= j)
+                           : (i < home || home <= j))
+                    continue;
+                break;
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    static void rehash(std::vector<Slot> & slots, size_t newSize)
+    {
+        std::vector<Slot> newSlots(newSize);
+        size_t mask = newSize - 1;
+        for (auto & s: slots) {
+            if (s.rec == NONE) continue;
+            size_t i = s.h1 & mask;
+            while (newSlots[i].rec != NONE)
+                i = (i + 1) & mask;
+            newSlots[i] = s;
+        }
+        slots.swap(newSlots);
+    }
+
+    void growTables()
+    {
+        size_t newSize = std::max<size_t>(table.size() * 2, 1024);
+        rehash(table, newSize);
+        rehash(auctionTable, newSize);
+    }
+};
+
+
+} // namespace RTBKIT
+
+#endif /* __post_auction__pending_store_h__ */
@@ -7,3 +7,7 @@ LIBRTB_POST_AUCTION_LINK := \
 	zeromq boost_thread logger opstats crypto++ leveldb gc services banker
 
 $(eval $(call library,post_auction,$(LIBRTB_POST_AUCTION_SOURCES),$(LIBRTB_POST_AUCTION_LINK)))
+
+$(eval $(call program,post_auction_runner,post_auction boost_program_options))
+
+$(eval $(call include_sub_make,post_auction_testing,testing,post_auction_testing.mk))
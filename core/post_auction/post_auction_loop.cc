@@ -13,6 +13,8 @@
 #include "jml/utils/pair_utils.h"
 #include "jml/arch/futex.h"
 #include "rtbkit/core/banker/banker.h"
+#include "rtbkit/common/auction_trace.h"
+#include "rtbkit/common/bid_result.h"
 #include "jml/db/persistent.h"
 
 using namespace std;
@@ -51,6 +53,91 @@ reconstitute(ML::DB::Store_Reader & store)
 }
 
 
+/*****************************************************************************/
+/* SUBMITTED AUCTION                                                         */
+/*****************************************************************************/
+
+std::vector<SubmittedAuctionEvent>
+SubmittedAuction::
+toEvents() const
+{
+    std::vector<SubmittedAuctionEvent> result(spots.size());
+
+    for (unsigned i = 0;  i < spots.size();  ++i) {
+        SubmittedAuctionEvent & event = result[i];
+        event.auctionId = auctionId;
+        event.adSpotId = spots[i].adSpotId;
+        event.spotIndex = spots[i].spotIndex;
+        event.lossTimeout = lossTimeout;
+        event.augmentations = spots[i].augmentations;
+        event.bidRequest = bidRequest;
+        event.bidRequestStr = bidRequestStr;
+        event.bidRequestFormatStr = bidRequestFormatStr;
+        event.bidResponse = spots[i].bidResponse;
+    }
+
+    return result;
+}
+
+void
+SubmittedAuction::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << (unsigned char)0
+          << auctionId << lossTimeout << bidRequestStr << bidRequestFormatStr
+          << slim << ML::DB::compact_size_t(spots.size());
+
+    for (auto & spot: spots) {
+        store << spot.adSpotId << spot.spotIndex << spot.augmentations;
+
+        const Auction::Response & response = spot.bidResponse;
+        if (slim) {
+            store << response.price.maxPrice << response.price.priority
+                  << response.tagId << response.test << response.account << response.agent << response.bidData
+                  << response.meta << response.creativeId
+                  << response.creativeName << response.visitChannels;
+        }
+        else store << response;
+    }
+}
+
+void
+SubmittedAuction::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("unknown SubmittedAuction version");
+
+    store >> auctionId >> lossTimeout >> bidRequestStr >> bidRequestFormatStr
+          >> slim;
+
+    ML::DB::compact_size_t numSpots(store);
+    spots.resize(numSpots);
+
+    for (auto & spot: spots) {
+        store >> spot.adSpotId >> spot.spotIndex >> spot.augmentations;
+
+        Auction::Response & response = spot.bidResponse;
+        if (slim) {
+            store >> response.price.maxPrice >> response.price.priority
+                  >> response.tagId >> response.test >> response.account >> response.agent >> response.bidData
+                  >> response.meta >> response.creativeId
+                  >> response.creativeName >> response.visitChannels;
+            response.localStatus = Auction::WIN;
+        }
+        else store >> response;
+    }
+
+    // In slim mode the spot indexes are enough; the request is only
+    // parsed if someone needs it later
+    if (!slim)
+        bidRequest.reset(BidRequest::parse(bidRequestFormatStr, bidRequestStr));
+    else bidRequest.reset();
+}
+
+
 /*****************************************************************************/
 /* POST AUCTION EVENT TYPE                                                   */
 /*****************************************************************************/
@@ -160,6 +247,37 @@ operator << (std::ostream & stream, const PostAuctionEvent & event)
 }
 
 
+/*****************************************************************************/
+/* POST AUCTION EVENT BATCH                                                  */
+/*****************************************************************************/
+
+void
+PostAuctionEventBatch::
+serialize(ML::DB::Store_Writer & store) const
+{
+    unsigned char version = 0;
+    store << version << ML::DB::compact_size_t(events.size());
+    for (auto & event: events)
+        event.serialize(store);
+}
+
+void
+PostAuctionEventBatch::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version;
+    store >> version;
+    if (version != 0)
+        throw ML::Exception("reconstituting unknown version of "
+                            "PostAuctionEventBatch");
+
+    ML::DB::compact_size_t numEvents(store);
+    events.resize(numEvents);
+    for (auto & event: events)
+        event.reconstitute(store);
+}
+
+
 /*****************************************************************************/
 /* SUBMISSION INFO                                                           */
 /*****************************************************************************/
@@ -425,12 +543,79 @@ reconstituteFromString(const std::string & str)
 /* POST AUCTION LOOP                                                         */
 /*****************************************************************************/
 
+PostAuctionLoop::TaskQueue::
+TaskQueue(size_t queueSize)
+    : numOverflowed(0), sink(queueSize), overflowing(false)
+{
+    sink.onEvent = std::bind(&TaskQueue::runTask, this,
+                             std::placeholders::_1);
+}
+
+void
+PostAuctionLoop::TaskQueue::
+push(const std::function<void ()> & task)
+{
+    if (!overflowing && sink.tryPush(task))
+        return;
+
+    std::unique_lock<std::mutex> guard(overflowLock);
+    overflow.push_back(task);
+    overflowing = true;
+    ++numOverflowed;
+
+    // If the loop emptied the ring before we got here it won't come back
+    // to drain the overflow, so try it now.  Otherwise the ring is full
+    // and the loop will drain it once it has run a task.
+    drainOverflow();
+}
+
+void
+PostAuctionLoop::TaskQueue::
+addTo(MessageLoop & loop, const std::string & name)
+{
+    loop.addSource(name, sink);
+}
+
+void
+PostAuctionLoop::TaskQueue::
+runTask(const std::function<void ()> & task)
+{
+    task();
+
+    if (overflowing) {
+        std::unique_lock<std::mutex> guard(overflowLock);
+        drainOverflow();
+    }
+}
+
+void
+PostAuctionLoop::TaskQueue::
+drainOverflow()
+{
+    while (!overflow.empty() && sink.tryPush(overflow.front()))
+        overflow.pop_front();
+    if (overflow.empty())
+        overflowing = false;
+}
+
+PostAuctionLoop::Partition::
+Partition(int index, size_t queueSize, bool haveZmqContext)
+    : index(index),
+      auctions(queueSize),
+      events(queueSize),
+      messages(queueSize),
+      tasks(queueSize),
+      router(haveZmqContext)
+{
+}
+
 PostAuctionLoop::
 PostAuctionLoop(std::shared_ptr<ServiceProxies> proxies,
                 const std::string & serviceName)
     : RouterServiceBase(serviceName, proxies),
-      auctions(65536),
-      events(65536),
+      numPartitions_(1),
+      queueSize(65536),
+      agentMessages(65536),
       endpoint(getZmqContext()),
       router(!!getZmqContext()),
       toAgents(getZmqContext()),
@@ -443,8 +628,9 @@ PostAuctionLoop::
 PostAuctionLoop(ServiceBase & parent,
                 const std::string & serviceName)
     : RouterServiceBase(serviceName, parent),
-      auctions(16386),
-      events(1024),
+      numPartitions_(1),
+      queueSize(16386),
+      agentMessages(16386),
       endpoint(getZmqContext()),
       router(!!getZmqContext()),
       toAgents(getZmqContext()),
@@ -453,10 +639,25 @@ PostAuctionLoop(ServiceBase & parent,
 {
 }
 
+void
+PostAuctionLoop::
+setNumPartitions(int numPartitions)
+{
+    if (!partitions.empty())
+        throw ML::Exception("setNumPartitions() must be called before init()");
+    if (numPartitions < 1)
+        throw ML::Exception("invalid number of partitions %d", numPartitions);
+    numPartitions_ = numPartitions;
+}
+
 void
 PostAuctionLoop::
 init()
 {
+    for (int i = 0;  i < numPartitions_;  ++i)
+        partitions.emplace_back
+            (new Partition(i, queueSize, !!getZmqContext()));
+
     initConnections();
     monitorProviderEndpoint.init();
 }
@@ -465,15 +666,59 @@ void
 PostAuctionLoop::
 initConnections()
 {
+    using std::placeholders::_1;
+
     registerServiceProvider(serviceName(), { "rtbPostAuctionService" });
 
     cerr << "post auction logger on " << serviceName() + "/logger" << endl;
     shared->logger.init(getServices()->config, serviceName() + "/logger");
 
-    auctions.onEvent = std::bind<void>(&PostAuctionLoop::doAuction, this,
-                                       std::placeholders::_1);
-    events.onEvent   = std::bind<void>(&PostAuctionLoop::doEvent, this,
-                                       std::placeholders::_1);
+    for (auto & p: partitions) {
+        Partition & part = *p;
+        string prefix = ML::format("PostAuctionLoop::partition%d::",
+                                   part.index);
+
+        part.auctions.onEvent
+            = std::bind<void>(&PostAuctionLoop::doAuction, this,
+                              std::ref(part), _1);
+        part.events.onEvent
+            = std::bind<void>(&PostAuctionLoop::doEvent, this,
+                              std::ref(part), _1);
+        part.messages.onEvent
+            = std::bind<void>(&PostAuctionLoop::doPartitionMessage, this,
+                              std::ref(part), _1);
+
+        part.router.bind("AUCTION",
+                         std::bind(&PostAuctionLoop::doAuctionMessage, this,
+                                   std::ref(part), _1));
+        part.router.bind("AUCTIONSPOTS",
+                         std::bind(&PostAuctionLoop::doAuctionSpotsMessage,
+                                   this, std::ref(part), _1));
+        part.router.bind("WIN",
+                         std::bind(&PostAuctionLoop::doWinMessage, this,
+                                   std::ref(part), _1));
+        part.router.bind("LOSS",
+                         std::bind(&PostAuctionLoop::doLossMessage, this,
+                                   std::ref(part), _1));
+        part.router.bind("IMPRESSION",
+                         std::bind(&PostAuctionLoop::doImpressionMessage, this,
+                                   std::ref(part), _1));
+        part.router.bind("CLICK",
+                         std::bind(&PostAuctionLoop::doClickMessage, this,
+                                   std::ref(part), _1));
+
+        // Every second we check for expired auctions
+        part.loop.addPeriodic(prefix + "checkExpiredAuctions", 1.0,
+                              std::bind<void>
+                              (&PostAuctionLoop::checkExpiredAuctions,
+                               this, std::ref(part)));
+
+        part.loop.addSource(prefix + "auctions", part.auctions);
+        part.loop.addSource(prefix + "events", part.events);
+        part.loop.addSource(prefix + "messages", part.messages);
+        part.tasks.addTo(part.loop, prefix + "tasks");
+    }
+
     toAgents.clientMessageHandler = [&] (const std::vector<std::string> & msg)
         {
             // Clients should never send the post auction service anything,
@@ -481,29 +726,33 @@ initConnections()
             cerr << "PostAuctionLoop got agent message " << msg << endl;
         };
 
-    router.bind("AUCTION",
-                std::bind(&PostAuctionLoop::doAuctionMessage, this,
-                          std::placeholders::_1));
-    router.bind("WIN",
-                std::bind(&PostAuctionLoop::doWinMessage, this,
-                          std::placeholders::_1));
-    router.bind("LOSS",
-                std::bind(&PostAuctionLoop::doLossMessage, this,
-                          std::placeholders::_1));
-    router.bind("IMPRESSION",
-                std::bind(&PostAuctionLoop::doImpressionMessage, this,
-                          std::placeholders::_1));
-    router.bind("CLICK",
-                std::bind(&PostAuctionLoop::doClickMessage, this,
-                          std::placeholders::_1));
+    // Everything but visits is decoded by the partition that owns the
+    // auction
+    for (auto type: { "AUCTION", "AUCTIONSPOTS", "WIN", "LOSS",
+                      "IMPRESSION", "CLICK" })
+        router.bind(type,
+                    std::bind(&PostAuctionLoop::dispatchMessage, this, _1));
     router.bind("VISIT",
-                std::bind(&PostAuctionLoop::doVisitMessage, this,
-                          std::placeholders::_1));
-
-    // Every second we check for expired auctions
-    loop.addPeriodic("PostAuctionLoop::checkExpiredAuctions", 1.0,
-                     std::bind<void>(&PostAuctionLoop::checkExpiredAuctions,
-                                     this));
+                std::bind(&PostAuctionLoop::doVisitMessage, this, _1));
+    router.bind("EVENTBATCH",
+                std::bind(&PostAuctionLoop::doEventBatchMessage, this, _1));
+
+    // The banker's bid events are shared by all of the partitions
+    loop.addPeriodic("PostAuctionLoop::logBidEvents", 1.0,
+                     [=] (uint64_t) { this->banker->logBidEvents(*this); });
+
+    // The queues between the threads grow past their ring buffers rather
+    // than blocking; keep track of how often that happens
+    loop.addPeriodic("PostAuctionLoop::queueStats", 1.0,
+                     [=] (uint64_t)
+                     {
+                         this->recordLevel(agentMessages.numOverflowed,
+                                           "queues.agentMessages.overflowed");
+                         for (auto & p: partitions)
+                             this->recordLevel(p->tasks.numOverflowed,
+                                               "queues.partition%d.tasks"
+                                               ".overflowed", p->index);
+                     });
 
     // Initialize zeromq endpoints
     endpoint.init(getServices()->config, ZMQ_XREP, serviceName() + "/events");
@@ -514,8 +763,7 @@ initConnections()
                     &router,
                     std::placeholders::_1);
 
-    loop.addSource("PostAuctionLoop::auctions", auctions);
-    loop.addSource("PostAuctionLoop::events", events);
+    agentMessages.addTo(loop, "PostAuctionLoop::agentMessages");
 
     loop.addSource("PostAuctionLoop::endpoint", endpoint);
 
@@ -538,6 +786,8 @@ void
 PostAuctionLoop::
 start(std::function<void ()> onStop)
 {
+    for (auto & p: partitions)
+        p->loop.start();
     loop.start(onStop);
     monitorProviderEndpoint.start();
 }
@@ -547,12 +797,50 @@ PostAuctionLoop::
 shutdown()
 {
     loop.shutdown();
+    for (auto & p: partitions)
+        p->loop.shutdown();
+
+    // Nothing can be written any more; get what's queued onto disk
+    if (submittedPersistence)
+        submittedPersistence->close();
+    if (finishedPersistence)
+        finishedPersistence->close();
     toAgents.shutdown();
     endpoint.shutdown();
     configListener.shutdown();
     monitorProviderEndpoint.shutdown();
 }
 
+size_t
+PostAuctionLoop::
+numAwaitingWinLoss() const
+{
+    size_t result = 0;
+    for (auto & p: partitions)
+        result += p->submitted.size();
+    return result;
+}
+
+size_t
+PostAuctionLoop::
+numFinishedAuctionsTracked() const
+{
+    size_t result = 0;
+    for (auto & p: partitions)
+        result += p->finished.size();
+    return result;
+}
+
+size_t
+PostAuctionLoop::
+numUidsTracked() const
+{
+    size_t result = 0;
+    for (auto & p: partitions)
+        result += p->uidIndex.size();
+    return result;
+}
+
 Json::Value
 PostAuctionLoop::
 getServiceStatus() const
@@ -584,7 +872,7 @@ injectWin(const Id & auctionId,
     event->account = account;
     event->bidTimestamp = bidTimestamp;
 
-    events.push(event);
+    partitionForAuction(auctionId).events.push(event);
 }
 
 void
@@ -610,7 +898,7 @@ injectLoss(const Id & auctionId,
     event->account = account;
     event->bidTimestamp = bidTimestamp;
 
-    events.push(event);
+    partitionForAuction(auctionId).events.push(event);
 }
 
 void
@@ -631,7 +919,7 @@ injectImpression(const Id & auctionId,
     event->metadata = impressionMeta;
     event->uids = uids;
 
-    events.push(event);
+    partitionForAuction(auctionId).events.push(event);
 }
 
 void
@@ -650,7 +938,7 @@ injectClick(const Id & auctionId,
     event->metadata = clickMeta;
     event->uids = uids;
 
-    events.push(event);
+    partitionForAuction(auctionId).events.push(event);
 }
 
 void
@@ -667,65 +955,155 @@ injectVisit(Date timestamp,
     event->uids = uids;
     event->channels = channels;
 
-    events.push(event);
+    dispatchVisit(event);
+}
+
+namespace {
+
+/** Read just enough of a serialized AUCTION, AUCTIONSPOTS, WIN, LOSS,
+    IMPRESSION or CLICK
+    message to know which auction it's for, so that it can be handed to the
+    right partition without decoding the rest of it.
+*/
+Id peekAuctionId(const std::string & messageType, const std::string & payload)
+{
+    istringstream stream(payload);
+    DB::Store_Reader store(stream);
+
+    unsigned char version;
+    store >> version;
+    if (messageType != "AUCTION" && messageType != "AUCTIONSPOTS") {
+        PostAuctionEventType type;
+        store >> type;
+    }
+
+    Id auctionId;
+    store >> auctionId;
+    return auctionId;
+}
+
+} // file scope
+
+void
+PostAuctionLoop::
+dispatchMessage(const std::vector<std::string> & message)
+{
+    Id auctionId;
+    try {
+        auctionId = peekAuctionId(message.at(1), message.at(2));
+    } catch (const std::exception & exc) {
+        recordHit("messages.undecodable");
+        logRouterError("dispatchMessage.undecodable", exc.what());
+        return;
+    }
+
+    Partition::Message toPartition;
+    toPartition.message = message;
+    partitionForAuction(auctionId).messages.push(toPartition);
+}
+
+void
+PostAuctionLoop::
+dispatchVisit(const std::shared_ptr<PostAuctionEvent> & event)
+{
+    recordHit("delivery.VISIT.messagesReceived");
+
+    event->channels.forEach([&] (int, string ch, float wt)
+                            {
+                                this->recordHit("delivery.VISIT.channel.%s"
+                                                ".messagesReceived", ch);
+                            });
+
+    for (auto it = event->uids.begin(), end = event->uids.end();
+         it != end;  ++it) {
+        Id uid = it->second;
+        Partition & part = partitionForUid(uid);
+        runInPartition(part,
+                       [=, &part] ()
+                       {
+                           this->doVisit(part, event, uid);
+                       });
+    }
+}
+
+void
+PostAuctionLoop::
+runInPartition(Partition & part, const std::function<void ()> & fn)
+{
+    part.tasks.push(fn);
 }
 
 void
 PostAuctionLoop::
-doAuctionMessage(const std::vector<std::string> & message)
+doAuctionMessage(Partition & part, const std::vector<std::string> & message)
 {
     recordHit("messages.AUCTION");
     //cerr << "doAuctionMessage " << message << endl;
 
     SubmittedAuctionEvent event
         = ML::DB::reconstituteFromString<SubmittedAuctionEvent>(message.at(2));
-    doAuction(event);
+    doAuction(part, event);
+}
+
+void
+PostAuctionLoop::
+doAuctionSpotsMessage(Partition & part,
+                      const std::vector<std::string> & message)
+{
+    recordHit("messages.AUCTIONSPOTS");
+
+    SubmittedAuction auction
+        = ML::DB::reconstituteFromString<SubmittedAuction>(message.at(2));
+    recordOutcome(auction.spots.size(), "messages.AUCTIONSPOTS.numSpots");
+
+    for (auto & event: auction.toEvents())
+        doAuction(part, event);
 }
 
 void
 PostAuctionLoop::
-doWinMessage(const std::vector<std::string> & message)
+doWinMessage(Partition & part, const std::vector<std::string> & message)
 {
     lastWinLoss = Date::now();
 
     recordHit("messages.WIN");
     auto event = std::make_shared<PostAuctionEvent>
         (ML::DB::reconstituteFromString<PostAuctionEvent>(message.at(2)));
-    doWinLoss(event, false /* replay */);
+    doWinLoss(part, event, false /* replay */);
 }
 
 void
 PostAuctionLoop::
-doLossMessage(const std::vector<std::string> & message)
+doLossMessage(Partition & part, const std::vector<std::string> & message)
 {
     lastWinLoss = Date::now();
 
     recordHit("messages.LOSS");
     auto event = std::make_shared<PostAuctionEvent>
         (ML::DB::reconstituteFromString<PostAuctionEvent>(message.at(2)));
-    doWinLoss(event, false /* replay */);
+    doWinLoss(part, event, false /* replay */);
 }
 
 void
 PostAuctionLoop::
-doImpressionMessage(const std::vector<std::string> & message)
+doImpressionMessage(Partition & part, const std::vector<std::string> & message)
 {
     lastImpression = Date::now();
 
     recordHit("messages.IMPRESSION");
     auto event = std::make_shared<PostAuctionEvent>
         (ML::DB::reconstituteFromString<PostAuctionEvent>(message.at(2)));
-    doImpressionClick(event);
+    doImpressionClick(part, event);
 }
 
 void
 PostAuctionLoop::
-doClickMessage(const std::vector<std::string> & message)
+doClickMessage(Partition & part, const std::vector<std::string> & message)
 {
     recordHit("messages.CLICK");
     auto event = std::make_shared<PostAuctionEvent>
         (ML::DB::reconstituteFromString<PostAuctionEvent>(message.at(2)));
-    doImpressionClick(event);
+    doImpressionClick(part, event);
 }
 
 void
@@ -735,7 +1113,80 @@ doVisitMessage(const std::vector<std::string> & message)
     recordHit("messages.VISIT");
     auto event = std::make_shared<PostAuctionEvent>
         (ML::DB::reconstituteFromString<PostAuctionEvent>(message.at(2)));
-    doVisit(event);
+    dispatchVisit(event);
+}
+
+void
+PostAuctionLoop::
+doEventBatchMessage(const std::vector<std::string> & message)
+{
+    recordHit("messages.EVENTBATCH");
+
+    auto batch = std::make_shared<PostAuctionEventBatch>
+        (ML::DB::reconstituteFromString<PostAuctionEventBatch>(message.at(2)));
+    recordOutcome(batch->events.size(), "messages.EVENTBATCH.numEvents");
+
+    bool hasVisits = false;
+    for (auto & event: batch->events) {
+        recordHit("messages.%s", print(event.type));
+        if (event.type == PAE_WIN || event.type == PAE_LOSS)
+            lastWinLoss = Date::now();
+        else if (event.type == PAE_IMPRESSION)
+            lastImpression = Date::now();
+        else if (event.type == PAE_VISIT)
+            hasVisits = true;
+    }
+
+    // Normally there's only one partition, in which case the batch can go
+    // over as-is
+    if (partitions.size() == 1 && !hasVisits) {
+        Partition::Message toPartition;
+        toPartition.batch = batch;
+        partitions[0]->messages.push(toPartition);
+        return;
+    }
+
+    std::vector<std::shared_ptr<PostAuctionEventBatch> >
+        split(partitions.size());
+
+    for (auto & event: batch->events) {
+        // Visits aren't tied to an auction
+        if (event.type == PAE_VISIT) {
+            dispatchVisit(std::make_shared<PostAuctionEvent>(std::move(event)));
+            continue;
+        }
+
+        auto & partBatch = split[partitionForAuction(event.auctionId).index];
+        if (!partBatch)
+            partBatch = std::make_shared<PostAuctionEventBatch>();
+        partBatch->events.emplace_back(std::move(event));
+    }
+
+    for (unsigned i = 0;  i < split.size();  ++i) {
+        if (!split[i])
+            continue;
+        Partition::Message toPartition;
+        toPartition.batch = split[i];
+        partitions[i]->messages.push(toPartition);
+    }
+}
+
+void
+PostAuctionLoop::
+doPartitionMessage(Partition & part, const Partition::Message & message)
+{
+    if (message.batch)
+        doEventBatch(part, message.batch);
+    else part.router.handleMessage(message.message);
+}
+
+void
+PostAuctionLoop::
+doEventBatch(Partition & part,
+             const std::shared_ptr<PostAuctionEventBatch> & batch)
+{
+    for (auto & event: batch->events)
+        doEvent(part, std::shared_ptr<PostAuctionEvent>(batch, &event));
 }
 
 namespace {
@@ -770,15 +1221,7 @@ void
 PostAuctionLoop::
 initStatePersistence(const std::string & path)
 {
-    typedef PendingPersistenceT<pair<Id, Id>, SubmissionInfo>
-        SubmittedPending;
-
-    auto submittedDb = std::make_shared<LeveldbPendingPersistence>();
-    submittedDb->open(path + "/submitted");
-
-    auto submittedPersistence
-        = std::make_shared<SubmittedPending>();
-    submittedPersistence->store = submittedDb;
+    submittedPersistence = std::make_shared<SubmittedPersistence>();
 
     auto stringifySubmissionInfo = [] (const SubmissionInfo & info)
         {
@@ -796,33 +1239,26 @@ initStatePersistence(const std::string & path)
     submittedPersistence->unstringifyKey = unstringifyPair;
     submittedPersistence->stringifyValue = stringifySubmissionInfo;
     submittedPersistence->unstringifyValue = unstringifySubmissionInfo;
+    submittedPersistence->open(path + "/submitted");
 
+    // The database is shared by the partitions; read it once, handing
+    // each entry to the partition owning its auction
     Date newTimeout = Date::now().plusSeconds(15);
 
-    auto acceptSubmitted = [&] (pair<Id, Id> & key,
-                                SubmissionInfo & info,
-                                Date & timeout) -> bool
+    auto onSubmitted = [&] (pair<Id, Id> & key, SubmissionInfo & info)
         {
             info.fromOldRouter = true;
             newTimeout.addSeconds(0.001);
-            timeout = newTimeout;
             this->debugSpot(key.first, key.second, "RECONST SUBMITTED");
-            return true;
+            this->partitionForAuction(key.first)
+                .submitted.loadEntry(key, info, newTimeout);
         };
 
-    submitted.initFromStore(submittedPersistence,
-                            acceptSubmitted,
-                            Date::now().plusSeconds(15));
-
-    typedef PendingPersistenceT<pair<Id, Id>, FinishedInfo>
-        FinishedPending;
-
-    auto finishedDb = std::make_shared<LeveldbPendingPersistence>();
-    finishedDb->open(path + "/finished");
+    submittedPersistence->scan(onSubmitted);
+    for (auto & p: partitions)
+        p->submitted.persistence = submittedPersistence;
 
-    auto finishedPersistence
-        = std::make_shared<FinishedPending>();
-    finishedPersistence->store = finishedDb;
+    finishedPersistence = std::make_shared<FinishedPersistence>();
 
     auto stringifyFinishedInfo = [] (const FinishedInfo & info)
         {
@@ -840,30 +1276,32 @@ initStatePersistence(const std::string & path)
     finishedPersistence->unstringifyKey = unstringifyPair;
     finishedPersistence->stringifyValue = stringifyFinishedInfo;
     finishedPersistence->unstringifyValue = unstringifyFinishedInfo;
+    finishedPersistence->open(path + "/finished");
 
     newTimeout = Date::now().plusSeconds(900);
 
-    auto acceptFinished = [&] (pair<Id, Id> & key,
-                               FinishedInfo & info,
-                               Date & timeout) -> bool
+    auto onFinished = [&] (pair<Id, Id> & key, FinishedInfo & info)
         {
             info.fromOldRouter = true;
             newTimeout.addSeconds(0.001);
-            timeout = newTimeout;
             this->debugSpot(key.first, key.second, "RECONST FINISHED");
+            this->partitionForAuction(key.first)
+                .finished.loadEntry(key, info, newTimeout);
 
-            // Index the IDs
+            // Index the IDs.  The partitions aren't running yet, so we can
+            // fill in their slices of the index directly.
             for (auto it = info.uids.begin(), end = info.uids.end();
                  it != end;  ++it) {
-                uidIndex[*it][key] = Date::now();
+                this->partitionForUid(*it).uidIndex[*it][key] = Date::now();
             }
-
-            return true;
         };
 
-    finished.initFromStore(finishedPersistence,
-                           acceptFinished,
-                           Date::now().plusSeconds(900));
+    finishedPersistence->scan(onFinished);
+    for (auto & p: partitions)
+        p->finished.persistence = finishedPersistence;
+
+    auto submittedDb = submittedPersistence;
+    auto finishedDb = finishedPersistence;
 
     auto backgroundWork = [=] (volatile int & shutdown, int64_t threadId)
         {
@@ -905,12 +1343,41 @@ initStatePersistence(const std::string & path)
         };
 
     loop.startSubordinateThread(backgroundWork);
+
+    // Writes are done behind our back; keep an eye on whether the writers
+    // are keeping up
+    auto recordPersistenceStats = [=] (uint64_t)
+        {
+            this->recordLevel(submittedDb->queueDepth(),
+                              "persistentData.submitted.queueDepth");
+            this->recordLevel(submittedDb->numBlockedPushes,
+                              "persistentData.submitted.blockedPushes");
+            this->recordLevel(submittedDb->blockedMicros / 1000.0,
+                              "persistentData.submitted.blockedMs");
+            this->recordLevel(submittedDb->numRejected,
+                              "persistentData.submitted.rejected");
+            this->recordLevel(submittedDb->numFailed,
+                              "persistentData.submitted.failed");
+            this->recordLevel(finishedDb->queueDepth(),
+                              "persistentData.finished.queueDepth");
+            this->recordLevel(finishedDb->numBlockedPushes,
+                              "persistentData.finished.blockedPushes");
+            this->recordLevel(finishedDb->blockedMicros / 1000.0,
+                              "persistentData.finished.blockedMs");
+            this->recordLevel(finishedDb->numRejected,
+                              "persistentData.finished.rejected");
+            this->recordLevel(finishedDb->numFailed,
+                              "persistentData.finished.failed");
+        };
+
+    loop.addPeriodic("PostAuctionLoop::persistenceStats", 1.0,
+                     recordPersistenceStats);
 }
 
 
 void
 PostAuctionLoop::
-checkExpiredAuctions()
+checkExpiredAuctions(Partition & part)
 {
     if (shared->simulationMode_)
         return;
@@ -918,8 +1385,8 @@ checkExpiredAuctions()
     Date start = Date::now();
 
     {
-        cerr << " checking " << submitted.size()
-             << " submitted auctions for inferred loss" << endl;
+        recordLevel(part.submitted.size(),
+                    "partition%d.submittedAuctions", part.index);
 
 
         //RouterProfiler profiler(this, dutyCycleCurrent.nsExpireSubmitted);
@@ -935,7 +1402,7 @@ checkExpiredAuctions()
 
                 recordHit("submittedAuctionExpiry");
 
-                if (!info.bidRequest) {
+                if (!info.hasAuction()) {
                     recordHit("submittedAuctionExpiryWithoutBid");
                     //cerr << "expired with no bid request" << endl;
                     this->debugSpot(auctionId, adSpotId, "EXPIRED SPOT NO BR", {});
@@ -948,7 +1415,8 @@ checkExpiredAuctions()
 
                 //cerr << "onExpiredSubmitted " << key << endl;
                 try {
-                    this->doBidResult(auctionId, adSpotId, info, Amount() /* price */,
+                    this->doBidResult(part, auctionId, adSpotId, info,
+                                      Amount() /* price */,
                                       start /* date */, BS_LOSS, "inferred",
                                       "null", UserIds());
                 } catch (const std::exception & exc) {
@@ -960,12 +1428,12 @@ checkExpiredAuctions()
                 return Date();
             };
 
-        submitted.expire(onExpiredSubmitted, start);
+        part.submitted.expire(onExpiredSubmitted, start);
     }
 
     {
-        cerr << " checking " << finished.size()
-             << " finished auctions for expiry" << endl;
+        recordLevel(part.finished.size(),
+                    "partition%d.finishedAuctions", part.index);
 
         //RouterProfiler profiler(this, dutyCycleCurrent.nsExpireFinished);
 
@@ -978,25 +1446,18 @@ checkExpiredAuctions()
 
                 // We need to clean up the uid index
                 for (auto it = info.uids.begin(), end = info.uids.end();
-                     it != end;  ++it) {
-                    const Id & uid = *it;
-                    auto & entry = uidIndex[uid];
-                    entry.erase(key);
-                    if (entry.empty())
-                        uidIndex.erase(uid);
-                }
+                     it != end;  ++it)
+                    this->removeFromUidIndex(*it, key);
                 return Date();
             };
 
-        finished.expire(onExpiredFinished);
+        part.finished.expire(onExpiredFinished);
     }
-
-    banker->logBidEvents(*this);
 }
 
 void
 PostAuctionLoop::
-doAuction(const SubmittedAuctionEvent & event)
+doAuction(Partition & part, const SubmittedAuctionEvent & event)
 {
     try {
         recordHit("processedAuction");
@@ -1005,6 +1466,8 @@ doAuction(const SubmittedAuctionEvent & event)
 
         //cerr << "doAuction for " << auctionId << endl;
 
+        AuctionTrace::record(auctionId, AP_PAL_SUBMITTED);
+
         Date lossTimeout = event.lossTimeout;
 
         // move the auction over to the submitted bid pipeline...
@@ -1012,19 +1475,20 @@ doAuction(const SubmittedAuctionEvent & event)
 
         SubmissionInfo submission;
         vector<std::shared_ptr<PostAuctionEvent> > earlyWinEvents;
-        if (submitted.count(key)) {
-            submission = submitted.pop(key);
+        if (part.submitted.count(key)) {
+            submission = part.submitted.pop(key);
             earlyWinEvents.swap(submission.earlyWinEvents);
             recordHit("auctionAlreadySubmitted");
         }
 
         submission.bidRequest = std::move(event.bidRequest);
+        submission.spotIndex = event.spotIndex;
         submission.bidRequestFormatStr = std::move(event.bidRequestFormatStr);
         submission.bidRequestStr = std::move(event.bidRequestStr);
         submission.augmentations = std::move(event.augmentations);
         submission.bid = std::move(event.bidResponse);
 
-        submitted.insert(key, submission, lossTimeout);
+        part.submitted.insert(key, submission, lossTimeout);
 
         string transId = makeBidId(auctionId, event.adSpotId, event.bidResponse.agent);
         banker->attachBid(event.bidResponse.account,
@@ -1051,7 +1515,7 @@ doAuction(const SubmittedAuctionEvent & event)
              it != end;  ++it) {
             recordHit("replayedEarlyWinEvent");
             //cerr << "replaying early win message" << endl;
-            doWinLoss(*it, true /* is_replay */);
+            doWinLoss(part, *it, true /* is_replay */);
         }
     } catch (const std::exception & exc) {
         cerr << "doAuction ignored error handling auction: "
@@ -1061,7 +1525,7 @@ doAuction(const SubmittedAuctionEvent & event)
 
 void
 PostAuctionLoop::
-doEvent(const std::shared_ptr<PostAuctionEvent> & event)
+doEvent(Partition & part, const std::shared_ptr<PostAuctionEvent> & event)
 {
     //cerr << "!!!PostAuctionLoop::doEvent:got post auction event " <<
     //print(event->type) << endl;
@@ -1070,14 +1534,11 @@ doEvent(const std::shared_ptr<PostAuctionEvent> & event)
         switch (event->type) {
         case PAE_WIN:
         case PAE_LOSS:
-            doWinLoss(event, false);
+            doWinLoss(part, event, false);
             break;
         case PAE_IMPRESSION:
         case PAE_CLICK:
-            doImpressionClick(event);
-            break;
-        case PAE_VISIT:
-            doVisit(event);
+            doImpressionClick(part, event);
             break;
         default:
             throw Exception("postAuctionLoop.unknownEventType",
@@ -1099,12 +1560,39 @@ addToUidIndex(const std::string & uidDomain,
               const Id & slotId)
 {
     if (!uid) return;
-    uidIndex[uid][make_pair(auctionId, slotId)] = Date::now();
+
+    Partition & part = partitionForUid(uid);
+    auto key = make_pair(auctionId, slotId);
+    Date now = Date::now();
+    runInPartition(part,
+                   [=, &part] ()
+                   {
+                       part.uidIndex[uid][key] = now;
+                   });
+}
+
+void
+PostAuctionLoop::
+removeFromUidIndex(const Id & uid, const std::pair<Id, Id> & key)
+{
+    Partition & part = partitionForUid(uid);
+    runInPartition(part,
+                   [=, &part] ()
+                   {
+                       auto it = part.uidIndex.find(uid);
+                       if (it == part.uidIndex.end())
+                           return;
+                       it->second.erase(key);
+                       if (it->second.empty())
+                           part.uidIndex.erase(it);
+                   });
 }
 
 void
 PostAuctionLoop::
-doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
+doWinLoss(Partition & part,
+          const std::shared_ptr<PostAuctionEvent> & event,
+          bool isReplay)
 {
     BidStatus status;
     if (event->type == PAE_WIN) {
@@ -1159,11 +1647,11 @@ doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
        timed out, and so an auction may be both inFlight and submitted or
        finished.
     */
-    if (finished.count(key)) {
+    if (part.finished.count(key)) {
 
         //cerr << "doWinLoss in finished" << endl;
 
-        FinishedInfo info = finished.get(key);
+        FinishedInfo info = part.finished.get(key);
         if (info.hasWin()) {
             if (winPrice == info.winPrice
                 && status == info.reportedStatus) {
@@ -1194,7 +1682,7 @@ doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
 
             info.setWin(timestamp, BS_WIN, winPrice, meta.toString());
 
-            finished.update(key, info);
+            part.finished.update(key, info);
 
             recordHit("bidResult.%s.winAfterLossAssumed", typeStr);
             recordOutcome(winPrice.value,
@@ -1229,7 +1717,7 @@ doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
     for (auto it = submitted.begin() ; it != submitted.end() ;++it)
         cerr << it->first << endl;
 #endif
-    if (!submitted.count(key)) {
+    if (!part.submitted.count(key)) {
         double timeGapMs = getTimeGapMs();
         if (timeGapMs < lossTimeout * 1000 or shared->simulationMode_) {
             recordHit("bidResult.%s.noBidSubmitted", typeStr);
@@ -1241,7 +1729,8 @@ doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
             */
             SubmissionInfo info;
             info.earlyWinEvents.push_back(event);
-            submitted.insert(key, info, Date::now().plusSeconds(lossTimeout));
+            part.submitted.insert(key, info,
+                                  Date::now().plusSeconds(lossTimeout));
 
             return;
         }
@@ -1263,13 +1752,13 @@ doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
             return;
         }
     }
-    SubmissionInfo info = submitted.pop(key);
-    if (!info.bidRequest) {
+    SubmissionInfo info = part.submitted.pop(key);
+    if (!info.hasAuction()) {
         //cerr << "doWinLoss doubled bid request" << endl;
 
         // We doubled up on a WIN without having got the auction yet
         info.earlyWinEvents.push_back(event);
-        submitted.insert(key, info, Date::now().plusSeconds(lossTimeout));
+        part.submitted.insert(key, info, Date::now().plusSeconds(lossTimeout));
         return;
     }
 
@@ -1278,35 +1767,34 @@ doWinLoss(const std::shared_ptr<PostAuctionEvent> & event, bool isReplay)
     //cerr << "event.metadata = " << event->metadata << endl;
     //cerr << "event.winPrice = " << event->winPrice << endl;
 
-    doBidResult(auctionId, adSpotId, info,
+    doBidResult(part, auctionId, adSpotId, info,
                 winPrice, timestamp, status,
                 status == BS_WIN ? "guaranteed" : "inferred",
                 meta.toString(), uids);
     std::for_each(info.earlyImpressionClickEvents.begin(),
                   info.earlyImpressionClickEvents.end(),
                   std::bind(&PostAuctionLoop::doImpressionClick, this,
-                            std::placeholders::_1));
+                            std::ref(part), std::placeholders::_1));
 
     //cerr << "doWinLoss done" << endl;
 }
 
-template<typename Value>
-bool findAuction(PendingList<pair<Id,Id>, Value> & pending,
+template<typename Value, typename Persistence>
+bool findAuction(PendingStore<Value, Persistence> & pending,
                  const Id & auctionId)
 {
-    auto key = make_pair(auctionId, Id());
-    auto key2 = pending.completePrefix(key, IsPrefixPair());
+    auto key2 = pending.completePrefix(auctionId);
     return key2.first == auctionId;
 }
 
-template<typename Value>
-bool findAuction(PendingList<pair<Id,Id>, Value> & pending,
+template<typename Value, typename Persistence>
+bool findAuction(PendingStore<Value, Persistence> & pending,
                  const Id & auctionId,
                  Id & adSpotId, Value & val)
 {
     auto key = make_pair(auctionId, adSpotId);
     if (!adSpotId) {
-        auto key2 = pending.completePrefix(key, IsPrefixPair());
+        auto key2 = pending.completePrefix(auctionId);
         if (key2.first == auctionId) {
             //cerr << "found info for " << make_pair(auctionId, adSpotId)
             //     << " under " << key << endl;
@@ -1324,7 +1812,8 @@ bool findAuction(PendingList<pair<Id,Id>, Value> & pending,
 
 void
 PostAuctionLoop::
-doImpressionClick(const std::shared_ptr<PostAuctionEvent> & event)
+doImpressionClick(Partition & part,
+                  const std::shared_ptr<PostAuctionEvent> & event)
 {
     //RouterProfiler profiler(this, dutyCycleCurrent.nsImpression);
     //static const char* fName = "PostAuctionLoop::doImpressionClick:";
@@ -1340,6 +1829,7 @@ doImpressionClick(const std::shared_ptr<PostAuctionEvent> & event)
     FinishedInfo finishedInfo;
 
     recordHit("delivery.%s.messagesReceived", typeStr);
+    AuctionTrace::record(auctionId, AP_PAL_CAMPAIGN_EVENT, -1, typeEnum);
 
     //cerr << fName << typeStr << " " << auctionId << "-" << adSpotId << endl;
     //cerr <<"The number of elements in submitted " << submitted.size() << endl;
@@ -1354,7 +1844,7 @@ doImpressionClick(const std::shared_ptr<PostAuctionEvent> & event)
                      << adSpotId << endl;
         };
 
-    if (findAuction(submitted, auctionId, adSpotId, submissionInfo)) {
+    if (findAuction(part.submitted, auctionId, adSpotId, submissionInfo)) {
         // Record the impression or click in the submission info.  This will
         // then be passed on once the win comes in.
         //
@@ -1369,10 +1859,10 @@ doImpressionClick(const std::shared_ptr<PostAuctionEvent> & event)
 
         submissionInfo.earlyImpressionClickEvents.push_back(event);
 
-        submitted.update(make_pair(auctionId, adSpotId), submissionInfo);
+        part.submitted.update(make_pair(auctionId, adSpotId), submissionInfo);
         return;
     }
-    else if (findAuction(finished, auctionId, adSpotId, finishedInfo)) {
+    else if (findAuction(part.finished, auctionId, adSpotId, finishedInfo)) {
         // Update the info
         if (typeEnum == PAE_IMPRESSION) {
             if (finishedInfo.hasImpression()) {
@@ -1431,7 +1921,7 @@ doImpressionClick(const std::shared_ptr<PostAuctionEvent> & event)
                                                      adSpotId);
                              });
 
-        finished.update(key, finishedInfo);
+        part.finished.update(key, finishedInfo);
 
         routePostAuctionEvent(typeEnum, finishedInfo,
                               SegmentList(), false /* filterChannels */);
@@ -1532,28 +2022,63 @@ routePostAuctionEvent(PostAuctionEventType type,
 
 void
 PostAuctionLoop::
-doVisit(const std::shared_ptr<PostAuctionEvent> & event)
+doVisit(Partition & part,
+        const std::shared_ptr<PostAuctionEvent> & event,
+        const Id & uid)
 {
     //RouterProfiler profiler(this, dutyCycleCurrent.nsVisit);
 
-    Date timestamp = event->timestamp;
     const JsonHolder & meta = event->metadata;
-    const UserIds & uids = event->uids;
     const SegmentList & channels = event->channels;
 
-    FinishedInfo finishedInfo;
+    // Try to find the UID in our slice of the index
 
-    //cerr << "channels = " << channels << endl;
+    auto uit = part.uidIndex.find(uid);
+    if (uit == part.uidIndex.end()) return;
 
-    recordHit("delivery.VISIT.messagesReceived");
+    cerr << "visit metadata " << meta << endl;
+    cerr << "UID " << uid << " matched "
+         << uit->second.size() << " users" << endl;
+
+    auto & entries = uit->second;
+
+    // For each auction this UID matches, we notify of the visit.  The
+    // auction is looked up by the partition that owns it.
+    for (auto jt = entries.begin(), jend = entries.end();
+         jt != jend;  ++jt) {
+        std::pair<Id, Id> key = jt->first;
+
+        cerr << "  auction " << key.first << " spot " << key.second
+             << endl;
+
+        recordHit("delivery.VISIT.foundMatchingAuction");
+
+        Partition & owner = partitionForAuction(key.first);
+        runInPartition(owner,
+                       [=, &owner] ()
+                       {
+                           this->doVisitAuction(owner, event, key);
+                       });
+    }
+
+    recordHit("delivery.VISIT.foundUser");
 
     channels.forEach([&] (int, string ch, float wt)
                      {
-                         //cerr << "channel " << ch << endl;
-                         this->recordHit("delivery.VISIT.channel.%s.messagesReceived", ch);
+                         this->recordHit("delivery.VISIT.channel.%s"
+                                         ".foundUser", ch);
                      });
+}
 
-    //cerr << type << " " << auctionId << "-" << adSpotId << endl;
+void
+PostAuctionLoop::
+doVisitAuction(Partition & part,
+               const std::shared_ptr<PostAuctionEvent> & event,
+               const std::pair<Id, Id> & key)
+{
+    Date timestamp = event->timestamp;
+    const JsonHolder & meta = event->metadata;
+    const SegmentList & channels = event->channels;
 
     auto recordUnmatched = [&] (const std::string & why)
         {
@@ -1563,99 +2088,60 @@ doVisit(const std::shared_ptr<PostAuctionEvent> & event)
                              meta, channels.toJsonStr());
         };
 
-    // Try to find any of the UIDs in the index
-
-    bool foundUser = false;
-
-    for (auto it = uids.begin(), end = uids.end();  it != end;  ++it) {
-        auto uit = uidIndex.find(it->second);
-        if (uit == uidIndex.end()) continue;
-
-        cerr << "visit metadata " << meta << endl;
-        cerr << "UID " << *it << " matched "
-             << uit->second.size() << " users" << endl;
-
-        auto & entries = uit->second;
-
-        foundUser = true;
-
-        // For each auction this UID matches, we notify of the visit
-        for (auto jt = entries.begin(), jend = entries.end();
-             jt != jend;  ++jt) {
-            Id auctionId = jt->first.first;
-            Id adSpotId = jt->first.second;
-
-            cerr << "  auction " << auctionId << " spot " << adSpotId
-                 << endl;
-
-            // Find if we have a finished auction (answer should be yes)
-            std::pair<Id, Id> key(auctionId, adSpotId);
-
-            recordHit("delivery.VISIT.foundMatchingAuction");
-
-            FinishedInfo finishedInfo;
-            if (!findAuction(finished, auctionId, adSpotId, finishedInfo)) {
-                logRouterError("doVisit.inconsistentIndex",
-                               "auction in indexed not in finished");
-                recordUnmatched("inconsistentIndex");
-                return;
-            }
-
-            cerr << "  found finished auction for account "
-                 << finishedInfo.bid.account << " with channels "
-                 << finishedInfo.visitChannels << endl;
-
-            // Check for a channel match
-            if (!finishedInfo.visitChannels.match(channels)) {
-                cerr << event->print() << endl;
-                cerr << "channel mismatch: channels =  ";
-                channels.forEach([&] (int, string ch, float wt)
-                                 {
-                                     cerr << " " << ch;
-                                 });
-                cerr << endl;
-                recordUnmatched("channelMismatch");
-                return;
-            }
+    // Find if we have a finished auction (answer should be yes)
+    Id adSpotId = key.second;
+    FinishedInfo finishedInfo;
+    if (!findAuction(part.finished, key.first, adSpotId, finishedInfo)) {
+        logRouterError("doVisit.inconsistentIndex",
+                       "auction in indexed not in finished");
+        recordUnmatched("inconsistentIndex");
+        return;
+    }
 
-            recordHit("delivery.VISIT.matched");
+    cerr << "  found finished auction for account "
+         << finishedInfo.bid.account << " with channels "
+         << finishedInfo.visitChannels << endl;
 
-            cerr << "matched" << endl;
+    // Check for a channel match
+    if (!finishedInfo.visitChannels.match(channels)) {
+        cerr << event->print() << endl;
+        cerr << "channel mismatch: channels =  ";
+        channels.forEach([&] (int, string ch, float wt)
+                         {
+                             cerr << " " << ch;
+                         });
+        cerr << endl;
+        recordUnmatched("channelMismatch");
+        return;
+    }
 
-            channels.forEach([&] (int, string ch, float wt)
-                             {
-                                 this->recordHit("delivery.VISIT.account.%s"
-                                                 ".channel.%s.matched",
-                                                 finishedInfo.bid.account.toString().c_str(),
-                                                 ch);
-                             });
+    recordHit("delivery.VISIT.matched");
 
-            //cerr << "MATCHED VISIT " << message << endl;
+    cerr << "matched" << endl;
 
-            finishedInfo.addVisit(timestamp,
-                                  meta.toString(),
-                                  channels);
-            finished.update(key, finishedInfo);
+    channels.forEach([&] (int, string ch, float wt)
+                     {
+                         this->recordHit("delivery.VISIT.account.%s"
+                                         ".channel.%s.matched",
+                                         finishedInfo.bid.account.toString().c_str(),
+                                         ch);
+                     });
 
-            routePostAuctionEvent(PAE_VISIT, finishedInfo, channels,
-                                  true /* filterChannels */);
-        }
-    }
+    //cerr << "MATCHED VISIT " << message << endl;
 
-    if (foundUser) {
-        recordHit("delivery.VISIT.foundUser");
+    finishedInfo.addVisit(timestamp,
+                          meta.toString(),
+                          channels);
+    part.finished.update(key, finishedInfo);
 
-        channels.forEach([&] (int, string ch, float wt)
-                         {
-                             this->recordHit("delivery.VISIT.channel.%s"
-                                             ".foundUser", ch);
-                         });
-    }
+    routePostAuctionEvent(PAE_VISIT, finishedInfo, channels,
+                          true /* filterChannels */);
 }
 
 void
 PostAuctionLoop::
-doBidResult(const Id & auctionId,
+doBidResult(Partition & part,
+            const Id & auctionId,
             const Id & adSpotId,
             const SubmissionInfo & submission,
             Amount winPrice,
@@ -1673,6 +2159,10 @@ doBidResult(const Id & auctionId,
     else if (status == BS_LOSS) msg = "LOSS";
     else throwException("doBidResult.nonWinLoss", "submitted non win/loss");
 
+    if (status == BS_WIN)
+        AuctionTrace::record(auctionId, AP_PAL_WIN, -1, winPrice.value);
+    else AuctionTrace::record(auctionId, AP_PAL_LOSS);
+
 #if 0
     cerr << "doBidResult: " << msg
          << " id " << auctionId << " spot " << adSpotId
@@ -1690,7 +2180,9 @@ doBidResult(const Id & auctionId,
     string agent = submission.bid.agent;
 
     // Find the adspot ID
-    int adspot_num = submission.bidRequest->findAdSpotIndex(adSpotId);
+    int adspot_num = submission.spotIndex;
+    if (adspot_num == -1 && submission.bidRequest)
+        adspot_num = submission.bidRequest->findAdSpotIndex(adSpotId);
 
     if (adspot_num == -1) {
         logRouterError("doBidResult.adSpotIdNotFound",
@@ -1776,17 +2268,35 @@ doBidResult(const Id & auctionId,
                account.toString(),
                submission.bidRequestFormatStr);
 
-    sendAgentMessage(response.agent, msg, timestamp,
-                     confidence, auctionId,
-                     toString(adspot_num),
-                     winPrice.toString(),
-                     submission.bidRequestStr,
-                     response.bidData,
-                     "null",
-                     response.meta,
-                     submission.augmentations,
-                     submission.bidRequestFormatStr
-                     /* "datacratic" */);
+    // Agents that asked for binary results are only sent what they don't
+    // already have; everyone else gets the full message
+    AgentConfigEntry entry = configListener.getAgentEntry(response.agent);
+    BidResultFormat format = BRF_FULL;
+    if (entry.valid())
+        format = (status == BS_WIN
+                  ? entry.config->winFormat : entry.config->lossFormat);
+
+    if (format == BRF_BINARY) {
+        BinaryBidResult result;
+        result.timestamp = timestamp;
+        result.confidence = confidence;
+        result.auctionId = auctionId;
+        result.spotNum = adspot_num;
+        result.price = winPrice;
+        sendAgentMessage(response.agent, msg, timestamp,
+                         result.serializeToString());
+    }
+    else sendAgentMessage(response.agent, msg, timestamp,
+                          confidence, auctionId,
+                          toString(adspot_num),
+                          winPrice.toString(),
+                          submission.bidRequestStr,
+                          response.bidData,
+                          "null",
+                          response.meta,
+                          submission.augmentations,
+                          submission.bidRequestFormatStr
+                          /* "datacratic" */);
 
     // Finally, place it in the finished queue
     FinishedInfo i;
@@ -1817,7 +2327,7 @@ doBidResult(const Id & auctionId,
 
     Date expiryTime = Date::now().plusSeconds(expiryInterval);
 
-    finished.insert(make_pair(auctionId, adSpotId), i, expiryTime);
+    part.finished.insert(make_pair(auctionId, adSpotId), i, expiryTime);
 }
 
 void
@@ -1839,7 +2349,7 @@ injectSubmittedAuction(const Id & auctionId,
     event.bidResponse = bidResponse;
     event.lossTimeout = lossTimeout;
 
-    auctions.push(event);
+    partitionForAuction(auctionId).auctions.push(event);
 }
 
 void
@@ -8,7 +8,12 @@
 
 #include "rtbkit/core/router/router_base.h"
 #include "soa/service/pending_list.h"
+#include "pending_store.h"
+#include "write_behind_persistence.h"
 #include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include "soa/service/message_loop.h"
 #include "soa/service/typed_message_channel.h"
 #include <boost/shared_ptr.hpp>
@@ -32,8 +37,14 @@ namespace RTBKIT {
 */
 
 struct SubmittedAuctionEvent {
+    SubmittedAuctionEvent()
+        : spotIndex(-1)
+    {
+    }
+
     Id auctionId;                  ///< ID of the auction
     Id adSpotId;                   ///< ID of the adspot
+    int spotIndex;                 ///< Index of the adspot; -1 if unknown
     Date lossTimeout;              ///< Time at which a loss is to be assumed
     JsonHolder augmentations;      ///< Augmentations active
     std::shared_ptr<BidRequest> bidRequest;  ///< Bid request
@@ -46,6 +57,55 @@ struct SubmittedAuctionEvent {
 };
 
 
+/*****************************************************************************/
+/* SUBMITTED AUCTION                                                         */
+/*****************************************************************************/
+
+/** All of the spots of an auction that had a bid submitted, sent from the
+    router to the post auction loop as a single AUCTIONSPOTS message.  The
+    bid request is sent (and parsed) once for the auction rather than once
+    for every spot.
+
+    In slim mode only what the post auction loop actually uses is sent:
+    the spot index goes along with each spot so that the post auction loop
+    doesn't need to parse the bid request, and the bid responses lose the
+    fields that only matter within the router.
+*/
+
+struct SubmittedAuction {
+    SubmittedAuction()
+        : slim(false)
+    {
+    }
+
+    struct Spot {
+        Spot()
+            : spotIndex(-1)
+        {
+        }
+
+        Id adSpotId;                   ///< ID of the adspot
+        int spotIndex;                 ///< Index of the adspot in the request
+        JsonHolder augmentations;      ///< Augmentations of the bidding agent
+        Auction::Response bidResponse; ///< Bid response that was sent
+    };
+
+    Id auctionId;                  ///< ID of the auction
+    Date lossTimeout;              ///< Time at which a loss is to be assumed
+    std::shared_ptr<BidRequest> bidRequest;  ///< Bid request (not in slim)
+    std::string bidRequestStr;     ///< Bid request as string on the wire
+    std::string bidRequestFormatStr;  ///< Format of stringified request
+    std::vector<Spot> spots;       ///< Spots that had a bid submitted
+    bool slim;                     ///< Only send what the PAL uses
+
+    /** Split into one event per spot.  The events share the bid request. */
+    std::vector<SubmittedAuctionEvent> toEvents() const;
+
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+};
+
+
 /*****************************************************************************/
 /* POST AUCTION EVENT TYPE                                                   */
 /*****************************************************************************/
@@ -95,6 +155,23 @@ std::ostream &
 operator << (std::ostream & stream, const PostAuctionEvent & event);
 
 
+/*****************************************************************************/
+/* POST AUCTION EVENT BATCH                                                  */
+/*****************************************************************************/
+
+/** A number of post auction events sent in one message.  Ad servers can
+    send us tens of thousands of WINs and LOSSes per second, and sending
+    them one per message means the per-message overhead dominates.
+*/
+
+struct PostAuctionEventBatch {
+    std::vector<PostAuctionEvent> events;
+
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+};
+
+
 /*****************************************************************************/
 /* SUBMISSION INFO                                                           */
 /*****************************************************************************/
@@ -106,13 +183,21 @@ operator << (std::ostream & stream, const PostAuctionEvent & event);
 
 struct SubmissionInfo {
     SubmissionInfo()
-        : fromOldRouter(false)
+        : spotIndex(-1), fromOldRouter(false)
     {
     }
 
-    std::shared_ptr<BidRequest> bidRequest;
+    /** Have we got the auction itself, or only events that came in
+        before it? */
+    bool hasAuction() const
+    {
+        return bidRequest || !bidRequestStr.empty();
+    }
+
+    std::shared_ptr<BidRequest> bidRequest;  ///< Null if not parsed
     std::string bidRequestStr;
     std::string bidRequestFormatStr;
+    int spotIndex;                        ///< -1 if not known
     JsonHolder augmentations;
     Auction::Response  bid;               ///< Bid we passed on
     bool fromOldRouter;                   ///< Was reconstituted
@@ -289,26 +374,29 @@ struct PostAuctionLoop : public RouterServiceBase,
     /// and event sources
     void bindTcp();
 
+    /** Set the number of partitions that the post auction state is split
+        over.  Each partition has its own thread and owns the auctions
+        whose id hashes to it, plus the slice of the user id index whose
+        uids hash to it.  Must be called before init().
+    */
+    void setNumPartitions(int numPartitions);
+
+    int numPartitions() const
+    {
+        return numPartitions_;
+    }
+
     void init();
 
     void start(std::function<void ()> onStop = std::function<void ()>());
 
     void shutdown();
 
-    size_t numAwaitingWinLoss() const
-    {
-        return submitted.size();
-    }
+    size_t numAwaitingWinLoss() const;
 
-    size_t numFinishedAuctionsTracked() const
-    {
-        return finished.size();
-    }
+    size_t numFinishedAuctionsTracked() const;
 
-    size_t numUidsTracked() const
-    {
-        return uidIndex.size();
-    }
+    size_t numUidsTracked() const;
 
     /** The post auction loop has state which needs to hang around for a
         long time.  We don't want this state to be lost if the post auction
@@ -317,7 +405,9 @@ struct PostAuctionLoop : public RouterServiceBase,
         This call will read any old state which is in the given directory,
         and also start recording state changes to that directory.
 
-        It uses leveldb under the hood.
+        It uses leveldb under the hood, written from background threads so
+        that the post auction loop doesn't wait on the disk.  Must be
+        called after init() and before start().
     */
     void initStatePersistence(const std::string & path);
 
@@ -414,52 +504,224 @@ struct PostAuctionLoop : public RouterServiceBase,
     void notifyFinishedSpot(const Id & auctionId, const Id & adSpotId);
 
 private:
+    /** List of auctions we're currently tracking as submitted.  Note that an
+        auction may be both submitted and in flight (if we had submitted a bid
+        from one agent but were waiting on bids for another agent).
+
+        The key is the (auction id, spot id) pair since after submission,
+        the result from every auction comes back separately.
+    */
+    typedef WriteBehindPersistence<std::pair<Id, Id>, SubmissionInfo>
+        SubmittedPersistence;
+    typedef PendingStore<SubmissionInfo, SubmittedPersistence> Submitted;
+
+    /** List of auctions we've won and we're waiting for an IMPRESSION
+        or a CLICK message from, or otherwise we're keeping around in case
+        a duplicate WIN or IMPRESSION or CLICK message comes through,
+        or otherwise we're looking for a late WIN message for.
+
+        We keep this list around for 5 minutes for those that were lost,
+        and one hour for those that were won.
+    */
+    typedef WriteBehindPersistence<std::pair<Id, Id>, FinishedInfo>
+        FinishedPersistence;
+    typedef PendingStore<FinishedInfo, FinishedPersistence> Finished;
+
+    // UserId -> ((auctionId, slotId) -> date)
+    typedef std::unordered_map<Id, std::map<std::pair<Id, Id>, Date> >
+        UidIndex;
+
+    /** Tasks to run on a MessageLoop, for the queues that the partitions
+        push to: their own tasks and the messages to the agents.  The
+        partitions push to each other and to the main loop, which pushes
+        back to them, so a push that blocked when the queue was full could
+        deadlock.  push() never blocks: what doesn't fit in the ring buffer
+        goes into an overflow list, which is moved into the ring buffer as
+        it empties.  Tasks pushed by any one thread run in order.
+    */
+    struct TaskQueue {
+        TaskQueue(size_t queueSize);
+
+        void push(const std::function<void ()> & task);
+
+        /// Add the queue to the given loop, which runs its tasks
+        void addTo(MessageLoop & loop, const std::string & name);
+
+        uint64_t numOverflowed;   ///< Tasks that didn't fit the ring
+
+    private:
+        void runTask(const std::function<void ()> & task);
+
+        /// Move what fits from the overflow list into the ring buffer
+        void drainOverflow();
+
+        TypedMessageSink<std::function<void ()> > sink;
+        std::atomic<bool> overflowing;
+        std::mutex overflowLock;
+        std::deque<std::function<void ()> > overflow;
+    };
+
+    /** One slice of the post auction state, with the thread that processes
+        it.  Everything about an auction (its submission, win, loss,
+        impression, click and the matching part of a visit) is handled by
+        the partition that its auction id hashes to.  The uid index is
+        sliced by uid instead, so a visit is first looked up in the
+        partitions owning its uids and then handed to the partitions that
+        own the matching auctions.
+
+        Nothing in a partition is touched from outside of its own thread
+        once it's started; other threads go through its sinks.
+    */
+    struct Partition {
+        Partition(int index, size_t queueSize, bool haveZmqContext);
+
+        int index;
+
+        /// Thread that processes this partition
+        MessageLoop loop;
+
+        /// Auctions come in on this when running in-process
+        TypedMessageSink<SubmittedAuctionEvent> auctions;
+
+        /// Events come in on this when running in-process
+        TypedMessageSink<std::shared_ptr<PostAuctionEvent> > events;
+
+        /** Messages from the endpoint: either an undecoded zeromq
+            message, or a batch of events decoded from an EVENTBATCH.
+            They share a queue so that they're handled in the order that
+            they arrived in.
+        */
+        struct Message {
+            std::vector<std::string> message;
+            std::shared_ptr<PostAuctionEventBatch> batch;
+        };
+
+        TypedMessageSink<Message> messages;
+
+        /// Work handed over from other partitions and the main loop
+        TaskQueue tasks;
+
+        /// Routes the undecoded messages to their handlers
+        ZmqMessageRouter router;
+
+        Submitted submitted;
+        Finished finished;
+
+        /** Map of user IDs to (auction, slot) pairs so that we can match
+            our visits up to the original auctions.  Only contains the uids
+            that hash to this partition.
+        */
+        UidIndex uidIndex;
+    };
+
+    int numPartitions_;
+    size_t queueSize;    ///< Size of each of the partitions' queues
+    std::vector<std::unique_ptr<Partition> > partitions;
+
+    /// Shared by all of the partitions; only set up with persistence
+    std::shared_ptr<SubmittedPersistence> submittedPersistence;
+    std::shared_ptr<FinishedPersistence> finishedPersistence;
+
+    Partition & partitionForAuction(const Id & auctionId)
+    {
+        return *partitions[auctionId.hash() % partitions.size()];
+    }
+
+    Partition & partitionForUid(const Id & uid)
+    {
+        return *partitions[uid.hash() % partitions.size()];
+    }
+
     /** Initialize all of our connections, hooking everything in to the
         event loop.
     */
     void initConnections();
 
+    /** Hand an undecoded message from the endpoint to the partition
+        owning its auction. */
+    void dispatchMessage(const std::vector<std::string> & message);
+
+    /** Hand a visit to the partitions owning its uids. */
+    void dispatchVisit(const std::shared_ptr<PostAuctionEvent> & event);
+
     /** Handle a new auction that came in. */
-    void doAuction(const SubmittedAuctionEvent & event);
+    void doAuction(Partition & part, const SubmittedAuctionEvent & event);
 
     /** Handle a post-auction event that came in. */
-    void doEvent(const std::shared_ptr<PostAuctionEvent> & event);
+    void doEvent(Partition & part,
+                 const std::shared_ptr<PostAuctionEvent> & event);
 
     /** Decode from zeromq and handle a new auction that came in. */
-    void doAuctionMessage(const std::vector<std::string> & message);
+    void doAuctionMessage(Partition & part,
+                          const std::vector<std::string> & message);
+
+    /** Decode from zeromq and handle all of the submitted spots of an
+        auction. */
+    void doAuctionSpotsMessage(Partition & part,
+                               const std::vector<std::string> & message);
 
     /** Decode from zeromq and handle a new auction that came in. */
-    void doWinMessage(const std::vector<std::string> & message);
+    void doWinMessage(Partition & part,
+                      const std::vector<std::string> & message);
 
     /** Decode from zeromq and handle a new auction that came in. */
-    void doLossMessage(const std::vector<std::string> & message);
+    void doLossMessage(Partition & part,
+                       const std::vector<std::string> & message);
 
     /** Decode from zeromq nd handle a new impression message that came in. */
-    void doImpressionMessage(const std::vector<std::string> & message);
+    void doImpressionMessage(Partition & part,
+                             const std::vector<std::string> & message);
 
     /** Decode from zeromq nd handle a new impression message that came in. */
-    void doClickMessage(const std::vector<std::string> & message);
+    void doClickMessage(Partition & part,
+                        const std::vector<std::string> & message);
 
-    /** Decode from zeromq nd handle a new impression message that came in. */
+    /** Decode from zeromq and pass a visit on to the partitions owning its
+        uids. */
     void doVisitMessage(const std::vector<std::string> & message);
 
+    /** Decode a batch of events from zeromq and split it up between the
+        partitions owning the auctions. */
+    void doEventBatchMessage(const std::vector<std::string> & message);
+
+    /** Handle a message from the endpoint that was passed to the
+        partition. */
+    void doPartitionMessage(Partition & part,
+                            const Partition::Message & message);
+
+    /** Handle each of the events in the batch.  The events are passed on
+        with a pointer that shares ownership of the batch rather than
+        being allocated one by one.
+    */
+    void doEventBatch(Partition & part,
+                      const std::shared_ptr<PostAuctionEventBatch> & batch);
+
     /** Periodic auction expiry. */
-    void checkExpiredAuctions();
+    void checkExpiredAuctions(Partition & part);
 
     /** We got a win/loss.  Match it up with its bid and pass on to the
         winning bidder.
     */
-    void doWinLoss(const std::shared_ptr<PostAuctionEvent> & event,
+    void doWinLoss(Partition & part,
+                   const std::shared_ptr<PostAuctionEvent> & event,
                    bool isReplay);
 
-    /** An auction was submitted... record that */
-    void doSubmitted(const std::shared_ptr<PostAuctionEvent> & event);
-
     /** We got an impression or click on the control socket */
-    void doImpressionClick(const std::shared_ptr<PostAuctionEvent> & event);
+    void doImpressionClick(Partition & part,
+                           const std::shared_ptr<PostAuctionEvent> & event);
 
-    /** We got a visit event on the control socket. */
-    void doVisit(const std::shared_ptr<PostAuctionEvent> & event);
+    /** We got a visit event; look up the given uid (which is owned by this
+        partition) and pass the visit on to each matching auction.
+    */
+    void doVisit(Partition & part,
+                 const std::shared_ptr<PostAuctionEvent> & event,
+                 const Id & uid);
+
+    /** Match a visit with one of the finished auctions owned by this
+        partition. */
+    void doVisitAuction(Partition & part,
+                        const std::shared_ptr<PostAuctionEvent> & event,
+                        const std::pair<Id, Id> & key);
 
     /** Send out a post-auction event to anything that may be listening. */
     bool routePostAuctionEvent(PostAuctionEventType type,
@@ -468,7 +730,8 @@ private:
                                bool filterChannels);
 
     /** Communicate the result of a bid message to an agent. */
-    void doBidResult(const Id & auctionId,
+    void doBidResult(Partition & part,
+                     const Id & auctionId,
                      const Id & adSpotId,
                      const SubmissionInfo & submission,
                      Amount price,
@@ -478,60 +741,28 @@ private:
                      const std::string & winLossMeta,
                      const UserIds & uids);
 
-    /** List of auctions we're currently tracking as submitted.  Note that an
-        auction may be both submitted and in flight (if we had submitted a bid
-        from one agent but were waiting on bids for another agent).
-
-        The key is the (auction id, spot id) pair since after submission,
-        the result from every auction comes back separately.
-    */
-    typedef PendingList<std::pair<Id, Id>,
-                        SubmissionInfo> Submitted;
-    Submitted submitted;
-
-    /** List of auctions we've won and we're waiting for an IMPRESSION
-        or a CLICK message from, or otherwise we're keeping around in case
-        a duplicate WIN or IMPRESSION or CLICK message comes through,
-        or otherwise we're looking for a late WIN message for.
-
-        We keep this list around for 5 minutes for those that were lost,
-        and one hour for those that were won.
-    */
-    typedef PendingList<std::pair<Id, Id>, FinishedInfo> Finished;
-    Finished finished;
-
-    /** Map of user IDs to (auction, slot) pairs so that we can match our
-        visits up to the original auctions.
-    */
-    struct UidIndexEntry {
-        Id auctionId;
-        Id adSpotId;
-        Date timestamp;
-    };
-
-    // UserId -> ((auctionId, slotId) -> date)
-    typedef std::unordered_map<Id, std::map<std::pair<Id, Id>, Date> >
-        UidIndex;
-    UidIndex uidIndex;
-
     /** Add the given User ID to the user ID index.  Calling this function
         sets things up such that a visit from the given user ID will be
         associated with the finished auction with the given auction Id and
-        slot ID.
+        slot ID.  The index entry is added by the partition owning the uid.
     */
     void addToUidIndex(const std::string & uidDomain,
                        const Id & uid,
                        const Id & auctionId,
                        const Id & slotId);
 
-    /// This provides the thread we use to actually process with
-    MessageLoop loop;
+    /** Remove the given auction from the uid's index entry, in the
+        partition owning the uid. */
+    void removeFromUidIndex(const Id & uid, const std::pair<Id, Id> & key);
 
-    /// Auctions come in on this when running in-process
-    TypedMessageSink<SubmittedAuctionEvent> auctions;
+    /** Run the given function in the given partition's thread. */
+    void runInPartition(Partition & part, const std::function<void ()> & fn);
 
-    /// Events come in on this when running in-process
-    TypedMessageSink<std::shared_ptr<PostAuctionEvent> > events;
+    /// This provides the thread that handles the connections
+    MessageLoop loop;
+
+    /// Sends to the agents from the partitions, which run on our loop
+    TaskQueue agentMessages;
 
     /// Endpoint that routers and event sources connect to
     ZmqNamedEndpoint endpoint;
@@ -543,15 +774,28 @@ private:
     /// Messages to the agents go out on this
     ZmqNamedClientBus toAgents;
 
-    /** Send the given message to the given bidding agent. */
+    /** Send the given message to the given bidding agent.  Called from
+        the partitions; the message is actually sent from our loop's thread
+        as the socket can't be shared.
+    */
     template<typename... Args>
     void sendAgentMessage(const std::string & agent,
                           const std::string & messageType,
                           const Date & date,
                           Args... args)
     {
-        toAgents.sendMessage(agent, messageType, date,
-                             std::forward<Args>(args)...);
+        agentMessages.push
+            (std::bind(&PostAuctionLoop::doSendAgentMessage<Args...>, this,
+                       agent, messageType, date, args...));
+    }
+
+    template<typename... Args>
+    void doSendAgentMessage(const std::string & agent,
+                            const std::string & messageType,
+                            const Date & date,
+                            Args... args)
+    {
+        toAgents.sendMessage(agent, messageType, date, args...);
     }
 
     /** Turn an auction and agent into the bid ID for the banker */
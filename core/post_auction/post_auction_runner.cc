@@ -0,0 +1,116 @@
+/* post_auction_runner.cc                                          -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Runner for the post auction service.
+*/
+
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/positional_options.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include "rtbkit/core/post_auction/post_auction_loop.h"
+#include "rtbkit/core/banker/slave_banker.h"
+#include "rtbkit/common/auction_trace.h"
+#include "jml/arch/timers.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+int main(int argc, char ** argv)
+{
+    using namespace boost::program_options;
+
+    options_description configuration_options("Configuration options");
+
+    std::string zookeeperUri;
+    std::string installation;
+    std::string nodeName;
+    std::string persistenceDir;
+    int numPartitions = 1;
+    double traceSampleRate = AuctionTrace::sampleRate();
+
+    std::vector<std::string> carbonUris;  ///< TODO: zookeeper
+
+    configuration_options.add_options()
+        ("zookeeper-uri,Z", value(&zookeeperUri),
+         "URI of zookeeper to use")
+        ("installation,I", value(&installation),
+         "Name of the installation that is running")
+        ("node-name,N", value(&nodeName),
+         "Name of the node we're running")
+        ("carbon-connection,c", value<vector<string> >(&carbonUris),
+         "URI of connection to carbon daemon")
+        ("partitions,p", value<int>(&numPartitions),
+         "Number of threads to split the post auction state over by "
+         "auction id")
+        ("persistence-dir,d", value<string>(&persistenceDir),
+         "Directory to keep the post auction state in, so that it "
+         "survives a restart")
+        ("trace-sample-rate", value<double>(&traceSampleRate),
+         "proportion of auctions to trace the phases of (0 to 1); "
+         "should match the router's so that the same auctions are traced");
+
+    options_description all_opt;
+    all_opt
+        .add(configuration_options);
+    all_opt.add_options()
+        ("help,h", "print this message");
+
+    variables_map vm;
+    store(command_line_parser(argc, argv)
+          .options(all_opt)
+          .run(),
+          vm);
+    notify(vm);
+
+    if (vm.count("help")) {
+        cerr << all_opt << endl;
+        exit(1);
+    }
+
+    if (installation.empty()) {
+        cerr << "'installation' parameter is required" << endl;
+        exit(1);
+    }
+
+    if (nodeName.empty()) {
+        cerr << "'node-name' parameter is required" << endl;
+        exit(1);
+    }
+
+    AuctionTrace::setSampleRate(traceSampleRate);
+
+    std::shared_ptr<ServiceProxies> proxies(new ServiceProxies());
+    proxies->useZookeeper(zookeeperUri, installation);
+    if (!carbonUris.empty())
+        proxies->logToCarbon(carbonUris, installation + "." + nodeName);
+
+    auto banker = std::make_shared<SlaveBanker>(proxies->zmqContext,
+                                                proxies->config,
+                                                "postAuction.slaveBanker");
+
+    PostAuctionLoop postAuctionLoop(proxies, "postAuction");
+    postAuctionLoop.setNumPartitions(numPartitions);
+    postAuctionLoop.init();
+    postAuctionLoop.setBanker(banker);
+    if (!persistenceDir.empty())
+        postAuctionLoop.initStatePersistence(persistenceDir);
+    postAuctionLoop.bindTcp();
+
+    banker->start();
+    postAuctionLoop.start();
+
+    cerr << "post auction service running with " << numPartitions
+         << " partitions" << endl;
+
+    for (;;) {
+        ML::sleep(10);
+    }
+}
@@ -0,0 +1,273 @@
+/* pending_store_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and benchmark for the post auction loop's pending store.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "jml/arch/format.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/pair_utils.h"
+#include "soa/service/pending_list.h"
+#include "rtbkit/core/post_auction/pending_store.h"
+#include <malloc.h>
+#include <iostream>
+#include <map>
+#include <algorithm>
+#include <cmath>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+struct Value {
+    Value(int i = 0)
+        : i(i)
+    {
+    }
+
+    int i;
+    std::string payload;
+};
+
+pair<Id, Id> makeKey(int auction, int spot)
+{
+    return make_pair(Id(auction), Id(spot));
+}
+
+size_t heapInUse()
+{
+    return mallinfo().uordblks;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_pending_store_basics )
+{
+    PendingStore<Value> store;
+
+    auto k1 = makeKey(1, 1), k2 = makeKey(1, 2), k3 = makeKey(2, 1);
+
+    BOOST_CHECK_EQUAL(store.size(), 0);
+    BOOST_CHECK(!store.count(k1));
+
+    Date now = Date::now();
+    store.insert(k1, 1, now.plusSeconds(10));
+    store.insert(k2, 2, now.plusSeconds(10));
+    store.insert(k3, 3, now.plusSeconds(10));
+    BOOST_CHECK_THROW(store.insert(k1, 1, now), ML::Exception);
+
+    BOOST_CHECK_EQUAL(store.size(), 3);
+    BOOST_CHECK_EQUAL(store.get(k2).i, 2);
+
+    store.update(k2, 22);
+    BOOST_CHECK_EQUAL(store.get(k2).i, 22);
+
+    BOOST_CHECK_EQUAL(store.pop(k1).i, 1);
+    BOOST_CHECK(!store.count(k1));
+    BOOST_CHECK(store.count(k2));
+    BOOST_CHECK_THROW(store.pop(k1), ML::Exception);
+
+    BOOST_CHECK(store.erase(k3));
+    BOOST_CHECK(!store.erase(k3));
+    BOOST_CHECK_EQUAL(store.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_pending_store_complete_prefix )
+{
+    PendingStore<Value> store;
+    pair<Id, Id> none;
+
+    auto k0 = make_pair(Id("3"), Id("0"));
+    auto k1 = make_pair(Id("3"), Id("1"));
+    auto k2 = make_pair(Id("3"), Id("2"));
+    auto m1 = make_pair(Id("5"), Id("1"));
+
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("3")), none);
+
+    store.insert(k1, 1, Date());
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("3")), k1);
+    store.insert(k2, 2, Date());
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("3")), k1);
+    store.insert(k0, 0, Date());
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("3")), k0);
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("5")), none);
+
+    store.insert(m1, 1, Date());
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("5")), m1);
+
+    store.erase(k0);
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("3")), k1);
+    store.erase(k1);
+    store.erase(k2);
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("3")), none);
+    BOOST_CHECK_EQUAL(store.completePrefix(Id("5")), m1);
+}
+
+BOOST_AUTO_TEST_CASE( test_pending_store_expiry )
+{
+    Date start = Date::fromSecondsSinceEpoch
+        (floor(Date::now().secondsSinceEpoch()));
+    PendingStore<Value> store;
+
+    // One per second for 20 seconds, plus one beyond the ring's horizon
+    for (unsigned i = 0;  i < 20;  ++i)
+        store.insert(makeKey(i, 1), i, start.plusSeconds(i + 0.5));
+    store.insert(makeKey(100, 1), 100, start.plusSeconds(10000));
+
+    vector<int> expired;
+    int renewed = 0;
+    auto onExpired = [&] (const pair<Id, Id> & key, const Value & value)
+        {
+            // Renew the first one to expire once
+            if (value.i == 0 && renewed++ == 0)
+                return start.plusSeconds(15.5);
+            expired.push_back(value.i);
+            return Date();
+        };
+
+    store.expire(onExpired, start);
+    BOOST_CHECK(expired.empty());
+
+    store.expire(onExpired, start.plusSeconds(5));
+    BOOST_CHECK(expired == vector<int>({ 1, 2, 3, 4 }));
+    BOOST_CHECK_EQUAL(store.size(), 17);
+
+    expired.clear();
+    store.expire(onExpired, start.plusSeconds(16));
+    BOOST_CHECK_EQUAL(expired.size(), 12);
+    BOOST_CHECK(std::find(expired.begin(), expired.end(), 0) != expired.end());
+
+    // Skip more than a full turn of the ring
+    expired.clear();
+    store.expire(onExpired, start.plusSeconds(20000));
+    BOOST_CHECK_EQUAL(expired.size(), 5);
+    BOOST_CHECK(std::find(expired.begin(), expired.end(), 100)
+                != expired.end());
+    BOOST_CHECK_EQUAL(store.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_pending_store_against_map )
+{
+    // Random operations checked against a std::map, to exercise the
+    // backwards shift deletion and the table growth.
+    PendingStore<Value> store;
+    std::map<pair<Id, Id>, int> ref;
+
+    srandom(1);
+    for (unsigned i = 0;  i < 200000;  ++i) {
+        auto key = makeKey(random() % 5000, random() % 3);
+        int op = random() % 3;
+        if (op == 0 && !ref.count(key)) {
+            store.insert(key, i, Date::now().plusSeconds(60));
+            ref[key] = i;
+        }
+        else if (op == 1) {
+            BOOST_REQUIRE_EQUAL(store.erase(key), (bool)ref.erase(key));
+        }
+        else {
+            BOOST_REQUIRE_EQUAL(store.count(key), (bool)ref.count(key));
+            if (ref.count(key))
+                BOOST_REQUIRE_EQUAL(store.get(key).i, ref[key]);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(store.size(), ref.size());
+    for (auto & e: ref)
+        BOOST_CHECK_EQUAL(store.get(e.first).i, e.second);
+}
+
+/* Insert, lookup and expiry speed of the PendingStore against the
+   PendingList for a million entries.  Set RTBKIT_RUN_BENCHMARKS=1 to run
+   it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_pending_store_vs_pending_list )
+{
+    if (!runBenchmarks)
+        return;
+
+    int numEntries = 1000000;
+
+    auto fillValue = [] (int i)
+        {
+            Value v(i);
+            return v;
+        };
+
+    Date start = Date::fromSecondsSinceEpoch
+        (floor(Date::now().secondsSinceEpoch()));
+
+    // PendingList
+    {
+        size_t before = heapInUse();
+        Date beforeInsert = Date::now();
+
+        PendingList<pair<Id, Id>, Value> pending;
+        for (unsigned i = 0;  i < numEntries;  ++i)
+            pending.insert(makeKey(i, 1), fillValue(i),
+                           start.plusSeconds(i % 3600));
+
+        double insertTime = Date::now().secondsSince(beforeInsert);
+        size_t bytes = heapInUse() - before;
+
+        Date beforeExpire = Date::now();
+        size_t numExpired = 0;
+        auto onExpired = [&] (const pair<Id, Id> &, const Value &)
+            {
+                ++numExpired;
+                return Date();
+            };
+        for (unsigned s = 0;  s < 60;  ++s)
+            pending.expire(onExpired, start.plusSeconds(s));
+        double expireTime = Date::now().secondsSince(beforeExpire);
+
+        cerr << format("PendingList:  %8.1f bytes/entry, insert %6.3fs, "
+                       "60 expiries %6.3fs (%zd expired)",
+                       1.0 * bytes / numEntries, insertTime, expireTime,
+                       numExpired)
+             << endl;
+    }
+
+    // PendingStore
+    {
+        size_t before = heapInUse();
+        Date beforeInsert = Date::now();
+
+        PendingStore<Value> pending;
+        for (unsigned i = 0;  i < numEntries;  ++i)
+            pending.insert(makeKey(i, 1), fillValue(i),
+                           start.plusSeconds(i % 3600));
+
+        double insertTime = Date::now().secondsSince(beforeInsert);
+        size_t bytes = heapInUse() - before;
+
+        Date beforeExpire = Date::now();
+        size_t numExpired = 0;
+        auto onExpired = [&] (const pair<Id, Id> &, const Value &)
+            {
+                ++numExpired;
+                return Date();
+            };
+        for (unsigned s = 0;  s < 60;  ++s)
+            pending.expire(onExpired, start.plusSeconds(s));
+        double expireTime = Date::now().secondsSince(beforeExpire);
+
+        cerr << format("PendingStore: %8.1f bytes/entry, insert %6.3fs, "
+                       "60 expiries %6.3fs (%zd expired)",
+                       1.0 * bytes / numEntries, insertTime, expireTime,
+                       numExpired)
+             << endl;
+
+        BOOST_CHECK_EQUAL(pending.size() + numExpired, numEntries);
+    }
+}
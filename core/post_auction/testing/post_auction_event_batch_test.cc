@@ -0,0 +1,95 @@
+/* post_auction_event_batch_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test that batches of post auction events and multi-spot submissions make
+   it through serialization.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "jml/db/persistent.h"
+#include "rtbkit/core/post_auction/post_auction_loop.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+BOOST_AUTO_TEST_CASE( test_event_batch_round_trip )
+{
+    PostAuctionEventBatch batch;
+
+    for (unsigned i = 0;  i < 100;  ++i) {
+        PostAuctionEvent event;
+        event.type = (i % 2 ? PAE_WIN : PAE_LOSS);
+        event.auctionId = Id(i + 1);
+        event.adSpotId = Id(1);
+        event.timestamp = Date::fromSecondsSinceEpoch(1000 + i);
+        event.account = { "campaign", "strategy" };
+        event.winPrice = (i % 2 ? MicroUSD(i) : Amount());
+        event.bidTimestamp = Date::fromSecondsSinceEpoch(999 + i);
+        batch.events.push_back(event);
+    }
+
+    string str = ML::DB::serializeToString(batch);
+    auto batch2 = ML::DB::reconstituteFromString<PostAuctionEventBatch>(str);
+
+    BOOST_REQUIRE_EQUAL(batch2.events.size(), batch.events.size());
+    for (unsigned i = 0;  i < batch.events.size();  ++i)
+        BOOST_CHECK_EQUAL(batch2.events[i].print(), batch.events[i].print());
+
+    // Empty batches are fine too
+    PostAuctionEventBatch empty;
+    auto empty2 = ML::DB::reconstituteFromString<PostAuctionEventBatch>
+        (ML::DB::serializeToString(empty));
+    BOOST_CHECK(empty2.events.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_slim_submitted_auction_round_trip )
+{
+    SubmittedAuction submission;
+    submission.auctionId = Id(1234);
+    submission.lossTimeout = Date::fromSecondsSinceEpoch(1015);
+    submission.bidRequestStr = "{\"id\":\"1234\"}";
+    submission.bidRequestFormatStr = "datacratic";
+    submission.slim = true;
+
+    for (unsigned i = 0;  i < 3;  ++i) {
+        SubmittedAuction::Spot spot;
+        spot.adSpotId = Id(i + 1);
+        spot.spotIndex = i;
+        spot.bidResponse.price.maxPrice = MicroUSD(1000 * (i + 1));
+        spot.bidResponse.tagId = i + 10;
+        spot.bidResponse.test = false;
+        spot.bidResponse.account = { "campaign", "strategy" };
+        spot.bidResponse.agent = "agent";
+        submission.spots.push_back(spot);
+    }
+
+    string str = ML::DB::serializeToString(submission);
+    auto submission2
+        = ML::DB::reconstituteFromString<SubmittedAuction>(str);
+
+    // Slim submissions aren't parsed
+    BOOST_CHECK(!submission2.bidRequest);
+    BOOST_CHECK_EQUAL(submission2.bidRequestStr, submission.bidRequestStr);
+
+    auto events = submission2.toEvents();
+    BOOST_REQUIRE_EQUAL(events.size(), 3);
+    for (unsigned i = 0;  i < events.size();  ++i) {
+        BOOST_CHECK_EQUAL(events[i].auctionId, Id(1234));
+        BOOST_CHECK_EQUAL(events[i].adSpotId, Id(i + 1));
+        BOOST_CHECK_EQUAL(events[i].spotIndex, i);
+        BOOST_CHECK_EQUAL(events[i].bidResponse.price.maxPrice,
+                          MicroUSD(1000 * (i + 1)));
+        BOOST_CHECK_EQUAL(events[i].bidResponse.agent, "agent");
+
+        // These go out to the agents and into the logs, so they can't be
+        // left at their defaults
+        BOOST_CHECK_EQUAL(events[i].bidResponse.tagId, i + 10);
+        BOOST_CHECK_EQUAL(events[i].bidResponse.test, false);
+    }
+}
@@ -0,0 +1,118 @@
+/* post_auction_partitions_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and scaling benchmark for the partitions of the post auction loop.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/post_auction/post_auction_loop.h"
+#include "rtbkit/core/banker/null_banker.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/testing/watchdog.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+/** Submit numAuctions auctions of one spot to the loop and then win each of
+    them, for one of numUsers users.  Returns once all of the wins have
+    been matched, with the number of seconds that it took.
+*/
+double runAuctions(PostAuctionLoop & loop,
+                   size_t numAuctions, size_t numUsers)
+{
+    AccountKey account({ "campaign", "strategy" });
+    Auction::Response response(Auction::Price(MicroUSD(1000), 1), 0,
+                               account, false, "agent");
+
+    auto request = std::make_shared<BidRequest>();
+    request->spots.push_back(AdSpot());
+    request->spots[0].id = Id(1);
+
+    Date start = Date::now();
+    Date lossTimeout = start.plusSeconds(600);
+
+    for (size_t i = 0;  i < numAuctions;  ++i)
+        loop.injectSubmittedAuction(Id(i + 1), Id(1), request, "",
+                                    JsonHolder(), response, lossTimeout);
+
+    for (size_t i = 0;  i < numAuctions;  ++i) {
+        UserIds uids;
+        uids.add(Id(i % numUsers + 1), ID_EXCHANGE);
+        loop.injectWin(Id(i + 1), Id(1), MicroUSD(500), Date::now(),
+                       JsonHolder(), uids, account, start);
+    }
+
+    while (loop.numFinishedAuctionsTracked() < numAuctions)
+        ML::sleep(0.001);
+
+    return Date::now().secondsSince(start);
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_partitions_match_wins )
+{
+    Watchdog watchdog(30.0);
+
+    auto proxies = std::make_shared<ServiceProxies>();
+    PostAuctionLoop loop(proxies, "postAuction");
+    loop.setNumPartitions(4);
+    loop.init();
+    loop.setBanker(std::make_shared<NullBanker>(true));
+    loop.start();
+
+    size_t numAuctions = 10000, numUsers = 100;
+    runAuctions(loop, numAuctions, numUsers);
+
+    BOOST_CHECK_EQUAL(loop.numAwaitingWinLoss(), 0);
+    BOOST_CHECK_EQUAL(loop.numFinishedAuctionsTracked(), numAuctions);
+
+    // The uid index is filled in by tasks that the partitions owning the
+    // auctions send to the ones owning the uids
+    while (loop.numUidsTracked() < numUsers)
+        ML::sleep(0.001);
+    BOOST_CHECK_EQUAL(loop.numUidsTracked(), numUsers);
+
+    loop.shutdown();
+}
+
+/* Wins per second that the loop can match up, by number of partitions.
+   Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_post_auction_partitions )
+{
+    if (!runBenchmarks)
+        return;
+
+    size_t numAuctions = 200000, numUsers = 10000;
+
+    for (int numPartitions: { 1, 2, 4, 8 }) {
+        auto proxies = std::make_shared<ServiceProxies>();
+        PostAuctionLoop loop(proxies, "postAuction");
+        loop.setNumPartitions(numPartitions);
+        loop.init();
+        loop.setBanker(std::make_shared<NullBanker>(true));
+        loop.start();
+
+        double elapsed = runAuctions(loop, numAuctions, numUsers);
+
+        cerr << ML::format("%d partitions  %8.0f wins/s",
+                           numPartitions, numAuctions / elapsed)
+             << endl;
+
+        loop.shutdown();
+    }
+}
@@ -0,0 +1,152 @@
+/* post_auction_proxy_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test that the post auction proxy batches WINs and LOSSes by size and by
+   delay.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/plugins/exchange/ad_server_connector.h"
+#include "rtbkit/core/post_auction/post_auction_loop.h"
+#include "jml/db/persistent.h"
+#include "jml/arch/timers.h"
+#include <mutex>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+namespace {
+
+/** Proxy that records what it sends instead of sending it. */
+struct TestProxy : public PostAuctionProxy {
+    TestProxy()
+        : PostAuctionProxy(std::make_shared<zmq::context_t>(1))
+    {
+    }
+
+    ~TestProxy()
+    {
+        shutdown();
+    }
+
+    struct Sent {
+        std::string messageType;
+        size_t numEvents;
+        Date date;
+    };
+
+    virtual void sendToPostAuctionService(const std::string & messageType,
+                                          const std::string & payload)
+    {
+        Sent result;
+        result.messageType = messageType;
+        result.numEvents = 1;
+        result.date = Date::now();
+        if (messageType == "EVENTBATCH")
+            result.numEvents = ML::DB::reconstituteFromString
+                <PostAuctionEventBatch>(payload).events.size();
+
+        std::lock_guard<std::mutex> guard(lock);
+        sent.push_back(result);
+    }
+
+    std::vector<Sent> getSent()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return sent;
+    }
+
+    void injectWin(int auction)
+    {
+        PostAuctionProxy::injectWin(Id(auction), Id(1), MicroUSD(100),
+                                    Date::now(), JsonHolder(), UserIds(),
+                                    AccountKey({ "campaign" }), Date::now());
+    }
+
+    std::mutex lock;
+    std::vector<Sent> sent;
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_batching_by_size )
+{
+    TestProxy proxy;
+    proxy.setBatching(10, 10000000 /* 10 seconds */);
+    proxy.start();
+
+    for (unsigned i = 0;  i < 25;  ++i)
+        proxy.injectWin(i + 1);
+
+    // Full batches go straight away
+    auto sent = proxy.getSent();
+    BOOST_REQUIRE_EQUAL(sent.size(), 2);
+    for (auto & s: sent) {
+        BOOST_CHECK_EQUAL(s.messageType, "EVENTBATCH");
+        BOOST_CHECK_EQUAL(s.numEvents, 10);
+    }
+
+    // Anything else flushes the partial batch before it's sent
+    proxy.injectImpression(Id(1), Id(1), Date::now(), JsonHolder(),
+                           UserIds());
+    sent = proxy.getSent();
+    BOOST_REQUIRE_EQUAL(sent.size(), 4);
+    BOOST_CHECK_EQUAL(sent[2].messageType, "EVENTBATCH");
+    BOOST_CHECK_EQUAL(sent[2].numEvents, 5);
+    BOOST_CHECK_EQUAL(sent[3].messageType, "IMPRESSION");
+
+    // As does shutting down
+    proxy.injectWin(26);
+    proxy.shutdown();
+    sent = proxy.getSent();
+    BOOST_REQUIRE_EQUAL(sent.size(), 5);
+    BOOST_CHECK_EQUAL(sent[4].numEvents, 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_batching_by_delay )
+{
+    TestProxy proxy;
+    double maxDelay = 0.05;
+    proxy.setBatching(1000, maxDelay * 1000000);
+    proxy.start();
+
+    for (unsigned i = 0;  i < 3;  ++i) {
+        Date start = Date::now();
+        proxy.injectWin(1);
+        ML::sleep(maxDelay / 5);
+        proxy.injectWin(2);
+
+        // The batch goes once its first event has waited the maximum
+        // delay, not later
+        while (proxy.getSent().size() < i + 1
+               && Date::now().secondsSince(start) < 5.0)
+            ML::sleep(0.001);
+
+        auto sent = proxy.getSent();
+        BOOST_REQUIRE_EQUAL(sent.size(), i + 1);
+        BOOST_CHECK_EQUAL(sent[i].numEvents, 2);
+        double waited = sent[i].date.secondsSince(start);
+        BOOST_CHECK_GE(waited, maxDelay);
+        BOOST_CHECK_LT(waited, maxDelay * 1.8);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_no_delay_sends_immediately )
+{
+    TestProxy proxy;
+    proxy.setBatching(1000, 0);
+    proxy.start();
+
+    proxy.injectWin(1);
+
+    auto sent = proxy.getSent();
+    BOOST_REQUIRE_EQUAL(sent.size(), 1);
+    BOOST_CHECK_EQUAL(sent[0].messageType, "WIN");
+}
@@ -0,0 +1,7 @@
+# Post auction testing makefile
+
+$(eval $(call test,pending_store_test,types,boost))
+$(eval $(call test,post_auction_event_batch_test,post_auction,boost))
+$(eval $(call test,write_behind_persistence_test,types leveldb boost_thread,boost))
+$(eval $(call test,post_auction_partitions_test,post_auction,boost))
+$(eval $(call test,post_auction_proxy_test,exchange post_auction,boost))
@@ -0,0 +1,280 @@
+/* write_behind_persistence_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and benchmark for the post auction loop's write-behind leveldb
+   persistence.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "jml/arch/format.h"
+#include "jml/utils/environment.h"
+#include "rtbkit/core/post_auction/pending_store.h"
+#include "rtbkit/core/post_auction/write_behind_persistence.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <iostream>
+#include <map>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+Env_Option<string> tmpDir("TMP", "./tmp");
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+typedef pair<Id, Id> Key;
+
+struct Value {
+    Value(int i = 0)
+        : i(i), payload(200, 'x')
+    {
+    }
+
+    int i;
+    std::string payload;   ///< About the size of a small bid request
+};
+
+typedef WriteBehindPersistence<Key, Value> Persistence;
+
+Key makeKey(int auction, int spot)
+{
+    return make_pair(Id(auction), Id(spot));
+}
+
+std::shared_ptr<Persistence>
+openPersistence(const std::string & path)
+{
+    auto result = std::make_shared<Persistence>();
+    result->stringifyKey = [] (const Key & key)
+        {
+            return key.first.toString() + ":" + key.second.toString();
+        };
+    result->unstringifyKey = [] (const std::string & str)
+        {
+            auto pos = str.find(':');
+            return make_pair(Id(str.substr(0, pos)), Id(str.substr(pos + 1)));
+        };
+    result->stringifyValue = [] (const Value & value)
+        {
+            return to_string(value.i) + ":" + value.payload;
+        };
+    result->unstringifyValue = [] (const std::string & str)
+        {
+            auto pos = str.find(':');
+            Value value(std::stoi(str.substr(0, pos)));
+            value.payload = str.substr(pos + 1);
+            return value;
+        };
+    result->open(path);
+    return result;
+}
+
+std::string makeDbPath(const std::string & name)
+{
+    string dir = tmpDir;
+    string path = dir + "/" + name;
+    int res = system(("rm -rf " + path + " && mkdir -p " + dir).c_str());
+    if (res != 0)
+        throw ML::Exception("couldn't clear " + path);
+    return path;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_write_behind_crash_recovery )
+{
+    string path = makeDbPath("write_behind_crash_recovery");
+    int numEntries = 10000;
+
+    pid_t pid = fork();
+    BOOST_REQUIRE(pid != -1);
+
+    if (pid == 0) {
+        // Child: write everything, wait for the writer to get it onto
+        // disk and then die without any chance to clean up.
+        auto persistence = openPersistence(path);
+        for (unsigned i = 0;  i < numEntries;  ++i)
+            persistence->set(makeKey(i, 1), Value(i));
+        for (unsigned i = 0;  i < numEntries;  i += 10)
+            persistence->erase(makeKey(i, 1));
+        for (unsigned i = 1;  i < numEntries;  i += 10)
+            persistence->set(makeKey(i, 1), Value(-(int)i));
+        persistence->sync();
+
+        kill(getpid(), SIGKILL);
+        _exit(1);  // not reached
+    }
+
+    int status;
+    BOOST_REQUIRE_EQUAL(waitpid(pid, &status, 0), pid);
+    BOOST_REQUIRE(WIFSIGNALED(status));
+    BOOST_CHECK_EQUAL(WTERMSIG(status), SIGKILL);
+
+    // Reload what the dead process left behind
+    auto persistence = openPersistence(path);
+    std::map<Key, int> loaded;
+    persistence->scan([&] (Key & key, Value & value)
+                      {
+                          loaded[key] = value.i;
+                      });
+
+    BOOST_CHECK_EQUAL(loaded.size(), numEntries - numEntries / 10);
+    for (unsigned i = 0;  i < numEntries;  ++i) {
+        auto it = loaded.find(makeKey(i, 1));
+        if (i % 10 == 0)
+            BOOST_CHECK(it == loaded.end());
+        else if (i % 10 == 1) {
+            BOOST_REQUIRE(it != loaded.end());
+            BOOST_CHECK_EQUAL(it->second, -(int)i);
+        }
+        else {
+            BOOST_REQUIRE(it != loaded.end());
+            BOOST_CHECK_EQUAL(it->second, (int)i);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_write_behind_pending_store )
+{
+    string path = makeDbPath("write_behind_pending_store");
+
+    Date now = Date::now();
+
+    {
+        PendingStore<Value, Persistence> store;
+        store.initFromStore(openPersistence(path),
+                            [] (Key &, Value &, Date &) { return true; },
+                            now.plusSeconds(60));
+        BOOST_CHECK_EQUAL(store.size(), 0);
+
+        for (unsigned i = 0;  i < 100;  ++i)
+            store.insert(makeKey(i, 1), Value(i), now.plusSeconds(60));
+        for (unsigned i = 0;  i < 50;  ++i)
+            store.pop(makeKey(i, 1));
+
+        // Closing flushes the queue
+        store.persistence->close();
+    }
+
+    PendingStore<Value, Persistence> store;
+    store.initFromStore(openPersistence(path),
+                        [] (Key &, Value &, Date &) { return true; },
+                        now.plusSeconds(60));
+    BOOST_CHECK_EQUAL(store.size(), 50);
+    BOOST_CHECK(!store.count(makeKey(0, 1)));
+    BOOST_CHECK_EQUAL(store.get(makeKey(99, 1)).i, 99);
+}
+
+BOOST_AUTO_TEST_CASE( test_write_behind_bad_entries )
+{
+    string path = makeDbPath("write_behind_bad_entries");
+
+    auto persistence = openPersistence(path);
+
+    // A key that can't be stored is refused on the caller's thread
+    auto stringifyKey = persistence->stringifyKey;
+    persistence->stringifyKey = [=] (const Key & key)
+        {
+            if (!key.second)
+                throw ML::Exception("attempt to store null ID");
+            return stringifyKey(key);
+        };
+
+    // A value that can't be stored is skipped by the writer thread
+    auto stringifyValue = persistence->stringifyValue;
+    persistence->stringifyValue = [=] (const Value & value)
+        {
+            if (value.i < 0)
+                throw ML::Exception("bad value");
+            return stringifyValue(value);
+        };
+
+    persistence->set(makeKey(1, 1), Value(1));
+    persistence->set(make_pair(Id(2), Id()), Value(2));
+    persistence->set(makeKey(3, 1), Value(-3));
+    persistence->set(makeKey(4, 1), Value(4));
+    persistence->sync();
+
+    BOOST_CHECK_EQUAL(persistence->numRejected, 1);
+    BOOST_CHECK_EQUAL(persistence->numFailed, 1);
+    BOOST_CHECK_EQUAL(persistence->numQueued, 3);
+
+    std::map<Key, int> loaded;
+    persistence->scan([&] (Key & key, Value & value)
+                      {
+                          loaded[key] = value.i;
+                      });
+
+    BOOST_CHECK_EQUAL(loaded.size(), 2);
+    BOOST_CHECK_EQUAL(loaded[makeKey(1, 1)], 1);
+    BOOST_CHECK_EQUAL(loaded[makeKey(4, 1)], 4);
+}
+
+/* Events per second through a PendingStore with and without the write
+   behind persistence.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_write_behind_persistence )
+{
+    if (!runBenchmarks)
+        return;
+
+    int numEvents = 500000;
+
+    // Each event is a submission (insert) followed later on by its result
+    // (pop), which is what the post auction loop does for every bid.
+    auto runEvents = [&] (PendingStore<Value, Persistence> & store)
+        {
+            Date before = Date::now();
+            Date timeout = before.plusSeconds(60);
+            for (unsigned i = 0;  i < numEvents;  ++i) {
+                store.insert(makeKey(i, 1), Value(i), timeout);
+                if (i >= 1000)
+                    store.pop(makeKey(i - 1000, 1));
+            }
+            return Date::now().secondsSince(before);
+        };
+
+    double offTime, onTime, flushTime;
+    uint64_t numBlocked, numBatches;
+
+    {
+        PendingStore<Value, Persistence> store;
+        offTime = runEvents(store);
+    }
+
+    {
+        PendingStore<Value, Persistence> store;
+        string path = makeDbPath("write_behind_benchmark");
+        store.initFromStore(openPersistence(path),
+                            [] (Key &, Value &, Date &) { return true; },
+                            Date::now());
+        onTime = runEvents(store);
+
+        Date before = Date::now();
+        store.persistence->sync();
+        flushTime = Date::now().secondsSince(before);
+
+        numBlocked = store.persistence->numBlockedPushes;
+        numBatches = store.persistence->numBatches;
+    }
+
+    cerr << format("persistence off: %8.0f events/sec", numEvents / offTime)
+         << endl;
+    cerr << format("persistence on:  %8.0f events/sec "
+                   "(%lld blocked pushes, %lld batches, "
+                   "%.3fs to drain the queue)",
+                   numEvents / onTime, (long long)numBlocked,
+                   (long long)numBatches, flushTime)
+         << endl;
+}
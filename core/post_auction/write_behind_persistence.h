@@ -0,0 +1,287 @@
+/* write_behind_persistence.h                                      -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Persistence for the post auction loop's pending state that writes to
+   leveldb from a background thread.
+*/
+
+#ifndef __post_auction__write_behind_persistence_h__
+#define __post_auction__write_behind_persistence_h__
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "jml/utils/ring_buffer.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/timers.h"
+#include "soa/types/date.h"
+#include <boost/thread/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* WRITE BEHIND PERSISTENCE                                                  */
+/*****************************************************************************/
+
+/** Replacement for PendingPersistenceT<Key, Value> on top of leveldb that
+    keeps the disk (and the serialization of the values) out of the thread
+    that owns the PendingStore.
+
+    set() and erase() serialize the key, which also checks that it can be
+    stored, and move the value into a bounded queue.  A background thread
+    drains the queue, serializes the values and commits them to leveldb in
+    write batches of up to maxBatchSize operations.
+
+    Entries whose key can't be serialized are never queued; they're counted
+    in numRejected.  Those whose value can't be serialized are skipped by
+    the writer and counted in numFailed.
+
+    When the queue is full the caller has to wait for the writer to catch
+    up; this is counted in numBlockedPushes and blockedMicros so that it
+    can be monitored.
+
+    set() and erase() may be called from several threads, but all of the
+    operations on any given key must come from the same thread for them to
+    be written in order.
+*/
+
+template<typename Key, typename Value>
+struct WriteBehindPersistence {
+
+    WriteBehindPersistence(size_t queueSize = 65536,
+                           size_t maxBatchSize = 1024)
+        : numQueued(0), numWritten(0), numBatches(0),
+          numBlockedPushes(0), blockedMicros(0),
+          numRejected(0), numFailed(0),
+          maxBatchSize(maxBatchSize), queue(queueSize), shutdown_(false)
+    {
+    }
+
+    ~WriteBehindPersistence()
+    {
+        close();
+    }
+
+    std::function<std::string (const Key &)> stringifyKey;
+    std::function<Key (const std::string &)> unstringifyKey;
+    std::function<std::string (const Value &)> stringifyValue;
+    std::function<Value (const std::string &)> unstringifyValue;
+
+    /** Open (creating if necessary) the leveldb database at the given path
+        and start the writer thread. */
+    void open(const std::string & path)
+    {
+        if (db)
+            throw ML::Exception("WriteBehindPersistence already open");
+
+        leveldb::Options options;
+        options.create_if_missing = true;
+
+        leveldb::DB * newDb;
+        leveldb::Status status = leveldb::DB::Open(options, path, &newDb);
+        if (!status.ok())
+            throw ML::Exception("opening leveldb %s: %s",
+                                path.c_str(), status.ToString().c_str());
+        db.reset(newDb);
+
+        shutdown_ = false;
+        writerThread.reset
+            (new boost::thread(std::bind(&WriteBehindPersistence::runWriter,
+                                         this)));
+    }
+
+    /** Write out everything that's queued, stop the writer thread and
+        close the database. */
+    void close()
+    {
+        if (!writerThread)
+            return;
+        shutdown_ = true;
+        writerThread->join();
+        writerThread.reset();
+        db.reset();
+    }
+
+    /** Queue the given entry to be written.  The value is taken by value
+        so that callers who don't need it any more can move it in.
+    */
+    void set(const Key & key, Value value)
+    {
+        Delta delta;
+        if (!makeKey(key, delta))
+            return;
+        delta.value = std::make_shared<const Value>(std::move(value));
+        push(delta);
+    }
+
+    /** Queue the given entry to be erased. */
+    void erase(const Key & key)
+    {
+        Delta delta;
+        if (!makeKey(key, delta))
+            return;
+        push(delta);
+    }
+
+    /** Call the given function on each entry in the database.  Should only
+        be done on startup, before anything is written.
+    */
+    template<typename OnEntry>
+    void scan(OnEntry onEntry)
+    {
+        std::unique_ptr<leveldb::Iterator> it
+            (db->NewIterator(leveldb::ReadOptions()));
+
+        for (it->SeekToFirst();  it->Valid();  it->Next()) {
+            Key key = unstringifyKey(it->key().ToString());
+            Value value = unstringifyValue(it->value().ToString());
+            onEntry(key, value);
+        }
+
+        if (!it->status().ok())
+            throw ML::Exception("scanning leveldb: %s",
+                                it->status().ToString().c_str());
+    }
+
+    /** Wait until everything that was queued before the call has been
+        committed to leveldb. */
+    void sync()
+    {
+        uint64_t target = numQueued;
+        while (numWritten < target)
+            ML::sleep(0.001);
+    }
+
+    /** Compact the database.  Safe to call while writes are happening. */
+    void compact()
+    {
+        db->CompactRange(nullptr, nullptr);
+    }
+
+    /** Approximate size on disk of the database. */
+    uint64_t getDbSize()
+    {
+        leveldb::Range range("", "\xff\xff\xff\xff");
+        uint64_t size = 0;
+        db->GetApproximateSizes(&range, 1, &size);
+        return size;
+    }
+
+    /** Number of operations waiting to be written. */
+    size_t queueDepth() const
+    {
+        return numQueued - numWritten;
+    }
+
+    uint64_t numQueued;          ///< Operations queued
+    uint64_t numWritten;         ///< Operations committed to leveldb
+    uint64_t numBatches;         ///< Write batches committed
+    uint64_t numBlockedPushes;   ///< Pushes that had to wait for the writer
+    uint64_t blockedMicros;      ///< Time spent waiting for the writer
+    uint64_t numRejected;        ///< Operations whose key couldn't be stored
+    uint64_t numFailed;          ///< Values that couldn't be serialized
+
+private:
+    /** What's queued for each operation.  The value is shared so that
+        putting it into and taking it out of the ring buffer doesn't copy
+        it; it's null for an erase.
+    */
+    struct Delta {
+        std::string key;
+        std::shared_ptr<const Value> value;
+    };
+
+    /** Serialize the key into the delta on the caller's thread.  Keys that
+        can't be serialized (for example with a null id) are only counted
+        rather than being allowed to reach the writer thread.  They can
+        come in at the rate of the events (an early WIN for a null spot
+        does it), so they aren't logged one by one.
+    */
+    bool makeKey(const Key & key, Delta & delta)
+    {
+        try {
+            delta.key = stringifyKey(key);
+            return true;
+        } catch (const std::exception &) {
+            ML::atomic_inc(numRejected);
+            return false;
+        }
+    }
+
+    void push(const Delta & delta)
+    {
+        if (!writerThread)
+            throw ML::Exception("WriteBehindPersistence is not open");
+
+        ML::atomic_inc(numQueued);
+        if (queue.tryPush(delta))
+            return;
+
+        Datacratic::Date before = Datacratic::Date::now();
+        queue.push(delta);
+        ML::atomic_inc(numBlockedPushes);
+        ML::atomic_add(blockedMicros,
+                       (uint64_t)(1000000 * Datacratic::Date::now()
+                                  .secondsSince(before)));
+    }
+
+    void runWriter()
+    {
+        leveldb::WriteOptions options;
+
+        for (;;) {
+            Delta delta;
+            if (!queue.tryPop(delta, 0.1)) {
+                if (shutdown_)
+                    break;
+                continue;
+            }
+
+            leveldb::WriteBatch batch;
+            size_t numInBatch = 0;
+
+            do {
+                ++numInBatch;
+                if (!delta.value) {
+                    batch.Delete(delta.key);
+                    continue;
+                }
+
+                // Nothing thrown here can be allowed to escape the thread
+                try {
+                    batch.Put(delta.key, stringifyValue(*delta.value));
+                } catch (const std::exception & exc) {
+                    ML::atomic_inc(numFailed);
+                    std::cerr << "WriteBehindPersistence: not persisting "
+                              << "entry: " << exc.what() << std::endl;
+                }
+            } while (numInBatch < maxBatchSize && queue.tryPop(delta));
+
+            leveldb::Status status = db->Write(options, &batch);
+            if (!status.ok())
+                std::cerr << "WriteBehindPersistence: error writing to "
+                          << "leveldb: " << status.ToString() << std::endl;
+
+            ML::atomic_add(numWritten, numInBatch);
+            ML::atomic_inc(numBatches);
+        }
+    }
+
+    size_t maxBatchSize;
+    ML::RingBufferSRMW<Delta> queue;
+    std::unique_ptr<leveldb::DB> db;
+    volatile bool shutdown_;
+    boost::scoped_ptr<boost::thread> writerThread;
+};
+
+
+} // namespace RTBKIT
+
+#endif /* __post_auction__write_behind_persistence_h__ */
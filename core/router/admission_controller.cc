@@ -0,0 +1,137 @@
+/* admission_controller.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Admission control for the router.
+*/
+
+#include "admission_controller.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/exception.h"
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* ADMISSION CONTROLLER                                                      */
+/*****************************************************************************/
+
+const char *
+AdmissionController::
+print(Stage stage)
+{
+    switch (stage) {
+    case STAGE_AUGMENTATION:  return "augmentation";
+    case STAGE_START_BIDDING: return "startBidding";
+    case STAGE_AGENT:         return "agent";
+    default:
+        throw ML::Exception("unknown admission stage %d", stage);
+    }
+}
+
+const char *
+AdmissionController::
+print(DropReason reason)
+{
+    switch (reason) {
+    case DROP_NONE:       return "none";
+    case DROP_DEADLINE:   return "deadline";
+    case DROP_NO_BIDDERS: return "noBidders";
+    default:
+        throw ML::Exception("unknown admission drop reason %d", reason);
+    }
+}
+
+AdmissionController::
+AdmissionController(double updateInterval, double safetyMargin)
+    : numAdmitted(0),
+      updateInterval(updateInterval),
+      safetyMargin_(safetyMargin),
+      enabled_(true),
+      numBidders_(0),
+      expectedLatency_(0.0)
+{
+    for (unsigned i = 0;  i < NUM_DROP_REASONS;  ++i)
+        numDropped[i] = 0;
+}
+
+void
+AdmissionController::
+recordStageDelay(Stage stage, double seconds)
+{
+    StageInfo & info = stages[stage];
+    info.total += std::max(0.0, seconds);
+    ++info.count;
+}
+
+bool
+AdmissionController::
+update(Date now)
+{
+    if (lastUpdate != Date()
+        && now.secondsSince(lastUpdate) < updateInterval)
+        return false;
+    lastUpdate = now;
+
+    double latency = 0.0;
+
+    for (unsigned i = 0;  i < NUM_STAGES;  ++i) {
+        StageInfo & info = stages[i];
+
+        // A stage without any samples decays towards zero.  Otherwise, once
+        // we're dropping everything we'd never find out that the delays
+        // had gone away again.
+        double mean = info.count ? info.total / info.count : 0.0;
+        info.estimate = 0.5 * info.estimate + 0.5 * mean;
+        info.total = 0.0;
+        info.count = 0;
+
+        latency += info.estimate;
+    }
+
+    expectedLatency_ = latency;
+    return true;
+}
+
+AdmissionController::DropReason
+AdmissionController::
+admit(Date now, Date deadline)
+{
+    DropReason result = DROP_NONE;
+
+    if (!enabled_)
+        result = DROP_NONE;
+    else if (numBidders_ == 0)
+        result = DROP_NO_BIDDERS;
+    else if (now.plusSeconds(expectedLatency_ + safetyMargin_) > deadline)
+        result = DROP_DEADLINE;
+
+    if (result == DROP_NONE)
+        ML::atomic_inc(numAdmitted);
+    else ML::atomic_inc(numDropped[result]);
+
+    return result;
+}
+
+Json::Value
+AdmissionController::
+toJson() const
+{
+    Json::Value result;
+    result["enabled"] = enabled_;
+    result["numBidders"] = (double)numBidders_;
+    result["expectedLatencyMs"] = expectedLatency_ * 1000.0;
+    for (unsigned i = 0;  i < NUM_STAGES;  ++i)
+        result["stageDelayMs"][print((Stage)i)] = stages[i].estimate * 1000.0;
+    result["numAdmitted"] = (double)numAdmitted;
+    for (unsigned i = 1;  i < NUM_DROP_REASONS;  ++i)
+        result["numDropped"][print((DropReason)i)]
+            = (double)numDropped[i];
+    return result;
+}
+
+} // namespace RTBKIT
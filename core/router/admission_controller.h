@@ -0,0 +1,125 @@
+/* admission_controller.h                                          -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Decides whether an incoming bid request can still be answered in time.
+*/
+
+#ifndef __router__admission_controller_h__
+#define __router__admission_controller_h__
+
+#include "soa/types/date.h"
+#include "soa/jsoncpp/json.h"
+#include <string>
+
+
+namespace RTBKIT {
+
+using Datacratic::Date;
+
+
+/*****************************************************************************/
+/* ADMISSION CONTROLLER                                                      */
+/*****************************************************************************/
+
+/** Admission control for the router.
+
+    The router measures how long auctions spend in each of its stages and
+    feeds the measurements in here from its main loop.  Every
+    updateInterval seconds the measurements are turned into an estimate of
+    how long an auction admitted now will take to get a bid out of the
+    agents.
+
+    The exchange connectors ask admit() about each bid request before
+    parsing it, and drop only those that can't meet their deadline with
+    the current delays, or that have nobody to bid on them.
+
+    The record*() and update() functions must all be called from the same
+    thread; admit() can be called from any thread.
+*/
+
+struct AdmissionController {
+
+    enum Stage {
+        STAGE_AUGMENTATION,  ///< Auction start until augmentation is done
+        STAGE_START_BIDDING, ///< Waiting in the router's start bidding queue
+        STAGE_AGENT,         ///< Sent to an agent until its bid comes back
+        NUM_STAGES
+    };
+
+    enum DropReason {
+        DROP_NONE,           ///< Auction was admitted
+        DROP_DEADLINE,       ///< Can't meet the deadline
+        DROP_NO_BIDDERS,     ///< No agent could bid on it
+        NUM_DROP_REASONS
+    };
+
+    static const char * print(Stage stage);
+    static const char * print(DropReason reason);
+
+    AdmissionController(double updateInterval = 0.1,
+                        double safetyMargin = 0.002);
+
+    /** Turn admission control on or off.  When off, everything is
+        admitted. */
+    void setEnabled(bool enabled) { enabled_ = enabled; }
+    bool enabled() const { return enabled_; }
+
+    /** Extra time, in seconds, that an auction must have on top of the
+        expected latency to be admitted. */
+    void setSafetyMargin(double seconds) { safetyMargin_ = seconds; }
+
+    /** Record that an auction spent the given number of seconds in the
+        given stage. */
+    void recordStageDelay(Stage stage, double seconds);
+
+    /** Record the number of agents that could possibly bid. */
+    void setNumBidders(size_t numBidders) { numBidders_ = numBidders; }
+
+    /** Publish a new latency estimate if updateInterval has passed since
+        the last one.  Returns true if one was published.
+    */
+    bool update(Date now = Date::now());
+
+    /** Should an auction that arrives at now and that must be answered by
+        deadline be started?  Returns DROP_NONE if it should, or the reason
+        it should be dropped otherwise.
+    */
+    DropReason admit(Date now, Date deadline);
+
+    /** Latest estimate, in seconds, of the time between an auction being
+        admitted and the agents' bids coming back. */
+    double expectedLatency() const { return expectedLatency_; }
+
+    /** Latest estimate of the delay in the given stage. */
+    double stageDelay(Stage stage) const { return stages[stage].estimate; }
+
+    uint64_t numAdmitted;                  ///< Auctions let through
+    uint64_t numDropped[NUM_DROP_REASONS]; ///< Auctions dropped, by reason
+
+    Json::Value toJson() const;
+
+private:
+    struct StageInfo {
+        StageInfo()
+            : estimate(0.0), total(0.0), count(0)
+        {
+        }
+
+        double estimate;   ///< Smoothed delay
+        double total;      ///< Delays recorded since the last update
+        uint64_t count;    ///< Number recorded since the last update
+    };
+
+    StageInfo stages[NUM_STAGES];
+
+    double updateInterval;
+    volatile double safetyMargin_;
+    volatile bool enabled_;
+    volatile size_t numBidders_;
+    volatile double expectedLatency_;
+    Date lastUpdate;
+};
+
+} // namespace RTBKIT
+
+#endif /* __router__admission_controller_h__ */
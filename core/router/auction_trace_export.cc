@@ -0,0 +1,100 @@
+/* auction_trace_export.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Tool to turn auction traces dumped by the /trace REST endpoints of the
+   RTBkit processes into a file that can be loaded into chrome://tracing.
+*/
+
+#include "rtbkit/common/auction_trace.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/arch/exception.h"
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/positional_options.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include <string>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+int main(int argc, char ** argv)
+{
+    using namespace boost::program_options;
+
+    vector<string> inputFiles;
+    string outputFile = "-";
+    string auctionId;
+    string processName = "rtbkit";
+
+    options_description options("Options");
+    options.add_options()
+        ("input,i", value<vector<string> >(&inputFiles),
+         "trace dumps to read (from /trace or /trace/<auctionId>/records); "
+         "the records of all of them are merged")
+        ("output,o", value<string>(&outputFile),
+         "file to write the Chrome trace to (default: stdout)")
+        ("auction,a", value<string>(&auctionId),
+         "only export the trace of the given auction")
+        ("process-name", value<string>(&processName),
+         "name of the process in the trace")
+        ("help,h", "print this message");
+
+    positional_options_description positional;
+    positional.add("input", -1);
+
+    variables_map vm;
+    store(command_line_parser(argc, argv)
+          .options(options)
+          .positional(positional)
+          .run(),
+          vm);
+    notify(vm);
+
+    if (vm.count("help") || inputFiles.empty()) {
+        cerr << options << endl;
+        return 1;
+    }
+
+    uint64_t auctionHash = auctionId.empty() ? 0 : Id(auctionId).hash();
+
+    vector<AuctionTraceRecord> records;
+
+    for (auto & filename: inputFiles) {
+        ML::filter_istream stream(filename);
+        string contents((istreambuf_iterator<char>(stream)),
+                        istreambuf_iterator<char>());
+
+        for (auto & r: AuctionTrace::fromJson(Json::parse(contents))) {
+            if (!auctionId.empty() && r.auction != auctionHash)
+                continue;
+            records.push_back(r);
+        }
+    }
+
+    auto byTime = [] (const AuctionTraceRecord & r1,
+                      const AuctionTraceRecord & r2)
+        {
+            return r1.timestamp < r2.timestamp;
+        };
+
+    std::stable_sort(records.begin(), records.end(), byTime);
+
+    cerr << "exporting " << records.size() << " trace records" << endl;
+
+    ML::filter_ostream output(outputFile);
+    output << boost::trim_copy(AuctionTrace::toChromeTrace(records, processName)
+                               .toString())
+           << endl;
+
+    return 0;
+}
@@ -14,7 +14,12 @@
 #include "soa/service/zmq_utils.h"
 #include <iostream>
 #include <boost/make_shared.hpp>
+#include <boost/algorithm/string.hpp>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
 #include "rtbkit/core/agent_configuration/agent_config.h"
+#include "rtbkit/common/auction_trace.h"
 
 
 using namespace std;
@@ -24,6 +29,153 @@ using namespace ML;
 
 namespace RTBKIT {
 
+namespace {
+
+/** Bid request format of the binary serialization of a BidRequest. */
+const std::string binaryFormat("datacratic-binary");
+
+} // file scope
+
+
+/*****************************************************************************/
+/* AUGMENTOR LATENCY                                                         */
+/*****************************************************************************/
+
+AugmentorLatency::
+AugmentorLatency(double percentile)
+    : percentile(percentile),
+      numSamples(0), nextSample(0), sinceUpdate(0), expected_(0.0)
+{
+}
+
+void
+AugmentorLatency::
+responseReceived(double seconds)
+{
+    samples[nextSample] = seconds;
+    nextSample = (nextSample + 1) % NUM_SAMPLES;
+    if (numSamples < NUM_SAMPLES)
+        ++numSamples;
+
+    if (++sinceUpdate >= UPDATE_EVERY && numSamples >= MIN_SAMPLES)
+        update();
+}
+
+void
+AugmentorLatency::
+update()
+{
+    double sorted[NUM_SAMPLES];
+    std::copy(samples, samples + numSamples, sorted);
+
+    unsigned n = std::min<unsigned>(numSamples * percentile, numSamples - 1);
+    std::nth_element(sorted, sorted + n, sorted + numSamples);
+    expected_ = sorted[n];
+    sinceUpdate = 0;
+}
+
+
+/*****************************************************************************/
+/* AUGMENTOR INFO                                                            */
+/*****************************************************************************/
+
+AugmentorInstance *
+AugmentorInfo::
+findInstance(const std::string & addr)
+{
+    for (auto & instance: instances)
+        if (instance.addr == addr)
+            return &instance;
+    return 0;
+}
+
+AugmentorInstance *
+AugmentorInfo::
+leastLoaded(const std::string & except)
+{
+    AugmentorInstance * result = 0;
+    for (auto & instance: instances) {
+        if (instance.addr == except)
+            continue;
+        if (!result || instance.inFlight.size() < result->inFlight.size())
+            result = &instance;
+    }
+    return result;
+}
+
+AugmentorInstance *
+AugmentorInfo::
+instanceFor(const Id & auctionId)
+{
+    for (auto & instance: instances)
+        if (instance.inFlight.count(auctionId))
+            return &instance;
+    return 0;
+}
+
+void
+AugmentorInfo::
+updateNumInFlight()
+{
+    AugmentorInstance * instance = leastLoaded();
+    numInFlight = instance ? instance->inFlight.size() : 0;
+}
+
+
+/*****************************************************************************/
+/* HEDGE TIMER                                                               */
+/*****************************************************************************/
+
+HedgeTimer::
+HedgeTimer()
+    : fd(timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC))
+{
+    if (fd == -1)
+        throw ML::Exception(errno, "timerfd_create");
+}
+
+HedgeTimer::
+~HedgeTimer()
+{
+    ::close(fd);
+}
+
+void
+HedgeTimer::
+arm(Date when)
+{
+    // Date is on the same clock as CLOCK_REALTIME.  A zero time would
+    // disarm the timer, so the past is always at least a nanosecond.
+    double seconds = std::max(when.secondsSinceEpoch(), 1e-9);
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec = (time_t)seconds;
+    spec.it_value.tv_nsec
+        = std::max<long>(1, (seconds - spec.it_value.tv_sec) * 1000000000);
+
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, 0) == -1)
+        throw ML::Exception(errno, "timerfd_settime");
+}
+
+bool
+HedgeTimer::
+processOne()
+{
+    uint64_t numExpiries;
+    ssize_t res = ::read(fd, &numExpiries, sizeof(numExpiries));
+    if (res == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return false;
+        throw ML::Exception(errno, "HedgeTimer read");
+    }
+
+    if (onTimer)
+        onTimer();
+    return false;
+}
+
 
 /*****************************************************************************/
 /* AUGMENTATION LOOP                                                         */
@@ -35,6 +187,8 @@ AugmentationLoop(ServiceBase & parent,
     : ServiceBase(name, parent),
       allAugmentors(0),
       idle_(1),
+      hedgePercentile(0.0),
+      binaryRequests(false),
       inbox(2048),
       toAugmentors(getZmqContext())
 {
@@ -47,6 +201,8 @@ AugmentationLoop(std::shared_ptr<ServiceProxies> proxies,
     : ServiceBase(name, proxies),
       allAugmentors(0),
       idle_(1),
+      hedgePercentile(0.0),
+      binaryRequests(false),
       inbox(2048),
       toAugmentors(getZmqContext())
 {
@@ -83,6 +239,7 @@ init()
     toAugmentors.onDisconnection = [=] (const std::string & client)
         {
             cerr << "augmentor " << client << " has disconnected" << endl;
+            removeInstance(client);
         };
 
     inbox.onEvent = [&] (const std::shared_ptr<Entry> & entry)
@@ -94,58 +251,68 @@ init()
 
             //cerr << "got lock on inbox" << endl;
 
+            const Id & auctionId = entry->info->auction->id;
+
             // TODO: wake up loop if slower...
             // TODO: DRY with other function...
-            augmenting.insert(entry->info->auction->id, entry,
-                              entry->timeout);
+            augmenting.insert(auctionId, entry, entry->timeout);
+
+            std::string agents = encodeAgents(*entry);
+            Projections projections;
+            vector<string> unavailable;
 
             for (auto it = entry->outstanding.begin(),
                      end = entry->outstanding.end();
                  it != end;  ++it) {
 
-                auto & aug = *augmentors[*it];
+                // It may have gone away since augment() saw it
+                auto found = augmentors.find(*it);
+                AugmentorInstance * instance = 0;
+                if (found != augmentors.end())
+                    instance = found->second->leastLoaded();
+                if (!instance) {
+                    string eventName = "augmentor." + *it + ".unavailable";
+                    recordEvent(eventName.c_str());
+                    unavailable.push_back(*it);
+                    continue;
+                }
+
+                auto & aug = *found->second;
 
                 //cerr << "sending to " << *it << " at "
-                //     << aug.agentAddr << endl;
-
-                set<string> agents;
-                const auto& bidderGroups = entry->info->potentialGroups;
-
-                for (auto jt = bidderGroups.begin(), end = bidderGroups.end();
-                     jt != end; ++jt)
-                {
-                    for (auto kt = jt->begin(), end = jt->end();
-                         kt != end; ++kt)
-                    {
-                        agents.insert(kt->agent);
-                    }
-                }
+                //     << instance->addr << endl;
 
-                std::ostringstream availableAgentsStr;
-                ML::DB::Store_Writer writer(availableAgentsStr);
-                writer.save(agents);
-                        
-                // Send the message to the augmentor
-                toAugmentors.sendMessage(aug.augmentorAddr,
-                                         "AUGMENT", "1.0", *it,
-                                         entry->info->auction->id.toString(),
-                                         entry->info->auction->requestStrFormat,
-                                         entry->info->auction->requestStr,
-                                         availableAgentsStr.str(),
-                                         Date::now());
+                AuctionTrace::record(auctionId, AP_AUGMENTOR_SENT);
 
-                if (!aug.inFlight.insert
-                    (make_pair(entry->info->auction->id, now))
-                    .second) {
-                    cerr << "warning: double augment for auction "
-                         << entry->info->auction->id << endl;
-                }
-                else aug.numInFlight = aug.inFlight.size();
+                sendAugment(aug, *instance, *entry, agents, projections,
+                            now);
+                aug.updateNumInFlight();
+
+                // Hedge it if it's not answered as fast as usual
+                double hedgeAfter = aug.latency.expected();
+                if (hedgePercentile > 0.0 && aug.instances.size() > 1
+                    && hedgeAfter > 0.0
+                    && now.plusSeconds(hedgeAfter) < entry->timeout)
+                    scheduleHedge(now.plusSeconds(hedgeAfter), auctionId,
+                                  *it);
+            }
+
+            bool done = false;
+            for (auto & name: unavailable)
+                done = augmentorFinished(*entry, name);
+
+            if (done) {
+                AuctionTrace::record(auctionId, AP_AUGMENTATION_DONE);
+                auto it = augmenting.find(auctionId);
+                if (it != augmenting.end())
+                    augmenting.erase(it);
             }
-                    
+
             idle_ = 0;
         };
 
+    hedgeTimer.onTimer = [=] () { this->checkHedges(); };
+
     addSource("AugmentationLoop::inbox", inbox);
     addSource("AugmentationLoop::toAugmentors", toAugmentors);
     addPeriodic("AugmentationLoop::checkExpiries", 0.977,
@@ -156,6 +323,9 @@ void
 AugmentationLoop::
 start()
 {
+    if (hedgePercentile > 0.0)
+        addSource("AugmentationLoop::hedgeTimer", hedgeTimer);
+
     //toAugmentors.start();
     MessageLoop::start();
 }
@@ -225,6 +395,160 @@ handleAugmentorMessage(const std::vector<std::string> & message)
                              + type);
 }
 
+std::string
+AugmentationLoop::
+encodeAgents(const Entry & entry)
+{
+    set<string> agents;
+    const auto& bidderGroups = entry.info->potentialGroups;
+
+    for (auto jt = bidderGroups.begin(), end = bidderGroups.end();
+         jt != end; ++jt)
+    {
+        for (auto kt = jt->begin(), end = jt->end();
+             kt != end; ++kt)
+        {
+            agents.insert(kt->agent);
+        }
+    }
+
+    std::ostringstream availableAgentsStr;
+    ML::DB::Store_Writer writer(availableAgentsStr);
+    writer.save(agents);
+    return availableAgentsStr.str();
+}
+
+void
+AugmentationLoop::
+sendAugment(const AugmentorInfo & aug,
+            AugmentorInstance & instance,
+            const Entry & entry,
+            const std::string & agents,
+            Projections & projections,
+            Date now)
+{
+    const Auction & auction = *entry.info->auction;
+
+    // Work out what to send of the request
+    const std::string * format = &auction.requestStrFormat;
+    const std::string * request = &auction.requestStr;
+
+    if (aug.requestFields) {
+        request = 0;
+        for (auto & p: projections)
+            if (p.first == aug.requestFields)
+                request = &p.second;
+        if (!request) {
+            projections.push_back(make_pair(
+                aug.requestFields,
+                auction.request->projected(aug.requestFields)
+                    .serializeToString()));
+            request = &projections.back().second;
+        }
+        format = &binaryFormat;
+    }
+    else if (binaryRequests) {
+        format = &binaryFormat;
+        request = &auction.requestSerialized;
+    }
+
+    // Send the message to the augmentor, with the time at which we'll stop
+    // waiting for it
+    toAugmentors.sendMessage(instance.addr,
+                             "AUGMENT", "1.0", aug.name,
+                             auction.id.toString(),
+                             *format, *request,
+                             agents,
+                             Date::now(),
+                             entry.timeout);
+
+    if (!instance.inFlight.insert(make_pair(auction.id, now)).second) {
+        cerr << "warning: double augment for auction "
+             << auction.id << endl;
+    }
+}
+
+void
+AugmentationLoop::
+scheduleHedge(Date when, const Id & auctionId, const std::string & augmentor)
+{
+    if (hedgeQueue.empty() || when < hedgeQueue.begin()->first)
+        hedgeTimer.arm(when);
+    hedgeQueue.insert(make_pair(when, make_pair(auctionId, augmentor)));
+}
+
+void
+AugmentationLoop::
+checkHedges()
+{
+    Guard guard(lock);
+
+    Date now = Date::now();
+
+    while (!hedgeQueue.empty() && hedgeQueue.begin()->first <= now) {
+        Id auctionId = hedgeQueue.begin()->second.first;
+        string name = hedgeQueue.begin()->second.second;
+        hedgeQueue.erase(hedgeQueue.begin());
+
+        // Only if it's still waiting for that augmentor
+        auto it = augmenting.find(auctionId);
+        if (it == augmenting.end() || !it->second->outstanding.count(name))
+            continue;
+
+        auto found = augmentors.find(name);
+        if (found == augmentors.end())
+            continue;
+        AugmentorInfo & aug = *found->second;
+
+        AugmentorInstance * first = aug.instanceFor(auctionId);
+        AugmentorInstance * other
+            = aug.leastLoaded(first ? first->addr : "");
+        if (!other || aug.hedges.count(auctionId))
+            continue;
+
+        Projections projections;
+        sendAugment(aug, *other, *it->second, encodeAgents(*it->second),
+                    projections, now);
+        aug.updateNumInFlight();
+
+        AugmentorInfo::Hedge & hedge = aug.hedges[auctionId];
+        hedge.addr = other->addr;
+        hedge.sent = now;
+
+        string eventName = "augmentor." + name + ".hedged";
+        recordEvent(eventName.c_str());
+    }
+
+    if (!hedgeQueue.empty())
+        hedgeTimer.arm(hedgeQueue.begin()->first);
+}
+
+void
+AugmentationLoop::
+removeInstance(const std::string & addr)
+{
+    Guard guard(lock);
+
+    for (auto it = augmentors.begin();  it != augmentors.end();) {
+        AugmentorInfo & aug = *it->second;
+        for (unsigned i = 0;  i < aug.instances.size();  ++i) {
+            if (aug.instances[i].addr != addr)
+                continue;
+            aug.instances.erase(aug.instances.begin() + i);
+            aug.updateNumInFlight();
+            break;
+        }
+
+        if (aug.instances.empty()) {
+            string eventName = "augmentor." + it->first + ".disconnected";
+            recordEvent(eventName.c_str());
+            augmentors.erase(it++);
+            updateAllAugmentors();
+        }
+        else ++it;
+    }
+}
+
 void
 AugmentationLoop::
 checkExpiries()
@@ -240,31 +564,48 @@ checkExpiries()
 
         AugmentorInfo & aug = *it->second;
 
-        vector<Id> lostAuctions;
+        for (auto & instance: aug.instances) {
+            vector<Id> lostAuctions;
 
-        for (auto jt = aug.inFlight.begin(),
-                 jend = aug.inFlight.end();
-             jt != jend;  ++jt) {
-            if (now.secondsSince(jt->second) > 5.0) {
-                cerr << "warning: augmentor " << it->first
-                     << " lost auction " << jt->first
-                     << endl;
+            for (auto jt = instance.inFlight.begin(),
+                     jend = instance.inFlight.end();
+                 jt != jend;  ++jt) {
+                if (now.secondsSince(jt->second) > 5.0) {
+                    cerr << "warning: augmentor " << it->first
+                         << " at " << instance.addr
+                         << " lost auction " << jt->first
+                         << endl;
 
-                string eventName = "augmentor."
-                    + it->first + ".lostAuction";
-                recordEvent(eventName.c_str());
+                    string eventName = "augmentor."
+                        + it->first + ".lostAuction";
+                    recordEvent(eventName.c_str());
 
-                lostAuctions.push_back(jt->first);
+                    lostAuctions.push_back(jt->first);
+                }
             }
+
+            // Delete all in flight that appear to be lost
+            for (unsigned i = 0;  i < lostAuctions.size();  ++i)
+                instance.inFlight.erase(lostAuctions[i]);
         }
-                
-        // Delete all in flight that appear to be lost
-        for (unsigned i = 0;  i < lostAuctions.size();  ++i)
-            aug.inFlight.erase(lostAuctions[i]);
-                
+
+        aug.updateNumInFlight();
+
+        for (auto jt = aug.hedges.begin();  jt != aug.hedges.end();) {
+            if (now.secondsSince(jt->second.sent) > 5.0)
+                aug.hedges.erase(jt++);
+            else ++jt;
+        }
+
         string eventName = "augmentor." + it->first + ".numInFlight";
+        recordEvent(eventName.c_str(), ET_LEVEL, aug.numInFlight);
+
+        eventName = "augmentor." + it->first + ".numInstances";
+        recordEvent(eventName.c_str(), ET_LEVEL, aug.instances.size());
+
+        eventName = "augmentor." + it->first + ".expectedMs";
         recordEvent(eventName.c_str(), ET_LEVEL,
-                    aug.inFlight.size());
+                    aug.latency.expected() * 1000.0);
     }
     
 #if 0
@@ -295,6 +636,18 @@ checkExpiries()
                 string eventName = "augmentor." + *it
                     + ".expiredTooLate";
                 recordEvent(eventName.c_str(), ET_COUNT);
+
+                // It took at least until the timeout, which needs to be in
+                // the latency estimate along with the responses
+                auto found = augmentors.find(*it);
+                if (found == augmentors.end())
+                    continue;
+                AugmentorInfo & aug = *found->second;
+                AugmentorInstance * instance = aug.instanceFor(id);
+                if (instance)
+                    aug.latency.requestExpired
+                        (entry->timeout.secondsSince
+                         (instance->inFlight[id]));
             }
                 
             this->augmentationExpired(id, *entry);
@@ -377,12 +730,14 @@ augment(const std::shared_ptr<AugmentationInfo> & info,
     // Now go through and find all of the bidders
     for (unsigned i = 0;  i < info->potentialGroups.size();  ++i) {
         const GroupPotentialBidders & group = info->potentialGroups[i];
+        std::set<std::string> & groupAugmentors = entry->waiting[i];
         for (unsigned j = 0;  j < group.size();  ++j) {
             const PotentialBidder & bidder = group[j];
             const AgentConfig & config = *bidder.config;
             for (unsigned k = 0;  k < config.augmentations.size();  ++k) {
                 const std::string & name = config.augmentations[k].name;
                 augmentors.insert(name);
+                groupAugmentors.insert(name);
             }
         }
     }
@@ -451,11 +806,26 @@ augment(const std::shared_ptr<AugmentationInfo> & info,
     }
 #endif
 
+    AuctionTrace::record(info->auction->id, AP_AUGMENTATION_START, -1,
+                         entry->outstanding.size());
+
     if (entry->outstanding.empty()) {
         // No augmentors required... run the auction straight away
+        AuctionTrace::record(info->auction->id, AP_AUGMENTATION_DONE);
         onFinished(info);
     }
     else {
+        // Groups only wait for the augmentors that will be asked, and those
+        // that don't need any can start bidding straight away
+        for (auto & group: entry->waiting) {
+            for (auto it = group.second.begin();  it != group.second.end();) {
+                if (entry->outstanding.count(*it))
+                    ++it;
+                else group.second.erase(it++);
+            }
+        }
+        passOnGroups(*entry, false);
+
         //cerr << "putting in inbox" << endl;
         inbox.push(entry);
 
@@ -495,8 +865,8 @@ void
 AugmentationLoop::
 doConfig(const std::vector<std::string> & message)
 {
-    if (message.size() != 4)
-        throw ML::Exception("config message has wrong size: %zd vs 4",
+    if (message.size() != 4 && message.size() != 5)
+        throw ML::Exception("config message has wrong size: %zd vs 4 or 5",
                             message.size());
 
     const string & augmentorAddr = message[0];
@@ -506,39 +876,46 @@ doConfig(const std::vector<std::string> & message)
     if (version != "1.0")
         throw ML::Exception("unknown version for config message");
 
+    // Optional list of the fields of the bid request that it needs
+    uint32_t requestFields = 0;
+    if (message.size() == 5) {
+        vector<string> fields;
+        boost::split(fields, message[4], boost::is_any_of(","));
+        requestFields = BidRequest::parseFields(fields);
+    }
+
     //cerr << "configuring augmentor " << name << " on " << connectTo
     //     << endl;
 
     string eventName = "augmentor." + name + ".configured";
     recordEvent(eventName.c_str());
 
-    auto newInfo = std::make_shared<AugmentorInfo>();
-    newInfo->name = name;
-    newInfo->augmentorAddr = augmentorAddr;
-
     //cerr << "connecting on " << connectTo << endl;
     //info->connection();
 
-    if (augmentors.count(name)) {
-        // Grab the old version
-        auto oldInfo = augmentors[name];
-
-        // There was an old entry... wait until nobody is using it
-
-        // First unpublish the entry
-        updateAllAugmentors();
-
-        // Now wait until nothing else can see it
-        allAugmentorsGc.deferBarrier();
-
-        augmentors.erase(name);
-
-        //cerr << "  done removing old version" << endl;
+    // Other instances of the same augmentor are added to it.  The augmentor
+    // structures are only modified under the lock, so they can be changed
+    // in place.
+    auto & info = augmentors[name];
+    bool isNew = !info;
+    if (isNew) {
+        info = std::make_shared<AugmentorInfo>();
+        info->name = name;
+        if (hedgePercentile > 0.0)
+            info->latency = AugmentorLatency(hedgePercentile);
     }
 
-    augmentors[name] = newInfo;
+    info->requestFields = requestFields;
 
-    updateAllAugmentors();
+    // An instance that configures again starts over
+    AugmentorInstance * instance = info->findInstance(augmentorAddr);
+    if (instance)
+        *instance = AugmentorInstance(augmentorAddr);
+    else info->instances.push_back(AugmentorInstance(augmentorAddr));
+    info->updateNumInFlight();
+
+    if (isNew)
+        updateAllAugmentors();
 
     toAugmentors.sendMessage(augmentorAddr, "CONFIGOK");
 
@@ -559,10 +936,13 @@ doResponse(const std::vector<std::string> & message)
         throw ML::Exception("unknown response version");
     Date startTime = Date::parseSecondsSinceEpoch(message[3]);
 
+    const string & augmentorAddr = message[0];
     Id id(message[4]);
     const std::string & augmentor = message[5];
     const std::string & augmentation = message[6];
 
+    Date now = Date::now();
+
     AugmentationList augmentationList;
     if (augmentation != "" && augmentation != "null") {
         try {
@@ -578,8 +958,10 @@ doResponse(const std::vector<std::string> & message)
         }
     }
 
+    double timeTaken = startTime.secondsUntil(now);
+
     {
-        double timeTakenMs = startTime.secondsUntil(Date::now()) * 1000.0;
+        double timeTakenMs = timeTaken * 1000.0;
         string eventName = "augmentor." + augmentor + ".timeTakenMs";
         recordEvent(eventName.c_str(), ET_OUTCOME, timeTakenMs);
     }
@@ -599,10 +981,37 @@ doResponse(const std::vector<std::string> & message)
     // Modify the augmentor data structures
     //Guard guard(lock);
 
-    if (augmentors.count(augmentor)) {
-        auto & entry = *augmentors[augmentor];
-        entry.inFlight.erase(id);
-        entry.numInFlight = entry.inFlight.size();
+    auto found = augmentors.find(augmentor);
+    if (found != augmentors.end()) {
+        AugmentorInfo & aug = *found->second;
+        aug.latency.responseReceived(timeTaken);
+
+        AugmentorInstance * instance = aug.findInstance(augmentorAddr);
+        if (instance)
+            instance->inFlight.erase(id);
+        aug.updateNumInFlight();
+
+        auto hedge = aug.hedges.find(id);
+        if (hedge != aug.hedges.end()) {
+            AugmentorInfo::Hedge & h = hedge->second;
+            if (h.firstResponse == Date()) {
+                h.firstResponse = now;
+                h.hedgeWon = (augmentorAddr == h.addr);
+                string eventName = "augmentor." + augmentor
+                    + (h.hedgeWon ? ".hedgeWon" : ".hedgeLost");
+                recordEvent(eventName.c_str());
+            }
+            else {
+                // Both have answered; record how much sooner the hedge did
+                if (h.hedgeWon) {
+                    string eventName = "augmentor." + augmentor
+                        + ".hedgeSavedMs";
+                    recordEvent(eventName.c_str(), ET_OUTCOME,
+                                h.firstResponse.secondsUntil(now) * 1000.0);
+                }
+                aug.hedges.erase(hedge);
+            }
+        }
     }
 
     auto it = augmenting.find(id);
@@ -614,20 +1023,85 @@ doResponse(const std::vector<std::string> & message)
         return;
     }
 
-    it->second->info->auction->augmentations.mergeWith(augmentationList);
+    // The first response wins when a request was hedged
+    if (!it->second->outstanding.count(augmentor)) {
+        string eventName = "augmentor." + augmentor + ".duplicateResponse";
+        recordEvent(eventName.c_str());
+        return;
+    }
+
+    AuctionTrace::record(id, AP_AUGMENTOR_RESPONSE);
 
-    it->second->outstanding.erase(augmentor);
-    if (it->second->outstanding.empty()) {
-        it->second->onFinished(it->second->info);
+    it->second->info->augmentations.mergeWith(augmentationList);
+
+    if (augmentorFinished(*it->second, augmentor)) {
+        AuctionTrace::record(id, AP_AUGMENTATION_DONE);
         augmenting.erase(it);
     }
 }
 
+bool
+AugmentationLoop::
+augmentorFinished(Entry & entry, const std::string & augmentor)
+{
+    entry.outstanding.erase(augmentor);
+    for (auto & group: entry.waiting)
+        group.second.erase(augmentor);
+
+    passOnGroups(entry, entry.outstanding.empty());
+    return entry.outstanding.empty();
+}
+
+void
+AugmentationLoop::
+passOnGroups(Entry & entry, bool all)
+{
+    const AugmentationInfo & info = *entry.info;
+
+    vector<unsigned> ready;
+    for (auto & group: entry.waiting)
+        if (all || group.second.empty())
+            ready.push_back(group.first);
+
+    if (ready.empty())
+        return;
+
+    bool continued = entry.waiting.size() < info.potentialGroups.size();
+    for (unsigned i: ready)
+        entry.waiting.erase(i);
+    bool moreToCome = !entry.waiting.empty();
+
+    // Nothing else will read or write them now
+    if (!moreToCome)
+        info.auction->augmentations = info.augmentations;
+
+    // The usual case of all of the groups at once
+    if (!continued && !moreToCome) {
+        entry.onFinished(entry.info);
+        return;
+    }
+
+    auto part = std::make_shared<AugmentationInfo>(info.auction,
+                                                   info.lossTimeout);
+    for (unsigned i: ready)
+        part->potentialGroups.push_back(info.potentialGroups[i]);
+    part->augmentations = info.augmentations;
+    part->continued = continued;
+    part->moreToCome = moreToCome;
+
+    if (moreToCome)
+        recordEvent("augmentation.groupsPassedOnEarly", ET_COUNT,
+                    ready.size());
+
+    entry.onFinished(part);
+}
+
 void
 AugmentationLoop::
-augmentationExpired(const Id & id, const Entry & entry)
+augmentationExpired(const Id & id, Entry & entry)
 {
-    entry.onFinished(entry.info);
+    AuctionTrace::record(id, AP_AUGMENTATION_DONE, -1, 1);
+    passOnGroups(entry, true);
 }                     
 
 } // namespace RTBKIT
@@ -12,6 +12,7 @@
 #include "soa/service/timeout_map.h"
 #include "soa/service/zmq_endpoint.h"
 #include "soa/service/typed_message_channel.h"
+#include "soa/service/async_event_source.h"
 #include "router_types.h"
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread/thread.hpp>
@@ -21,43 +22,180 @@
 #include "jml/arch/spinlock.h"
 #include <boost/thread/locks.hpp>
 #include "soa/gc/gc_lock.h"
+#include <functional>
 
 
 namespace RTBKIT {
 
 
+/*****************************************************************************/
+/* AUGMENTOR LATENCY                                                         */
+/*****************************************************************************/
+
+/** Live estimate of how long an augmentor takes to respond, from which the
+    delay after which a request to it is hedged is taken.  As for
+    AgentLatency, it comes from the most recent NUM_SAMPLES response times.
+*/
+struct AugmentorLatency {
+    AugmentorLatency(double percentile = 0.95);
+
+    enum {
+        NUM_SAMPLES = 256,    ///< Response times kept
+        MIN_SAMPLES = 16,     ///< Needed before the estimate is used
+        UPDATE_EVERY = 16     ///< Samples between updates of the estimate
+    };
+
+    /** The augmentor responded after the given number of seconds. */
+    void responseReceived(double seconds);
+
+    /** A request to the augmentor expired after the given number of
+        seconds without a response.  It's counted as a response that took
+        that long, so that an augmentor that stops answering is seen as
+        slow rather than only having its fast responses counted. */
+    void requestExpired(double seconds) { responseReceived(seconds); }
+
+    /** Time in seconds within which the augmentor answers the percentile of
+        the requests given on construction, or zero if there aren't enough
+        samples to tell. */
+    double expected() const { return expected_; }
+
+private:
+    void update();
+
+    double percentile;
+    double samples[NUM_SAMPLES];
+    unsigned numSamples;
+    unsigned nextSample;
+    unsigned sinceUpdate;
+    double expected_;
+};
+
+
 /*****************************************************************************/
 /* AUGMENTOR CONFIG                                                          */
 /*****************************************************************************/
 
+/** A connected instance of an augmentor.  There can be several of them
+    configured under the same name.
+*/
+struct AugmentorInstance {
+    AugmentorInstance(const std::string & addr = "")
+        : addr(addr)
+    {
+    }
+
+    std::string addr;                   ///< zmq socket name for it
+    std::map<Id, Date> inFlight;        ///< Auctions sent to it, and when
+};
+
 /** Information about a given augmentor. */
 struct AugmentorInfo {
     AugmentorInfo()
-        : numInFlight(0)
+        : numInFlight(0), requestFields(0)
     {
     }
 
-    std::string augmentorAddr;             ///< zmq socket name for it
     std::string name;                   ///< What the augmentation is called
-    std::map<Id, Date> inFlight;
+    std::vector<AugmentorInstance> instances;
+
+    /** Fewest auctions in flight on any of the instances.  Read without the
+        lock by AugmentationLoop::augment(). */
     int numInFlight;
+
+    /** Fields of the bid request it asked for in its configuration, from
+        BidRequest::parseFields(); zero for the whole request. */
+    uint32_t requestFields;
+
+    /** Response times over all of the instances. */
+    AugmentorLatency latency;
+
+    /** An auction that was sent to a second instance. */
+    struct Hedge {
+        Hedge()
+            : hedgeWon(false)
+        {
+        }
+
+        std::string addr;               ///< Instance it was hedged to
+        Date sent;                      ///< When it was hedged
+        Date firstResponse;             ///< Null until a response arrives
+        bool hedgeWon;                  ///< First response was the hedge's
+    };
+
+    /** Hedged auctions until both instances have responded. */
+    std::map<Id, Hedge> hedges;
+
+    /** Instance with the given address, or null. */
+    AugmentorInstance * findInstance(const std::string & addr);
+
+    /** Instance with the fewest auctions in flight, other than the one with
+        the given address, or null if there is none. */
+    AugmentorInstance * leastLoaded(const std::string & except = "");
+
+    /** Instance that the given auction is in flight on, or null. */
+    AugmentorInstance * instanceFor(const Id & auctionId);
+
+    void updateNumInFlight();
 };
 
-// Information about an auction being augmented
+/** Information about an auction being augmented.
+
+    The groups of an auction are passed on to start bidding as soon as the
+    augmentors that their agents need have responded, so an auction can come
+    out of the augmentation loop in several parts, each with some of its
+    groups.
+*/
 struct AugmentationInfo {
     AugmentationInfo()
+        : continued(false), moreToCome(false)
     {
     }
 
     AugmentationInfo(const std::shared_ptr<Auction> & auction,
                      Date lossTimeout)
-        : auction(auction), lossTimeout(lossTimeout)
+        : auction(auction), lossTimeout(lossTimeout),
+          continued(false), moreToCome(false)
     {
     }
 
     std::shared_ptr<Auction> auction;   ///< Our copy of the auction
     Date lossTimeout;                     ///< When we send a loss if
     std::vector<GroupPotentialBidders> potentialGroups; ///< One per group
+
+    /** Augmentations received by the time the groups were passed on.  The
+        auction's own augmentations are only filled in once the last of its
+        groups are passed on, as the router may be bidding on the others. */
+    AugmentationList augmentations;
+
+    bool continued;     ///< Earlier groups were already passed on
+    bool moreToCome;    ///< Later groups are still being augmented
+};
+
+
+/*****************************************************************************/
+/* HEDGE TIMER                                                               */
+/*****************************************************************************/
+
+/** One-shot timer that runs onTimer on the message loop it's added to at
+    the time it was last armed for.  Used to wake the augmentation loop for
+    the next hedge that's due rather than polling for them.
+*/
+struct HedgeTimer : public AsyncEventSource {
+    HedgeTimer();
+    ~HedgeTimer();
+
+    /** Fire at the given time, instead of whenever it was armed for.  A
+        time in the past fires straight away.  Can be called from any
+        thread. */
+    void arm(Date when);
+
+    virtual int selectFd() const { return fd; }
+    virtual bool processOne();
+
+    std::function<void ()> onTimer;
+
+private:
+    int fd;
 };
 
 
@@ -96,6 +234,10 @@ struct AugmentationLoop : public ServiceBase, public MessageLoop {
         std::set<std::string> outstanding;
         OnFinished onFinished;
         Date timeout;
+
+        /** Augmentors that each group not yet passed on is waiting for,
+            by index in info->potentialGroups. */
+        std::map<unsigned, std::set<std::string> > waiting;
     };
 
     /** List of auctions we're currently augmenting.  Once the augmentation
@@ -129,6 +271,23 @@ struct AugmentationLoop : public ServiceBase, public MessageLoop {
 
     int idle_;
 
+    /** If non-zero, hedge requests to augmentors with more than one instance:
+        one that hasn't been answered by the time that this proportion of the
+        augmentor's recent requests were answered in is also sent to its
+        least loaded other instance, and the first response is used.  Set
+        before the loop is started.
+    */
+    double hedgePercentile;
+
+    /** Send augmentors that didn't ask for only some fields of the bid
+        request the binary serialization of it (the "datacratic-binary"
+        format) rather than the string it came in as.  Augmentors that did
+        ask are always sent a projection in that format.
+        It's much cheaper for them to parse, but augmentors built before the
+        format existed can't read it.  Set before the loop is started.
+    */
+    bool binaryRequests;
+
     /// We pick up augmentations to be done from here
     TypedMessageSink<std::shared_ptr<Entry> > inbox;
 
@@ -146,6 +305,38 @@ struct AugmentationLoop : public ServiceBase, public MessageLoop {
 
     void checkExpiries();
 
+    /** Auctions to hedge, by the time at which to hedge them, with the
+        augmentor to hedge. */
+    std::multimap<Date, std::pair<Id, std::string> > hedgeQueue;
+
+    /** Armed for the first entry of hedgeQueue. */
+    HedgeTimer hedgeTimer;
+
+    /** Queue a hedge, and bring the timer forward if it's the next one. */
+    void scheduleHedge(Date when, const Id & auctionId,
+                       const std::string & augmentor);
+
+    /** Send the hedges that are due. */
+    void checkHedges();
+
+    /** Projections of a bid request, encoded once per auction for all of the
+        augmentors that asked for the same fields. */
+    typedef std::vector<std::pair<uint32_t, std::string> > Projections;
+
+    /** Send the entry's auction to the given instance of the augmentor. */
+    void sendAugment(const AugmentorInfo & aug,
+                     AugmentorInstance & instance,
+                     const Entry & entry,
+                     const std::string & agents,
+                     Projections & projections,
+                     Date now);
+
+    /** Encode the agents that can bid on the entry's auction. */
+    static std::string encodeAgents(const Entry & entry);
+
+    /** Remove an instance that has disconnected. */
+    void removeInstance(const std::string & addr);
+
     /** Handle a configuration message from an augmentor. */
     void doConfig(const std::vector<std::string> & message);
 
@@ -155,7 +346,16 @@ struct AugmentationLoop : public ServiceBase, public MessageLoop {
     /** Handle a message asking for augmentation. */
     void doAugment(const std::vector<std::string> & message);
 
-    void augmentationExpired(const Id & id, const Entry & entry);
+    /** The augmentor has responded, or won't.  Passes on the groups that
+        were only waiting for it, and returns true once the entry isn't
+        waiting for any augmentor. */
+    bool augmentorFinished(Entry & entry, const std::string & augmentor);
+
+    /** Pass the groups of the entry that aren't waiting for any augmentor,
+        or all of the remaining ones if all is set, on to onFinished. */
+    void passOnGroups(Entry & entry, bool all);
+
+    void augmentationExpired(const Id & id, Entry & entry);
 };
 
 } // namespace RTBKIT
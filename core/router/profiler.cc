@@ -0,0 +1,233 @@
+/* profiler.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Continuous profiling of the router's main loop.
+*/
+
+#include "profiler.h"
+#include <algorithm>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* ROUTER LOOP EVENT                                                         */
+/*****************************************************************************/
+
+const char * print(RouterLoopEvent event)
+{
+    switch (event) {
+    case RLE_IDLE:               return "idle";
+    case RLE_START_BIDDING:      return "startBidding";
+    case RLE_CONFIG:             return "config";
+    case RLE_SUBMITTED:          return "submitted";
+    case RLE_BID:                return "bid";
+    case RLE_PONG:               return "pong";
+    case RLE_AGENT_MESSAGE:      return "agentMessage";
+    case RLE_EXPIRE_IN_FLIGHT:   return "expireInFlight";
+    case RLE_EXPIRE_BLACKLIST:   return "expireBlacklist";
+    case RLE_EXPIRE_DEBUG:       return "expireDebug";
+    case RLE_HOUSEKEEPING:       return "housekeeping";
+    default:
+        throw ML::Exception("unknown router loop event %d", (int)event);
+    }
+}
+
+const char * print(RouterLoopQueue queue)
+{
+    switch (queue) {
+    case RLQ_START_BIDDING:      return "startBidding";
+    case RLQ_CONFIG:             return "config";
+    case RLQ_SUBMITTED:          return "submitted";
+    default:
+        throw ML::Exception("unknown router loop queue %d", (int)queue);
+    }
+}
+
+
+/*****************************************************************************/
+/* ROUTER LOOP SAMPLE                                                        */
+/*****************************************************************************/
+
+RouterLoopSample::
+RouterLoopSample()
+    : elapsed(0.0), iterations(0), numInFlight(0), numAugmenting(0)
+{
+    std::fill(count, count + RLE_NUM_EVENTS, 0);
+    std::fill(ticks, ticks + RLE_NUM_EVENTS, 0);
+    std::fill(maxDrained, maxDrained + RLQ_NUM_QUEUES, 0);
+}
+
+double
+RouterLoopSample::
+dutyCycle() const
+{
+    uint64_t total = 0;
+    for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i)
+        total += ticks[i];
+    if (total == 0)
+        return 0.0;
+    return 1.0 - (double)ticks[RLE_IDLE] / total;
+}
+
+Json::Value
+RouterLoopSample::
+toJson() const
+{
+    Json::Value result;
+    result["timestamp"] = timestamp.print(3);
+    result["elapsed"] = elapsed;
+    result["iterations"] = (double)iterations;
+    result["dutyCycle"] = dutyCycle();
+    result["numInFlight"] = numInFlight;
+    result["numAugmenting"] = numAugmenting;
+
+    uint64_t totalTicks = 0;
+    for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i)
+        totalTicks += ticks[i];
+
+    Json::Value & events = result["events"];
+    for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i) {
+        Json::Value & event = events[print((RouterLoopEvent)i)];
+        double seconds = ticks[i] * ML::seconds_per_tick;
+        event["count"] = (double)count[i];
+        event["seconds"] = seconds;
+        event["percent"] = totalTicks ? 100.0 * ticks[i] / totalTicks : 0.0;
+        event["usPerEvent"]
+            = count[i] ? 1000000.0 * seconds / count[i] : 0.0;
+    }
+
+    Json::Value & queues = result["maxDrainedPerIteration"];
+    for (unsigned i = 0;  i < RLQ_NUM_QUEUES;  ++i)
+        queues[print((RouterLoopQueue)i)] = maxDrained[i];
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* ROUTER LOOP PROFILER                                                      */
+/*****************************************************************************/
+
+RouterLoopProfiler::
+RouterLoopProfiler(size_t maxSamples)
+    : current(RLE_IDLE), lastSwitch(ML::ticks()), iterations(0),
+      lastSample(Date::now()), maxSamples(maxSamples)
+{
+    std::fill(counts, counts + RLE_NUM_EVENTS, 0);
+    std::fill(ticks, ticks + RLE_NUM_EVENTS, 0);
+    std::fill(maxDrained, maxDrained + RLQ_NUM_QUEUES, 0);
+}
+
+RouterLoopSample
+RouterLoopProfiler::
+sample(Date now, uint32_t numInFlight, uint32_t numAugmenting)
+{
+    // Close off what is being done now so that it's in this sample
+    switchTo(current);
+
+    RouterLoopSample sample;
+    sample.timestamp = now;
+    sample.elapsed = now.secondsSince(lastSample);
+    sample.iterations = iterations;
+    sample.numInFlight = numInFlight;
+    sample.numAugmenting = numAugmenting;
+    std::copy(counts, counts + RLE_NUM_EVENTS, sample.count);
+    std::copy(ticks, ticks + RLE_NUM_EVENTS, sample.ticks);
+    std::copy(maxDrained, maxDrained + RLQ_NUM_QUEUES,
+              sample.maxDrained);
+
+    std::fill(counts, counts + RLE_NUM_EVENTS, 0);
+    std::fill(ticks, ticks + RLE_NUM_EVENTS, 0);
+    std::fill(maxDrained, maxDrained + RLQ_NUM_QUEUES, 0);
+    iterations = 0;
+    lastSample = now;
+
+    Guard guard(lock);
+    samples.push_back(sample);
+    while (samples.size() > maxSamples)
+        samples.pop_front();
+
+    return sample;
+}
+
+std::vector<RouterLoopSample>
+RouterLoopProfiler::
+history(double seconds) const
+{
+    Guard guard(lock);
+
+    if (samples.empty())
+        return std::vector<RouterLoopSample>();
+
+    Date cutoff = samples.back().timestamp.plusSeconds(-seconds);
+
+    auto it = samples.end();
+    while (it != samples.begin() && (it - 1)->timestamp > cutoff)
+        --it;
+
+    return std::vector<RouterLoopSample>(it, samples.end());
+}
+
+RouterLoopSample
+RouterLoopProfiler::
+summary(double seconds) const
+{
+    RouterLoopSample result;
+
+    for (auto & s: history(seconds)) {
+        result.timestamp = s.timestamp;
+        result.elapsed += s.elapsed;
+        result.iterations += s.iterations;
+        for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i) {
+            result.count[i] += s.count[i];
+            result.ticks[i] += s.ticks[i];
+        }
+        for (unsigned i = 0;  i < RLQ_NUM_QUEUES;  ++i)
+            result.maxDrained[i]
+                = std::max(result.maxDrained[i], s.maxDrained[i]);
+        result.numInFlight = s.numInFlight;
+        result.numAugmenting = s.numAugmenting;
+    }
+
+    return result;
+}
+
+Json::Value
+RouterLoopProfiler::
+toJson(double seconds) const
+{
+    Json::Value result;
+    result["summary"] = summary(seconds).toJson();
+
+    // The time series are one array per metric, as that's what gets graphed
+    Json::Value & series = result["series"];
+    series["timestamp"] = Json::Value(Json::arrayValue);
+
+    for (auto & s: history(seconds)) {
+        series["timestamp"].append(s.timestamp.secondsSinceEpoch());
+        series["dutyCycle"].append(s.dutyCycle());
+        series["iterations"].append((double)s.iterations);
+        series["numInFlight"].append(s.numInFlight);
+        series["numAugmenting"].append(s.numAugmenting);
+
+        for (unsigned i = 0;  i < RLQ_NUM_QUEUES;  ++i)
+            series["maxDrainedPerIteration"][print((RouterLoopQueue)i)]
+                .append(s.maxDrained[i]);
+
+        for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i) {
+            Json::Value & event = series["events"][print((RouterLoopEvent)i)];
+            event["count"].append((double)s.count[i]);
+            event["seconds"].append(s.ticks[i] * ML::seconds_per_tick);
+        }
+    }
+
+    return result;
+}
+
+} // namespace RTBKIT
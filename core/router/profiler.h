@@ -6,12 +6,17 @@
 #ifndef __router__profiler_h__
 #define __router__profiler_h__
 
+#include "soa/types/date.h"
+#include "soa/jsoncpp/json.h"
 #include "jml/arch/timers.h"
 #include "jml/arch/exception.h"
-#include "jml/arch/atomic_ops.h"
+#include <deque>
+#include <mutex>
 
 namespace RTBKIT {
 
+using Datacratic::Date;
+
 
 /*****************************************************************************/
 /* ROUTER PROFILER                                                           */
@@ -43,22 +48,166 @@ inline int64_t microsecondsBetween(double after, double before)
 }
 
 
+/** What the router's main loop can be busy doing.  Every cycle of the loop
+    is attributed to exactly one of these.
+*/
+enum RouterLoopEvent {
+    RLE_IDLE,                 ///< Sleeping or polling for something to do
+    RLE_START_BIDDING,        ///< Augmented auction sent to the agents
+    RLE_CONFIG,               ///< Agent configuration changed
+    RLE_SUBMITTED,            ///< Auction submitted to the exchange
+    RLE_BID,                  ///< BID message from an agent
+    RLE_PONG,                 ///< PONG0 or PONG1 message from an agent
+    RLE_AGENT_MESSAGE,        ///< Agent message (handling BID and PONG
+                              ///< is counted separately)
+    RLE_EXPIRE_IN_FLIGHT,     ///< Expiring in flight auctions
+    RLE_EXPIRE_BLACKLIST,     ///< Expiring blacklist entries
+    RLE_EXPIRE_DEBUG,         ///< Expiring debug info
+    RLE_HOUSEKEEPING,         ///< Loop overhead, pings, dead agents, ...
+
+    RLE_NUM_EVENTS
+};
+
+const char * print(RouterLoopEvent event);
+
+/** Queues that the router's main loop drains. */
+enum RouterLoopQueue {
+    RLQ_START_BIDDING,
+    RLQ_CONFIG,
+    RLQ_SUBMITTED,
+
+    RLQ_NUM_QUEUES
+};
+
+const char * print(RouterLoopQueue queue);
+
+
+/** What the router's main loop did over one sampling interval. */
+
+struct RouterLoopSample {
+    RouterLoopSample();
+
+    Date timestamp;           ///< End of the interval
+    double elapsed;           ///< Seconds covered by the sample
+    uint64_t iterations;      ///< Number of times the loop woke up
+
+    uint64_t count[RLE_NUM_EVENTS];    ///< Number of each event
+    uint64_t ticks[RLE_NUM_EVENTS];    ///< Cycles spent on each event
+
+    /// Most entries taken off each queue in a single loop iteration.  This
+    /// is a lower bound on how deep the queue got, not its depth.
+    uint32_t maxDrained[RLQ_NUM_QUEUES];
+
+    uint32_t numInFlight;     ///< Auctions waiting for bids at the end
+    uint32_t numAugmenting;   ///< Auctions being augmented at the end
+
+    /** Proportion of the cycles that weren't spent idle. */
+    double dutyCycle() const;
+
+    Json::Value toJson() const;
+};
+
+
+/** Continuous profile of the router's main loop.
+
+    The loop thread attributes its cycles to events with switchTo(), which
+    costs a timestamp counter read and two additions into fixed arrays.
+    Once per sampling interval it calls sample(), which turns what was
+    accumulated since the previous call into a RouterLoopSample and keeps
+    it in a history covering the last few minutes.
+
+    Everything except the reading of the history (which can be done from
+    any thread) must be called from the loop thread.
+*/
+
+struct RouterLoopProfiler {
+
+    RouterLoopProfiler(size_t maxSamples = 600);
+
+    /** Attribute the cycles since the last switch to the current event
+        and make the given event the current one. */
+    void switchTo(RouterLoopEvent event)
+    {
+        uint64_t now = ML::ticks();
+        ticks[current] += now - lastSwitch;
+        lastSwitch = now;
+        current = event;
+    }
+
+    /** Count an occurrence of an event. */
+    void count(RouterLoopEvent event)
+    {
+        ++counts[event];
+    }
+
+    /** The loop woke up. */
+    void iteration()
+    {
+        ++iterations;
+    }
+
+    /** The given number of entries were taken off the given queue in this
+        iteration of the loop. */
+    void drained(RouterLoopQueue queue, uint32_t numDrained)
+    {
+        if (numDrained > maxDrained[queue])
+            maxDrained[queue] = numDrained;
+    }
+
+    RouterLoopEvent currentEvent() const { return current; }
+
+    /** Close the current sampling interval, add it to the history and
+        return it. */
+    RouterLoopSample sample(Date now, uint32_t numInFlight, uint32_t numAugmenting);
+
+    /** The samples covering the last given number of seconds, oldest
+        first. */
+    std::vector<RouterLoopSample> history(double seconds) const;
+
+    /** Sum of the history over the last given number of seconds. */
+    RouterLoopSample summary(double seconds) const;
+
+    /** History and summary of the last given number of seconds. */
+    Json::Value toJson(double seconds) const;
+
+private:
+    RouterLoopEvent current;
+    uint64_t lastSwitch;
+    uint64_t counts[RLE_NUM_EVENTS];
+    uint64_t ticks[RLE_NUM_EVENTS];
+    uint32_t maxDrained[RLQ_NUM_QUEUES];
+    uint64_t iterations;
+    Date lastSample;
+
+    size_t maxSamples;
+    std::deque<RouterLoopSample> samples;
+
+    typedef std::unique_lock<std::mutex> Guard;
+    mutable std::mutex lock;
+};
+
+
+/** Attributes the loop's cycles to the given event for the lifetime of the
+    object, and then back to whatever it was doing before.  These nest: the
+    cycles of the inner scope are only counted in the inner event.
+*/
+
 struct RouterProfiler {
 
-    RouterProfiler(uint64_t & counter)
-        : counter(counter)
+    RouterProfiler(RouterLoopProfiler & profiler, RouterLoopEvent event)
+        : profiler(profiler), previous(profiler.currentEvent())
     {
-        startTime = getProfilingTime();
+        profiler.count(event);
+        profiler.switchTo(event);
     }
 
     ~RouterProfiler()
     {
-        ML::atomic_add(counter,
-                       microsecondsBetween(getProfilingTime(), startTime));
+        profiler.switchTo(previous);
     }
 
-    uint64_t & counter;
-    double startTime;
+    RouterLoopProfiler & profiler;
+    RouterLoopEvent previous;
 };
 
 } // namespace RTBKIT
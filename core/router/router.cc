@@ -30,6 +30,10 @@
 #include "rtbkit/core/banker/null_banker.h"
 #include <boost/algorithm/string.hpp>
 #include "rtbkit/core/post_auction/post_auction_loop.h"
+#include "rtbkit/common/auction_trace.h"
+#include "rtbkit/common/auction_pool.h"
+#include "rtbkit/common/bid_result.h"
+#include "soa/service/rest_request_binding.h"
 
 
 using namespace std;
@@ -56,6 +60,85 @@ toJson() const
 }
 
 
+/*****************************************************************************/
+/* POTENTIAL BIDDER FILTER                                                   */
+/*****************************************************************************/
+
+void
+PotentialBidderFilter::
+add(const std::shared_ptr<const AgentConfig> & config)
+{
+    Entry entry;
+    entry.config = config;
+    entry.hasLocationFilter = !config->locationFilter.empty();
+
+    // Ask the filter about each hour of a week (1 January 2012 was a
+    // Sunday)
+    Date sunday = Date::fromSecondsSinceEpoch(1325376000);
+    for (unsigned i = 0;  i < 168;  ++i) {
+        Date hour = sunday.plusSeconds(3600 * i + 1800);
+        entry.hours[hour.hourOfWeek()]
+            = config->hourOfWeekFilter.isIncluded(hour.secondsSinceEpoch());
+    }
+
+    if (entry.hours.none())
+        return;
+
+    int index = entries.size();
+    std::set<Format> formats;
+    for (auto & creative: config->creatives)
+        if (formats.insert(creative.format).second)
+            byFormat[creative.format].push_back(index);
+
+    if (!formats.empty())
+        entries.push_back(entry);
+}
+
+bool
+PotentialBidderFilter::
+matches(const BidRequest & request) const
+{
+    // With no timestamp the real filter can't be applied either, so don't
+    // hold it against anyone
+    int hour = -1;
+    if (request.timestamp)
+        hour = Date::fromSecondsSinceEpoch(request.timestamp).hourOfWeek();
+
+    std::unique_ptr<AgentConfig::RequestFilterCache> cache;
+
+    for (auto & spot: request.spots) {
+        for (auto & format: spot.formats) {
+            auto it = byFormat.find(format);
+            if (it == byFormat.end())
+                continue;
+
+            for (int index: it->second) {
+                const Entry & entry = entries[index];
+                const AgentConfig & config = *entry.config;
+
+                if (hour != -1 && !entry.hours[hour])
+                    continue;
+                if (!config.exchangeFilter.isIncluded(request.exchange))
+                    continue;
+                if (entry.hasLocationFilter) {
+                    if (!cache)
+                        cache.reset
+                            (new AgentConfig::RequestFilterCache(request));
+                    if (!config.locationFilter
+                        .isIncluded(cache->location, cache->locationHash,
+                                    cache->locationFilter))
+                        continue;
+                }
+
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
 /*****************************************************************************/
 /* ROUTER                                                                    */
 /*****************************************************************************/
@@ -72,13 +155,13 @@ Router(ServiceBase & parent,
       configBuffer(1024),
       startBiddingBuffer(65536),
       submittedBuffer(65536),
-      auctionGraveyard(65536),
       augmentationLoop(*this),
       secondsUntilLossAssumed_(secondsUntilLossAssumed),
       globalBidProbability(1.0),
       bidsErrorRate(0.0),
       budgetErrorRate(0.0),
       connectPostAuctionLoop(connectPostAuctionLoop),
+      slimPostAuctionSubmissions_(false),
       allAgents(new AllAgentInfo()),
       configListener(getZmqContext()),
       initialized(false),
@@ -101,13 +184,13 @@ Router(std::shared_ptr<ServiceProxies> services,
       configBuffer(1024),
       startBiddingBuffer(65536),
       submittedBuffer(65536),
-      auctionGraveyard(65536),
       augmentationLoop(*this),
       secondsUntilLossAssumed_(secondsUntilLossAssumed),
       globalBidProbability(1.0),
       bidsErrorRate(0.0),
       budgetErrorRate(0.0),
       connectPostAuctionLoop(connectPostAuctionLoop),
+      slimPostAuctionSubmissions_(false),
       allAgents(new AllAgentInfo()),
       configListener(getZmqContext()),
       initialized(false),
@@ -154,16 +237,21 @@ init()
             configBuffer.push(make_pair(agent, config));
         };
 
-    onSubmittedAuction = [=] (std::shared_ptr<Auction> auction,
-                              Id adSpotId,
-                              Auction::Response response)
-        {
-            submitToPostAuctionService(auction, adSpotId, response);
-        };
-
     monitorProxy.init(getServices()->config);
     monitorProviderEndpoint.init();
 
+    addRouteSyncReturn(monitorProviderEndpoint.router_,
+                       "/profile",
+                       {"GET"},
+                       "Return the profile of the router's main loop",
+                       "Summary and time series of the loop's activity",
+                       [] (const Json::Value & profile) { return profile; },
+                       &Router::getLoopProfile,
+                       this,
+                       RestParamDefault<int>("seconds",
+                                             "seconds of history to return",
+                                             60));
+
     initialized = true;
 }
 
@@ -249,26 +337,6 @@ start(boost::function<void ()> onStop)
     configListener.init(getServices()->config);
     configListener.start();
 
-    /* This is an extra thread which sits there deleting auctions
-       to take this out of the hands of the main loop (it can easily use
-       up nearly 20% of the capacity of the main loop).
-    */
-    auto auctionDeleter = [=] ()
-        {
-            while (!this->shutdown_) {
-                std::shared_ptr<Auction> toDelete;
-                auctionGraveyard.tryPop(toDelete, 0.05);
-                int numDeleted = 1;
-                while (this->auctionGraveyard.tryPop(toDelete))
-                    ++numDeleted;
-                //cerr << "deleted " << numDeleted << " auctions"
-                //     << endl;
-                ML::sleep(0.001);
-            }
-        };
-
-    cleanupThread.reset(new boost::thread(auctionDeleter));
-
     monitorProxy.start();
     monitorProviderEndpoint.start();
 }
@@ -326,58 +394,28 @@ run()
         { 0, wakeupMainLoop.fd(), ZMQ_POLLIN, 0 }
     };
 
-    double last_check = ML::wall_time(), last_check_pace = last_check,
-        lastPings = last_check;
+    double last_check = ML::wall_time(), lastPings = last_check;
 
     //cerr << "server listening" << endl;
 
-    auto getTime = [&] () { return Date::now().secondsSinceEpoch(); };
-
-    double beforeSleep, afterSleep = getTime();
-    int numTimesCouldSleep = 0;
-    int totalSleeps = 0;
-    double lastTimestamp = 0;
+    double lastTimestamp = 0, lastProfile = last_check;
 
     recordHit("routerUp");
 
     //double lastDump = ML::wall_time();
 
-    struct TimesEntry {
-        TimesEntry()
-            : time(0.0), count(0)
-        {
-        };
-
-        void add(double time)
-        {
-            this->time += time;
-            ++count;
-        }
-
-        double time;
-        uint64_t count;
-    };
-
-    std::map<std::string, TimesEntry> times;
-
-    double auctionKeepProbability = 1.0;
-
     // Attempt to wake up once per millisecond
 
     Date lastSleep = Date::now();
 
     while (!shutdown_) {
-        beforeSleep = getTime();
-
-        dutyCycleCurrent.nsProcessing
-            += microsecondsBetween(beforeSleep, afterSleep);
+        loopProfiler.switchTo(RLE_IDLE);
 
         int rc = 0;
 
         for (unsigned i = 0;  i < 20 && rc == 0;  ++i)
             rc = zmq_poll(items, 2, 0);
         if (rc == 0) {
-            ++numTimesCouldSleep;
             checkExpiredAuctions();
 
 #if 1
@@ -398,36 +436,28 @@ run()
 
         //cerr << "rc = " << rc << endl;
 
-        afterSleep = getTime();
-
-        dutyCycleCurrent.nsSleeping
-            += microsecondsBetween(afterSleep, beforeSleep);
-        dutyCycleCurrent.nEvents += 1;
-
-        times["asleep"].add(microsecondsBetween(afterSleep, beforeSleep));
+        loopProfiler.iteration();
+        loopProfiler.switchTo(RLE_HOUSEKEEPING);
 
         if (rc == -1 && zmq_errno() != EINTR) {
             cerr << "zeromq error: " << zmq_strerror(zmq_errno()) << endl;
         }
 
         {
-            double atStart = getTime();
+            uint32_t numDrained = 0;
             std::shared_ptr<AugmentationInfo> info;
             while (startBiddingBuffer.tryPop(info)) {
                 doStartBidding(info);
+                ++numDrained;
             }
-
-            double atEnd = getTime();
-            times["doStartBidding"].add(microsecondsBetween(atEnd, atStart));
+            loopProfiler.drained(RLQ_START_BIDDING, numDrained);
         }
 
-
-
         {
-            double atStart = getTime();
-
+            uint32_t numDrained = 0;
             std::pair<std::string, std::shared_ptr<const AgentConfig> > config;
             while (configBuffer.tryPop(config)) {
+                ++numDrained;
                 if (!config.second) {
                     // deconfiguration
                     // TODO
@@ -438,30 +468,25 @@ run()
                     doConfig(config.first, config.second);
                 }
             }
-
-            double atEnd = getTime();
-            times["doConfig"].add(microsecondsBetween(atEnd, atStart));
+            loopProfiler.drained(RLQ_CONFIG, numDrained);
         }
 
         {
-            double atStart = getTime();
+            uint32_t numDrained = 0;
             std::shared_ptr<Auction> auction;
-            while (submittedBuffer.tryPop(auction))
+            while (submittedBuffer.tryPop(auction)) {
                 doSubmitted(auction);
-
-            double atEnd = getTime();
-            times["doSubmitted"].add(microsecondsBetween(atEnd, atStart));
+                ++numDrained;
+            }
+            loopProfiler.drained(RLQ_SUBMITTED, numDrained);
         }
 
         if (items[0].revents & ZMQ_POLLIN) {
-            double beforeMessage = getTime();
             // Agent message
             vector<string> message;
             try {
                 message = recvAll(agentEndpoint.getSocketUnsafe());
                 agentEndpoint.handleMessage(std::move(message));
-                double atEnd = getTime();
-                times[message.at(1)].add(microsecondsBetween(atEnd, beforeMessage));
             } catch (const std::exception & exc) {
                 cerr << "error handling agent message " << message
                      << ": " << exc.what() << endl;
@@ -480,7 +505,6 @@ run()
             continue;
 
         double now = ML::wall_time();
-        double beforeChecks = getTime();
 
         if (now - lastPings > 1.0) {
             // Send out pings and interpret the results of the last lot of
@@ -490,52 +514,16 @@ run()
             lastPings = now;
         }
 
-        if (now - last_check_pace > 10.0) {
-            if (numTimesCouldSleep < 50) {
-                auctionKeepProbability = std::max(auctionKeepProbability - 0.10,
-                                                 0.10);
+        // Feed the latest stage delays back to the exchange connectors
+        if (admission.update()) {
+            recordLevel(admission.expectedLatency() * 1000.0,
+                        "admission.expectedLatencyMs");
+            for (unsigned i = 0;  i < AdmissionController::NUM_STAGES;  ++i) {
+                auto stage = (AdmissionController::Stage)i;
+                recordLevel(admission.stageDelay(stage) * 1000.0,
+                            "admission.stageDelayMs.%s",
+                            AdmissionController::print(stage));
             }
-            else if (numTimesCouldSleep > 2000) {
-                auctionKeepProbability = std::min(auctionKeepProbability + 0.10,
-                                                 1.00);
-            }
-            else if (numTimesCouldSleep > 500) {
-                auctionKeepProbability = std::min(auctionKeepProbability + 0.05,
-                                                 1.00);
-            }
-            else if (numTimesCouldSleep > 100) {
-                auctionKeepProbability = std::min(auctionKeepProbability + 0.01,
-                                                 1.00);
-            }
-
-#if 1
-            cerr << "auctionKeepProbability = " << auctionKeepProbability
-                 << " numTimesCouldSleep = " << numTimesCouldSleep
-                 << endl;
-#endif
-
-            // Start dropping them early if we get to 50% and we're still having
-            // trouble keeping up.
-            double earlyAuctionKeepProbability = 1.0;
-#if 0
-            if (auctionKeepProbability < 0.5)
-                earlyAuctionKeepProbability = auctionKeepProbability * 0.5;
-#else
-            earlyAuctionKeepProbability = auctionKeepProbability;
-#endif
-            if (!shared->simulationMode_) {
-                setAcceptAuctionProbability(earlyAuctionKeepProbability);
-            }
-
-            recordEvent("auctionKeepPercentage", ET_LEVEL,
-                    auctionKeepProbability * 100.0);
-            recordEvent("numTimesCouldSleep", ET_LEVEL,
-                        numTimesCouldSleep);
-
-            totalSleeps += numTimesCouldSleep;
-
-            numTimesCouldSleep = 0;
-            last_check_pace = now;
         }
 
         if (now - last_check > 10.0) {
@@ -548,43 +536,35 @@ run()
                               inFlight.size(),
                               agents.size()));
 
-            dutyCycleCurrent.ending = Date::now();
-            dutyCycleHistory.push_back(dutyCycleCurrent);
-            dutyCycleCurrent.clear();
-
-            if (dutyCycleHistory.size() > 200)
-                dutyCycleHistory.erase(dutyCycleHistory.begin(),
-                                       dutyCycleHistory.end() - 100);
-
             checkDeadAgents();
 
-            double total = 0.0;
-            for (auto it = times.begin(); it != times.end();  ++it)
-                total += it->second.time;
-
-            cerr << "total of " << total << " microseconds and "
-                 << totalSleeps << " sleeps" << endl;
-
-            for (auto it = times.begin(); it != times.end();  ++it) {
-                cerr << ML::format("%-30s %8lld %10.0f %6.2f%% %8.2fus/call\n",
-                                   it->first.c_str(),
-                                   (unsigned long long)it->second.count,
-                                   it->second.time,
-                                   100.0 * it->second.time / total,
-                                   it->second.time / it->second.count);
-
-                recordEvent(("routerLoop." + it->first).c_str(), ET_LEVEL,
-                        1.0 * it->second.time / (now - last_check) / 1000000.0);
-
-            }
-
-            times.clear();
-            totalSleeps = 0;
-
             last_check = now;
         }
 
-        times["checks"].add(microsecondsBetween(getTime(), beforeChecks));
+        if (now - lastProfile >= 1.0) {
+            // Keep the proportion of the loop taken by each event in the
+            // metrics, as it was when it was dumped to stderr
+            RouterLoopSample latest
+                = loopProfiler.sample(Date::fromSecondsSinceEpoch(now),
+                                      inFlight.size(),
+                                      augmentationLoop.numAugmenting());
+            uint64_t totalTicks = 0;
+            for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i)
+                totalTicks += latest.ticks[i];
+            for (unsigned i = 0;  i < RLE_NUM_EVENTS;  ++i)
+                recordLevel(totalTicks ? 1.0 * latest.ticks[i] / totalTicks
+                            : 0.0,
+                            "routerLoop.%s", print((RouterLoopEvent)i));
+            recordLevel(latest.dutyCycle(), "routerLoop.dutyCycle");
+
+            AuctionPool::Stats pool = AuctionPool::global().stats();
+            recordLevel(pool.pooled, "auctionPool.pooled");
+            recordLevel(pool.allocated, "auctionPool.allocated");
+            recordLevel(pool.reused, "auctionPool.reused");
+            recordLevel(pool.freed, "auctionPool.freed");
+
+            lastProfile = now;
+        }
 
         if (now - lastTimestamp >= 1.0) {
             banker->logBidEvents(*this);
@@ -615,9 +595,6 @@ shutdown()
     if (runThread)
         runThread->join();
     runThread.reset();
-    if (cleanupThread)
-        cleanupThread->join();
-    cleanupThread.reset();
 
     shared->logger.shutdown();
     banker.reset();
@@ -666,12 +643,12 @@ injectAuction(Auction::HandleAuction onAuctionFinished,
               double lossTime)
 {
     std::shared_ptr<Auction> auction
-        (new Auction(onAuctionFinished,
-                     request,
-                     chomp(requestStr),
-                     requestStrFormat,
-                     Date::fromSecondsSinceEpoch(startTime),
-                     Date::fromSecondsSinceEpoch(expiryTime)));
+        = AuctionPool::global().create(onAuctionFinished,
+                                       request,
+                                       chomp(requestStr),
+                                       requestStrFormat,
+                                       Date::fromSecondsSinceEpoch(startTime),
+                                       Date::fromSecondsSinceEpoch(expiryTime));
 
     injectAuction(auction, lossTime);
 
@@ -696,6 +673,8 @@ void
 Router::
 handleAgentMessage(const std::vector<std::string> & message)
 {
+    RouterProfiler profiler(loopProfiler, RLE_AGENT_MESSAGE);
+
     try {
         using namespace std;
         //cerr << "got agent message " << message << endl;
@@ -713,21 +692,23 @@ handleAgentMessage(const std::vector<std::string> & message)
 
         if (request == "CONFIG") {
             string configName = message.at(2);
-            if (!agents.count(configName)) {
+            int slot = agents.find(configName);
+            if (slot == Agents::NO_SLOT) {
                 // We don't yet know about its configuration
                 sendAgentMessage(address, "NEEDCONFIG", getCurrentTime());
                 return;
             }
-            agents[configName].address = address;
+            agents[slot].address = address;
             return;
         }
 
-        if (!agents.count(address)) {
+        int slot = agents.find(address);
+        if (slot == Agents::NO_SLOT) {
             cerr << "doing NEEDCONFIG for " << address << endl;
             return;
         }
 
-        AgentInfo & info = agents[address];
+        AgentInfo & info = agents[slot];
         info.gotHeartbeat(Date::now());
 
         if (!info.configured) {
@@ -735,18 +716,18 @@ handleAgentMessage(const std::vector<std::string> & message)
         }
 
         if (request[0] == 'B' && request == "BID") {
-            doBid(message);
+            doBid(slot, message);
             return;
         }
 
         //cerr << "router got message " << message << endl;
 
         if (request[0] == 'P' && request == "PONG0") {
-            doPong(0, message);
+            doPong(0, slot, message);
             return;
         }
         else if (request[0] == 'P' && request == "PONG1") {
-            doPong(1, message);
+            doPong(1, slot, message);
             return;
         }
 
@@ -766,13 +747,12 @@ checkDeadAgents()
     using namespace std;
     //cerr << "checking for dead agents" << endl;
 
-    std::vector<Agents::iterator> deadAgents;
-
-    for (auto it = agents.begin(), end = agents.end();  it != end;
-         ++it) {
-        auto & info = it->second;
+    std::vector<int> deadAgents;
 
-        const std::string & account = info.config->account.toString('.');
+    auto checkAgent = [&] (int slot, const std::string & agent,
+                           AgentInfo & info)
+    {
+        const std::string & account = AccountPaths::dotted(info.config->account);
 
         Date now = Date::now();
         double oldest = 0.0;
@@ -793,7 +773,7 @@ checkDeadAgents()
 
                     this->recordHit("accounts.%s.lostBids", account);
 
-                    this->sendBidResponse(it->first,
+                    this->sendBidResponse(agent,
                                           info,
                                           BS_LOSTBID,
                                           this->getCurrentTime(),
@@ -829,9 +809,9 @@ checkDeadAgents()
 
         if (timeSinceHeartbeat > 5.0) {
             info.status->dead = true;
-            if (it->second.numBidsInFlight() != 0) {
-                cerr << "agent " << it->first
-                     << " has " << it->second.numBidsInFlight()
+            if (info.numBidsInFlight() != 0) {
+                cerr << "agent " << agent
+                     << " has " << info.numBidsInFlight()
                      << " undead auctions: " << endl;
 
                 auto onInFlight = [&] (const Id & id, Date date)
@@ -845,13 +825,15 @@ checkDeadAgents()
             }
             else {
                 // agent is dead
-                cerr << "agent " << it->first << " appears to be dead"
+                cerr << "agent " << agent << " appears to be dead"
                      << endl;
-                sendAgentMessage(it->first, "BYEBYE", getCurrentTime());
-                deadAgents.push_back(it);
+                sendAgentMessage(agent, "BYEBYE", getCurrentTime());
+                deadAgents.push_back(slot);
             }
         }
-    }
+    };
+
+    agents.forEach(checkAgent);
 
     for (auto it = deadAgents.begin(), end = deadAgents.end();
          it != end;  ++it) {
@@ -869,6 +851,34 @@ checkDeadAgents()
     //     << endl;
 }
 
+size_t
+Router::
+processPendingWork()
+{
+    size_t result = 0;
+
+    std::pair<std::string, std::shared_ptr<const AgentConfig> > config;
+    while (configBuffer.tryPop(config)) {
+        if (config.second)
+            doConfig(config.first, config.second);
+        ++result;
+    }
+
+    std::shared_ptr<AugmentationInfo> info;
+    while (startBiddingBuffer.tryPop(info)) {
+        doStartBidding(info);
+        ++result;
+    }
+
+    std::shared_ptr<Auction> auction;
+    while (submittedBuffer.tryPop(auction)) {
+        doSubmitted(auction);
+        ++result;
+    }
+
+    return result;
+}
+
 void
 Router::
 checkExpiredAuctions()
@@ -878,30 +888,47 @@ checkExpiredAuctions()
     if (shared->simulationMode_)
         return;
 
-    Date start = Date::now();
+    expireAuctions(Date::now());
+}
+
+void
+Router::
+expireAuctions(Date start)
+{
 
     {
-        RouterProfiler profiler(dutyCycleCurrent.nsExpireInFlight);
+        RouterProfiler profiler(loopProfiler, RLE_EXPIRE_IN_FLIGHT);
 
         // Look for in flight timeout expiries
         auto onExpiredInFlight = [&] (const Id & auctionId,
                                       const AuctionInfo & auctionInfo)
             {
                 this->debugAuction(auctionId, "EXPIRED", {});
+                AuctionTrace::record(auctionId, AP_AUCTION_EXPIRED);
 
                 // Tell any remaining bidders that it's too late...
                 for (auto it = auctionInfo.bidders.begin(),
                          end = auctionInfo.bidders.end();
                      it != end;  ++it) {
-                    string agent = it->first;
-                    if (!agents.count(agent)) continue;
+                    int slot = it->first;
+                    if (!agents.live(slot)) continue;
+
+                    AgentInfo & info = this->agents[slot];
+                    const string & agent = agents.name(slot);
 
-                    if (agents[agent].expireBidInFlight(auctionId)) {
-                        AgentInfo & info = this->agents[agent];
+                    if (info.expireBidInFlight(auctionId)) {
                         ++info.stats->tooLate;
+                        double waited = start.secondsSince(it->second.bidTime);
+                        info.latency.bidDropped(waited);
+
+                        // The agent took at least this long, and leaving it
+                        // out would make the stage look fastest just as the
+                        // agents fall behind
+                        admission.recordStageDelay
+                            (AdmissionController::STAGE_AGENT, waited);
 
                         this->recordHit("accounts.%s.droppedBids",
-                                        info.config->account.toString('.'));
+                                        AccountPaths::dotted(info.config->account));
 
                         this->sendBidResponse(agent,
                                               info,
@@ -923,7 +950,8 @@ checkExpiredAuctions()
                 for (auto it = auctionInfo.bidders.begin(),
                          end = auctionInfo.bidders.end();
                      it != end;  ++it)
-                    msg += ' ' + it->first + "->" + it->second.bidTime.print(5);
+                    msg += ' ' + agents.name(it->first) + "->"
+                        + it->second.bidTime.print(5);
                 cerr << Date::now().print(5) << " " << msg << endl;
                 dumpAuction(auctionId);
                 this->logRouterError("checkExpiredAuctions.inFlight",
@@ -945,12 +973,12 @@ checkExpiredAuctions()
     }
 
     {
-        RouterProfiler profiler(dutyCycleCurrent.nsExpireBlacklist);
+        RouterProfiler profiler(loopProfiler, RLE_EXPIRE_BLACKLIST);
         blacklist.doExpiries();
     }
 
     if (shared->doDebug) {
-        RouterProfiler profiler(dutyCycleCurrent.nsExpireDebug);
+        RouterProfiler profiler(loopProfiler, RLE_EXPIRE_DEBUG);
         expireDebugInfo();
     }
 }
@@ -975,6 +1003,7 @@ doStats(const std::vector<std::string> & message)
     result["numAugmenting"] = augmentationLoop.numAugmenting();
     result["numInFlight"] = inFlight.size();
     result["blacklistUsers"] = blacklist.size();
+    result["blacklistBytes"] = (double)blacklist.memUsage();
 
     result["numAgents"] = agents.size();
 
@@ -984,18 +1013,22 @@ doStats(const std::vector<std::string> & message)
 
     int totalAgentInFlight = 0;
 
-    BOOST_FOREACH(auto agent, agents) {
-        agentsVal[agent.first] = agent.second.toJson(false, false);
-        totalAgentInFlight += agent.second.numBidsInFlight();
-    }
+    auto onAgent = [&] (int slot, const std::string & agent,
+                        const AgentInfo & info)
+        {
+            agentsVal[agent] = info.toJson(false, false);
+            totalAgentInFlight += info.numBidsInFlight();
+        };
+
+    agents.forEach(onAgent);
 
     result["agents"] = agentsVal;
 
     result["totalAgentInFlight"] = totalAgentInFlight;
+    result["admission"] = admission.toJson();
 
-    if (dutyCycleHistory.empty())
-        result["dutyCycle"] = dutyCycleCurrent.toJson();
-    else result["dutyCycle"] = dutyCycleHistory.back().toJson();
+    result["dutyCycle"] = loopProfiler.summary(10.0).toJson();
+    result["auctionPool"] = AuctionPool::global().stats().toJson();
 
     result["fileDescriptorCount"] = ML::num_open_files();
 
@@ -1039,7 +1072,10 @@ augmentAuction(const std::shared_ptr<AugmentationInfo> & info)
 
     auto onDoneAugmenting = [=] (const std::shared_ptr<AugmentationInfo> & info)
         {
-            info->auction->doneAugmenting = Date::now();
+            // Only the first of the auction's groups to be passed on records
+            // when it was; the router may already be reading it after that
+            if (!info->continued)
+                info->auction->doneAugmenting = Date::now();
 
             if (info->auction->tooLate()) {
                 this->recordHit("tooLateAfterAugmenting");
@@ -1061,12 +1097,12 @@ preprocessAuction(const std::shared_ptr<Auction> & auction) const
 {
     ML::atomic_inc(shared->numAuctions);
 
-    Date now = Date::now();
+    Date now = getCurrentTime();
     auction->inPrepro = now;
 
     if (auction->lossAssumed == Date())
         auction->lossAssumed
-            = Date::now().plusSeconds(secondsUntilLossAssumed_);
+            = getCurrentTime().plusSeconds(secondsUntilLossAssumed_);
     Date lossTimeout = auction->lossAssumed;
 
     //cerr << "AUCTION " << auctionId << " " << auction->requestStr << endl;
@@ -1107,7 +1143,7 @@ preprocessAuction(const std::shared_ptr<Auction> & auction) const
                 if (!traceAuction) return;
 
                 this->recordHit("accounts.%s.filter.%s",
-                                config.account.toString('.'),
+                                AccountPaths::dotted(config.account),
                                 reason);
             };
 
@@ -1153,6 +1189,7 @@ preprocessAuction(const std::shared_ptr<Auction> & auction) const
 
             PotentialBidder bidder;
             bidder.agent = agentName;
+            bidder.agentSlot = entry.slot;
             bidder.spots = biddableSpots;
             bidder.config = entry.config;
             bidder.stats = entry.stats;
@@ -1202,7 +1239,7 @@ preprocessAuction(const std::shared_ptr<Auction> & auction) const
     auto info = std::make_shared<AugmentationInfo>(auction, lossTimeout);
     info->potentialGroups.swap(validGroups);
 
-    auction->outOfPrepro = Date::now();
+    auction->outOfPrepro = getCurrentTime();
 
     recordOutcome(auction->outOfPrepro.secondsSince(auction->inPrepro) * 1000.0,
                   "preprocessAuctionTimeMs");
@@ -1224,10 +1261,24 @@ Router::
 doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
 {
     //static const char *fName = "Router::doStartBidding:";
-    RouterProfiler profiler(dutyCycleCurrent.nsStartBidding);
+    RouterProfiler profiler(loopProfiler, RLE_START_BIDDING);
+
+    Date startedBidding = Date::now();
 
     try {
         Id auctionId = augInfo->auction->id;
+
+        if (augInfo->auction->doneAugmenting != Date()
+            && !augInfo->continued) {
+            const Auction & auction = *augInfo->auction;
+            admission.recordStageDelay
+                (AdmissionController::STAGE_AUGMENTATION,
+                 auction.doneAugmenting.secondsSince(auction.start));
+            admission.recordStageDelay
+                (AdmissionController::STAGE_START_BIDDING,
+                 Date::now().secondsSince(auction.doneAugmenting));
+        }
+
         if (shared->simulationMode_) {
             if (inFlight.count(auctionId)) {
                 cerr << "warning: attempt to add auction " << auctionId
@@ -1243,12 +1294,15 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
 #endif
         }
 
-        if (augmentationLoop.currentlyAugmenting(auctionId)) {
+        // The groups of an auction are passed on from augmentation as they
+        // become ready, so the earlier ones are already in flight
+        if (!augInfo->moreToCome
+            && augmentationLoop.currentlyAugmenting(auctionId)) {
             throwException("doStartBidding.alreadyAugmenting",
                            "auction with ID %s already preprocessing",
                            auctionId.toString().c_str());
         }
-        if (inFlight.count(auctionId)) {
+        if (!augInfo->continued && inFlight.count(auctionId)) {
             throwException("doStartBidding.alreadyInFlight",
                            "auction with ID %s already in progress",
                            auctionId.toString().c_str());
@@ -1265,11 +1319,15 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
 
         auto groupAgents = augInfo->potentialGroups;
 
-        AuctionInfo & auctionInfo = addAuction(augInfo->auction,
-                                               augInfo->lossTimeout);
+        auto found = inFlight.find(auctionId);
+        AuctionInfo & auctionInfo
+            = augInfo->continued && found != inFlight.end()
+            ? found->second
+            : addAuction(augInfo->auction, augInfo->lossTimeout);
+        auctionInfo.augmenting = augInfo->moreToCome;
         auto auction = augInfo->auction;
 
-        Date now = Date::now();
+        Date now = getCurrentTime();
 
         auction->inStartBidding = now;
 
@@ -1278,7 +1336,9 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
 
         bool traceAuction = auction->id.hash() % 10 == 0;
 
-        const AugmentationList& augList = augInfo->auction->augmentations;
+        // Worked out once for all of the agents that share an account
+        AugmentationProjection augProjection(augInfo->augmentations,
+                                             augmentationTags);
 
         /* For each round-robin group, send the request off to exactly one
            element. */
@@ -1289,8 +1349,8 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
 
             for (unsigned i = 0;  i < bidders.size();  ++i) {
                 PotentialBidder & bidder = bidders[i];
-                if (!agents.count(bidder.agent)) continue;
-                AgentInfo & info = agents[bidder.agent];
+                if (!agents.live(bidder.agentSlot)) continue;
+                AgentInfo & info = agents[bidder.agentSlot];
                 const AgentConfig & config = *info.config;
 
                 auto doFilterStat = [&] (const char * reason)
@@ -1298,7 +1358,7 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
                         if (!traceAuction) return;
 
                         this->recordHit("accounts.%s.filter.%s",
-                                        config.account.toString('.'),
+                                        AccountPaths::dotted(config.account),
                                         reason);
                     };
 
@@ -1307,16 +1367,19 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
                         if (!traceAuction) return;
 
                         this->recordOutcome(val, "accounts.%s.filter.%s",
-                                            config.account.toString('.'),
+                                            AccountPaths::dotted(config.account),
                                             reason);
                     };
 
 
                 doFilterStat("intoDynamicFilters");
 
-                /* Check if we have too many in flight. */
+                /* Check if we have too many in flight.  The window shrinks
+                   when the agent's bids get dropped for being too late. */
+                size_t inFlightWindow
+                    = info.latency.inFlightWindow(info.config->maxInFlight);
                 if (!shared->simulationMode_
-                    && info.numBidsInFlight() >= info.config->maxInFlight) {
+                    && info.numBidsInFlight() >= inFlightWindow) {
                     ++info.stats->tooManyInFlight;
                     bidder.inFlightProp = PotentialBidder::NULL_PROP;
                     doFilterStat("dynamic.tooManyInFlight");
@@ -1377,9 +1440,18 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
                     continue;
                 }
 
+                /* Check that the agent usually answers in the time left. */
+                if (info.latency.tooSlowFor(timeLeftMs / 1000.0)) {
+                    ML::atomic_inc(info.stats->tooSlow);
+                    bidder.inFlightProp = PotentialBidder::NULL_PROP;
+                    doFilterStat("dynamic.agentTooSlow");
+                    continue;
+                }
+
                 /* Filter on the augmentation tags */
-                vector<string> tags = augList.tagsForAccount(config.account);
-                if (!config.augmentationFilter.anyIsIncluded(tags)) {
+                const AugmentationTagSet & tags
+                    = augProjection.tagsForAccount(config.account);
+                if (!info.augmentationFilter.passes(tags)) {
                     ML::atomic_inc(info.stats->augmentationTagsExcluded);
                     doFilterStat("dynamic.augmentationTagsFiltered");
                     continue;
@@ -1425,27 +1497,26 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
 
             // Best one is the first one
             PotentialBidder & winner = bidders[best];
-            string agent = winner.agent;
+            const string & agent = winner.agent;
 
-            if (!agents.count(agent)) {
+            if (!agents.live(winner.agentSlot)) {
                 //cerr << "!!!AGENT IS GONE" << endl;
                 continue;  // agent is gone
             }
-            AgentInfo & info = agents[agent];
+            AgentInfo & info = agents[winner.agentSlot];
 
             ++info.stats->auctions;
 
-            Augmentation aug = auction->augmentations.filterForAccount(
-                    info.config->account);
-            auction->agentAugmentations[agent] = chomp(aug.toJson().toString());
+            auction->agentAugmentations[agent]
+                = augProjection.serializedForAccount(info.config->account);
 
             //auctionInfo.activities.push_back("sent to " + agent);
 
             BidInfo bidInfo;
-            bidInfo.bidTime = Date::now();
+            bidInfo.bidTime = getCurrentTime();
             bidInfo.spots = winner.spots;
 
-            auctionInfo.bidders.insert(make_pair(agent, bidInfo));  // create empty bid response
+            auctionInfo.bidders.push_back(make_pair(winner.agentSlot, bidInfo));  // create empty bid response
 
             if (!info.trackBidInFlight(auctionId, bidInfo.bidTime))
                 throwException("doStartBidding.agentAlreadyBidding",
@@ -1453,6 +1524,9 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
                                agent.c_str(),
                                auctionId.toString().c_str());
 
+            AuctionTrace::record(auctionId, AP_AGENT_AUCTION,
+                                 winner.agentSlot);
+
             //cerr << "sending to agent " << agent << endl;
             //cerr << fName << " sending AUCTION message " << endl;c
             /* Convert to JSON to send it on. */
@@ -1464,7 +1538,8 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
                              info.encodeBidRequest(*auction),
                              winner.spots.toJsonStr(),
                              toString(timeLeftMs),
-                             auction->agentAugmentations[agent]);
+                             auction->agentAugmentations[agent],
+                             auction->expiry);
 
             //cerr << "done" << endl;
         }
@@ -1479,7 +1554,10 @@ doStartBidding(const std::shared_ptr<AugmentationInfo> & augInfo)
             // Unwind everything?
         }
 
-        if (auctionInfo.bidders.empty()) {
+        AuctionTrace::record(auctionId, AP_START_BIDDING, startedBidding, -1,
+                             auctionInfo.bidders.size());
+
+        if (auctionInfo.bidders.empty() && !auctionInfo.augmenting) {
             /* No bidders; don't bother with the bid */
             ML::atomic_inc(shared->numNoBidders);
             inFlight.erase(auctionId);
@@ -1531,7 +1609,7 @@ static bool failBid(double proportion)
 
 void
 Router::
-doBid(const std::vector<std::string> & message)
+doBid(int agentSlot, const std::vector<std::string> & message)
 {
     //static const char *fName = "Router::doBid:";
     if (failBid(bidsErrorRate)) {
@@ -1539,9 +1617,9 @@ doBid(const std::vector<std::string> & message)
         return;
     }
 
-    Date dateGotBid = Date::now();
+    Date dateGotBid = getCurrentTime();
 
-    RouterProfiler profiler(dutyCycleCurrent.nsBid);
+    RouterProfiler profiler(loopProfiler, RLE_BID);
 
     ML::atomic_inc(shared->numBids);
 
@@ -1603,14 +1681,14 @@ doBid(const std::vector<std::string> & message)
 
     debugAuction(auctionId, "BID", message);
 
-    if (!agents.count(agent)) {
+    if (!agents.live(agentSlot)) {
         returnErrorResponse(message, "unknown agent");
         return;
     }
 
     doProfileEvent(2, "agents");
 
-    AgentInfo & info = agents[agent];
+    AgentInfo & info = agents[agentSlot];
 
     /* One less in flight. */
     if (!info.expireBidInFlight(auctionId)) {
@@ -1635,14 +1713,14 @@ doBid(const std::vector<std::string> & message)
 
     AuctionInfo & auctionInfo = it->second;
 
-    if (!auctionInfo.bidders.count(agent)) {
+    if (!auctionInfo.bidders.count(agentSlot)) {
         recordHit("bidError.agentSkippedAuction");
         returnErrorResponse(message,
                             "agent shouldn't bid on this auction");
         return;
     }
 
-    recordHit("accounts.%s.bids", info.config->account.toString('.'));
+    recordHit("accounts.%s.bids", AccountPaths::dotted(info.config->account));
 
     doProfileEvent(5, "auctionInfo");
 
@@ -1657,9 +1735,9 @@ doBid(const std::vector<std::string> & message)
         {
             this->recordHit("bidErrors.%s");
             this->recordHit("accounts.%s.bidErrors.total",
-                            info.config->account.toString('.'));
+                            AccountPaths::dotted(info.config->account));
             this->recordHit("accounts.%s.bidErrors.%s",
-                            info.config->account.toString('.'),
+                            AccountPaths::dotted(info.config->account),
                             reason);
 
             ++info.stats->invalid;
@@ -1688,8 +1766,9 @@ doBid(const std::vector<std::string> & message)
                  auctionInfo.auction->agentAugmentations[agent]);
         };
 
-    BidInfo bidInfo = auctionInfo.bidders[agent];
-    auctionInfo.bidders.erase(agent);
+    BidInfo bidInfo = auctionInfo.bidders.pop(agentSlot);
+    admission.recordStageDelay(AdmissionController::STAGE_AGENT,
+                               getCurrentTime().secondsSince(bidInfo.bidTime));
 
     doProfileEvent(6, "bidInfo");
 
@@ -1936,6 +2015,8 @@ doBid(const std::vector<std::string> & message)
 
     doProfileEvent(7, "parsing");
 
+    AuctionTrace::record(auctionId, AP_AGENT_BID, agentSlot, numValidBids);
+
     if (numValidBids > 0) {
         //logMessage("BID", agent, auctionId, biddata, meta);
         ML::atomic_add(shared->numNonEmptyBids, 1);
@@ -1952,6 +2033,7 @@ doBid(const std::vector<std::string> & message)
     doProfileEvent(8, "postParsing");
 
     double bidTime = dateGotBid.secondsSince(bidInfo.bidTime);
+    info.latency.bidReceived(bidTime);
 
     //cerr << "now " << auctionInfo.bidders.size() << " bidders" << endl;
 
@@ -1960,11 +2042,11 @@ doBid(const std::vector<std::string> & message)
 
     recordOutcome(1000.0 * bidTime,
                   "accounts.%s.bidResponseTimeMs",
-                  info.config->account.toString('.'));
+                  AccountPaths::dotted(info.config->account));
 
     doProfileEvent(9, "postTiming");
 
-    if (auctionInfo.bidders.empty()) {
+    if (auctionInfo.bidders.empty() && !auctionInfo.augmenting) {
         debugAuction(auctionId, "FINISH", message);
         if (!auctionInfo.auction->finish()) {
             debugAuction(auctionId, "FINISH TOO LATE", message);
@@ -2005,7 +2087,7 @@ doSubmitted(std::shared_ptr<Auction> auction)
     // Either a) move it across to the win queue, or b) drop it if we
     // didn't bid anything
 
-    RouterProfiler profiler(dutyCycleCurrent.nsSubmitted);
+    RouterProfiler profiler(loopProfiler, RLE_SUBMITTED);
 
     const Id & auctionId = auction->id;
 
@@ -2031,6 +2113,11 @@ doSubmitted(std::shared_ptr<Auction> auction)
     //ExcAssertEqual(allResponses.size(),
     //               auction->bidRequest->spots.size());
     //cerr << "got a win for auction id " << auctionId << " with num spots:" << allResponses.size() << endl;
+
+    // Spots with a bid to pass on to the post auction loop
+    std::vector<int> submittedSpots;
+    int numSubmitted = 0;
+
     // Go through the spots one by one
     for (unsigned spotNum = 0;  spotNum < allResponses.size();  ++spotNum) {
 
@@ -2061,9 +2148,10 @@ doSubmitted(std::shared_ptr<Auction> auction)
 
             //cerr << "doing response " << i << endl;
 
-            if (!agents.count(response.agent)) continue;
+            int slot = agents.find(response.agent);
+            if (slot == Agents::NO_SLOT) continue;
 
-            AgentInfo & info = agents[response.agent];
+            AgentInfo & info = agents[slot];
             const string & campaign = info.config->campaign;
             const string & strategy = info.config->strategy;
 
@@ -2140,17 +2228,19 @@ doSubmitted(std::shared_ptr<Auction> auction)
         if (!hasSubmittedBid) continue;
 
         ML::atomic_add(shared->numAuctionsWithBid, 1);
+        ++numSubmitted;
         //cerr << fName << "injecting submitted auction " << endl;
 
-        onSubmittedAuction(auction, spotId, responses[0]);
+        if (onSubmittedAuction)
+            onSubmittedAuction(auction, spotId, responses[0]);
+        else submittedSpots.push_back(spotNum);
         //postAuctionLoop.injectSubmittedAuction(auction, spotId, responses[0]);
     }
 
-    //cerr << "auction.use_count() = " << auction.use_count() << endl;
+    AuctionTrace::record(auctionId, AP_SUBMITTED, -1, numSubmitted);
 
-    if (auction.unique()) {
-        auctionGraveyard.tryPush(auction);
-    }
+    if (!submittedSpots.empty())
+        submitToPostAuctionService(auction, submittedSpots);
 }
 
 std::string
@@ -2180,7 +2270,7 @@ void
 Router::
 onNewAuction(std::shared_ptr<Auction> auction)
 {
-    if (!monitorProxy.getStatus()) {
+    if (!shared->simulationMode_ && !monitorProxy.getStatus()) {
         Date now = Date::now();
 
         if ((uint32_t) slowModeLastAuction.secondsSinceEpoch()
@@ -2200,6 +2290,8 @@ onNewAuction(std::shared_ptr<Auction> auction)
         }
     }
 
+    AuctionTrace::record(auction->id, AP_ROUTER_NEW);
+
     //logMessage("AUCTION", auction->id, auction->requestStr);
     const BidRequest & request = *auction->request;
     int numFields = 0;
@@ -2221,6 +2313,9 @@ onNewAuction(std::shared_ptr<Auction> auction)
         recordHit("auctionPassedPreprocessing");
         if (shared->simulationMode_)
         {
+            // Nothing is augmented in simulation mode; whatever the
+            // auction came in with is what the agents get
+            info->augmentations = auction->augmentations;
             startBiddingBuffer.push(info);
             wakeupMainLoop.signal();
         }
@@ -2262,26 +2357,34 @@ updateAllAgents()
 
         AllAgentInfo * current = allAgents;
 
-        for (auto it = agents.begin(), end = agents.end();  it != end;  ++it) {
-            if (!it->second.configured) continue;
-            if (!it->second.config) continue;
-            if (!it->second.stats) continue;
-            if (!it->second.status) continue;
-            if (it->second.status->dead) continue;
-
-            AgentInfoEntry entry;
-            entry.name = it->first;
-            entry.config = it->second.config;
-            entry.stats = it->second.stats;
-            entry.status = it->second.status;
-            int i = newInfo->size();
-            newInfo->push_back(entry);
-
-            newInfo->agentIndex[it->first] = i;
-            newInfo->accountIndex[it->second.config->account].push_back(i);
-        }
+        auto addAgent = [&] (int slot, const std::string & agent,
+                             const AgentInfo & info)
+            {
+                if (!info.configured) return;
+                if (!info.config) return;
+                if (!info.stats) return;
+                if (!info.status) return;
+                if (info.status->dead) return;
+
+                AgentInfoEntry entry;
+                entry.name = agent;
+                entry.slot = slot;
+                entry.config = info.config;
+                entry.stats = info.stats;
+                entry.status = info.status;
+                int i = newInfo->size();
+                newInfo->push_back(entry);
+
+                newInfo->agentIndex[agent] = i;
+                newInfo->accountIndex[AccountPaths::intern(info.config->account)]
+                    .push_back(i);
+                newInfo->potentialBidders.add(info.config);
+            };
+
+        agents.forEach(addAgent);
 
         if (ML::cmp_xchg(allAgents, current, newInfo.get())) {
+            admission.setNumBidders(newInfo->potentialBidders.size());
             newInfo.release();
             ExcAssertNotEqual(current, allAgents);
             if (current)
@@ -2296,7 +2399,7 @@ Router::
 doConfig(const std::string & agent,
          std::shared_ptr<const AgentConfig> config)
 {
-    RouterProfiler profiler(dutyCycleCurrent.nsConfig);
+    RouterProfiler profiler(loopProfiler, RLE_CONFIG);
     //const string fName = "Router::doConfig:";
     logMessage("CONFIG", agent, boost::trim_copy(config->toJson().toString()));
 
@@ -2304,7 +2407,7 @@ doConfig(const std::string & agent,
     if (newConfig->roundRobinGroup == "")
         newConfig->roundRobinGroup = agent;
 
-    AgentInfo & info = agents[agent];
+    AgentInfo & info = agents[agents.insert(agent)];
 
     if (info.configured) {
         unconfigure(agent, *info.config);
@@ -2312,6 +2415,9 @@ doConfig(const std::string & agent,
     }
 
     info.config = newConfig;
+    info.augmentationFilter.compile(newConfig->augmentationFilter.include,
+                                    newConfig->augmentationFilter.exclude,
+                                    augmentationTags);
     //cerr << "configured " << agent << " strategy : " << info.config->strategy << " campaign "
     //     <<  info.config->campaign << endl;
 
@@ -2366,6 +2472,13 @@ getStats() const
 #endif
 }
 
+Json::Value
+Router::
+getLoopProfile(int seconds) const
+{
+    return loopProfiler.toJson(seconds);
+}
+
 Json::Value
 Router::
 getAgentInfo(const std::string & agent) const
@@ -2400,29 +2513,31 @@ void
 Router::
 sendPings()
 {
-    for (auto it = agents.begin(), end = agents.end();
-         it != end;  ++it) {
-        const string & agent = it->first;
-        AgentInfo & info = it->second;
+    auto onAgent = [&] (int slot, const std::string & agent,
+                        AgentInfo & info)
+        {
+            // 1.  Send out new pings
+            Date now = Date::now();
+            if (info.sendPing(0, now))
+                this->sendAgentMessage(agent, "PING0", now, "null");
+            if (info.sendPing(1, now))
+                this->sendAgentMessage(agent, "PING1", now, "null");
 
-        // 1.  Send out new pings
-        Date now = Date::now();
-        if (info.sendPing(0, now))
-            sendAgentMessage(agent, "PING0", now, "null");
-        if (info.sendPing(1, now))
-            sendAgentMessage(agent, "PING1", now, "null");
+            // 2.  Look at the trend
+            //double mean, max;
+        };
 
-        // 2.  Look at the trend
-        //double mean, max;
-    }
+    agents.forEach(onAgent);
 }
 
 void
 Router::
-doPong(int level, const std::vector<std::string> & message)
+doPong(int level, int agentSlot, const std::vector<std::string> & message)
 {
     //cerr << "dopong (router)" << message << endl;
 
+    RouterProfiler profiler(loopProfiler, RLE_PONG);
+
     string agent = message.at(0);
     Date sentTime = Date::parseSecondsSinceEpoch(message.at(2));
     Date receivedTime = Date::parseSecondsSinceEpoch(message.at(3));
@@ -2432,19 +2547,18 @@ doPong(int level, const std::vector<std::string> & message)
     double outgoingTime = receivedTime.secondsSince(sentTime);
     double incomingTime = now.secondsSince(receivedTime);
 
-    auto it = agents.find(agent);
-    if (it == agents.end()) {
+    if (!agents.live(agentSlot)) {
         cerr << "warning: dead agent sent a pong: " << agent << endl;
         return;
     }
 
-    if (!it->second.configured)
+    auto & info = agents[agentSlot];
+    if (!info.configured)
         return;
 
-    auto & info = it->second;
     info.gotPong(level, sentTime, receivedTime, now);
 
-    const string & account = it->second.config->account.toString('.');
+    const string & account = AccountPaths::dotted(info.config->account);
     recordOutcome(roundTripTime * 1000.0,
                   "accounts.%s.ping%d.roundTripTimeMs", account, level);
     recordOutcome(outgoingTime * 1000.0,
@@ -2503,6 +2617,18 @@ sendBidResponse(const std::string & agent,
                          to_string(spotNum), price.toString());
         break;
 
+    case BRF_BINARY: {
+        BinaryBidResult result;
+        result.timestamp = timestamp;
+        result.confidence = message;
+        result.auctionId = auctionId;
+        result.spotNum = spotNum;
+        result.price = price;
+        sendAgentMessage(agent, statusStr, timestamp,
+                         result.serializeToString());
+        break;
+    }
+
     case BRF_NONE:
         break;
     }
@@ -2528,7 +2654,7 @@ forEachAccountAgent(const AccountKey & account,
     const AllAgentInfo * ac = allAgents;
     if (!ac) return;
 
-    auto it = ac->accountIndex.find(account);
+    auto it = ac->accountIndex.find(AccountPaths::find(account));
     if (it == ac->accountIndex.end())
         return;
 
@@ -2537,6 +2663,17 @@ forEachAccountAgent(const AccountKey & account,
         onAgent(ac->at(*jt));
 }
 
+bool
+Router::
+hasPotentialBidders(const BidRequest & request) const
+{
+    GcLock::SharedGuard guard(allAgentsGc);
+    const AllAgentInfo * ac = allAgents;
+    if (!ac) return false;
+
+    return ac->potentialBidders.matches(request);
+}
+
 AgentInfoEntry
 Router::
 getAgentEntry(const std::string & agent) const
@@ -2585,10 +2722,43 @@ submitToPostAuctionService(std::shared_ptr<Auction> auction,
     string str = ML::DB::serializeToString(event);
 
     postAuctionEndpoint.sendMessage("AUCTION", str);
+}
+
+void
+Router::
+submitToPostAuctionService(std::shared_ptr<Auction> auction,
+                           const std::vector<int> & spotNums)
+{
+    const std::vector<std::vector<Auction::Response> > & allResponses
+        = auction->getResponses();
 
-    if (auction.unique()) {
-        auctionGraveyard.tryPush(auction);
+    SubmittedAuction submission;
+    submission.auctionId = auction->id;
+    submission.lossTimeout = auction->lossAssumed;
+    submission.bidRequestStr = auction->requestStr;
+    submission.bidRequestFormatStr = auction->requestStrFormat;
+    submission.slim = slimPostAuctionSubmissions_;
+    submission.spots.resize(spotNums.size());
+
+    for (unsigned i = 0;  i < spotNums.size();  ++i) {
+        int spotNum = spotNums[i];
+        const Auction::Response & bid = allResponses.at(spotNum).at(0);
+
+        SubmittedAuction::Spot & spot = submission.spots[i];
+        spot.adSpotId = auction->request->spots.at(spotNum).id;
+        spot.spotIndex = spotNum;
+        spot.augmentations = auction->agentAugmentations[bid.agent];
+        spot.bidResponse = bid;
+
+        string auctionKey = auction->id.toString()
+                            + "-" + spot.adSpotId.toString()
+                            + "-" + bid.agent;
+        banker->detachBid(bid.account, auctionKey);
     }
+
+    string str = ML::DB::serializeToString(submission);
+
+    postAuctionEndpoint.sendMessage("AUCTIONSPOTS", str);
 }
 
 Json::Value
@@ -14,15 +14,20 @@
 #include <boost/scoped_ptr.hpp>
 #include "jml/utils/filter_streams.h"
 #include "soa/service/socket_per_thread.h"
+#include "soa/service/zmq_utils.h"
 #include "soa/service/timeout_map.h"
 #include "soa/service/pending_list.h"
 #include "augmentation_loop.h"
 #include "router_types.h"
+#include "messages.h"
+#include "admission_controller.h"
+#include "profiler.h"
 #include "soa/gc/gc_lock.h"
 #include "jml/utils/ring_buffer.h"
 #include "jml/arch/wakeup_fd.h"
 #include "router_base.h"
 #include <unordered_set>
+#include <bitset>
 #include <thread>
 #include "rtbkit/plugins/exchange/exchange_connector.h"
 #include "rtbkit/core/agent_configuration/blacklist.h"
@@ -44,7 +49,13 @@ struct Accountant;
 
 /** A single entry in the agent info structure. */
 struct AgentInfoEntry {
+    AgentInfoEntry()
+        : slot(AgentSlots::NO_SLOT)
+    {
+    }
+
     std::string name;
+    int slot;      ///< Slot of the agent in Router::agents
     std::shared_ptr<const AgentConfig> config;
     std::shared_ptr<const AgentStatus> status;
     std::shared_ptr<AgentStats> stats;
@@ -56,13 +67,47 @@ struct AgentInfoEntry {
 };
 
 
+/** Index of the agents by the creative formats that they can bid on,
+    with their hour of week and exchange filters, so that a request that
+    nobody could bid on can be turned away with a few lookups.  Built from
+    the agent configs whenever they change, and published along with the
+    rest of AllAgentInfo.
+
+    It only ever lets through more requests than the agents would bid on:
+    the fold position and the creatives' own filters aren't looked at.
+*/
+struct PotentialBidderFilter {
+
+    /** Add an agent with the given configuration. */
+    void add(const std::shared_ptr<const AgentConfig> & config);
+
+    /** Could any of the agents bid on the given request? */
+    bool matches(const BidRequest & request) const;
+
+    /** Number of agents that could bid on something.  Those with no
+        creatives or no hour of the week to bid in aren't counted. */
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry {
+        std::shared_ptr<const AgentConfig> config;
+        std::bitset<168> hours;    ///< Indexed by Date::hourOfWeek()
+        bool hasLocationFilter;
+    };
+
+    std::vector<Entry> entries;
+    std::map<Format, std::vector<int> > byFormat;  ///< Indexes in entries
+};
+
+
 /** A read-only structure with information about all of the agents so
     that auctions can scan them without worrying about data dependencies.
     Uses RCU.
 */
 struct AllAgentInfo : public std::vector<AgentInfoEntry> {
     std::unordered_map<std::string, int> agentIndex;
-    std::unordered_map<AccountKey, std::vector<int> > accountIndex;
+    std::unordered_map<AccountPathId, std::vector<int> > accountIndex;
+    PotentialBidderFilter potentialBidders;
 };
 
 
@@ -99,6 +144,33 @@ struct Router : public RouterServiceBase,
         secondsUntilLossAssumed_ = newValue;
     }
 
+    /** Only send the post auction loop the parts of each submitted auction
+        that it actually uses.  See SubmittedAuction.
+    */
+    void setSlimPostAuctionSubmissions(bool slim)
+    {
+        slimPostAuctionSubmissions_ = slim;
+    }
+
+    /** Send augmentors the binary serialization of each bid request rather
+        than the string it came in as.  See AugmentationLoop::binaryRequests.
+    */
+    void setBinaryAugmentationRequests(bool binary)
+    {
+        augmentationLoop.binaryRequests = binary;
+    }
+
+    /** Hedge requests to augmentors that have several instances after the
+        given percentile of their response times.  Zero turns it off.  See
+        AugmentationLoop::hedgePercentile.
+    */
+    void setAugmentationHedging(double percentile)
+    {
+        if (percentile < 0.0 || percentile >= 1.0)
+            throw ML::Exception("invalid augmentation hedging percentile");
+        augmentationLoop.hedgePercentile = percentile;
+    }
+
     std::shared_ptr<Banker> getBanker() const;
     void setBanker(const std::shared_ptr<Banker> & newBanker);
 
@@ -142,6 +214,7 @@ struct Router : public RouterServiceBase,
     /** Register the exchange */
     void addExchange(std::unique_ptr<ExchangeConnector> && exchange) {
         Guard guard(lock);
+        exchange->setRouter(this);
         exchanges.emplace_back(std::move(exchange));
     }
 
@@ -216,6 +289,10 @@ struct Router : public RouterServiceBase,
     /** Return a stats object that tells us what's going on. */
     Json::Value getStats() const;
 
+    /** Return the profile of the main loop over the last given number of
+        seconds. */
+    Json::Value getLoopProfile(int seconds) const;
+
     /** Return information about a given agent. */
     Json::Value getAgentInfo(const std::string & agent) const;
 
@@ -243,6 +320,28 @@ struct Router : public RouterServiceBase,
     */
     void setBudgetErrorRate(double val) { budgetErrorRate = val; }
 
+    /** Decides which bid requests the exchange connectors should drop
+        before they even get to the router, based on the delays currently
+        being seen in the router's stages.
+    */
+    AdmissionController admission;
+
+    /** If set, messages for the agents are passed to this function instead
+        of being sent over zeromq.  The message starts with the message
+        type.  Used by simulations to deliver messages in-process.
+    */
+    std::function<void (const std::string & agent,
+                        std::vector<std::string> && message)>
+        inProcessAgentMessage;
+
+    /** Do the work that's waiting in the router's internal buffers (new
+        configurations, auctions ready to be bid on and submitted auctions)
+        in the calling thread.  This is what the main loop does on each
+        iteration; simulations that don't start the router's thread call it
+        instead.  Returns the number of items processed.
+    */
+    size_t processPendingWork();
+
     /** Overwrite this function such that it causes the number of auctions
         coming in to be throttled.
     */
@@ -261,7 +360,10 @@ struct Router : public RouterServiceBase,
     virtual Json::Value getServiceStatus() const;
 
     /** Function to override if other behaviour than sending a response to
-        the post auction loop is desired.
+        the post auction loop is desired.  It's called once for each spot
+        that had a bid submitted.  If it's not set, all of the submitted
+        spots of an auction are passed to submitToPostAuctionService()
+        together.
     */
     std::function<void (std::shared_ptr<Auction>, Id, Auction::Response)>
         onSubmittedAuction;
@@ -272,15 +374,19 @@ struct Router : public RouterServiceBase,
                                             Id auctionId,
                                             const Auction::Response & bid);
 
+    /** Function to pass all of the submitted spots of an auction on to the
+        post auction loop in one message, so that the bid request is only
+        sent once.  spotNums contains the index of each spot that had a bid
+        submitted; the submitted bid is the first response for the spot.
+    */
+    virtual void
+    submitToPostAuctionService(std::shared_ptr<Auction> auction,
+                               const std::vector<int> & spotNums);
+
 protected:
     // This thread contains the main router loop
     boost::scoped_ptr<boost::thread> runThread;
 
-    // This thread wakes up every now and again to run the destructors
-    // on auction objects, which are expensive to destroy, so that they
-    // don't have to run in the main loop
-    boost::scoped_ptr<boost::thread> cleanupThread;
-
     typedef std::recursive_mutex Lock;
     typedef std::unique_lock<Lock> Guard;
 
@@ -295,20 +401,26 @@ public:
 
     void updateAllAgents();
 
-    /** Map from the configured name of the agent to the agent info. */
-    typedef std::map<std::string, AgentInfo> Agents;
+    /** Agent info for each agent, by slot.  The configured name of an agent
+        is also its zeromq identity, and is mapped to its slot once per
+        message received.
+    */
+    typedef AgentSlots Agents;
     Agents agents;
 
     ML::RingBufferSRMW<std::pair<std::string, std::shared_ptr<const AgentConfig> > > configBuffer;
     ML::RingBufferSRMW<std::shared_ptr<AugmentationInfo> > startBiddingBuffer;
     ML::RingBufferSRMW<std::shared_ptr<Auction> > submittedBuffer;
-    ML::RingBufferSWMR<std::shared_ptr<Auction> > auctionGraveyard;
 
     ML::Wakeup_Fd wakeupMainLoop;
 
     AugmentationLoop augmentationLoop;
     Blacklist blacklist;
 
+    /** Ids of the augmentation tags used in the agents' filters.  Only
+        touched by the main loop. */
+    AugmentationTagTable augmentationTags;
+
     /** List of auctions we're currently tracking as active. */
     typedef TimeoutMap<Id, AuctionInfo> InFlight;
     InFlight inFlight;
@@ -317,8 +429,9 @@ public:
     AuctionInfo &
     addAuction(std::shared_ptr<Auction> auction, Date timeout);
 
-    DutyCycleEntry dutyCycleCurrent;
-    std::vector<DutyCycleEntry> dutyCycleHistory;
+    /** Where the main loop spends its time.  The history is served over
+        REST as /profile by the monitor provider endpoint. */
+    RouterLoopProfiler loopProfiler;
 
     void run();
 
@@ -326,8 +439,16 @@ public:
 
     void checkDeadAgents();
 
+    /** Called from the main loop.  Does nothing in simulation mode, where
+        the simulation calls expireAuctions() with its own clock.
+    */
     void checkExpiredAuctions();
 
+    /** Expire the in flight auctions, blacklist entries and debug info that
+        are due at the given time.
+    */
+    void expireAuctions(Date now);
+
     void returnErrorResponse(const std::vector<std::string> & message,
                              const std::string & error);
 
@@ -361,11 +482,12 @@ public:
     //std::unordered_set<Id> recentlySubmitted;  // DEBUG
 
     /** An agent bid on an auction.  Arrange for this bid to be recorded. */
-    void doBid(const std::vector<std::string> & message);
+    void doBid(int agentSlot, const std::vector<std::string> & message);
 
     /** An agent responded to a ping message.  Arrange for the ping time
         to be recorded. */
-    void doPong(int level, const std::vector<std::string> & message);
+    void doPong(int level, int agentSlot,
+                const std::vector<std::string> & message);
 
     /** Send out a "ping" message to each agent, and interpret the results
         of the previous set of pings (do we need to throttle down?)
@@ -402,9 +524,51 @@ public:
                           const Date & date,
                           Args... args)
     {
+        if (inProcessAgentMessage) {
+            std::vector<std::string> message;
+            message.reserve(2 + sizeof...(Args));
+            message.push_back(messageType);
+            encodeAgentMessage(message, date, args...);
+            inProcessAgentMessage(agent, std::move(message));
+            return;
+        }
+
         agentEndpoint.sendMessage(agent, messageType, date, args...);
     }
 
+    /** Encoding of messages for inProcessAgentMessage.  Each part goes
+        through the same encodeMessage() overloads that sendMessage() uses
+        to put it on the wire.
+    */
+    static void encodeAgentMessage(std::vector<std::string> & message)
+    {
+    }
+
+    template<typename First, typename... Rest>
+    static void encodeAgentMessage(std::vector<std::string> & message,
+                                   const First & first,
+                                   const Rest &... rest)
+    {
+        encodeAgentMessagePart(message, first);
+        encodeAgentMessage(message, rest...);
+    }
+
+    template<typename Part>
+    static void encodeAgentMessagePart(std::vector<std::string> & message,
+                                       const Part & part)
+    {
+        using Datacratic::encodeMessage;
+        zmq::message_t encoded = encodeMessage(part);
+        message.emplace_back(static_cast<const char *>(encoded.data()),
+                             encoded.size());
+    }
+
+    static void encodeAgentMessagePart(std::vector<std::string> & message,
+                                       const std::vector<std::string> & parts)
+    {
+        message.insert(message.end(), parts.begin(), parts.end());
+    }
+
     /** Send the given bid response to the given bidding agent. */
     void sendBidResponse(const std::string & agent,
                          const AgentInfo & info,
@@ -430,6 +594,7 @@ public:
     double bidsErrorRate;
     double budgetErrorRate;
     bool connectPostAuctionLoop;
+    bool slimPostAuctionSubmissions_;
 
 
     /*************************************************************************/
@@ -457,6 +622,18 @@ public:
     */
     AgentInfoEntry getAgentEntry(const std::string & agent) const;
 
+    /** Could any of the current agents possibly bid on the given request?
+
+        This is a cheap prefilter for the exchange connectors to call before
+        they create an auction.  It looks the request's ad formats up in
+        the PotentialBidderFilter that's built along with allAgents, and
+        checks the exchange, hour of week and location filters of the
+        agents found.  It can return true for a request that nobody will
+        bid on, but never false for one that somebody would have.  Safe to
+        call from any thread.
+    */
+    bool hasPotentialBidders(const BidRequest & request) const;
+
     /** Listen for changes in configuration and let the router know about
         them.
     */
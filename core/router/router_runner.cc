@@ -17,6 +17,7 @@
 
 #include "rtbkit/core/router/router.h"
 #include "rtbkit/core/banker/slave_banker.h"
+#include "rtbkit/common/auction_trace.h"
 #include "jml/arch/timers.h"
 #include "jml/utils/file_functions.h"
 
@@ -39,7 +40,11 @@ static inline Json::Value loadJsonFromFile(const std::string & filename)
 
 RouterRunner::
 RouterRunner()
-    : lossSeconds(15.0)
+    : lossSeconds(15.0),
+      slimPostAuctionSubmissions(false),
+      binaryAugmentationRequests(false),
+      augmentationHedgePercentile(0.0),
+      traceSampleRate(AuctionTrace::sampleRate())
 {
 }
 
@@ -66,7 +71,20 @@ doOptions(int argc, char ** argv,
         ("carbon-connection,c", value<vector<string> >(&carbonUris),
          "URI of connection to carbon daemon")
         ("exchange-configuration,x", value<string>(&exchangeConfigurationFile),
-         "configuration file with exchange data");
+         "configuration file with exchange data")
+        ("slim-post-auction", bool_switch(&slimPostAuctionSubmissions),
+         "only send the post auction service what it needs about each "
+         "submitted auction")
+        ("binary-augmentation", bool_switch(&binaryAugmentationRequests),
+         "send augmentors bid requests in the binary format, which is "
+         "cheaper for them to parse")
+        ("augmentation-hedge-percentile",
+         value<double>(&augmentationHedgePercentile),
+         "send a request to a second instance of an augmentor when it "
+         "hasn't been answered after this percentile of the augmentor's "
+         "response times (0 to 1; 0 is off)")
+        ("trace-sample-rate", value<double>(&traceSampleRate),
+         "proportion of auctions to trace the phases of (0 to 1)");
 
     options_description all_opt = opts;
     all_opt
@@ -117,6 +135,10 @@ init()
     router = std::make_shared<Router>(proxies, servicePrefix);
     router->init();
     router->setBanker(banker);
+    router->setSlimPostAuctionSubmissions(slimPostAuctionSubmissions);
+    router->setBinaryAugmentationRequests(binaryAugmentationRequests);
+    router->setAugmentationHedging(augmentationHedgePercentile);
+    AuctionTrace::setSampleRate(traceSampleRate);
     router->bindTcp();
 }
 
@@ -33,6 +33,10 @@ struct RouterRunner {
     //std::string routerConfigurationFile;
     std::string exchangeConfigurationFile;
     float lossSeconds;
+    bool slimPostAuctionSubmissions;
+    bool binaryAugmentationRequests;
+    double augmentationHedgePercentile;
+    double traceSampleRate;
 
     void doOptions(int argc, char ** argv,
                    const boost::program_options::options_description & opts
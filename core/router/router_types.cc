@@ -8,95 +8,98 @@
 #include "router_types.h"
 #include "rtbkit/core/agent_configuration/agent_config.h"
 #include "jml/db/persistent.h"
+#include <algorithm>
 
 using namespace std;
 using namespace ML;
 
 namespace RTBKIT {
 
+namespace {
+
+/// Percentile of the response times taken as the expected response time
+const double expectedPercentile = 0.9;
+
+/// Weight of each new response in the on time ratio
+const double onTimeWeight = 1.0 / 64;
+
+} // file scope
+
+AgentLatency::
+AgentLatency()
+    : numSamples(0), nextSample(0), sinceUpdate(0), numTooSlow(0),
+      expected_(0.0), onTime(1.0)
+{
+}
+
+void
+AgentLatency::
+bidReceived(double seconds)
+{
+    onTime += onTimeWeight * (1.0 - onTime);
+    addSample(seconds);
+}
+
+void
+AgentLatency::
+bidDropped(double seconds)
+{
+    onTime -= onTimeWeight * onTime;
+    addSample(seconds);
+}
+
 void
-DutyCycleEntry::
-clear()
+AgentLatency::
+addSample(double seconds)
 {
-    starting = Date::now();
-    nsSleeping = nsProcessing =  nEvents = 0;
-    nsConfig = nsBid = nsAuction = nsWin = nsLoss = nsBidResult = 0;
-    nsRemoveInFlightAuction = nsRemoveSubmittedAuction = 0;
-    nsEraseLossTimeout = nsEraseAuction = 0;
-    nsTimeout = nsSubmitted = nsImpression = nsClick = nsVisit = 0;
-    nsStartBidding = 0;
-    nsExpireInFlight = nsExpireSubmitted
-        = nsExpireFinished = nsExpireBlacklist = nsExpireBanker
-        = nsExpireDebug = nsOnExpireSubmitted = 0;
+    samples[nextSample] = seconds;
+    nextSample = (nextSample + 1) % NUM_SAMPLES;
+    if (numSamples < NUM_SAMPLES)
+        ++numSamples;
+
+    if (++sinceUpdate >= UPDATE_EVERY && numSamples >= MIN_SAMPLES)
+        update();
 }
-        
+
 void
-DutyCycleEntry::
-operator += (const DutyCycleEntry & other)
+AgentLatency::
+update()
 {
-    starting = std::min(starting, other.starting);
-    ending = std::max(ending, other.ending);
-    nsSleeping += other.nsSleeping;
-    nsProcessing += other.nsProcessing;
-    nEvents += other.nEvents;
-    nsConfig += other.nsConfig;
-    nsBid += other.nsBid;
-    nsAuction += other.nsAuction;
-    nsStartBidding += other.nsStartBidding;
-    nsWin += other.nsWin;
-    nsLoss += other.nsLoss;
-    nsBidResult += other.nsBidResult;
-    nsRemoveInFlightAuction += other.nsRemoveInFlightAuction;
-    nsTimeout += other.nsTimeout;
-    nsSubmitted += other.nsSubmitted;
-    nsImpression += other.nsImpression;
-    nsClick += other.nsClick;
-    nsVisit += other.nsVisit;
-    throw ML::Exception("not finished");
+    double sorted[NUM_SAMPLES];
+    std::copy(samples, samples + numSamples, sorted);
+
+    unsigned n = std::min<unsigned>(numSamples * expectedPercentile, numSamples - 1);
+    std::nth_element(sorted, sorted + n, sorted + numSamples);
+    expected_ = sorted[n];
+    sinceUpdate = 0;
+}
+
+bool
+AgentLatency::
+tooSlowFor(double secondsLeft)
+{
+    if (expected_ == 0.0 || expected_ <= secondsLeft)
+        return false;
+    return ++numTooSlow % PROBE_EVERY != 0;
+}
+
+size_t
+AgentLatency::
+inFlightWindow(size_t maxInFlight) const
+{
+    if (numSamples < MIN_SAMPLES)
+        return maxInFlight;
+    return std::max<size_t>(1, maxInFlight * onTime);
 }
 
 Json::Value
-DutyCycleEntry::
+AgentLatency::
 toJson() const
 {
     Json::Value result;
-
-    double elapsedTime = ending.secondsSince(starting);
-
-    Json::Value & times = result["times"];
-    Json::Value & duty = result["duty"];
-
-    result["elapsedTime"] = elapsedTime;
-    result["events"] = nEvents;
-    result["eventsPerSecond"] = nEvents / elapsedTime;
-    result["nsProcessing"] = (double)nsProcessing;
-    result["nsSleeping"] = (double)nsSleeping;
-    result["dutyCycle"] = nsProcessing / (nsSleeping + nsProcessing + 0.0);
-
-    auto doTime = [&] (const char * metric, uint64_t val)
-        {
-            times[metric] = val;
-            duty[metric] = 100.0 * (double)val / (double)nsProcessing;
-        };
-
-    doTime("config", nsConfig);
-    doTime("bid", nsBid);
-    doTime("auction", nsAuction);
-    doTime("win", nsWin);
-    doTime("loss", nsLoss);
-    doTime("bidResult", nsBidResult);
-    doTime("removeInFlightAuction", nsRemoveInFlightAuction);
-    doTime("eraseLossTimeout", nsEraseLossTimeout);
-    doTime("eraseAuction", nsEraseAuction);
-    doTime("visit", nsVisit);
-    doTime("expireInFlight", nsExpireInFlight);
-    doTime("expireSubmitted", nsExpireSubmitted);
-    doTime("expireFinished", nsExpireFinished);
-    doTime("expireBlacklist", nsExpireBlacklist);
-    doTime("expireBanker", nsExpireBanker);
-    doTime("expireDebug", nsExpireDebug);
-    doTime("onExpireSubmitted", nsOnExpireSubmitted);
-
+    result["expectedMs"] = expected_ * 1000.0;
+    result["onTimeRatio"] = onTime;
+    result["numSamples"] = numSamples;
     return result;
 }
 
@@ -109,6 +112,7 @@ toJson(bool includeConfig, bool includeStats) const
     result["lastHeartbeat"]
         = status->lastHeartbeat.print(4);
     result["numInFlight"] = status->numBidsInFlight;
+    result["latency"] = latency.toJson();
     if (config && includeConfig) result["config"] = config->toJson(false);
     if (stats && includeStats) result["stats"] = stats->toJson();
     
@@ -155,7 +159,7 @@ AgentStats()
       exchangeFiltered(0),
       segmentsMissing(0), segmentFiltered(0),
       augmentationTagsExcluded(0), userBlacklisted(0), notEnoughTime(0),
-      requiredIdMissing(0),
+      tooSlow(0), requiredIdMissing(0),
       intoFilters(0), passedStaticFilters(0),
       passedStaticPhase1(0), passedStaticPhase2(0), passedStaticPhase3(0),
       passedDynamicFilters(0),
@@ -186,6 +190,7 @@ toJson() const
     result["tooManyInFlight"] = tooManyInFlight;
     result["requiredIdMissing"] = requiredIdMissing;
     result["notEnoughTime"] = notEnoughTime;
+    result["tooSlow"] = tooSlow;
 
     result["filter_noSpots"] = noSpots;
     result["filter_skippedBidProbability"] = skippedBidProbability;
@@ -11,7 +11,10 @@
 #include "rtbkit/common/bid_request.h"
 #include "rtbkit/common/auction.h"
 #include "jml/stats/distribution.h"
+#include "jml/utils/compact_vector.h"
 #include <set>
+#include <deque>
+#include <unordered_map>
 #include "rtbkit/common/currency.h"
 
 
@@ -85,6 +88,7 @@ struct AgentStats {
     uint64_t augmentationTagsExcluded;
     uint64_t userBlacklisted;
     uint64_t notEnoughTime;
+    uint64_t tooSlow;
     uint64_t requiredIdMissing;
 
     uint64_t intoFilters;
@@ -118,6 +122,72 @@ struct AgentStatus {
     size_t numBidsInFlight;
 };
 
+/*****************************************************************************/
+/* AGENT LATENCY                                                             */
+/*****************************************************************************/
+
+/** Live estimate of how long an agent takes to answer an AUCTION message with
+    a BID, and of how many of its answers arrive before the auction expires.
+
+    The estimate comes from the most recent NUM_SAMPLES response times.  A bid
+    that was dropped because the auction expired first counts with the time
+    that it was waited for, which is a lower bound on its real response time.
+*/
+struct AgentLatency {
+    AgentLatency();
+
+    enum {
+        NUM_SAMPLES = 256,    ///< Response times kept
+        MIN_SAMPLES = 16,     ///< Needed before the estimate is used
+        UPDATE_EVERY = 16,    ///< Samples between updates of the estimate
+        PROBE_EVERY = 32      ///< Send one in this many auctions to a slow agent
+    };
+
+    /** The agent bid after the given number of seconds. */
+    void bidReceived(double seconds);
+
+    /** The auction expired after the agent had been waited for for the given
+        number of seconds. */
+    void bidDropped(double seconds);
+
+    /** Time in seconds within which the agent answers 90% of the auctions,
+        or zero if there aren't enough samples to tell. */
+    double expected() const { return expected_; }
+
+    /** Recent proportion of the auctions answered before they expired, as
+        a moving average over roughly the last 64 auctions. */
+    double onTimeRatio() const { return onTime; }
+
+    /** Is the agent too slow for an auction with the given time left?  One in
+        PROBE_EVERY of the auctions that it's too slow for is let through
+        anyway, so that the estimate follows the agent when it speeds up. */
+    bool tooSlowFor(double secondsLeft);
+
+    /** Number of bids that the agent can have in flight.  It's shrunk in
+        proportion to the bids that were dropped, so that a slow agent doesn't
+        pile up bids that will be dropped anyway. */
+    size_t inFlightWindow(size_t maxInFlight) const;
+
+    Json::Value toJson() const;
+
+private:
+    void addSample(double seconds);
+    void update();
+
+    double samples[NUM_SAMPLES];
+    unsigned numSamples;
+    unsigned nextSample;
+    unsigned sinceUpdate;
+    unsigned numTooSlow;
+    double expected_;
+    double onTime;
+};
+
+
+/*****************************************************************************/
+/* AGENT INFO                                                                */
+/*****************************************************************************/
+
 /// Information about a agent
 struct AgentInfo {
     AgentInfo()
@@ -137,10 +207,17 @@ struct AgentInfo {
     
     bool configured;
     std::shared_ptr<const AgentConfig> config;
+
+    /// config->augmentationFilter compiled against Router::augmentationTags
+    AugmentationTagFilter augmentationFilter;
+
     std::shared_ptr<AgentStatus> status;
     std::shared_ptr<AgentStats> stats;
     double throttleProbability;
 
+    /// AUCTION to BID response times
+    AgentLatency latency;
+
     /** Address of the zeromq socket for this agent. */
     std::string address;
     
@@ -245,14 +322,153 @@ private:
     //std::set<std::pair<Id, Id> > awaitingResult;  ///< Auctions which are awaiting a win/loss result
 };
 
+
+/*****************************************************************************/
+/* AGENT SLOTS                                                               */
+/*****************************************************************************/
+
+/** Information about all of the agents known to the router, stored densely
+    by slot index.
+
+    An agent is given a slot the first time it's configured and keeps it
+    for the lifetime of the router, even if it dies and comes back.  The
+    auction paths carry slots around (in PotentialBidder and AuctionInfo)
+    and so can get at an agent's AgentInfo without looking up its name.
+
+    The slots are in a deque so that references to an AgentInfo stay valid
+    while new agents are added.
+*/
+struct AgentSlots {
+    enum { NO_SLOT = -1 };
+
+    AgentSlots()
+        : numLive(0)
+    {
+    }
+
+    /** Return the slot of the given agent, or NO_SLOT if it's not live. */
+    int find(const std::string & agent) const
+    {
+        auto it = index.find(agent);
+        if (it == index.end() || !slots[it->second].live)
+            return NO_SLOT;
+        return it->second;
+    }
+
+    /** Return the slot of the given agent, bringing it to life if it's not
+        already live. */
+    int insert(const std::string & agent)
+    {
+        auto res = index.insert(std::make_pair(agent, numSlots()));
+        if (res.second) {
+            slots.push_back(Slot());
+            slots.back().name = agent;
+        }
+
+        Slot & slot = slots[res.first->second];
+        if (!slot.live) {
+            slot.live = true;
+            ++numLive;
+        }
+        return res.first->second;
+    }
+
+    /** Forget everything about the agent in the given slot.  The slot stays
+        reserved for the agent. */
+    void erase(int slot)
+    {
+        Slot & entry = slots.at(slot);
+        if (!entry.live)
+            return;
+        entry.live = false;
+        entry.info = AgentInfo();
+        --numLive;
+    }
+
+    /** Is there an agent in the given slot? */
+    bool live(int slot) const
+    {
+        return slot >= 0 && slot < numSlots() && slots[slot].live;
+    }
+
+    bool count(const std::string & agent) const
+    {
+        return find(agent) != NO_SLOT;
+    }
+
+    AgentInfo & operator [] (int slot)
+    {
+        return slots[slot].info;
+    }
+
+    const AgentInfo & operator [] (int slot) const
+    {
+        return slots[slot].info;
+    }
+
+    /** Name (and zeromq identity) of the agent in the given slot. */
+    const std::string & name(int slot) const
+    {
+        return slots[slot].name;
+    }
+
+    /** Number of live agents. */
+    size_t size() const
+    {
+        return numLive;
+    }
+
+    /** Number of slots that have been handed out.  Slots are ints, like
+        NO_SLOT, so this is too. */
+    int numSlots() const
+    {
+        return slots.size();
+    }
+
+    /** Call fn(slot, name, info) for each live agent. */
+    template<typename Fn>
+    void forEach(const Fn & fn)
+    {
+        for (int i = 0;  i < numSlots();  ++i)
+            if (slots[i].live)
+                fn(i, slots[i].name, slots[i].info);
+    }
+
+    template<typename Fn>
+    void forEach(const Fn & fn) const
+    {
+        for (int i = 0;  i < numSlots();  ++i)
+            if (slots[i].live)
+                fn(i, slots[i].name, slots[i].info);
+    }
+
+private:
+    struct Slot {
+        Slot()
+            : live(false)
+        {
+        }
+
+        std::string name;
+        bool live;
+        AgentInfo info;
+    };
+
+    std::deque<Slot> slots;
+    std::unordered_map<std::string, int> index;
+    size_t numLive;
+};
+
+
 /** Information about one of the agents in a round robin group. */
 struct PotentialBidder {
     // If inFlightProp == NULL_PROP then the bidder has been filtered out.
     enum { NULL_PROP = 1000000 };
 
-    PotentialBidder() : inFlightProp(NULL_PROP) {}
+    PotentialBidder() : agentSlot(AgentSlots::NO_SLOT), inFlightProp(NULL_PROP) {}
 
     std::string agent;
+    int agentSlot;     ///< Slot of the agent in the router's AgentSlots
     float inFlightProp;
     BiddableSpots spots;
     std::shared_ptr<const AgentConfig> config;
@@ -262,7 +478,7 @@ struct PotentialBidder {
     {
         return inFlightProp < other.inFlightProp
             || (inFlightProp == other.inFlightProp
-                && agent < other.agent);
+                && agentSlot < other.agentSlot);
     }
 };
 
@@ -297,17 +513,63 @@ struct BidInfo {
     BiddableSpots spots;
 };
 
+/** The agents that an auction was sent to, keyed by agent slot.  There are
+    only ever a handful so they're kept inline and searched linearly.
+*/
+struct AuctionBidders
+    : public ML::compact_vector<std::pair<int, BidInfo>, 4, uint32_t> {
+
+    iterator find(int agentSlot)
+    {
+        for (auto it = begin(), e = end();  it != e;  ++it)
+            if (it->first == agentSlot)
+                return it;
+        return end();
+    }
+
+    const_iterator find(int agentSlot) const
+    {
+        for (auto it = begin(), e = end();  it != e;  ++it)
+            if (it->first == agentSlot)
+                return it;
+        return end();
+    }
+
+    bool count(int agentSlot) const
+    {
+        return find(agentSlot) != end();
+    }
+
+    /** Remove the given agent and return its bid info. */
+    BidInfo pop(int agentSlot)
+    {
+        auto it = find(agentSlot);
+        if (it == end())
+            throw ML::Exception("agent slot %d isn't bidding", agentSlot);
+        BidInfo result = it->second;
+        erase(it);
+        return result;
+    }
+};
+
 // Information about an in-flight auction
 struct AuctionInfo : public AuctionInfoBase {
-    AuctionInfo() {}
+    AuctionInfo()
+        : augmenting(false)
+    {
+    }
+
     AuctionInfo(const std::shared_ptr<Auction> & auction,
                 Date lossTimeout)
-        : AuctionInfoBase(auction, lossTimeout)
+        : AuctionInfoBase(auction, lossTimeout), augmenting(false)
     {
     }
 
-    std::map<std::string, BidInfo> bidders;  ///< List of bidders
+    AuctionBidders bidders;  ///< List of bidders
 
+    /** Some of its groups are still being augmented, so it can't finish
+        when the bidders run out. */
+    bool augmenting;
 };
 
 struct FormatInfo {
@@ -322,52 +584,6 @@ struct FormatInfo {
     Json::Value toJson() const;
 };
 
-struct DutyCycleEntry {
-    DutyCycleEntry()
-    {
-        clear();
-    }
-
-    Date starting, ending;
-    uint64_t nsSleeping;
-    uint64_t nsProcessing;
-    uint64_t nEvents;
-
-    // Time for different parts
-    uint64_t nsConfig;
-    uint64_t nsBid;
-    uint64_t nsAuction;
-    uint64_t nsStartBidding;
-    uint64_t nsWin;
-    uint64_t nsLoss;
-    uint64_t nsBidResult;
-    uint64_t nsRemoveInFlightAuction;
-    uint64_t nsRemoveSubmittedAuction;
-    uint64_t nsEraseLossTimeout;
-    uint64_t nsEraseAuction;
-    uint64_t nsTimeout;
-    uint64_t nsSubmitted;
-    uint64_t nsImpression;
-    uint64_t nsClick;
-    uint64_t nsVisit;
-    uint64_t nsExpireInFlight;
-    uint64_t nsExpireSubmitted;
-    uint64_t nsExpireFinished;
-    uint64_t nsExpireBlacklist;
-    uint64_t nsExpireBanker;
-    uint64_t nsExpireDebug;
-
-    uint64_t nsOnExpireSubmitted;
-
-    void clear();
-        
-    void operator += (const DutyCycleEntry & other);
-        
-    Json::Value toJson() const;
-};
-
-
-
 
 } // namespace RTBKIT
 
@@ -6,7 +6,10 @@ LIBRTB_ROUTER_SOURCES := \
 	augmentor_events_publisher.cc \
 	router_types.cc \
 	router_base.cc \
-	router_stack.cc
+	router_stack.cc \
+	admission_controller.cc \
+	profiler.cc \
+	simulation.cc
 
 LIBRTB_ROUTER_LINK := \
 	rtb zeromq boost_thread logger opstats crypto++ leveldb gc services redis banker agent_configuration monitor monitor_service post_auction
@@ -26,4 +29,6 @@ ROUTER_LOGGER_LINK := \
 $(eval $(call library,router_logger,$(ROUTER_LOGGER_SOURCES),$(ROUTER_LOGGER_LINK)))
 $(eval $(call program,router_logger_runner,router_logger boost_program_options opstats bid_request))
 
+$(eval $(call program,auction_trace_export,rtb boost_program_options))
+
 $(eval $(call include_sub_make,rtb_router_testing,testing,rtb_router_testing.mk))
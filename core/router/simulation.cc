@@ -0,0 +1,569 @@
+/* simulation.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Discrete event simulation of the router in virtual time.
+*/
+
+#include "simulation.h"
+#include "rtbkit/core/banker/null_banker.h"
+#include "rtbkit/common/auction_pool.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/arch/exception.h"
+#include <boost/algorithm/string/trim.hpp>
+#include <algorithm>
+#include <thread>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* SIMULATION EVENT QUEUE                                                    */
+/*****************************************************************************/
+
+void
+SimulationEventQueue::
+schedule(Date when, const Event & event)
+{
+    events.push(Entry{ when, nextSeq++, event });
+}
+
+SimulationEventQueue::Event
+SimulationEventQueue::
+popNext(Date & when)
+{
+    if (events.empty())
+        throw ML::Exception("popNext on empty simulation event queue");
+
+    when = events.top().when;
+    Event result = events.top().event;
+    events.pop();
+    return result;
+}
+
+
+/*****************************************************************************/
+/* SIMULATED AUCTION                                                         */
+/*****************************************************************************/
+
+std::vector<SimulatedAuction>
+loadSimulatedAuctions(const std::string & filename,
+                      const std::string & format,
+                      double maxAuctionTime,
+                      size_t maxAuctions)
+{
+    ML::filter_istream stream(filename);
+
+    std::vector<SimulatedAuction> result;
+
+    while (stream && (maxAuctions == 0 || result.size() < maxAuctions)) {
+        string line;
+        getline(stream, line);
+        if (line.empty())
+            continue;
+
+        SimulatedAuction auction;
+        auction.request.reset(BidRequest::parse(format, line));
+        auction.requestStr = line;
+        auction.requestStrFormat = format;
+        auction.start = Date::fromSecondsSinceEpoch(auction.request->timestamp);
+        auction.expiry = auction.start.plusSeconds(maxAuctionTime);
+
+        result.push_back(auction);
+    }
+
+    auto byStart = [] (const SimulatedAuction & a1, const SimulatedAuction & a2)
+        {
+            return a1.start < a2.start;
+        };
+
+    std::stable_sort(result.begin(), result.end(), byStart);
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* SIMULATED AGENT                                                           */
+/*****************************************************************************/
+
+void
+SimulatedAgentStats::
+add(const SimulatedAgentStats & other)
+{
+    auctions += other.auctions;
+    bids += other.bids;
+    wins += other.wins;
+    losses += other.losses;
+    errors += other.errors;
+    spent += other.spent;
+    for (auto & m: other.messages)
+        messages[m.first] += m.second;
+}
+
+Json::Value
+SimulatedAgentStats::
+toJson() const
+{
+    Json::Value result;
+    result["auctions"] = (double)auctions;
+    result["bids"] = (double)bids;
+    result["wins"] = (double)wins;
+    result["losses"] = (double)losses;
+    result["errors"] = (double)errors;
+    result["spent"] = spent.toJson();
+
+    Json::Value & messagesVal = result["messages"];
+    for (auto & m: messages)
+        messagesVal[m.first] = (double)m.second;
+
+    return result;
+}
+
+SimulatedAgent::
+SimulatedAgent(const std::string & name,
+               const AgentConfig & config,
+               double responseTime,
+               Amount bidPrice)
+    : name(name), config(config), responseTime(responseTime),
+      bidPrice(bidPrice)
+{
+}
+
+SimulatedAgent::
+~SimulatedAgent()
+{
+}
+
+Json::Value
+SimulatedAgent::
+bid(const Auction & auction, const BiddableSpots & spots)
+{
+    Json::Value result(Json::arrayValue);
+
+    for (auto & spot: spots) {
+        Json::Value bid;
+        if (!spot.second.empty()) {
+            bid["creative"] = spot.second[0];
+            bid["price"] = (double)(int64_t)MicroUSD_CPM(bidPrice);
+            bid["priority"] = 1.0;
+        }
+        result.append(bid);
+    }
+
+    return result;
+}
+
+void
+SimulatedAgent::
+onResult(const Auction & auction, const Id & spotId, bool won, Amount price)
+{
+}
+
+void
+SimulatedAgent::
+onMessage(const std::vector<std::string> & message)
+{
+}
+
+
+/*****************************************************************************/
+/* SIMULATION RESULTS                                                        */
+/*****************************************************************************/
+
+void
+SimulationResults::
+add(const SimulationResults & other)
+{
+    numAuctions += other.numAuctions;
+    numSubmitted += other.numSubmitted;
+    numWins += other.numWins;
+    numLosses += other.numLosses;
+    numEvents += other.numEvents;
+    virtualSeconds += other.virtualSeconds;
+    realSeconds += other.realSeconds;
+
+    for (auto & a: other.agents)
+        agents[a.first].add(a.second);
+}
+
+Json::Value
+SimulationResults::
+toJson() const
+{
+    Json::Value result;
+    result["numAuctions"] = (double)numAuctions;
+    result["numSubmitted"] = (double)numSubmitted;
+    result["numWins"] = (double)numWins;
+    result["numLosses"] = (double)numLosses;
+    result["numEvents"] = (double)numEvents;
+    result["virtualSeconds"] = virtualSeconds;
+    result["realSeconds"] = realSeconds;
+
+    Json::Value & agentsVal = result["agents"];
+    for (auto & a: agents)
+        agentsVal[a.first] = a.second.toJson();
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* ROUTER SIMULATION                                                         */
+/*****************************************************************************/
+
+RouterSimulation::
+RouterSimulation(std::shared_ptr<ServiceProxies> services,
+                 const std::string & serviceName,
+                 std::shared_ptr<Banker> banker)
+    : winModel(defaultWinModel),
+      winDelay(0.1),
+      expiryCheckInterval(0.01),
+      router(services, serviceName, 2.0 /* secondsUntilLossAssumed */,
+             true /* simulationMode */, false /* connectPostAuctionLoop */),
+      expiryCheckScheduled(false)
+{
+    router.init();
+    router.enterSimulationMode();
+    router.setBanker(banker ? banker : std::make_shared<NullBanker>(true));
+
+    router.inProcessAgentMessage
+        = [=] (const std::string & agent, std::vector<std::string> && message)
+        {
+            this->onAgentMessage(agent, std::move(message));
+        };
+
+    router.onSubmittedAuction
+        = [=] (std::shared_ptr<Auction> auction, Id spotId,
+               Auction::Response bid)
+        {
+            this->onSubmitted(auction, spotId, bid);
+        };
+}
+
+RouterSimulation::
+~RouterSimulation()
+{
+    router.inProcessAgentMessage = nullptr;
+    router.onSubmittedAuction = nullptr;
+}
+
+void
+RouterSimulation::
+addAgent(std::shared_ptr<SimulatedAgent> agent)
+{
+    if (agents.count(agent->name))
+        throw ML::Exception("simulated agent %s already exists",
+                            agent->name.c_str());
+
+    agents[agent->name] = agent;
+    router.doConfig(agent->name,
+                    std::make_shared<const AgentConfig>(agent->config));
+}
+
+void
+RouterSimulation::
+addAuction(const SimulatedAuction & auction)
+{
+    events.schedule(auction.start, [=] () { this->startAuction(auction); });
+}
+
+void
+RouterSimulation::
+addAuctions(const std::vector<SimulatedAuction> & auctions)
+{
+    for (auto & a: auctions)
+        addAuction(a);
+}
+
+void
+RouterSimulation::
+startAuction(const SimulatedAuction & simAuction)
+{
+    auto auction = AuctionPool::global().create(Auction::HandleAuction(),
+                                                simAuction.request,
+                                                simAuction.requestStr,
+                                                simAuction.requestStrFormat,
+                                                simAuction.start,
+                                                simAuction.expiry);
+
+    if (augment)
+        augment(*auction);
+
+    ++results.numAuctions;
+    running[auction->id] = simAuction;
+
+    router.injectAuction(auction, router.secondsUntilLossAssumed());
+
+    // The exchange won't wait any longer than the expiry.  Once the
+    // auction is finished and its submission has been processed there's
+    // nothing more that needs the logged data.
+    auto onExpiry = [=] ()
+        {
+            if (!auction->tooLate())
+                auction->finish();
+            router.processPendingWork();
+            running.erase(auction->id);
+        };
+
+    events.schedule(simAuction.expiry, onExpiry);
+}
+
+void
+RouterSimulation::
+onAgentMessage(const std::string & agentName,
+               std::vector<std::string> && message)
+{
+    auto it = agents.find(agentName);
+    if (it == agents.end())
+        return;
+
+    SimulatedAgent & agent = *it->second;
+
+    const string & type = message.at(0);
+    ++agent.stats.messages[type];
+
+    if (type == "AUCTION") {
+        onAuctionMessage(agent, message);
+        return;
+    }
+
+    if (type == "ERROR" || type == "INVALID" || type == "TOOLATE"
+        || type == "DROPPEDBID")
+        ++agent.stats.errors;
+
+    agent.onMessage(message);
+}
+
+void
+RouterSimulation::
+onAuctionMessage(SimulatedAgent & agent,
+                 const std::vector<std::string> & message)
+{
+    // This is called from inside the router, so we can look at what it
+    // sent out but not call back into it.
+    Id auctionId(message.at(2));
+
+    int slot = router.agents.find(agent.name);
+    auto it = router.inFlight.find(auctionId);
+    if (slot == Router::Agents::NO_SLOT || it == router.inFlight.end())
+        return;
+
+    auto bidder = it->second.bidders.find(slot);
+    if (bidder == it->second.bidders.end())
+        return;
+
+    ++agent.stats.auctions;
+
+    Json::Value bids = agent.bid(*it->second.auction, bidder->second.spots);
+    for (unsigned i = 0;  i < bids.size();  ++i)
+        if (!bids[i].isNull())
+            ++agent.stats.bids;
+
+    std::vector<std::string> response = {
+        agent.name, "BID", message[2],
+        boost::trim_copy(bids.toString()), "null"
+    };
+
+    events.schedule(now_.plusSeconds(agent.responseTime),
+                    [=] () { this->router.handleAgentMessage(response); });
+}
+
+bool
+RouterSimulation::
+defaultWinModel(const SimulatedAuction & auction,
+                int spotNum,
+                const Auction::Response & bid,
+                Amount & winPrice)
+{
+    if (spotNum >= auction.clearingPrices.size()
+        || auction.clearingPrices[spotNum].isZero()) {
+        winPrice = bid.price.maxPrice;
+        return true;
+    }
+
+    winPrice = auction.clearingPrices[spotNum];
+    return bid.price.maxPrice >= winPrice;
+}
+
+void
+RouterSimulation::
+onSubmitted(std::shared_ptr<Auction> auction,
+            Id spotId,
+            const Auction::Response & bid)
+{
+    ++results.numSubmitted;
+
+    auto it = running.find(auction->id);
+    if (it == running.end())
+        throw ML::Exception("submitted auction %s isn't running",
+                            auction->id.toString().c_str());
+
+    const SimulatedAuction & simAuction = it->second;
+
+    const std::vector<AdSpot> & spots = auction->request->spots;
+    int spotNum = 0;
+    while (spotNum < spots.size() && spots[spotNum].id != spotId)
+        ++spotNum;
+
+    Amount winPrice;
+    bool won = winModel(simAuction, spotNum, bid, winPrice);
+
+    string item = auction->id.toString() + "-" + spotId.toString()
+        + "-" + bid.agent;
+    AccountKey account = bid.account;
+    string agentName = bid.agent;
+
+    auto onResult = [=] ()
+        {
+            auto banker = this->router.getBanker();
+            if (won) {
+                banker->winBid(account, item, winPrice);
+                ++this->results.numWins;
+            }
+            else {
+                banker->cancelBid(account, item);
+                ++this->results.numLosses;
+            }
+
+            auto it = this->agents.find(agentName);
+            if (it == this->agents.end())
+                return;
+
+            SimulatedAgent & agent = *it->second;
+            if (won) {
+                ++agent.stats.wins;
+                agent.stats.spent += winPrice;
+            }
+            else ++agent.stats.losses;
+
+            agent.onResult(*auction, spotId, won, winPrice);
+        };
+
+    events.schedule(now_.plusSeconds(winDelay), onResult);
+}
+
+void
+RouterSimulation::
+scheduleExpiryCheck()
+{
+    if (expiryCheckScheduled || events.empty())
+        return;
+
+    Date base = std::max(now_, events.nextTime());
+
+    auto onCheck = [=] ()
+        {
+            this->expiryCheckScheduled = false;
+            this->router.expireAuctions(this->now_);
+            this->scheduleExpiryCheck();
+        };
+
+    expiryCheckScheduled = true;
+    events.schedule(base.plusSeconds(expiryCheckInterval), onCheck);
+}
+
+SimulationResults
+RouterSimulation::
+run()
+{
+    Date realStart = Date::now();
+    Date virtualStart;
+
+    scheduleExpiryCheck();
+
+    while (!events.empty()) {
+        Date when;
+        SimulationEventQueue::Event event = events.popNext(when);
+
+        if (virtualStart == Date())
+            virtualStart = when;
+
+        if (now_ < when) {
+            now_ = when;
+            router.setSimulatedTime(now_);
+        }
+
+        event();
+        router.processPendingWork();
+        ++results.numEvents;
+    }
+
+    if (virtualStart != Date())
+        results.virtualSeconds += now_.secondsSince(virtualStart);
+    results.realSeconds += Date::now().secondsSince(realStart);
+
+    for (auto & a: agents)
+        results.agents[a.first] = a.second->stats;
+
+    return results;
+}
+
+
+/*****************************************************************************/
+/* SHARDED SIMULATION                                                        */
+/*****************************************************************************/
+
+SimulationResults
+runShardedSimulation(std::vector<SimulatedAuction> auctions,
+                     int numShards,
+                     const std::function<std::shared_ptr<RouterSimulation>
+                                         (int shard)> & makeSimulation)
+{
+    auto byStart = [] (const SimulatedAuction & a1, const SimulatedAuction & a2)
+        {
+            return a1.start < a2.start;
+        };
+
+    std::stable_sort(auctions.begin(), auctions.end(), byStart);
+
+    numShards = std::max(1, std::min<int>(numShards, auctions.size()));
+    size_t perShard = (auctions.size() + numShards - 1) / numShards;
+
+    std::vector<SimulationResults> shardResults(numShards);
+    std::vector<std::exception_ptr> shardErrors(numShards);
+    std::vector<std::thread> threads;
+
+    Date realStart = Date::now();
+
+    for (int shard = 0;  shard < numShards;  ++shard) {
+        size_t begin = std::min(shard * perShard, auctions.size());
+        size_t end = std::min(begin + perShard, auctions.size());
+
+        auto runShard = [&, shard, begin, end] ()
+            {
+                try {
+                    auto simulation = makeSimulation(shard);
+                    for (size_t i = begin;  i < end;  ++i)
+                        simulation->addAuction(auctions[i]);
+                    shardResults[shard] = simulation->run();
+                } catch (...) {
+                    shardErrors[shard] = std::current_exception();
+                }
+            };
+
+        threads.emplace_back(runShard);
+    }
+
+    for (auto & t: threads)
+        t.join();
+
+    for (auto & e: shardErrors)
+        if (e)
+            std::rethrow_exception(e);
+
+    SimulationResults result;
+    for (auto & r: shardResults)
+        result.add(r);
+
+    // The shards ran side by side
+    result.realSeconds = Date::now().secondsSince(realStart);
+
+    return result;
+}
+
+} // namespace RTBKIT
@@ -0,0 +1,310 @@
+/* simulation.h                                                    -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Discrete event simulation of the router in virtual time.
+*/
+
+#ifndef __router__simulation_h__
+#define __router__simulation_h__
+
+#include "router.h"
+#include "rtbkit/common/auction.h"
+#include "rtbkit/core/agent_configuration/agent_config.h"
+#include "rtbkit/core/banker/banker.h"
+#include "soa/types/date.h"
+#include "soa/jsoncpp/json.h"
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+#include <map>
+
+
+namespace RTBKIT {
+
+
+/*****************************************************************************/
+/* SIMULATION EVENT QUEUE                                                    */
+/*****************************************************************************/
+
+/** Queue of events to happen at a given point in virtual time.  Events
+    scheduled for the same time happen in the order that they were
+    scheduled.
+*/
+
+struct SimulationEventQueue {
+    typedef std::function<void ()> Event;
+
+    SimulationEventQueue()
+        : nextSeq(0)
+    {
+    }
+
+    /** Arrange for the given event to happen at the given time. */
+    void schedule(Date when, const Event & event);
+
+    bool empty() const { return events.empty(); }
+    size_t size() const { return events.size(); }
+
+    /** Time of the next event.  The queue must not be empty. */
+    Date nextTime() const { return events.top().when; }
+
+    /** Remove the next event from the queue and return it, along with the
+        time at which it happens. */
+    Event popNext(Date & when);
+
+private:
+    struct Entry {
+        Date when;
+        uint64_t seq;
+        Event event;
+
+        /// Reversed, as the priority queue puts the largest on top
+        bool operator < (const Entry & other) const
+        {
+            if (when != other.when)
+                return other.when < when;
+            return other.seq < seq;
+        }
+    };
+
+    std::priority_queue<Entry> events;
+    uint64_t nextSeq;
+};
+
+
+/*****************************************************************************/
+/* SIMULATED AUCTION                                                         */
+/*****************************************************************************/
+
+/** A logged auction to be replayed. */
+
+struct SimulatedAuction {
+    std::shared_ptr<BidRequest> request;
+    std::string requestStr;
+    std::string requestStrFormat;
+    Date start;                ///< When the auction comes in
+    Date expiry;               ///< When the exchange wants the response by
+
+    /** Price that a bid needs to beat to win each spot.  If there is
+        nothing for a spot, any bid on the spot wins at its own price. */
+    std::vector<Amount> clearingPrices;
+};
+
+/** Load logged bid requests, one per line, from the given (possibly
+    compressed) file.  The auctions start at the timestamp in the request
+    and expire maxAuctionTime seconds later.  No more than maxAuctions are
+    loaded if it's non-zero.
+*/
+std::vector<SimulatedAuction>
+loadSimulatedAuctions(const std::string & filename,
+                      const std::string & format = "datacratic",
+                      double maxAuctionTime = 0.1,
+                      size_t maxAuctions = 0);
+
+
+/*****************************************************************************/
+/* SIMULATED AGENT                                                           */
+/*****************************************************************************/
+
+struct SimulatedAgentStats {
+    SimulatedAgentStats()
+        : auctions(0), bids(0), wins(0), losses(0), errors(0)
+    {
+    }
+
+    uint64_t auctions;    ///< AUCTION messages received
+    uint64_t bids;        ///< Spots bid on
+    uint64_t wins;
+    uint64_t losses;
+    uint64_t errors;      ///< ERROR, INVALID and TOOLATE messages
+    CurrencyPool spent;   ///< Total paid for the wins
+
+    /// Count of each type of message received from the router
+    std::map<std::string, uint64_t> messages;
+
+    void add(const SimulatedAgentStats & other);
+
+    Json::Value toJson() const;
+};
+
+/** Bidding agent that lives inside the simulation.  It takes
+    responseTime seconds of virtual time to answer each auction.
+
+    The default behaviour is to bid bidPrice on every spot it's offered,
+    with the first compatible creative; override bid() to do something
+    else.
+*/
+
+struct SimulatedAgent {
+    SimulatedAgent(const std::string & name,
+                   const AgentConfig & config,
+                   double responseTime = 0.005,
+                   Amount bidPrice = USD_CPM(1));
+
+    virtual ~SimulatedAgent();
+
+    std::string name;
+    AgentConfig config;
+    double responseTime;
+    Amount bidPrice;
+
+    SimulatedAgentStats stats;
+
+    /** Return the bids for the given auction in the format of the BID
+        message: an array with one entry (or null) for each of the spots.
+    */
+    virtual Json::Value bid(const Auction & auction,
+                            const BiddableSpots & spots);
+
+    /** Called with the result of each bid that the router submitted. */
+    virtual void onResult(const Auction & auction, const Id & spotId,
+                          bool won, Amount price);
+
+    /** Called for each message that the router sends to the agent. */
+    virtual void onMessage(const std::vector<std::string> & message);
+};
+
+
+/*****************************************************************************/
+/* SIMULATION RESULTS                                                        */
+/*****************************************************************************/
+
+struct SimulationResults {
+    SimulationResults()
+        : numAuctions(0), numSubmitted(0), numWins(0), numLosses(0),
+          numEvents(0), virtualSeconds(0), realSeconds(0)
+    {
+    }
+
+    uint64_t numAuctions;     ///< Auctions injected
+    uint64_t numSubmitted;    ///< Spots that had a bid submitted
+    uint64_t numWins;
+    uint64_t numLosses;
+    uint64_t numEvents;       ///< Events processed by the event loop
+    double virtualSeconds;    ///< Simulated time covered
+    double realSeconds;       ///< Wall clock time taken
+
+    /// Statistics for each agent, by name
+    std::map<std::string, SimulatedAgentStats> agents;
+
+    void add(const SimulationResults & other);
+
+    Json::Value toJson() const;
+};
+
+
+/*****************************************************************************/
+/* ROUTER SIMULATION                                                         */
+/*****************************************************************************/
+
+/** Runs a router in virtual time, as fast as the processing allows.
+
+    There are no threads, sockets or timers involved: the router is put
+    into simulation mode and never started, and everything that would
+    happen asynchronously is an event in a SimulationEventQueue.  Before
+    each event the router's clock is moved to the time of the event; after
+    it the router's internal buffers are drained.
+
+    Agent messages are delivered to SimulatedAgent objects in-process,
+    augmentation is done by the augment function when an auction is
+    injected and the post auction loop is replaced by winModel, whose
+    results are sent back to the agents (and the banker) winDelay seconds
+    after the auction was submitted.
+
+    The result of a simulation is deterministic for a given set of
+    auctions and agents.
+*/
+
+struct RouterSimulation {
+
+    RouterSimulation(std::shared_ptr<ServiceProxies> services
+                         = std::make_shared<ServiceProxies>(),
+                     const std::string & serviceName = "simulation",
+                     std::shared_ptr<Banker> banker
+                         = std::shared_ptr<Banker>());
+
+    ~RouterSimulation();
+
+    /** Add an agent.  It's configured in the router straight away. */
+    void addAgent(std::shared_ptr<SimulatedAgent> agent);
+
+    /** Arrange for the given auction to be injected at its start time. */
+    void addAuction(const SimulatedAuction & auction);
+
+    void addAuctions(const std::vector<SimulatedAuction> & auctions);
+
+    /** Run until there is nothing left to do.  Can be called again after
+        more auctions are added. */
+    SimulationResults run();
+
+    /** Decides whether a submitted bid wins, and at what price.  The
+        default wins when the bid's maximum price is at least the clearing
+        price of the spot, and pays the clearing price.
+    */
+    typedef std::function<bool (const SimulatedAuction & auction,
+                                int spotNum,
+                                const Auction::Response & bid,
+                                Amount & winPrice)> WinModel;
+    WinModel winModel;
+
+    /** Called on each auction before it gets to the router, to fill in
+        its augmentations. */
+    std::function<void (Auction & auction)> augment;
+
+    double winDelay;              ///< Seconds from submission to WIN/LOSS
+    double expiryCheckInterval;   ///< Seconds between inFlight expiries
+
+    Router router;
+    SimulationEventQueue events;
+
+    /** Time of the event currently being processed. */
+    Date now() const { return now_; }
+
+private:
+    void startAuction(const SimulatedAuction & auction);
+    void onAgentMessage(const std::string & agent,
+                        std::vector<std::string> && message);
+    void onAuctionMessage(SimulatedAgent & agent,
+                          const std::vector<std::string> & message);
+    void onSubmitted(std::shared_ptr<Auction> auction,
+                     Id spotId,
+                     const Auction::Response & bid);
+    void scheduleExpiryCheck();
+
+    static bool defaultWinModel(const SimulatedAuction & auction,
+                                int spotNum,
+                                const Auction::Response & bid,
+                                Amount & winPrice);
+
+    std::map<std::string, std::shared_ptr<SimulatedAgent> > agents;
+
+    /// Auctions currently in the router, with their logged data
+    std::map<Id, SimulatedAuction> running;
+
+    SimulationResults results;
+    Date now_;
+    bool expiryCheckScheduled;
+};
+
+
+/** Replay the given auctions over numShards simulations running in
+    parallel, one per thread.  Each shard gets a contiguous range of the
+    auctions sorted by start time, so that the interactions between
+    auctions that are close in time are preserved.
+
+    makeSimulation is called (from the shard's thread) to create and set up
+    the simulation for each shard, including its agents.  The results of
+    the shards are added together.
+*/
+SimulationResults
+runShardedSimulation(std::vector<SimulatedAuction> auctions,
+                     int numShards,
+                     const std::function<std::shared_ptr<RouterSimulation>
+                                         (int shard)> & makeSimulation);
+
+
+} // namespace RTBKIT
+
+#endif /* __router__simulation_h__ */
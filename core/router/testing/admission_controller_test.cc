@@ -0,0 +1,77 @@
+/* admission_controller_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for the router's admission control.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/admission_controller.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+BOOST_AUTO_TEST_CASE( test_admission_controller )
+{
+    AdmissionController admission(0.1 /* update */, 0.002 /* margin */);
+    Date now = Date::fromSecondsSinceEpoch(1000);
+
+    // Nobody to bid
+    BOOST_CHECK_EQUAL(admission.admit(now, now.plusSeconds(0.1)),
+                      AdmissionController::DROP_NO_BIDDERS);
+
+    admission.setNumBidders(3);
+    BOOST_CHECK_EQUAL(admission.admit(now, now.plusSeconds(0.1)),
+                      AdmissionController::DROP_NONE);
+    BOOST_CHECK_EQUAL(admission.admit(now, now.plusSeconds(0.001)),
+                      AdmissionController::DROP_DEADLINE);
+
+    // Build up 40ms of delay in the stages
+    for (unsigned i = 0;  i < 10;  ++i) {
+        admission.recordStageDelay(AdmissionController::STAGE_AUGMENTATION,
+                                   0.005);
+        admission.recordStageDelay(AdmissionController::STAGE_START_BIDDING,
+                                   0.015);
+        admission.recordStageDelay(AdmissionController::STAGE_AGENT, 0.020);
+        now = now.plusSeconds(0.1);
+        BOOST_CHECK(admission.update(now));
+    }
+
+    // Not time to update yet
+    BOOST_CHECK(!admission.update(now.plusSeconds(0.05)));
+
+    BOOST_CHECK_CLOSE(admission.expectedLatency(), 0.040, 1.0);
+    BOOST_CHECK_CLOSE(admission.stageDelay
+                      (AdmissionController::STAGE_START_BIDDING),
+                      0.015, 1.0);
+
+    BOOST_CHECK_EQUAL(admission.admit(now, now.plusSeconds(0.030)),
+                      AdmissionController::DROP_DEADLINE);
+    BOOST_CHECK_EQUAL(admission.admit(now, now.plusSeconds(0.050)),
+                      AdmissionController::DROP_NONE);
+
+    // Once the delays go away we admit again, even though nothing that
+    // would show it is getting through.
+    for (unsigned i = 0;  i < 10;  ++i) {
+        now = now.plusSeconds(0.1);
+        admission.update(now);
+    }
+    BOOST_CHECK_EQUAL(admission.admit(now, now.plusSeconds(0.030)),
+                      AdmissionController::DROP_NONE);
+
+    BOOST_CHECK_EQUAL(admission.numAdmitted, 3);
+    BOOST_CHECK_EQUAL(admission.numDropped
+                      [AdmissionController::DROP_DEADLINE], 2);
+    BOOST_CHECK_EQUAL(admission.numDropped
+                      [AdmissionController::DROP_NO_BIDDERS], 1);
+
+    admission.setEnabled(false);
+    admission.setNumBidders(0);
+    BOOST_CHECK_EQUAL(admission.admit(now, now),
+                      AdmissionController::DROP_NONE);
+}
@@ -0,0 +1,69 @@
+/* agent_latency_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for the router's estimate of agent response times.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/router_types.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+BOOST_AUTO_TEST_CASE( test_agent_latency_estimate )
+{
+    AgentLatency latency;
+
+    // Nothing is throttled until there are enough samples
+    BOOST_CHECK_EQUAL(latency.expected(), 0.0);
+    BOOST_CHECK(!latency.tooSlowFor(0.0));
+    BOOST_CHECK_EQUAL(latency.inFlightWindow(100), 100);
+
+    // 90% of the bids in 10ms, the rest in 50ms
+    for (unsigned i = 0;  i < AgentLatency::NUM_SAMPLES;  ++i)
+        latency.bidReceived(i % 10 == 9 ? 0.050 : 0.010);
+
+    BOOST_CHECK_CLOSE(latency.expected(), 0.010, 1e-6);
+    BOOST_CHECK_CLOSE(latency.onTimeRatio(), 1.0, 1e-6);
+    BOOST_CHECK_EQUAL(latency.inFlightWindow(100), 100);
+
+    BOOST_CHECK(!latency.tooSlowFor(0.020));
+
+    // One in PROBE_EVERY of the auctions it's too slow for gets through
+    int numSent = 0;
+    for (unsigned i = 0;  i < AgentLatency::PROBE_EVERY * 4;  ++i)
+        numSent += !latency.tooSlowFor(0.005);
+    BOOST_CHECK_EQUAL(numSent, 4);
+}
+
+BOOST_AUTO_TEST_CASE( test_agent_latency_dropped_bids )
+{
+    AgentLatency latency;
+
+    for (unsigned i = 0;  i < 64;  ++i)
+        latency.bidReceived(0.010);
+
+    // The agent stops answering; the auctions expire after 50ms
+    for (unsigned i = 0;  i < AgentLatency::NUM_SAMPLES;  ++i)
+        latency.bidDropped(0.050);
+
+    BOOST_CHECK_CLOSE(latency.expected(), 0.050, 1e-6);
+    BOOST_CHECK_LT(latency.onTimeRatio(), 0.1);
+    BOOST_CHECK_LT(latency.inFlightWindow(100), 10);
+    BOOST_CHECK_GE(latency.inFlightWindow(100), 1);
+    BOOST_CHECK(latency.tooSlowFor(0.040));
+
+    // Then it recovers
+    for (unsigned i = 0;  i < AgentLatency::NUM_SAMPLES;  ++i)
+        latency.bidReceived(0.010);
+
+    BOOST_CHECK_CLOSE(latency.expected(), 0.010, 1e-6);
+    BOOST_CHECK_GT(latency.onTimeRatio(), 0.9);
+    BOOST_CHECK(!latency.tooSlowFor(0.040));
+}
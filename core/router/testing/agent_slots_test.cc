@@ -0,0 +1,80 @@
+/* agent_slots_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for the router's dense agent slots and per-auction bidder lists.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/router_types.h"
+#include <set>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+BOOST_AUTO_TEST_CASE( test_agent_slots )
+{
+    AgentSlots agents;
+
+    BOOST_CHECK_EQUAL(agents.find("a"), AgentSlots::NO_SLOT);
+    BOOST_CHECK(!agents.live(0));
+
+    int a = agents.insert("a");
+    int b = agents.insert("b");
+    BOOST_CHECK_EQUAL(a, 0);
+    BOOST_CHECK_EQUAL(b, 1);
+    BOOST_CHECK_EQUAL(agents.insert("a"), a);
+    BOOST_CHECK_EQUAL(agents.find("b"), b);
+    BOOST_CHECK_EQUAL(agents.name(b), "b");
+    BOOST_CHECK_EQUAL(agents.size(), 2);
+
+    // References stay valid while agents are added
+    AgentInfo & info = agents[a];
+    info.address = "address-a";
+    for (unsigned i = 0;  i < 1000;  ++i)
+        agents.insert("agent" + to_string(i));
+    BOOST_CHECK_EQUAL(agents[a].address, "address-a");
+    BOOST_CHECK_EQUAL(&info, &agents[a]);
+
+    // An erased agent keeps its slot, but its info is reset
+    agents.erase(a);
+    BOOST_CHECK(!agents.live(a));
+    BOOST_CHECK(!agents.count("a"));
+    BOOST_CHECK_EQUAL(agents.size(), 1001);
+    BOOST_CHECK_EQUAL(agents.insert("a"), a);
+    BOOST_CHECK_EQUAL(agents[a].address, "");
+    BOOST_CHECK_EQUAL(agents.numSlots(), 1002);
+
+    set<int> seen;
+    agents.forEach([&] (int slot, const string & name, AgentInfo & info)
+                   {
+                       BOOST_CHECK_EQUAL(agents.find(name), slot);
+                       seen.insert(slot);
+                   });
+    BOOST_CHECK_EQUAL(seen.size(), agents.size());
+}
+
+BOOST_AUTO_TEST_CASE( test_auction_bidders )
+{
+    AuctionBidders bidders;
+
+    for (int slot = 0;  slot < 6;  ++slot) {
+        BidInfo info;
+        info.bidTime = Date::fromSecondsSinceEpoch(slot);
+        bidders.push_back(make_pair(slot * 10, info));
+    }
+
+    BOOST_CHECK(bidders.count(30));
+    BOOST_CHECK(!bidders.count(31));
+    BOOST_CHECK_EQUAL(bidders.pop(30).bidTime,
+                      Date::fromSecondsSinceEpoch(3));
+    BOOST_CHECK(!bidders.count(30));
+    BOOST_CHECK_EQUAL(bidders.size(), 5);
+    BOOST_CHECK_THROW(bidders.pop(30), ML::Exception);
+    BOOST_CHECK(bidders.count(50));
+}
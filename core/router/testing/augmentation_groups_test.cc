@@ -0,0 +1,145 @@
+/* augmentation_groups_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test that the groups of an auction are passed on to start bidding as soon
+   as the augmentors that they need have responded.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/augmentation_loop.h"
+#include "rtbkit/core/agent_configuration/agent_config.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+namespace {
+
+/** Entry for an auction with one group per element of needs, each with an
+    agent named after its index that needs the given augmentors. */
+std::shared_ptr<AugmentationLoop::Entry>
+makeEntry(const vector<set<string> > & needs,
+          vector<std::shared_ptr<AugmentationInfo> > & passedOn)
+{
+    auto entry = std::make_shared<AugmentationLoop::Entry>();
+    entry->info = std::make_shared<AugmentationInfo>
+        (std::make_shared<Auction>(), Date());
+    entry->onFinished = [&] (const std::shared_ptr<AugmentationInfo> & info)
+        {
+            passedOn.push_back(info);
+        };
+
+    for (unsigned i = 0;  i < needs.size();  ++i) {
+        auto config = std::make_shared<AgentConfig>();
+        for (auto & name: needs[i]) {
+            AgentConfig::AugmentationInfo augmentation;
+            augmentation.name = name;
+            config->augmentations.push_back(augmentation);
+        }
+
+        PotentialBidder bidder;
+        bidder.agent = ML::format("%d", i);
+        bidder.config = config;
+        entry->info->potentialGroups.push_back(GroupPotentialBidders());
+        entry->info->potentialGroups.back().push_back(bidder);
+
+        entry->waiting[i] = needs[i];
+        entry->outstanding.insert(needs[i].begin(), needs[i].end());
+    }
+
+    return entry;
+}
+
+/** Agents of the groups that were passed on. */
+string agentsOf(const AugmentationInfo & info)
+{
+    string result;
+    for (auto & group: info.potentialGroups)
+        result += group.at(0).agent;
+    return result;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_groups_passed_on_when_ready )
+{
+    auto proxies = std::make_shared<ServiceProxies>();
+    AugmentationLoop loop(proxies);
+
+    vector<std::shared_ptr<AugmentationInfo> > passedOn;
+    auto entry = makeEntry({ {}, { "slow" }, { "fast", "slow" }, { "fast" } },
+                           passedOn);
+
+    // The group that needs no augmentor doesn't wait at all
+    loop.passOnGroups(*entry, false);
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 1);
+    BOOST_CHECK_EQUAL(agentsOf(*passedOn[0]), "0");
+    BOOST_CHECK(!passedOn[0]->continued);
+    BOOST_CHECK(passedOn[0]->moreToCome);
+
+    // Nor does the one that only needs the fast augmentor wait for the slow
+    entry->info->augmentations.insertGlobal(Augmentation(Json::Value("fast")));
+    BOOST_CHECK(!loop.augmentorFinished(*entry, "fast"));
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 2);
+    BOOST_CHECK_EQUAL(agentsOf(*passedOn[1]), "3");
+    BOOST_CHECK(passedOn[1]->continued);
+    BOOST_CHECK(passedOn[1]->moreToCome);
+    BOOST_CHECK_EQUAL(passedOn[1]->augmentations.size(), 1);
+
+    // The auction is only given its augmentations with the last groups
+    BOOST_CHECK(entry->info->auction->augmentations.empty());
+
+    BOOST_CHECK(loop.augmentorFinished(*entry, "slow"));
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 3);
+    BOOST_CHECK_EQUAL(agentsOf(*passedOn[2]), "12");
+    BOOST_CHECK(passedOn[2]->continued);
+    BOOST_CHECK(!passedOn[2]->moreToCome);
+    BOOST_CHECK_EQUAL(entry->info->auction->augmentations.size(), 1);
+
+    BOOST_CHECK(entry->waiting.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_groups_passed_on_together )
+{
+    auto proxies = std::make_shared<ServiceProxies>();
+    AugmentationLoop loop(proxies);
+
+    vector<std::shared_ptr<AugmentationInfo> > passedOn;
+    auto entry = makeEntry({ { "aug" }, { "aug" } }, passedOn);
+
+    loop.passOnGroups(*entry, false);
+    BOOST_CHECK(passedOn.empty());
+
+    // When they all become ready at once the auction is passed on as it is
+    BOOST_CHECK(loop.augmentorFinished(*entry, "aug"));
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 1);
+    BOOST_CHECK_EQUAL(passedOn[0], entry->info);
+    BOOST_CHECK(!passedOn[0]->continued);
+    BOOST_CHECK(!passedOn[0]->moreToCome);
+}
+
+BOOST_AUTO_TEST_CASE( test_groups_passed_on_when_expired )
+{
+    auto proxies = std::make_shared<ServiceProxies>();
+    AugmentationLoop loop(proxies);
+
+    vector<std::shared_ptr<AugmentationInfo> > passedOn;
+    auto entry = makeEntry({ { "fast" }, { "slow" }, { "slow", "other" } },
+                           passedOn);
+
+    BOOST_CHECK(!loop.augmentorFinished(*entry, "fast"));
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 1);
+
+    // The groups still waiting go together when it runs out of time
+    loop.augmentationExpired(entry->info->auction->id, *entry);
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 2);
+    BOOST_CHECK_EQUAL(agentsOf(*passedOn[1]), "12");
+    BOOST_CHECK(passedOn[1]->continued);
+    BOOST_CHECK(!passedOn[1]->moreToCome);
+}
@@ -0,0 +1,179 @@
+/* augmentation_hedging_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for hedged augmentation requests and their bookkeeping.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/augmentation_loop.h"
+#include "jml/arch/format.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+namespace {
+
+/** RESPONSE message from the given instance of the "aug" augmentor. */
+vector<string> response(const string & addr, const Id & auctionId,
+                        const string & value)
+{
+    AugmentationList augmentations;
+    augmentations.insertGlobal(Augmentation(Json::Value(value)));
+
+    return { addr, "RESPONSE", "1.0",
+             ML::format("%.5f", Date::now().secondsSinceEpoch()),
+             auctionId.toString(), "aug",
+             augmentations.toJson().toString() };
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_augmentor_latency )
+{
+    AugmentorLatency latency(0.9);
+
+    // No hedging until there are enough samples
+    for (unsigned i = 0;  i < AugmentorLatency::MIN_SAMPLES - 1;  ++i)
+        latency.responseReceived(0.001);
+    BOOST_CHECK_EQUAL(latency.expected(), 0.0);
+
+    // 90% of the responses in 1ms, the rest in 4ms
+    for (unsigned i = 0;  i < AugmentorLatency::NUM_SAMPLES;  ++i)
+        latency.responseReceived(i % 10 == 9 ? 0.004 : 0.001);
+    BOOST_CHECK_CLOSE(latency.expected(), 0.001, 1e-6);
+
+    // It follows the augmentor when it slows down
+    for (unsigned i = 0;  i < AugmentorLatency::NUM_SAMPLES;  ++i)
+        latency.responseReceived(0.003);
+    BOOST_CHECK_CLOSE(latency.expected(), 0.003, 1e-6);
+
+    // Requests that expire count for as long as they were waited for
+    for (unsigned i = 0;  i < AugmentorLatency::NUM_SAMPLES;  ++i) {
+        if (i % 5 == 4)
+            latency.requestExpired(0.010);
+        else latency.responseReceived(0.003);
+    }
+    BOOST_CHECK_CLOSE(latency.expected(), 0.010, 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE( test_augmentor_instances )
+{
+    AugmentorInfo info;
+    info.name = "aug";
+
+    BOOST_CHECK(!info.leastLoaded());
+    info.updateNumInFlight();
+    BOOST_CHECK_EQUAL(info.numInFlight, 0);
+
+    info.instances.push_back(AugmentorInstance("aug1"));
+    info.instances.push_back(AugmentorInstance("aug2"));
+
+    Date now = Date::now();
+    info.instances[0].inFlight[Id(1)] = now;
+    info.instances[0].inFlight[Id(2)] = now;
+    info.instances[1].inFlight[Id(3)] = now;
+    info.updateNumInFlight();
+
+    BOOST_CHECK_EQUAL(info.numInFlight, 1);
+    BOOST_CHECK_EQUAL(info.leastLoaded()->addr, "aug2");
+
+    // The hedge goes to an instance other than the one it was sent to
+    BOOST_CHECK_EQUAL(info.instanceFor(Id(3))->addr, "aug2");
+    BOOST_CHECK_EQUAL(info.leastLoaded("aug2")->addr, "aug1");
+    BOOST_CHECK(!info.instanceFor(Id(4)));
+
+    BOOST_CHECK_EQUAL(info.findInstance("aug1"), &info.instances[0]);
+    BOOST_CHECK(!info.findInstance("aug3"));
+
+    // With a single instance there's nowhere to hedge to
+    info.instances.pop_back();
+    BOOST_CHECK(!info.leastLoaded("aug1"));
+}
+
+BOOST_AUTO_TEST_CASE( test_hedge_first_response_wins )
+{
+    auto proxies = std::make_shared<ServiceProxies>();
+    AugmentationLoop loop(proxies);
+    loop.hedgePercentile = 0.9;
+    loop.init();
+
+    // Two instances of the same augmentor
+    loop.handleAugmentorMessage({ "aug1", "CONFIG", "1.0", "aug" });
+    loop.handleAugmentorMessage({ "aug2", "CONFIG", "1.0", "aug" });
+    AugmentorInfo & aug = *loop.augmentors.at("aug");
+    BOOST_REQUIRE_EQUAL(aug.instances.size(), 2);
+
+    // An auction that was sent to the first one, as the inbox does
+    vector<std::shared_ptr<AugmentationInfo> > passedOn;
+
+    auto auction = std::make_shared<Auction>();
+    auction->id = Id(1);
+
+    Date now = Date::now();
+    auto entry = std::make_shared<AugmentationLoop::Entry>();
+    entry->info = std::make_shared<AugmentationInfo>(auction, Date());
+    entry->info->potentialGroups.push_back(GroupPotentialBidders());
+    entry->outstanding.insert("aug");
+    entry->waiting[0].insert("aug");
+    entry->timeout = now.plusSeconds(1.0);
+    entry->onFinished = [&] (const std::shared_ptr<AugmentationInfo> & info)
+        {
+            passedOn.push_back(info);
+        };
+
+    loop.augmenting.insert(auction->id, entry, entry->timeout);
+    aug.instances[0].inFlight[auction->id] = now;
+
+    // Hedges that aren't due yet, or are for auctions that aren't being
+    // augmented any more, aren't sent
+    loop.hedgeQueue.insert(make_pair(now.plusSeconds(60.0),
+                                     make_pair(auction->id, string("aug"))));
+    loop.hedgeQueue.insert(make_pair(now, make_pair(Id(2), string("aug"))));
+    loop.checkHedges();
+    BOOST_CHECK(aug.hedges.empty());
+    BOOST_CHECK_EQUAL(loop.hedgeQueue.size(), 1);
+
+    // Once it's due the hedge goes to the other instance, and only once
+    loop.hedgeQueue.clear();
+    loop.hedgeQueue.insert(make_pair(now, make_pair(auction->id,
+                                                    string("aug"))));
+    loop.hedgeQueue.insert(make_pair(now, make_pair(auction->id,
+                                                    string("aug"))));
+    loop.checkHedges();
+    BOOST_CHECK(loop.hedgeQueue.empty());
+    BOOST_REQUIRE_EQUAL(aug.hedges.count(auction->id), 1);
+    BOOST_CHECK_EQUAL(aug.hedges[auction->id].addr, "aug2");
+    BOOST_CHECK_EQUAL(aug.hedges[auction->id].firstResponse, Date());
+    BOOST_CHECK(aug.instances[0].inFlight.count(auction->id));
+    BOOST_CHECK(aug.instances[1].inFlight.count(auction->id));
+
+    // The hedge answers first and its augmentation is the one used
+    loop.handleAugmentorMessage(response("aug2", auction->id, "hedge"));
+    BOOST_REQUIRE_EQUAL(passedOn.size(), 1);
+    BOOST_CHECK_EQUAL(auction->augmentations.size(), 1);
+    BOOST_CHECK_EQUAL(auction->augmentations.begin()->second.data.asString(),
+                      "hedge");
+    BOOST_CHECK(!loop.currentlyAugmenting(auction->id));
+    BOOST_CHECK(aug.hedges[auction->id].hedgeWon);
+    BOOST_CHECK_NE(aug.hedges[auction->id].firstResponse, Date());
+    BOOST_CHECK(!aug.instances[1].inFlight.count(auction->id));
+
+    // The late response from the first instance is ignored, but it clears
+    // up what was kept about the hedge
+    loop.handleAugmentorMessage(response("aug1", auction->id, "late"));
+    BOOST_CHECK_EQUAL(passedOn.size(), 1);
+    BOOST_CHECK_EQUAL(auction->augmentations.begin()->second.data.asString(),
+                      "hedge");
+    BOOST_CHECK(!aug.hedges.count(auction->id));
+    BOOST_CHECK(!aug.instances[0].inFlight.count(auction->id));
+    BOOST_CHECK_EQUAL(aug.numInFlight, 0);
+
+    loop.shutdown();
+}
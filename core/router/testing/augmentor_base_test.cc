@@ -0,0 +1,285 @@
+/* augmentor_base_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and throughput benchmark for the augmentor base classes.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/plugins/augmentor/augmentor_base.h"
+#include "rtbkit/core/router/testing/sample_auctions.h"
+#include "jml/utils/testing/watchdog.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+#include "jml/utils/environment.h"
+#include <set>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+/** The first numRequests bid requests of the sample auctions. */
+vector<string> loadRequests(size_t numRequests)
+{
+    vector<string> result;
+    for (auto & sample: loadSampleRequests(numRequests))
+        result.push_back(sample.str);
+    return result;
+}
+
+/** An AUGMENT message as AugmentationLoop sends it. */
+vector<string> makeMessage(const string & format, const string & request,
+                           const Id & auctionId,
+                           Date deadline = Date::now().plusSeconds(60.0))
+{
+    set<string> agents = { "agent1", "agent2" };
+    ostringstream agentsStr;
+    ML::DB::Store_Writer writer(agentsStr);
+    writer.save(agents);
+
+    return { "AUGMENT", "1.0", "counting", auctionId.toString(),
+             format, request, agentsStr.str(),
+             ML::format("%f", Date::now().secondsSinceEpoch()),
+             ML::format("%f", deadline.secondsSinceEpoch()) };
+}
+
+vector<vector<string> >
+makeMessages(const vector<string> & requests, bool binary,
+             Date deadline = Date::now().plusSeconds(60.0))
+{
+    vector<vector<string> > result;
+    for (auto & request: requests) {
+        std::shared_ptr<BidRequest> parsed
+            (BidRequest::parse("datacratic", request));
+        if (binary)
+            result.push_back(makeMessage("datacratic-binary",
+                                         parsed->serializeToString(),
+                                         parsed->auctionId, deadline));
+        else result.push_back(makeMessage("datacratic", request,
+                                          parsed->auctionId, deadline));
+    }
+    return result;
+}
+
+/** Augmentor that only counts the requests its workers decoded. */
+struct CountingAugmentor : public MultiThreadedAugmentorBase {
+    CountingAugmentor(std::shared_ptr<ServiceProxies> proxies)
+        : MultiThreadedAugmentorBase("counting", "counting", proxies),
+          numDone(0)
+    {
+    }
+
+    ~CountingAugmentor()
+    {
+        shutdown();
+    }
+
+    using AugmentorBase::handleRouterMessage;
+
+    uint64_t numDone;
+
+protected:
+    virtual void doRequestImpl(const AugmentationRequest & request)
+    {
+        if (request.bidRequest && request.agents.size() == 2)
+            ML::atomic_inc(numDone);
+    }
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_decode_request )
+{
+    vector<string> requests = loadRequests(10);
+    BOOST_REQUIRE_EQUAL(requests.size(), 10);
+
+    auto textMessages = makeMessages(requests, false);
+    auto binaryMessages = makeMessages(requests, true);
+
+    for (unsigned i = 0;  i < requests.size();  ++i) {
+        AugmentationRequest text
+            = AugmentorBase::decodeRequest("router1", textMessages[i]);
+        AugmentationRequest binary
+            = AugmentorBase::decodeRequest("router1", binaryMessages[i]);
+
+        BOOST_CHECK_EQUAL(text.router, "router1");
+        BOOST_CHECK_EQUAL(text.augmentor, "counting");
+        BOOST_CHECK_EQUAL(text.id, text.bidRequest->auctionId);
+        BOOST_CHECK_EQUAL(text.agents.size(), 2);
+        BOOST_CHECK_EQUAL(text.agents.at(0), "agent1");
+
+        BOOST_CHECK_EQUAL(binary.id, text.id);
+        BOOST_CHECK_EQUAL(binary.agents.size(), 2);
+        BOOST_CHECK_EQUAL(binary.bidRequest->toJsonStr(),
+                          text.bidRequest->toJsonStr());
+    }
+
+    // The time available is worked out from the deadline
+    AugmentationRequest request
+        = AugmentorBase::decodeRequest("router1", textMessages[0]);
+    BOOST_CHECK_GT(request.timeAvailableMs, 59000.0);
+    BOOST_CHECK_LE(request.timeAvailableMs, 60000.0);
+
+    // Routers that don't send a deadline never expire
+    auto noDeadline = textMessages[0];
+    noDeadline.pop_back();
+    request = AugmentorBase::decodeRequest("router1", noDeadline);
+    BOOST_CHECK_EQUAL(request.deadline, Date::positiveInfinity());
+
+    auto badVersion = textMessages[0];
+    badVersion[1] = "0.9";
+    BOOST_CHECK_THROW(AugmentorBase::decodeRequest("router1", badVersion),
+                      ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_projected_request )
+{
+    vector<string> requests = loadRequests(100);
+
+    uint32_t fields = BidRequest::parseFields({ "userIds" });
+    BOOST_CHECK_EQUAL(fields, BidRequest::parseFields({ "id", "userIds" }));
+    BOOST_CHECK_NE(BidRequest::parseFields({}), 0);
+    BOOST_CHECK_THROW(BidRequest::parseFields({ "userId" }), ML::Exception);
+
+    size_t fullBytes = 0, projectedBytes = 0;
+
+    for (auto & str: requests) {
+        std::shared_ptr<BidRequest> request
+            (BidRequest::parse("datacratic", str));
+        string projection = request->projected(fields).serializeToString();
+
+        fullBytes += str.size();
+        projectedBytes += projection.size();
+
+        // It's decoded by augmentors like any other request
+        AugmentationRequest decoded = AugmentorBase::decodeRequest(
+                "router1",
+                makeMessage("datacratic-binary", projection,
+                            request->auctionId));
+
+        BOOST_CHECK_EQUAL(decoded.bidRequest->auctionId, request->auctionId);
+        BOOST_CHECK_EQUAL(decoded.bidRequest->userIds.toJsonStr(),
+                          request->userIds.toJsonStr());
+        BOOST_CHECK(decoded.bidRequest->spots.empty());
+        BOOST_CHECK(decoded.bidRequest->userAgent.empty());
+    }
+
+    cerr << ML::format("%.0f bytes per request, %.0f bytes projected",
+                       1.0 * fullBytes / requests.size(),
+                       1.0 * projectedBytes / requests.size())
+         << endl;
+
+    BOOST_CHECK_LT(projectedBytes * 10, fullBytes);
+}
+
+BOOST_AUTO_TEST_CASE( test_workers_decode_requests )
+{
+    Watchdog watchdog(30.0);
+
+    auto proxies = std::make_shared<ServiceProxies>();
+    CountingAugmentor augmentor(proxies);
+    augmentor.init(2);
+
+    auto messages = makeMessages(loadRequests(100), false);
+
+    // A malformed message is dropped by the worker without killing it
+    auto truncated = messages[0];
+    truncated.resize(5);
+    augmentor.handleRouterMessage("router1", truncated);
+
+    for (auto & message: messages)
+        augmentor.handleRouterMessage("router1", message);
+
+    while (augmentor.numDone < messages.size())
+        ML::sleep(0.001);
+
+    BOOST_CHECK_EQUAL(augmentor.numDone, messages.size());
+}
+
+BOOST_AUTO_TEST_CASE( test_workers_drop_expired_requests )
+{
+    Watchdog watchdog(30.0);
+
+    auto proxies = std::make_shared<ServiceProxies>();
+    CountingAugmentor augmentor(proxies);
+    augmentor.init(2);
+
+    vector<string> requests = loadRequests(20);
+    auto expired = makeMessages(requests, false,
+                                Date::now().plusSeconds(-1.0));
+    auto live = makeMessages(requests, false);
+
+    // The expired requests are answered without reaching doRequestImpl.
+    // There's no router to send the empty answers to, so those fail.
+    for (auto & message: expired)
+        augmentor.handleRouterMessage("router1", message);
+    for (auto & message: live)
+        augmentor.handleRouterMessage("router1", message);
+
+    while (augmentor.numDone < live.size())
+        ML::sleep(0.001);
+    ML::sleep(0.1);
+
+    BOOST_CHECK_EQUAL(augmentor.numDone, live.size());
+}
+
+/* Requests per second that an augmentor that does nothing but decode can
+   take in, by number of workers.  The first line of each format is how
+   fast a single thread parses, which was the limit when the message loop
+   parsed every request.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_augmentor_workers )
+{
+    if (!runBenchmarks)
+        return;
+
+    Watchdog watchdog(300.0);
+
+    vector<string> requests = loadRequests(1000);
+    size_t numRequests = 50000;
+
+    for (bool binary: { false, true }) {
+        auto messages = makeMessages(requests, binary);
+        const char * format = binary ? "binary" : "text";
+
+        Date before = Date::now();
+        for (size_t i = 0;  i < numRequests;  ++i)
+            AugmentorBase::decodeRequest("router1",
+                                         messages[i % messages.size()]);
+        double elapsed = Date::now().secondsSince(before);
+
+        cerr << ML::format("%-6s  loop thread  %8.0f requests/s",
+                           format, numRequests / elapsed)
+             << endl;
+
+        for (int numWorkers: { 1, 2, 4, 8 }) {
+            auto proxies = std::make_shared<ServiceProxies>();
+            CountingAugmentor augmentor(proxies);
+            augmentor.init(numWorkers);
+
+            Date before = Date::now();
+            for (size_t i = 0;  i < numRequests;  ++i)
+                augmentor.handleRouterMessage("router1",
+                                              messages[i % messages.size()]);
+            while (augmentor.numDone < numRequests)
+                ML::sleep(0.0001);
+            double elapsed = Date::now().secondsSince(before);
+
+            BOOST_CHECK_EQUAL(augmentor.numDone, numRequests);
+
+            cerr << ML::format("%-6s  %d workers    %8.0f requests/s",
+                               format, numWorkers, numRequests / elapsed)
+                 << endl;
+        }
+    }
+}
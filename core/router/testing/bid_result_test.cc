@@ -0,0 +1,170 @@
+/* bid_result_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and decoding benchmark for the formats of bid result messages.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/common/bid_result.h"
+#include "rtbkit/plugins/bidding_agent/bidding_agent.h"
+#include "rtbkit/core/router/testing/sample_auctions.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/format.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+/** A bid result for the first sample auction. */
+BinaryBidResult makeResult(std::string & requestStr)
+{
+    SampleRequest sample = loadSampleRequests(1).at(0);
+    requestStr = sample.str;
+
+    BinaryBidResult result;
+    result.timestamp = Date::fromSecondsSinceEpoch(1365000000.12345);
+    result.confidence = "guaranteed";
+    result.auctionId = sample.request->auctionId;
+    result.spotNum = 0;
+    result.price = MicroUSD(1234);
+    return result;
+}
+
+/** The result as it's sent in each of the formats. */
+vector<string> fullMessage(const BinaryBidResult & result,
+                           const string & requestStr)
+{
+    return { "WIN",
+             ML::format("%.5f", result.timestamp.secondsSinceEpoch()),
+             result.confidence, result.auctionId.toString(),
+             ML::format("%d", result.spotNum), result.price.toString(),
+             requestStr,
+             "[{\"creative\":0,\"price\":\"2000USD/1M\",\"priority\":1}]",
+             "null", "{\"campaign\":\"test\"}",
+             "{\"random\":{\"tags\":[\"pass\"]}}",
+             "datacratic" };
+}
+
+vector<string> lightweightMessage(const BinaryBidResult & result)
+{
+    vector<string> message = fullMessage(result, "");
+    message.resize(6);
+    return message;
+}
+
+vector<string> binaryMessage(const BinaryBidResult & result)
+{
+    return { "WIN",
+             ML::format("%.5f", result.timestamp.secondsSinceEpoch()),
+             result.serializeToString() };
+}
+
+size_t messageBytes(const vector<string> & message)
+{
+    size_t result = 0;
+    for (auto & part: message)
+        result += part.size();
+    return result;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_binary_bid_result )
+{
+    string requestStr;
+    BinaryBidResult result = makeResult(requestStr);
+
+    BinaryBidResult decoded
+        = BinaryBidResult::createFromString(result.serializeToString());
+    BOOST_CHECK_EQUAL(decoded.timestamp, result.timestamp);
+    BOOST_CHECK_EQUAL(decoded.confidence, result.confidence);
+    BOOST_CHECK_EQUAL(decoded.auctionId, result.auctionId);
+    BOOST_CHECK_EQUAL(decoded.spotNum, result.spotNum);
+    BOOST_CHECK_EQUAL(decoded.price, result.price);
+
+    // Results that aren't for any spot and have no price
+    result.spotNum = -1;
+    result.price = Amount();
+    decoded = BinaryBidResult::createFromString(result.serializeToString());
+    BOOST_CHECK_EQUAL(decoded.spotNum, -1);
+    BOOST_CHECK_EQUAL(decoded.price, Amount());
+
+    BOOST_CHECK_THROW(BinaryBidResult::createFromString(string("\1", 1)),
+                      ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_decode_result_formats )
+{
+    string requestStr;
+    BinaryBidResult result = makeResult(requestStr);
+
+    auto full = BiddingAgent::decodeResult(fullMessage(result, requestStr));
+    auto light = BiddingAgent::decodeResult(lightweightMessage(result));
+    auto binary = BiddingAgent::decodeResult(binaryMessage(result));
+
+    for (auto * args: { &light, &binary }) {
+        BOOST_CHECK_EQUAL(args->result, "WIN");
+        BOOST_CHECK_CLOSE(args->timestamp, full.timestamp, 1e-12);
+        BOOST_CHECK_EQUAL(args->confidence, full.confidence);
+        BOOST_CHECK_EQUAL(args->auctionId, full.auctionId);
+        BOOST_CHECK_EQUAL(args->spotNum, full.spotNum);
+        BOOST_CHECK_EQUAL(args->secondPrice, full.secondPrice);
+        BOOST_CHECK(!args->request);
+    }
+
+    BOOST_CHECK_EQUAL(full.secondPrice, 1234);
+    BOOST_CHECK_EQUAL(full.request->auctionId, result.auctionId);
+    BOOST_CHECK_EQUAL(full.metadata["campaign"].asString(), "test");
+
+    // A full message that was cut short
+    auto truncated = fullMessage(result, requestStr);
+    truncated.resize(8);
+    BOOST_CHECK_THROW(BiddingAgent::decodeResult(truncated), ML::Exception);
+
+    cerr << ML::format("full %zd bytes, lightweight %zd, binary %zd",
+                       messageBytes(fullMessage(result, requestStr)),
+                       messageBytes(lightweightMessage(result)),
+                       messageBytes(binaryMessage(result)))
+         << endl;
+}
+
+/* Results per second that an agent's loop thread can decode in each of the
+   formats.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_decode_results )
+{
+    if (!runBenchmarks)
+        return;
+
+    string requestStr;
+    BinaryBidResult result = makeResult(requestStr);
+
+    vector<pair<string, vector<string> > > formats = {
+        { "full", fullMessage(result, requestStr) },
+        { "lightweight", lightweightMessage(result) },
+        { "binary", binaryMessage(result) }
+    };
+
+    for (auto & format: formats) {
+        size_t numResults = format.first == "full" ? 10000 : 200000;
+
+        Date before = Date::now();
+        for (size_t i = 0;  i < numResults;  ++i)
+            BiddingAgent::decodeResult(format.second);
+        double elapsed = Date::now().secondsSince(before);
+
+        cerr << ML::format("%-12s %10.0f results/s",
+                           format.first.c_str(), numResults / elapsed)
+             << endl;
+    }
+}
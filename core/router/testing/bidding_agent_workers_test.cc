@@ -0,0 +1,186 @@
+/* bidding_agent_workers_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and throughput benchmark for the worker threads of the bidding agent.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/plugins/bidding_agent/bidding_agent.h"
+#include "rtbkit/core/router/testing/sample_auctions.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/testing/watchdog.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+#include <mutex>
+#include <set>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+/** AUCTION messages for the first numRequests sample auctions with distinct
+    ids, as the router sends them. */
+vector<vector<string> > loadAuctions(size_t numRequests)
+{
+    vector<vector<string> > result;
+    for (auto & sample: loadSampleRequests(numRequests)) {
+        Date now = Date::now();
+        result.push_back({ "AUCTION",
+                           ML::format("%f", now.secondsSinceEpoch()),
+                           sample.request->auctionId.toString(),
+                           "datacratic", sample.str, "[]", "50.0", "null",
+                           ML::format("%f", now.plusSeconds(600.0)
+                                      .secondsSinceEpoch()) });
+    }
+    return result;
+}
+
+/** The DROPPEDBID that the router sends for an auction. */
+vector<string> droppedBid(const vector<string> & auction)
+{
+    return { "DROPPEDBID", auction[1], "guaranteed", auction[2], "0",
+             MicroUSD(0).toString() };
+}
+
+/** Agent that records which thread handled the messages for each auction. */
+struct TestAgent : public BiddingAgent {
+    TestAgent(std::shared_ptr<ServiceProxies> proxies, int numWorkers)
+        : BiddingAgent(proxies, "test_agent"),
+          numRequests(0), numDropped(0), numMismatched(0)
+    {
+        strictMode(false);
+        this->numWorkers = numWorkers;
+
+        onBidRequest = [=] (double timestamp, Id id,
+                            std::shared_ptr<BidRequest> request,
+                            Json::Value spots, double timeLeftMs,
+                            Json::Value augmentations)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                threads[id] = boost::this_thread::get_id();
+                allThreads.insert(boost::this_thread::get_id());
+                ML::atomic_inc(numRequests);
+            };
+
+        onDroppedBid = [=] (const BidResultArgs & args)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (threads[args.auctionId] != boost::this_thread::get_id())
+                    ML::atomic_inc(numMismatched);
+                ML::atomic_inc(numDropped);
+            };
+    }
+
+    ~TestAgent()
+    {
+        shutdown();
+    }
+
+    using BiddingAgent::handleRouterMessage;
+
+    std::mutex lock;
+    std::map<Id, boost::thread::id> threads;
+    std::set<boost::thread::id> allThreads;
+    uint64_t numRequests, numDropped, numMismatched;
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_workers_handle_auctions_in_order )
+{
+    Watchdog watchdog(30.0);
+
+    auto auctions = loadAuctions(1000);
+
+    auto proxies = std::make_shared<ServiceProxies>();
+    TestAgent agent(proxies, 4);
+    agent.start("", "test_agent");
+
+    for (auto & auction: auctions) {
+        agent.handleRouterMessage("router1", auction);
+        agent.handleRouterMessage("router1", droppedBid(auction));
+    }
+
+    while (agent.numDropped < auctions.size())
+        ML::sleep(0.001);
+
+    BOOST_CHECK_EQUAL(agent.numRequests, auctions.size());
+
+    // Everything about an auction is handled on the same worker, so the
+    // drop is always seen after the auction
+    BOOST_CHECK_EQUAL(agent.numMismatched, 0);
+    BOOST_CHECK_EQUAL(agent.allThreads.size(), 4);
+    BOOST_CHECK(!agent.allThreads.count(boost::this_thread::get_id()));
+
+    for (auto & auction: auctions)
+        BOOST_CHECK_EQUAL(agent.requestDeadline(Id(auction[2])), Date());
+}
+
+BOOST_AUTO_TEST_CASE( test_no_workers )
+{
+    auto auctions = loadAuctions(10);
+
+    auto proxies = std::make_shared<ServiceProxies>();
+    TestAgent agent(proxies, 0);
+    agent.start("", "test_agent");
+
+    // Everything is handled on the thread that received it
+    for (auto & auction: auctions) {
+        agent.handleRouterMessage("router1", auction);
+        BOOST_CHECK_NE(agent.requestDeadline(Id(auction[2])), Date());
+    }
+
+    BOOST_CHECK_EQUAL(agent.numRequests, auctions.size());
+    BOOST_CHECK_EQUAL(agent.allThreads.size(), 1);
+    BOOST_CHECK(agent.allThreads.count(boost::this_thread::get_id()));
+}
+
+/* AUCTION messages per second that an agent can take in, by number of
+   workers.  With no workers they're all decoded by the thread that receives
+   them, which is the limit when the loop thread does it.  Set
+   RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_agent_workers )
+{
+    if (!runBenchmarks)
+        return;
+
+    Watchdog watchdog(300.0);
+
+    auto auctions = loadAuctions(20000);
+
+    for (int numWorkers: { 0, 1, 2, 4, 8 }) {
+        auto proxies = std::make_shared<ServiceProxies>();
+        TestAgent agent(proxies, numWorkers);
+        agent.start("", "test_agent");
+
+        // Messages for a worker that's too far behind are dropped, so no
+        // more are outstanding than fit in a worker's queue
+        Date before = Date::now();
+        for (size_t i = 0;  i < auctions.size();  ++i) {
+            while (i - agent.numRequests >= 8192)
+                ML::sleep(0.0001);
+            agent.handleRouterMessage("router1", auctions[i]);
+        }
+        while (agent.numRequests < auctions.size())
+            ML::sleep(0.0001);
+        double elapsed = Date::now().secondsSince(before);
+
+        BOOST_CHECK_EQUAL(agent.numRequests, auctions.size());
+
+        cerr << ML::format("%d workers  %8.0f auctions/s",
+                           numWorkers, auctions.size() / elapsed)
+             << endl;
+    }
+}
@@ -0,0 +1,242 @@
+/* blacklist_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and memory benchmark for the router's user blacklist.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/agent_configuration/blacklist.h"
+#include "rtbkit/core/agent_configuration/agent_config.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/format.h"
+#include <fstream>
+#include <unistd.h>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+BlacklistEntry makeEntry(uint32_t agent, uint32_t site = 0)
+{
+    BlacklistEntry result;
+    result.agent = agent;
+    result.campaign = 1;
+    result.strategy = 2;
+    result.site = site;
+    return result;
+}
+
+size_t countEntries(const BlacklistStore & store, uint64_t user)
+{
+    size_t result = 0;
+    store.any(user, [&] (const BlacklistEntry &) { ++result; return false; });
+    return result;
+}
+
+/** Resident set size of the process in bytes. */
+size_t residentBytes()
+{
+    std::ifstream stream("/proc/self/statm");
+    size_t total = 0, resident = 0;
+    stream >> total >> resident;
+    return resident * getpagesize();
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_blacklist_store )
+{
+    BlacklistStore store(1.0 /* bucketSeconds */, 8 /* numBuckets */);
+    Date start = Date::now();
+
+    store.add(1, makeEntry(1), start.plusSeconds(2.0));
+    store.add(1, makeEntry(2), start.plusSeconds(4.0));
+    store.add(2, makeEntry(1), start.plusSeconds(2.0));
+    BOOST_CHECK_EQUAL(store.numUsers(), 2);
+    BOOST_CHECK_EQUAL(store.numEntries(), 3);
+
+    // The same entry again only pushes back its expiry
+    store.add(2, makeEntry(1), start.plusSeconds(30.0));
+    BOOST_CHECK_EQUAL(store.numEntries(), 3);
+
+    // User zero is a valid user
+    store.add(0, makeEntry(3), start.plusSeconds(2.0));
+    BOOST_CHECK_EQUAL(store.numUsers(), 3);
+
+    BOOST_CHECK_EQUAL(countEntries(store, 1), 2);
+    BOOST_CHECK_EQUAL(countEntries(store, 2), 1);
+    BOOST_CHECK_EQUAL(countEntries(store, 0), 1);
+    BOOST_CHECK_EQUAL(countEntries(store, 3), 0);
+    BOOST_CHECK(store.any(1, [] (const BlacklistEntry & e)
+                          { return e.agent == 2; }));
+    BOOST_CHECK(!store.any(1, [] (const BlacklistEntry & e)
+                           { return e.agent == 3; }));
+
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(1.0)), 0);
+
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(3.0)), 2);
+    BOOST_CHECK_EQUAL(countEntries(store, 1), 1);
+    BOOST_CHECK_EQUAL(countEntries(store, 0), 0);
+    BOOST_CHECK_EQUAL(store.numUsers(), 2);
+
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(5.0)), 1);
+    BOOST_CHECK_EQUAL(store.numUsers(), 1);
+
+    // User 2's entry is past the ring's horizon; it has to survive the
+    // bucket it was put in coming round, more than once.
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(12.0)), 0);
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(20.0)), 0);
+    BOOST_CHECK_EQUAL(countEntries(store, 2), 1);
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(31.0)), 1);
+    BOOST_CHECK_EQUAL(store.numUsers(), 0);
+    BOOST_CHECK_EQUAL(store.numEntries(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_blacklist_store_grows_and_shrinks )
+{
+    BlacklistStore store;
+    Date start = Date::now();
+    int numUsers = 100000;
+
+    for (int i = 0;  i < numUsers;  ++i) {
+        store.add(i, makeEntry(1), start.plusSeconds(i % 2 ? 2.0 : 60.0));
+        store.add(i, makeEntry(2, i), start.plusSeconds(2.0));
+    }
+
+    BOOST_CHECK_EQUAL(store.numUsers(), numUsers);
+    BOOST_CHECK_EQUAL(store.numEntries(), 2 * numUsers);
+    size_t fullSize = store.memUsage();
+
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(3.0)),
+                      numUsers + numUsers / 2);
+    BOOST_CHECK_EQUAL(store.numUsers(), numUsers / 2);
+
+    for (int i = 0;  i < numUsers;  ++i) {
+        size_t n = countEntries(store, i);
+        if (n != (i % 2 ? 0 : 1)) {
+            BOOST_CHECK_EQUAL(n, (i % 2 ? 0 : 1));
+            break;
+        }
+    }
+
+    BOOST_CHECK_EQUAL(store.expire(start.plusSeconds(61.0)), numUsers / 2);
+    BOOST_CHECK_EQUAL(store.numUsers(), 0);
+    BOOST_CHECK_LT(store.memUsage(), fullSize);
+}
+
+BOOST_AUTO_TEST_CASE( test_blacklist_matches )
+{
+    Blacklist blacklist;
+
+    AgentConfig config;
+    config.campaign = "campaign";
+    config.strategy = "strategy1";
+    config.blacklistType = BL_USER;
+    config.blacklistScope = BL_STRATEGY;
+    config.blacklistTime = 60.0;
+
+    BidRequest request;
+    request.url = Url("http://datacratic.com/page1");
+    request.userIds.exchangeId = Id("user1");
+
+    BidRequest otherUser = request;
+    otherUser.userIds.exchangeId = Id("user2");
+    otherUser.userIds.providerId = Id("user1");
+
+    BidRequest otherSite = request;
+    otherSite.url = Url("http://datacratic.com/page2");
+
+    BOOST_CHECK(!blacklist.matches(request, "agent1", config));
+
+    blacklist.add(request, "agent1", config);
+    BOOST_CHECK_EQUAL(blacklist.size(), 1);
+
+    BOOST_CHECK(blacklist.matches(request, "agent1", config));
+    BOOST_CHECK(blacklist.matches(request, "agent2", config));
+    BOOST_CHECK(blacklist.matches(otherSite, "agent1", config));
+
+    // Matched on the provider id as well
+    BOOST_CHECK(blacklist.matches(otherUser, "agent1", config));
+    otherUser.userIds.providerId = Id();
+    BOOST_CHECK(!blacklist.matches(otherUser, "agent1", config));
+
+    // Scope
+    AgentConfig otherStrategy = config;
+    otherStrategy.strategy = "strategy2";
+    BOOST_CHECK(!blacklist.matches(request, "agent1", otherStrategy));
+
+    otherStrategy.blacklistScope = BL_CAMPAIGN;
+    BOOST_CHECK(blacklist.matches(request, "agent1", otherStrategy));
+
+    otherStrategy.blacklistScope = BL_AGENT;
+    BOOST_CHECK(blacklist.matches(request, "agent1", otherStrategy));
+    BOOST_CHECK(!blacklist.matches(request, "agent2", otherStrategy));
+
+    // Site
+    AgentConfig siteConfig = config;
+    siteConfig.blacklistType = BL_USER_SITE;
+    BOOST_CHECK(blacklist.matches(request, "agent1", siteConfig));
+    BOOST_CHECK(!blacklist.matches(otherSite, "agent1", siteConfig));
+
+    BOOST_CHECK_GT(blacklist.memUsage(), 0);
+}
+
+/* Memory used per blacklisted user, each with a single entry, which is the
+   common case.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_blacklist_memory )
+{
+    if (!runBenchmarks)
+        return;
+
+    Date start = Date::now();
+
+    for (size_t numUsers: { 1000000, 10000000 }) {
+        size_t rssBefore = residentBytes();
+        Date before = Date::now();
+
+        BlacklistStore store;
+        for (size_t i = 0;  i < numUsers;  ++i)
+            store.add(Id(i + 1).hash(), makeEntry(i % 16 + 1),
+                      start.plusSeconds(15.0));
+
+        double insertTime = Date::now().secondsSince(before);
+        size_t rssAfter = residentBytes();
+
+        before = Date::now();
+        size_t numFound = 0;
+        for (size_t i = 0;  i < numUsers;  ++i) {
+            uint32_t agent = i % 16 + 1;
+            numFound += store.any(Id(i + 1).hash(),
+                                  [=] (const BlacklistEntry & e)
+                                  { return e.agent == agent; });
+        }
+        double lookupTime = Date::now().secondsSince(before);
+
+        BOOST_CHECK_EQUAL(store.numUsers(), numUsers);
+        BOOST_CHECK_EQUAL(numFound, numUsers);
+
+        cerr << ML::format("%8zd users: %6.1f bytes/user (%6.1f resident), "
+                           "%5.0fns/insert, %5.0fns/lookup",
+                           numUsers,
+                           1.0 * store.memUsage() / numUsers,
+                           1.0 * (rssAfter - rssBefore) / numUsers,
+                           1e9 * insertTime / numUsers,
+                           1e9 * lookupTime / numUsers)
+             << endl;
+
+        // A table slot is 32 bytes, and the table is at most 70% full.
+        // Each user is also in an expiry bucket.
+        BOOST_CHECK_LT(store.memUsage(), numUsers * (32 / 0.35 + 16));
+    }
+}
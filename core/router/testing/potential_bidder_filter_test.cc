@@ -0,0 +1,86 @@
+/* potential_bidder_filter_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for the prefilter that turns away requests that no agent could bid
+   on.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/router.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+namespace {
+
+std::shared_ptr<AgentConfig> makeConfig(int width, int height)
+{
+    auto config = std::make_shared<AgentConfig>();
+    config->creatives.push_back(Creative(width, height));
+    return config;
+}
+
+BidRequest makeRequest(const std::string & exchange, int width, int height,
+                       double timestamp = 1325376000.0)
+{
+    BidRequest request;
+    request.exchange = exchange;
+    request.timestamp = timestamp;
+    request.spots.push_back(AdSpot(Id(1)));
+    request.spots[0].formats.push_back(Format(width, height));
+    return request;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_potential_bidder_filter )
+{
+    PotentialBidderFilter filter;
+
+    // Nobody can bid on anything until there are agents
+    BOOST_CHECK(!filter.matches(makeRequest("abc", 300, 250)));
+
+    // Bids on 300x250 on exchange abc only
+    auto config = makeConfig(300, 250);
+    config->exchangeFilter.include.push_back("abc");
+    filter.add(config);
+
+    // Bids on 728x90 on Mondays from 10:00 to 11:00 UTC only
+    config = makeConfig(728, 90);
+    string hours(168, '0');
+    hours[24 + 10] = '1';
+    Json::Value hoursJson;
+    hoursJson["hourlyBitmapSundayMidnightUtc"] = hours;
+    config->hourOfWeekFilter.fromJson(hoursJson);
+    filter.add(config);
+
+    // Has no creatives so can never bid
+    filter.add(std::make_shared<AgentConfig>());
+
+    // Only the agents that can bid on something count as bidders
+    BOOST_CHECK_EQUAL(filter.size(), 2);
+
+    BOOST_CHECK(filter.matches(makeRequest("abc", 300, 250)));
+    BOOST_CHECK(!filter.matches(makeRequest("xyz", 300, 250)));
+    BOOST_CHECK(!filter.matches(makeRequest("abc", 160, 600)));
+
+    // Monday 2 January 2012
+    BOOST_CHECK(filter.matches(makeRequest("xyz", 728, 90, 1325500200.0)));
+    BOOST_CHECK(!filter.matches(makeRequest("xyz", 728, 90, 1325503800.0)));
+
+    // Without a timestamp the hour can't be held against the agent
+    BOOST_CHECK(filter.matches(makeRequest("xyz", 728, 90, 0.0)));
+
+    // Any of the request's spots will do
+    BidRequest request = makeRequest("abc", 160, 600);
+    request.spots.push_back(AdSpot(Id(2)));
+    request.spots[1].formats.push_back(Format(300, 250));
+    BOOST_CHECK(filter.matches(request));
+}
@@ -0,0 +1,106 @@
+/* router_loop_profiler_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for the continuous profile of the router's main loop.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "rtbkit/core/router/profiler.h"
+#include "jml/arch/timers.h"
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+BOOST_AUTO_TEST_CASE( test_loop_profiler_sample )
+{
+    RouterLoopProfiler profiler;
+    Date start = Date::now();
+
+    profiler.iteration();
+    profiler.iteration();
+
+    {
+        RouterProfiler bid(profiler, RLE_BID);
+        ML::sleep(0.01);
+
+        // The inner scope's cycles only go to the inner event
+        {
+            RouterProfiler pong(profiler, RLE_PONG);
+            ML::sleep(0.01);
+        }
+        BOOST_CHECK_EQUAL(profiler.currentEvent(), RLE_BID);
+    }
+    BOOST_CHECK_EQUAL(profiler.currentEvent(), RLE_IDLE);
+
+    // Only the most drained in one iteration is kept
+    profiler.drained(RLQ_START_BIDDING, 3);
+    profiler.drained(RLQ_START_BIDDING, 7);
+    profiler.drained(RLQ_START_BIDDING, 2);
+
+    RouterLoopSample sample
+        = profiler.sample(start.plusSeconds(1.0), 10, 20);
+
+    BOOST_CHECK_EQUAL(sample.iterations, 2);
+    BOOST_CHECK_EQUAL(sample.count[RLE_BID], 1);
+    BOOST_CHECK_EQUAL(sample.count[RLE_PONG], 1);
+    BOOST_CHECK_EQUAL(sample.count[RLE_CONFIG], 0);
+    BOOST_CHECK_GT(sample.ticks[RLE_BID], 0);
+    BOOST_CHECK_GT(sample.ticks[RLE_PONG], 0);
+    BOOST_CHECK_EQUAL(sample.ticks[RLE_CONFIG], 0);
+    BOOST_CHECK_EQUAL(sample.maxDrained[RLQ_START_BIDDING], 7);
+    BOOST_CHECK_EQUAL(sample.maxDrained[RLQ_SUBMITTED], 0);
+    BOOST_CHECK_EQUAL(sample.numInFlight, 10);
+    BOOST_CHECK_EQUAL(sample.numAugmenting, 20);
+    BOOST_CHECK_GT(sample.dutyCycle(), 0.0);
+    BOOST_CHECK_LE(sample.dutyCycle(), 1.0);
+
+    // Everything starts again from zero for the next interval
+    RouterLoopSample next = profiler.sample(start.plusSeconds(2.0), 0, 0);
+    BOOST_CHECK_EQUAL(next.iterations, 0);
+    BOOST_CHECK_EQUAL(next.count[RLE_BID], 0);
+    BOOST_CHECK_EQUAL(next.ticks[RLE_BID], 0);
+    BOOST_CHECK_EQUAL(next.maxDrained[RLQ_START_BIDDING], 0);
+    BOOST_CHECK_CLOSE(next.elapsed, 1.0, 1e-6);
+
+    Json::Value json = sample.toJson();
+    BOOST_CHECK_EQUAL(json["events"]["bid"]["count"].asInt(), 1);
+    BOOST_CHECK_EQUAL(json["maxDrainedPerIteration"]["startBidding"].asInt(),
+                      7);
+}
+
+BOOST_AUTO_TEST_CASE( test_loop_profiler_history )
+{
+    RouterLoopProfiler profiler(5);
+    Date start = Date::now();
+
+    for (unsigned i = 1;  i <= 10;  ++i) {
+        profiler.iteration();
+        profiler.drained(RLQ_SUBMITTED, i);
+        profiler.sample(start.plusSeconds(i), i, 0);
+    }
+
+    // Only the last maxSamples are kept
+    BOOST_CHECK_EQUAL(profiler.history(1000.0).size(), 5);
+
+    auto recent = profiler.history(2.5);
+    BOOST_REQUIRE_EQUAL(recent.size(), 3);
+    BOOST_CHECK_EQUAL(recent.front().numInFlight, 8);
+    BOOST_CHECK_EQUAL(recent.back().numInFlight, 10);
+
+    RouterLoopSample summary = profiler.summary(2.5);
+    BOOST_CHECK_EQUAL(summary.iterations, 3);
+    BOOST_CHECK_EQUAL(summary.maxDrained[RLQ_SUBMITTED], 10);
+    BOOST_CHECK_EQUAL(summary.numInFlight, 10);
+    BOOST_CHECK_CLOSE(summary.elapsed, 3.0, 1e-6);
+
+    Json::Value json = profiler.toJson(2.5);
+    BOOST_CHECK_EQUAL(json["series"]["timestamp"].size(), 3);
+    BOOST_CHECK_EQUAL(json["series"]["maxDrainedPerIteration"]["submitted"]
+                      .size(), 3);
+}
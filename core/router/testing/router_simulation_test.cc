@@ -0,0 +1,202 @@
+/* router_simulation_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test for the virtual time simulation of the router.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "jml/arch/format.h"
+#include "rtbkit/core/router/simulation.h"
+#include "rtbkit/core/router/testing/sample_auctions.h"
+#include <iostream>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+namespace {
+
+AgentConfig makeConfig(const std::string & strategy)
+{
+    AgentConfig config;
+    config.campaign = "simulation";
+    config.strategy = strategy;
+    config.account = { config.campaign, config.strategy };
+    config.maxInFlight = 20000;
+    config.minTimeAvailableMs = 0;
+    config.augmentations.clear();
+    config.creatives.push_back(Creative::sampleLB);
+    config.creatives.push_back(Creative::sampleWS);
+    config.creatives.push_back(Creative::sampleBB);
+    return config;
+}
+
+std::shared_ptr<RouterSimulation> makeSimulation(int shard = 0)
+{
+    auto result = std::make_shared<RouterSimulation>
+        (std::make_shared<ServiceProxies>(),
+         ML::format("simulation%d", shard));
+
+    // One agent that answers in time and one that never does
+    result->addAgent(std::make_shared<SimulatedAgent>
+                     ("fast", makeConfig("fast"), 0.005, USD_CPM(2)));
+    result->addAgent(std::make_shared<SimulatedAgent>
+                     ("slow", makeConfig("slow"), 0.5, USD_CPM(2)));
+    return result;
+}
+
+/** Agent that keeps the augmentations it was sent with each auction. */
+struct AugmentedAgent : public SimulatedAgent {
+    AugmentedAgent(const std::string & name, const AgentConfig & config)
+        : SimulatedAgent(name, config)
+    {
+    }
+
+    virtual Json::Value bid(const Auction & auction,
+                            const BiddableSpots & spots)
+    {
+        auto it = auction.agentAugmentations.find(name);
+        if (it != auction.agentAugmentations.end())
+            received.push_back(Json::parse(it->second));
+        return SimulatedAgent::bid(auction, spots);
+    }
+
+    vector<Json::Value> received;
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_simulation_event_queue )
+{
+    SimulationEventQueue queue;
+    vector<int> order;
+
+    Date start = Date::fromSecondsSinceEpoch(1000);
+    queue.schedule(start.plusSeconds(2), [&] () { order.push_back(3); });
+    queue.schedule(start.plusSeconds(1), [&] () { order.push_back(1); });
+    queue.schedule(start.plusSeconds(1), [&] () { order.push_back(2); });
+
+    BOOST_CHECK_EQUAL(queue.size(), 3);
+    BOOST_CHECK_EQUAL(queue.nextTime(), start.plusSeconds(1));
+
+    while (!queue.empty()) {
+        Date when;
+        queue.popNext(when)();
+    }
+
+    BOOST_CHECK(order == vector<int>({ 1, 2, 3 }));
+}
+
+BOOST_AUTO_TEST_CASE( test_router_simulation_replay )
+{
+    auto auctions = loadSimulatedAuctions(sampleAuctionFile, "datacratic", 0.05,
+                                          2000);
+    BOOST_REQUIRE_EQUAL(auctions.size(), 2000);
+
+    // Every other auction has a clearing price that the agents can't meet
+    for (unsigned i = 0;  i < auctions.size();  i += 2)
+        auctions[i].clearingPrices.resize(auctions[i].request->spots.size(),
+                                          USD_CPM(10));
+
+    auto simulation = makeSimulation();
+    simulation->addAuctions(auctions);
+    SimulationResults results = simulation->run();
+
+    cerr << results.toJson() << endl;
+
+    BOOST_CHECK_EQUAL(results.numAuctions, auctions.size());
+    BOOST_CHECK_GT(results.numSubmitted, 0);
+    BOOST_CHECK_EQUAL(results.numWins + results.numLosses,
+                      results.numSubmitted);
+    BOOST_CHECK_GT(results.numWins, 0);
+    BOOST_CHECK_GT(results.numLosses, 0);
+
+    // Virtual time covers the whole log, however long it took to run
+    BOOST_CHECK_GT(results.virtualSeconds,
+                   auctions.back().start.secondsSince(auctions[0].start));
+
+    const SimulatedAgentStats & fast = results.agents["fast"];
+    const SimulatedAgentStats & slow = results.agents["slow"];
+
+    BOOST_CHECK_GT(fast.auctions, 0);
+    BOOST_CHECK_EQUAL(fast.wins + fast.losses, results.numSubmitted);
+    BOOST_CHECK_EQUAL(fast.errors, 0);
+
+    // The slow agent's bids all arrive after the auction has expired
+    BOOST_CHECK_GT(slow.auctions, 0);
+    BOOST_CHECK_EQUAL(slow.wins + slow.losses, 0);
+    BOOST_CHECK_GT(slow.errors, 0);
+
+    // The same input gives the same output
+    auto simulation2 = makeSimulation();
+    simulation2->addAuctions(auctions);
+    SimulationResults results2 = simulation2->run();
+
+    BOOST_CHECK_EQUAL(results2.numSubmitted, results.numSubmitted);
+    BOOST_CHECK_EQUAL(results2.numWins, results.numWins);
+    BOOST_CHECK_EQUAL(results2.numEvents, results.numEvents);
+    BOOST_CHECK_EQUAL(results2.agents["fast"].toJson(), fast.toJson());
+}
+
+BOOST_AUTO_TEST_CASE( test_simulation_augmentations )
+{
+    auto auctions = loadSimulatedAuctions(sampleAuctionFile, "datacratic", 0.05,
+                                          100);
+
+    RouterSimulation simulation;
+    auto agent = std::make_shared<AugmentedAgent>("augmented",
+                                                  makeConfig("augmented"));
+    simulation.addAgent(agent);
+
+    // What the augment hook gives the auction is what the agent gets
+    simulation.augment = [] (Auction & auction)
+        {
+            Augmentation augmentation(Json::Value("segment"));
+            augmentation.tags.insert("pass");
+            auction.augmentations.insertGlobal(augmentation);
+        };
+
+    simulation.addAuctions(auctions);
+    SimulationResults results = simulation.run();
+
+    BOOST_CHECK_GT(results.agents["augmented"].auctions, 0);
+    BOOST_CHECK_EQUAL(agent->received.size(),
+                      results.agents["augmented"].auctions);
+
+    for (auto & augmentation: agent->received) {
+        BOOST_CHECK_EQUAL(augmentation["data"].asString(), "segment");
+        BOOST_CHECK_EQUAL(augmentation["tags"][0].asString(), "pass");
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_sharded_simulation )
+{
+    auto auctions = loadSimulatedAuctions(sampleAuctionFile, "datacratic", 0.05,
+                                          4000);
+
+    SimulationResults single;
+    {
+        auto simulation = makeSimulation();
+        simulation->addAuctions(auctions);
+        single = simulation->run();
+    }
+
+    SimulationResults sharded
+        = runShardedSimulation(auctions, 4, makeSimulation);
+
+    cerr << ML::format("single: %.3fs real for %.1fs virtual; "
+                       "4 shards: %.3fs real",
+                       single.realSeconds, single.virtualSeconds,
+                       sharded.realSeconds)
+         << endl;
+
+    BOOST_CHECK_EQUAL(sharded.numAuctions, auctions.size());
+    BOOST_CHECK_EQUAL(sharded.agents["fast"].auctions,
+                      single.agents["fast"].auctions);
+    BOOST_CHECK_EQUAL(sharded.numSubmitted, single.numSubmitted);
+}
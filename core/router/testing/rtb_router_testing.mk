@@ -3,9 +3,32 @@
 
 #$(eval $(call program,rtb_router_test,rtb_router boost_unit_test_framework))
 
+# librouter_testing.so
+LIBROUTERTESTING_SOURCES := \
+	sample_auctions.cc
+
+LIBROUTERTESTING_LINK := \
+	bid_request utils
+
+$(eval $(call library,router_testing, \
+	$(LIBROUTERTESTING_SOURCES), \
+	$(LIBROUTERTESTING_LINK)))
+
 $(eval $(call nodejs_test,rtb_router_unit_test,rtb sync))
 $(eval $(call nodejs_test,rtb_new_format_test,bid_request sync_utils))
 #$(eval $(call test,rtb_router_leak_test,rtb_router rtbsim,boost valgrind))
 $(eval $(call test,pending_list_test,types,boost))
+$(eval $(call test,agent_slots_test,rtb_router,boost))
+$(eval $(call test,admission_controller_test,rtb_router,boost))
+$(eval $(call test,agent_latency_test,rtb_router,boost))
+$(eval $(call test,router_loop_profiler_test,rtb_router,boost))
+$(eval $(call test,blacklist_test,rtb_router,boost))
+$(eval $(call test,potential_bidder_filter_test,rtb_router,boost))
+$(eval $(call test,router_simulation_test,rtb_router router_testing,boost))
+$(eval $(call test,augmentor_base_test,augmentor_base bid_request services router_testing,boost))
+$(eval $(call test,augmentation_hedging_test,rtb_router,boost))
+$(eval $(call test,augmentation_groups_test,rtb_router,boost))
+$(eval $(call test,bid_result_test,bidding_agent bid_request router_testing,boost))
+$(eval $(call test,bidding_agent_workers_test,bidding_agent bid_request services router_testing,boost))
 #$(eval $(call test,router_banker_test,rtb_router dataflow bidding_agent,boost))
 #$(eval $(call test,augmentation_test,rtb_router bid_request augmentor_base,boost))
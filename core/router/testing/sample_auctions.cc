@@ -0,0 +1,40 @@
+/* sample_auctions.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Access to the log of sample auctions that the router tests replay.
+*/
+
+#include "sample_auctions.h"
+#include "jml/utils/filter_streams.h"
+#include <set>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace RTBKIT {
+
+const char * sampleAuctionFile
+    = "rtbkit/core/router/testing/20000-datacratic-auctions.xz";
+
+std::vector<SampleRequest>
+loadSampleRequests(size_t numRequests)
+{
+    filter_istream stream(sampleAuctionFile);
+
+    vector<SampleRequest> result;
+    set<Id> seen;
+    string line;
+    while (result.size() < numRequests && getline(stream, line)) {
+        SampleRequest sample;
+        sample.request.reset(BidRequest::parse("datacratic", line));
+        if (!seen.insert(sample.request->auctionId).second)
+            continue;
+        sample.str = line;
+        result.push_back(sample);
+    }
+    return result;
+}
+
+} // namespace RTBKIT
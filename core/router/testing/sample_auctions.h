@@ -0,0 +1,35 @@
+/* sample_auctions.h                                               -*- C++ -*-
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Access to the log of sample auctions that the router tests replay.
+*/
+
+#ifndef __router__testing__sample_auctions_h__
+#define __router__testing__sample_auctions_h__
+
+#include "rtbkit/common/bid_request.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace RTBKIT {
+
+/** Log of 20000 bid requests in the "datacratic" format, one per line. */
+extern const char * sampleAuctionFile;
+
+/** A bid request of the sample log, as it was logged and parsed. */
+struct SampleRequest {
+    std::string str;
+    std::shared_ptr<BidRequest> request;
+};
+
+/** The first numRequests bid requests of the sample log.  Those with an
+    auction id that was already seen are skipped, so that each is for a
+    different auction.
+*/
+std::vector<SampleRequest> loadSampleRequests(size_t numRequests);
+
+} // namespace RTBKIT
+
+#endif /* __router__testing__sample_auctions_h__ */
@@ -136,6 +136,8 @@ struct Components
 
         // Setup a post auction loop (PAL) which handles all exchange events
         // that don't need to be processed in real-time (wins, loss, etc).
+        // Its state is split by auction id over a couple of threads.
+        postAuctionLoop.setNumPartitions(2);
         postAuctionLoop.init();
         postAuctionLoop.setBanker(makeSlaveBanker("pas1"));
         postAuctionLoop.bindTcp();
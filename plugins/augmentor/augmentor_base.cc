@@ -11,6 +11,7 @@
 #include "jml/arch/timers.h"
 #include "jml/utils/vector_utils.h"
 #include "jml/arch/futex.h"
+#include <boost/algorithm/string/join.hpp>
 
 
 using namespace std;
@@ -56,14 +57,25 @@ init()
 {
     toRouters.init(getServices()->config, serviceName());
 
+    // Fail now rather than in the router
+    BidRequest::parseFields(requestFields);
+    string fields = boost::algorithm::join(requestFields, ",");
+
     toRouters.connectHandler = [=] (const std::string & newRouter)
         {
             cerr << "connected to router " << newRouter << endl;
 
-            toRouters.sendMessage(newRouter,
-                                  "CONFIG",
-                                  "1.0",
-                                  augmentorName);
+            if (fields.empty())
+                toRouters.sendMessage(newRouter,
+                                      "CONFIG",
+                                      "1.0",
+                                      augmentorName);
+            else
+                toRouters.sendMessage(newRouter,
+                                      "CONFIG",
+                                      "1.0",
+                                      augmentorName,
+                                      fields);
 
             cerr << "done sending message" << endl;
         };
@@ -128,6 +140,82 @@ respond(const AugmentationRequest & request, const AugmentationList & response)
             chomp(response.toJson().toString()));
 }
 
+namespace {
+
+/** Decode the fields of an AUGMENT message that are needed to respond to
+    it, which is all but the agents and the bid request. */
+AugmentationRequest
+decodeHeader(const std::string & router,
+             const std::vector<std::string> & message)
+{
+    const string & version = message.at(1);
+
+    if (version != "1.0")
+        throw ML::Exception("unexpected version in augment");
+
+    AugmentationRequest request;
+    request.router = router;
+    request.augmentor = message.at(2);
+    request.id = Id(message.at(3));
+
+    const string & startTimeStr = message.at(7);
+    request.startTime
+        = Date::fromSecondsSinceEpoch(strtod(startTimeStr.c_str(), 0));
+
+    // Older routers don't send the deadline
+    if (message.size() > 8) {
+        request.deadline = Date::parseSecondsSinceEpoch(message[8]);
+        request.timeAvailableMs
+            = Date::now().secondsUntil(request.deadline) * 1000.0;
+    }
+    else {
+        request.deadline = Date::positiveInfinity();
+        request.timeAvailableMs = 0.05;
+    }
+
+    return request;
+}
+
+/** Decode the agents and the bid request of an AUGMENT message. */
+void
+decodeBody(const std::vector<std::string> & message,
+           AugmentationRequest & request)
+{
+    const string & bidRequestSource = message.at(4);
+    const string & bidRequestStr = message.at(5);
+
+    const string & agentsStr = message.at(6);
+    ML::DB::Store_Reader reader(agentsStr.c_str(), agentsStr.size());
+    reader.load(request.agents);
+
+    request.bidRequest.reset(
+            BidRequest::parse(bidRequestSource, bidRequestStr));
+}
+
+} // file scope
+
+AugmentationRequest
+AugmentorBase::
+decodeRequest(const std::string & router,
+              const std::vector<std::string> & message)
+{
+    AugmentationRequest request = decodeHeader(router, message);
+    decodeBody(message, request);
+    return request;
+}
+
+bool
+AugmentorBase::
+respondIfExpired(const AugmentationRequest & request)
+{
+    if (Date::now() < request.deadline)
+        return false;
+
+    recordHit("expiredRequests");
+    respond(request, AugmentationList());
+    return true;
+}
+
 void
 AugmentorBase::
 handleRouterMessage(const std::string & router,
@@ -147,35 +235,19 @@ handleRouterMessage(const std::string & router,
 #endif
         }
         else if (type == "AUGMENT") {
-            const string & version = message.at(1);
-
-            if (version != "1.0")
-                throw ML::Exception("unexpected version in augment");
-
-            AugmentationRequest request;
-            request.router = router;
-            request.timeAvailableMs = 0.05;
-            request.augmentor = message.at(2);
-            request.id = Id(message.at(3));
-
-            const string & bidRequestSource = message.at(4);
-            const string & bidRequestStr = message.at(5);
-
-            istringstream agentsStr(message.at(6));
-            ML::DB::Store_Reader reader(agentsStr);
-            reader.load(request.agents);
-
-            const string & startTimeStr = message.at(7);
-            request.startTime
-                = Date::fromSecondsSinceEpoch(strtod(startTimeStr.c_str(), 0));
+            if (onRawRequest) {
+                onRawRequest(router, message);
+                return;
+            }
 
-            if (onRequest) {
-                request.bidRequest.reset(
-                        BidRequest::parse(bidRequestSource, bidRequestStr));
+            AugmentationRequest request = decodeHeader(router, message);
 
+            if (!onRequest)
+                respond(request, AugmentationList());
+            else if (!respondIfExpired(request)) {
+                decodeBody(message, request);
                 onRequest(request);
             }
-            else respond(request, AugmentationList());
         }
         else throw ML::Exception("unknown router message");
 
@@ -198,8 +270,8 @@ MultiThreadedAugmentorBase(const std::string & augmentorName,
       numWithInfo(0),
       ringBuffer(102400)
 {
-    AugmentorBase::onRequest
-        = boost::bind(&MultiThreadedAugmentorBase::pushRequest, this, _1);
+    AugmentorBase::onRawRequest
+        = boost::bind(&MultiThreadedAugmentorBase::pushRequest, this, _1, _2);
     numThreadsCreated = 0;
 }
 
@@ -211,8 +283,8 @@ MultiThreadedAugmentorBase(const std::string & augmentorName,
       numWithInfo(0),
       ringBuffer(102400)
 {
-    AugmentorBase::onRequest
-        = boost::bind(&MultiThreadedAugmentorBase::pushRequest, this, _1);
+    AugmentorBase::onRawRequest
+        = boost::bind(&MultiThreadedAugmentorBase::pushRequest, this, _1, _2);
     numThreadsCreated = 0;
 }
 
@@ -248,7 +320,7 @@ shutdown()
     ML::memory_barrier();
 
     for (unsigned i = 0;  i < numThreadsCreated;  ++i)
-        pushRequest(AugmentationRequest());
+        ringBuffer.push(RawRequest());
 
     workers.join_all();
 
@@ -263,10 +335,17 @@ runWorker()
 {
     while (!shutdown_) {
         try {
-            auto req = ringBuffer.pop();
+            auto raw = ringBuffer.pop();
             if (shutdown_)
                 return;
-            doRequestImpl(req);
+
+            AugmentationRequest request
+                = decodeHeader(raw.router, raw.message);
+            if (respondIfExpired(request))
+                continue;
+
+            decodeBody(raw.message, request);
+            doRequestImpl(request);
         } catch (const std::exception & exc) {
             std::cerr << "exception handling aug request: "
                       << exc.what() << std::endl;
@@ -276,9 +355,13 @@ runWorker()
 
 void
 MultiThreadedAugmentorBase::
-pushRequest(const AugmentationRequest & request)
+pushRequest(const std::string & router,
+            const std::vector<std::string> & message)
 {
-    ringBuffer.push(request);
+    RawRequest raw;
+    raw.router = router;
+    raw.message = message;
+    ringBuffer.push(raw);
 }
 
 } // namespace RTBKIT
@@ -45,6 +45,7 @@ struct AugmentationRequest
     std::vector<std::string> agents;          // Agents availble to bid.
     double timeAvailableMs;                   // Time to respond.
     Date startTime;                           // Start of the latency timer.
+    Date deadline;                            // Router stops waiting here.
 };
 
 
@@ -77,23 +78,67 @@ struct AugmentorBase : public ServiceBase, public MessageLoop {
     */
     void configureAndWait();
 
+    /** Fields of the bid request that the augmentor needs, named as they
+        are in the canonical JSON (see BidRequest::parseFields()).  The
+        router then only sends those fields, which for an augmentor keyed on
+        a user id is a few bytes instead of the whole request.  Empty means
+        the whole request.  Must be set before init(), and needs a router
+        that knows about projections.
+    */
+    std::vector<std::string> requestFields;
+
     /** Type of the callback for an augmentation request. */
     typedef boost::function<void (const AugmentationRequest &)> OnRequest;
 
     /** Function to be called on an augmentation request. */
     OnRequest onRequest;
 
+    /** Type of the callback for an augmentation request that hasn't been
+        decoded yet.  The message is the AUGMENT message as it came from the
+        router.
+    */
+    typedef boost::function<void (const std::string & router,
+                                  const std::vector<std::string> & message)>
+        OnRawRequest;
+
+    /** Function to be called on an augmentation request in place of
+        onRequest.  Decoding the request, which means parsing the bid request,
+        is left to the callback so that it can be done by decodeRequest() on
+        another thread than the message loop.
+    */
+    OnRawRequest onRawRequest;
+
+    /** Decode the given AUGMENT message from the given router, including
+        parsing its bid request.  Throws if the message is malformed.
+
+        The deadline is the absolute time at which the router stops waiting
+        for the augmentation, which assumes that the clocks of the router and
+        augmentor are kept in sync; timeAvailableMs is what's left of it at
+        the time of decoding.  Routers that don't send a deadline leave it
+        at positive infinity.
+    */
+    static AugmentationRequest
+    decodeRequest(const std::string & router,
+                  const std::vector<std::string> & message);
+
     /** Function to be called to respond to an augmentation request. */
     void respond(const AugmentationRequest & request,
                  const AugmentationList & response);
 
+protected:
+    void handleRouterMessage(const std::string & router,
+                             const std::vector<std::string> & message);
+
+    /** If the request's deadline has already passed, respond to it with an
+        empty augmentation so that the router stops tracking it, and return
+        true.  This is done before any work is done on the request.
+    */
+    bool respondIfExpired(const AugmentationRequest & request);
+
 private:
     std::string augmentorName; // This can differ from the servicenName!
 
     ZmqMultipleNamedClientBusProxy toRouters;
-
-    void handleRouterMessage(const std::string & router,
-                             const std::vector<std::string> & message);
 };
 
 
@@ -101,7 +146,14 @@ private:
 /* MULTI THREADED AUGMENTOR                                                   */
 /*****************************************************************************/
 
-/** Multi-threaded augmentor base class. */
+/** Multi-threaded augmentor base class.
+
+    The message loop only queues the AUGMENT messages; they are decoded,
+    including the parsing of the bid request, by the worker that picks them
+    up so that the cost of parsing is spread over the workers.  Requests
+    whose deadline has passed by the time a worker picks them up are
+    answered with an empty augmentation without being parsed.
+*/
 
 struct MultiThreadedAugmentorBase : public AugmentorBase {
 
@@ -125,7 +177,13 @@ protected:
 private:
     uint64_t numWithInfo;
 
-    ML::RingBufferSWMR<AugmentationRequest> ringBuffer;
+    /** An AUGMENT message waiting for a worker. */
+    struct RawRequest {
+        std::string router;
+        std::vector<std::string> message;
+    };
+
+    ML::RingBufferSWMR<RawRequest> ringBuffer;
 
     boost::thread_group workers;
 
@@ -137,7 +195,8 @@ private:
 
     volatile bool shutdown_;
 
-    void pushRequest(const AugmentationRequest &);
+    void pushRequest(const std::string & router,
+                     const std::vector<std::string> & message);
 };
 
 
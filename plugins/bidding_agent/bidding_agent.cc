@@ -6,6 +6,7 @@
 */
 
 #include "rtbkit/plugins/bidding_agent/bidding_agent.h"
+#include "rtbkit/common/bid_result.h"
 
 #include "jml/arch/exception.h"
 #include "jml/arch/timers.h"
@@ -15,6 +16,7 @@
 #include "jml/arch/futex.h"
 #include "soa/service/zmq_utils.h"
 #include "soa/service/process_stats.h"
+#include "jml/arch/format.h"
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
@@ -47,6 +49,10 @@ jsonParse(const std::string & str)
     return Json::parse(str);
 }
 
+/** Agent and index of the worker that the current thread is, if any. */
+static __thread const BiddingAgent * workerAgent = 0;
+static __thread int workerIndex = -1;
+
 /******************************************************************************/
 /* ROUTER PROXY                                                               */
 /******************************************************************************/
@@ -55,10 +61,12 @@ BiddingAgent::
 BiddingAgent(std::shared_ptr<ServiceProxies> proxies,
             const std::string & name)
     : ServiceBase(name, proxies),
+      numWorkers(0),
       toRouters(getZmqContext()),
       toPostAuctionServices(getZmqContext()),
       toConfigurationAgent(getZmqContext()),
       toRouterChannel(65536),
+      shutdown_(false),
       requiresAllCB(true)
 {
 }
@@ -67,10 +75,12 @@ BiddingAgent::
 BiddingAgent(ServiceBase& parent,
             const std::string & name)
     : ServiceBase(name, parent),
+      numWorkers(0),
       toRouters(getZmqContext()),
       toPostAuctionServices(getZmqContext()),
       toConfigurationAgent(getZmqContext()),
       toRouterChannel(65536),
+      shutdown_(false),
       requiresAllCB(true)
 {
 }
@@ -128,6 +138,20 @@ start(const std::string& clientSocketURI, const std::string& name)
     addSource("BiddingAgent::toPostAuctionServices", toPostAuctionServices);
     addSource("BiddingAgent::toConfigurationAgent", toConfigurationAgent);
     addSource("BiddingAgent::toRouterChannel", toRouterChannel);
+
+    shutdown_ = false;
+    for (int i = 0;  i < numWorkers;  ++i) {
+        workers.emplace_back(new Worker());
+        workers.back()->outbox.onEvent = [=] (const RouterMessage & msg)
+            {
+                toRouters.sendMessage(msg.toRouter, msg.type, msg.payload);
+            };
+        addSource(ML::format("BiddingAgent::worker%d", i),
+                  workers.back()->outbox);
+    }
+    for (int i = 0;  i < numWorkers;  ++i)
+        workerThreads.create_thread([=] () { this->runWorker(i); });
+
     MessageLoop::start();
     //MessageLoop::debug(true);
     //toRouters.debug(true);
@@ -137,13 +161,85 @@ void
 BiddingAgent::
 shutdown()
 {
+    // The workers are stopped first, as they can only finish what they're
+    // doing while the loop is still taking their messages for the routers
+    shutdown_ = true;
+    workerThreads.join_all();
+
     MessageLoop::shutdown();
+    workers.clear();
 
     toConfigurationAgent.shutdown();
     toRouters.shutdown();
     //toPostAuctionService.shutdown();
 }
 
+void
+BiddingAgent::
+runWorker(int index)
+{
+    workerAgent = this;
+    workerIndex = index;
+
+    Worker & worker = *workers[index];
+
+    while (!shutdown_) {
+        // Only the loop thread writes to the inbox, so the worker looks
+        // for shutdown itself rather than being sent something
+        Worker::Message message;
+        if (!worker.inbox.tryPop(message, 0.01))
+            continue;
+
+        try {
+            dispatchMessage(message.fromRouter, message.message);
+        } catch (const std::exception & exc) {
+            recordHit("error");
+            cerr << "Error handling message " << message.message
+                 << " on worker " << index << ": " << exc.what() << endl;
+        }
+    }
+}
+
+int
+BiddingAgent::
+workerFor(const std::vector<std::string> & msg) const
+{
+    if (workers.empty())
+        return -1;
+
+    // Hash the auction id as it's written on the wire, which is the same
+    // for all of the messages about an auction
+    const std::string * auctionId = 0;
+    std::string binaryAuctionId;
+
+    const std::string & type = msg[0];
+    if (type == "AUCTION" || type == "IMPRESSION" || type == "CLICK"
+        || type == "VISIT") {
+        if (msg.size() > 2)
+            auctionId = &msg[2];
+    }
+    else if (type == "WIN" || type == "LOSS" || type == "NOBUDGET"
+             || type == "TOOLATE" || type == "INVALID"
+             || type == "DROPPEDBID") {
+        if (msg.size() == 3) {
+            try {
+                binaryAuctionId = BinaryBidResult::createFromString(msg[2])
+                    .auctionId.toString();
+                auctionId = &binaryAuctionId;
+            } catch (...) {
+                // The worker will report it
+            }
+        }
+        else if (msg.size() > 3)
+            auctionId = &msg[3];
+    }
+    else return -1;
+
+    if (!auctionId)
+        return 0;
+    return std::hash<std::string>()(*auctionId) % workers.size();
+}
+
 void
 BiddingAgent::
 handleRouterMessage(const std::string & fromRouter,
@@ -163,6 +259,33 @@ handleRouterMessage(const std::string & fromRouter,
         return;
     }
 
+    if (shutdown_) {
+        recordHit("droppedShuttingDown");
+        return;
+    }
+
+    int worker = workerFor(message);
+    if (worker == -1) {
+        dispatchMessage(fromRouter, message);
+        return;
+    }
+
+    // Blocking here would stop the loop from taking the messages that the
+    // worker sends to the routers, so a worker that's this far behind
+    // misses the message instead.  The router times out any bid that it
+    // was waiting for.
+    Worker::Message toWorker;
+    toWorker.fromRouter = fromRouter;
+    toWorker.message = message;
+    if (!workers[worker]->inbox.tryPush(toWorker))
+        recordHit("droppedWorkerFull");
+}
+
+void
+BiddingAgent::
+dispatchMessage(const std::string & fromRouter,
+                const std::vector<std::string> & message)
+{
     bool invalid = false;
 
     switch (message[0][0]) {
@@ -327,6 +450,17 @@ handleBidRequest(const std::string & fromRouter,
         double timestamp = boost::lexical_cast<double>(msg[1]);
         Id id(msg[2]);
 
+        // Older routers don't send the deadline.  There's no point in
+        // parsing anything once the router has given up on the auction.
+        Date deadline = Date::positiveInfinity();
+        if (msg.size() > 8) {
+            deadline = Date::parseSecondsSinceEpoch(msg[8]);
+            if (Date::now() >= deadline) {
+                recordHit("expiredRequests");
+                return;
+            }
+        }
+
         string bidRequestSource = msg[3];
 
         std::shared_ptr<BidRequest> br(
@@ -338,14 +472,21 @@ handleBidRequest(const std::string & fromRouter,
 
         recordHit("requests");
 
-        if (requests.count(id))
-            throw ML::Exception("seen multiple requests with same ID");
+        Date now = Date::now();
+        if (msg.size() > 8)
+            timeLeftMs = now.secondsUntil(deadline) * 1000.0;
 
         {
-            lock_guard<mutex> guard (requestsLock);
+            RequestShard & shard = requestShard(id);
+            lock_guard<mutex> guard (shard.lock);
+
+            if (shard.requests.count(id))
+                throw ML::Exception("seen multiple requests with same ID");
 
-            requests[id].timestamp = Date::now();
-            requests[id].fromRouter = fromRouter;
+            RequestStatus & status = shard.requests[id];
+            status.timestamp = now;
+            status.fromRouter = fromRouter;
+            status.deadline = deadline;
         }
 
         callback(timestamp, id, br, spots, timeLeftMs, augmentations);
@@ -368,31 +509,9 @@ handleResult(const std::vector<std::string>& msg, ResultCbFn& callback)
     if (!callback) return;
 
     try {
-        checkMessageSize(msg, 6);
-
         recordHit(eventName(msg[0]));
 
-        BidResultArgs args;
-        args.result = msg[0];
-        args.timestamp = boost::lexical_cast<double>(msg[1]);
-        args.confidence = msg[2];
-        args.auctionId = Id(msg[3]);
-        args.spotNum = boost::lexical_cast<int>(msg[4]);
-        args.secondPrice = MicroUSD(Amount::parse(msg[5]));
-
-        // Lightweight messages stop here
-        if (msg.size() > 6) {
-            checkMessageSize(msg, 12);
-            string bidRequestSource = msg[11];
-            args.request.reset(BidRequest::parse(bidRequestSource, msg[6]));
-            args.ourBid = jsonParse(msg[7]);
-            args.accountInfo = jsonParse(msg[8]);
-            args.metadata = jsonParse(msg[9]);
-            args.augmentations = jsonParse(msg[10]);
-        }
-        else {
-            //args.request.reset(new BidRequest());
-        }
+        BidResultArgs args = decodeResult(msg);
 
         if (args.result == "WIN")
             recordLevel(args.secondPrice, "winPrice");
@@ -400,8 +519,9 @@ handleResult(const std::vector<std::string>& msg, ResultCbFn& callback)
         callback(args);
 
         if (msg[0] == "DROPPEDBID") {
-            lock_guard<mutex> guard (requestsLock);
-            requests.erase(Id(msg[3]));
+            RequestShard & shard = requestShard(args.auctionId);
+            lock_guard<mutex> guard (shard.lock);
+            shard.requests.erase(args.auctionId);
         }
 
     } catch (const std::exception & exc) {
@@ -411,6 +531,50 @@ handleResult(const std::vector<std::string>& msg, ResultCbFn& callback)
     }
 }
 
+BiddingAgent::BidResultArgs
+BiddingAgent::
+decodeResult(const std::vector<std::string>& msg)
+{
+    BidResultArgs args;
+    args.result = msg.at(0);
+
+    // Binary results are the date followed by a single BinaryBidResult
+    if (msg.size() == 3) {
+        BinaryBidResult result = BinaryBidResult::createFromString(msg[2]);
+        args.timestamp = result.timestamp.secondsSinceEpoch();
+        args.confidence = result.confidence;
+        args.auctionId = result.auctionId;
+        args.spotNum = result.spotNum;
+        args.secondPrice = MicroUSD(result.price);
+        return args;
+    }
+
+    if (msg.size() < 6)
+        throw ML::Exception("result message of wrong size: %zd vs 6",
+                            msg.size());
+
+    args.timestamp = boost::lexical_cast<double>(msg[1]);
+    args.confidence = msg[2];
+    args.auctionId = Id(msg[3]);
+    args.spotNum = boost::lexical_cast<int>(msg[4]);
+    args.secondPrice = MicroUSD(Amount::parse(msg[5]));
+
+    // Lightweight messages stop here
+    if (msg.size() > 6) {
+        if (msg.size() < 12)
+            throw ML::Exception("full result message of wrong size: "
+                                "%zd vs 12", msg.size());
+        string bidRequestSource = msg[11];
+        args.request.reset(BidRequest::parse(bidRequestSource, msg[6]));
+        args.ourBid = jsonParse(msg[7]);
+        args.accountInfo = jsonParse(msg[8]);
+        args.metadata = jsonParse(msg[9]);
+        args.augmentations = jsonParse(msg[10]);
+    }
+
+    return args;
+}
+
 void
 BiddingAgent::
 handleSimple(const std::vector<std::string>& msg, SimpleCbFn& callback)
@@ -493,6 +657,19 @@ handleDelivery(const std::vector<std::string>& msg, DeliveryCbFn& callback)
     }
 }
 
+Date
+BiddingAgent::
+requestDeadline(const Id & id)
+{
+    RequestShard & shard = requestShard(id);
+    lock_guard<mutex> guard (shard.lock);
+
+    auto it = shard.requests.find(id);
+    if (it == shard.requests.end())
+        return Date();
+    return it->second.deadline;
+}
+
 void
 BiddingAgent::
 doBid (Id id, Json::Value jsonResponse, Json::Value jsonMeta)
@@ -510,13 +687,14 @@ doBid (Id id, Json::Value jsonResponse, Json::Value jsonMeta)
         Date beforeSend;
         string fromRouter;
         {
-            lock_guard<mutex> guard (requestsLock);
+            RequestShard & shard = requestShard(id);
+            lock_guard<mutex> guard (shard.lock);
 
-            auto it = requests.find(id);
-            if (it != requests.end()) {
+            auto it = shard.requests.find(id);
+            if (it != shard.requests.end()) {
                 beforeSend = it->second.timestamp;
                 fromRouter = it->second.fromRouter;
-                requests.erase(it);
+                shard.requests.erase(it);
             }
         }
 
@@ -525,7 +703,7 @@ doBid (Id id, Json::Value jsonResponse, Json::Value jsonMeta)
         }
         else return;
 
-        toRouterChannel.push(RouterMessage(fromRouter, "BID", { id.toString(), response, meta }));
+        sendToRouter(RouterMessage(fromRouter, "BID", { id.toString(), response, meta }));
 
         /** Gather some stats */
         for (int i = 0; i < jsonResponse.size(); ++i) {
@@ -585,7 +763,7 @@ doPong(const std::string & fromRouter, Date sent, Date received,
         };
 
         message.insert(message.end(), payload.begin(), payload.end());
-        toRouterChannel.push(RouterMessage(fromRouter, "PONG1", message));
+        sendToRouter(RouterMessage(fromRouter, "PONG1", message));
     } catch (const std::exception & exc) {
         recordHit("error");
         cerr << "Error submitting pong " << payload
@@ -593,6 +771,16 @@ doPong(const std::string & fromRouter, Date sent, Date received,
     }
 }
 
+void
+BiddingAgent::
+sendToRouter(RouterMessage && message)
+{
+    // A worker has its own queue, so that they don't contend for one
+    if (workerAgent == this)
+        workers[workerIndex]->outbox.push(std::move(message));
+    else toRouterChannel.push(std::move(message));
+}
+
 void
 BiddingAgent::
 doConfig(Json::Value jsonConfig)
@@ -19,12 +19,14 @@
 #include "jml/arch/spinlock.h"
 #include "soa/service/zmq_endpoint.h"
 #include "soa/service/typed_message_channel.h"
+#include "jml/utils/ring_buffer.h"
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/thread/barrier.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
 #include <string>
 #include <vector>
 #include <thread>
@@ -67,7 +69,29 @@ struct BiddingAgent : public ServiceBase, public MessageLoop {
     void start(const std::string& clientSocketURI, const std::string& name);
     void shutdown();
 
+    /** Number of worker threads that decode the messages about auctions
+        (AUCTION, the bid results and the deliveries) and call the callbacks
+        for them.  Messages are given to a worker by a hash of their auction
+        id, so those about the same auction are handled in order by the same
+        thread.  Zero, the default, handles everything on the message loop
+        thread.  The callbacks must be thread safe if it's set.  Must be set
+        before start().  A message for a worker whose queue is full is
+        dropped and counted as droppedWorkerFull.
+    */
+    int numWorkers;
+
     void doBid(Id id, Json::Value response, Json::Value meta);
+
+    /** Absolute time at which the router stops waiting for a bid on the
+        given auction, which assumes that the clocks of the router and agent
+        are kept in sync.  It's positive infinity for routers that don't
+        send one, and an empty Date once the auction has been bid on.
+
+        Requests that arrive after their deadline are dropped without being
+        parsed, and the timeLeftMs passed to onBidRequest is what's left of
+        the deadline when the callback is called.
+    */
+    Date requestDeadline(const Id & id);
     void doPong(const std::string & fromRouter, Date sent, Date received,
                 const std::vector<std::string> & payload);
     void doConfig(Json::Value config);
@@ -132,6 +156,14 @@ struct BiddingAgent : public ServiceBase, public MessageLoop {
     typedef void (ResultCb) (const BidResultArgs & args);
     typedef boost::function<ResultCb> ResultCbFn;
 
+    /** Decode a WIN, LOSS or other bid result message in any of the
+        formats that the agent can configure.  Lightweight and binary
+        results leave the request, ourBid, accountInfo, metadata and
+        augmentations empty; binary ones are decoded without any JSON or
+        text parsing.
+    */
+    static BidResultArgs decodeResult(const std::vector<std::string> & msg);
+
     BidRequestCbFn onBidRequest;
     ResultCbFn onWin;
     ResultCbFn onLoss;
@@ -173,13 +205,58 @@ private:
     ZmqNamedClientBusProxy toConfigurationAgent;
     TypedMessageSink<RouterMessage> toRouterChannel;
 
+    /** Send a message to a router from any thread. */
+    void sendToRouter(RouterMessage && message);
+
     struct RequestStatus {
         Date timestamp;
         std::string fromRouter;
+        Date deadline;
+    };
+
+    /** Auctions waiting for a bid, sharded by auction id so that the
+        workers and the threads calling doBid() rarely want the same lock.
+    */
+    struct RequestShard {
+        std::map<Id, RequestStatus> requests;
+        std::mutex lock;
     };
-    
-    std::map<Id, RequestStatus> requests;
-    std::mutex requestsLock;
+
+    enum { NUM_REQUEST_SHARDS = 64 };
+    RequestShard requestShards[NUM_REQUEST_SHARDS];
+
+    RequestShard & requestShard(const Id & id)
+    {
+        return requestShards[id.hash() % NUM_REQUEST_SHARDS];
+    }
+
+    /** A worker thread, with the messages waiting for it and those it
+        sends back to the routers, which only it writes to.
+    */
+    struct Worker {
+        Worker()
+            : inbox(16384), outbox(65536)
+        {
+        }
+
+        struct Message {
+            std::string fromRouter;
+            std::vector<std::string> message;
+        };
+
+        ML::RingBufferSWMR<Message> inbox;
+        TypedMessageSink<RouterMessage> outbox;
+    };
+
+    std::vector<std::unique_ptr<Worker> > workers;
+    boost::thread_group workerThreads;
+    volatile bool shutdown_;
+
+    void runWorker(int index);
+
+    /** Worker that handles the messages about the given message's auction,
+        or -1 if it's handled on the message loop thread. */
+    int workerFor(const std::vector<std::string> & msg) const;
 
     bool requiresAllCB;
 
@@ -187,8 +264,13 @@ private:
 
     // void doHeartbeat();
 
+protected:
     void handleRouterMessage(const std::string & fromRouter,
                              const std::vector<std::string>& msg);
+
+private:
+    void dispatchMessage(const std::string & fromRouter,
+                         const std::vector<std::string>& msg);
     void handleError(const std::vector<std::string>& msg, ErrorCbFn& callback);
     void handleBidRequest(const std::string & fromRouter,
             const std::vector<std::string>& msg, BidRequestCbFn& callback);
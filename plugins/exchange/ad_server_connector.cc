@@ -8,6 +8,7 @@
 
 #include "ad_server_connector.h"
 #include "rtbkit/core/post_auction/post_auction_loop.h"
+#include "jml/arch/timers.h"
 
 using namespace std;
 
@@ -20,13 +21,18 @@ namespace RTBKIT {
 
 PostAuctionProxy::
 PostAuctionProxy(std::shared_ptr<zmq::context_t> zmqContext)
-    : toPostAuctionService(zmqContext)
+    : toPostAuctionService(zmqContext),
+      maxBatchSize(1),
+      maxBatchDelayUs(0),
+      batch(new PostAuctionEventBatch()),
+      shutdown_(false)
 {
 }
 
 PostAuctionProxy::
 ~PostAuctionProxy()
 {
+    shutdown();
 }
 
 void
@@ -50,16 +56,135 @@ init(std::shared_ptr<ConfigurationService> config)
 #endif
 }
 
+void
+PostAuctionProxy::
+setBatching(size_t maxBatchSize, int maxBatchDelayUs)
+{
+    if (maxBatchSize < 1)
+        throw ML::Exception("batches need at least one event");
+    if (maxBatchDelayUs < 0)
+        throw ML::Exception("negative batch delay");
+    if (flushThread)
+        throw ML::Exception("setBatching() must be called before start()");
+
+    this->maxBatchSize = maxBatchSize;
+    this->maxBatchDelayUs = maxBatchDelayUs;
+}
+
 void
 PostAuctionProxy::
 start()
 {
+    if (!batching())
+        return;
+
+    shutdown_ = false;
+    flushThread.reset
+        (new boost::thread(std::bind(&PostAuctionProxy::runFlushThread,
+                                     this)));
 }
 
 void
 PostAuctionProxy::
 shutdown()
 {
+    if (flushThread) {
+        {
+            Guard guard(lock);
+            shutdown_ = true;
+        }
+        batchStarted.notify_all();
+        flushThread->join();
+        flushThread.reset();
+    }
+
+    flush();
+}
+
+void
+PostAuctionProxy::
+runFlushThread()
+{
+    double maxDelay = maxBatchDelayUs / 1000000.0;
+
+    Guard guard(lock);
+    while (!shutdown_) {
+        if (batch->events.empty()) {
+            batchStarted.wait(guard);
+            continue;
+        }
+
+        // Sleep until the first event of the batch has waited as long as
+        // it can.  If the batch is sent in the meantime because it's full
+        // we're woken up when the next one starts.
+        double wait = maxDelay - Date::now().secondsSince(batchStart);
+        if (wait <= 0.0) {
+            sendBatch();
+            continue;
+        }
+
+        batchStarted.wait_for(guard,
+                              std::chrono::microseconds
+                              ((int64_t)(wait * 1000000.0) + 1));
+    }
+}
+
+void
+PostAuctionProxy::
+flush()
+{
+    Guard guard(lock);
+    sendBatch();
+}
+
+void
+PostAuctionProxy::
+sendBatch()
+{
+    if (batch->events.empty())
+        return;
+
+    string str = ML::DB::serializeToString(*batch);
+    sendToPostAuctionService("EVENTBATCH", str);
+    batch->events.clear();
+}
+
+void
+PostAuctionProxy::
+sendToPostAuctionService(const std::string & messageType,
+                         const std::string & payload)
+{
+    toPostAuctionService.sendMessage(messageType, payload);
+}
+
+void
+PostAuctionProxy::
+sendWinLoss(const std::string & messageType, const PostAuctionEvent & event)
+{
+    if (!batching()) {
+        sendMessage(messageType, event);
+        return;
+    }
+
+    Guard guard(lock);
+    batch->events.push_back(event);
+    if (batch->events.size() >= maxBatchSize)
+        sendBatch();
+    else if (batch->events.size() == 1) {
+        batchStart = Date::now();
+        batchStarted.notify_one();
+    }
+}
+
+void
+PostAuctionProxy::
+sendMessage(const std::string & messageType, const PostAuctionEvent & event)
+{
+    string str = ML::DB::serializeToString(event);
+
+    Guard guard(lock);
+    sendBatch();
+    sendToPostAuctionService(messageType, str);
 }
 
 void
@@ -84,8 +209,7 @@ injectWin(const Id & auctionId,
     event.account = account;
     event.bidTimestamp = bidTimestamp;
 
-    string str = ML::DB::serializeToString(event);
-    toPostAuctionService.sendMessage("WIN", str);
+    sendWinLoss("WIN", event);
 }
 
 void
@@ -106,8 +230,7 @@ injectLoss(const Id & auctionId,
     event.account = account;
     event.bidTimestamp = bidTimestamp;
 
-    string str = ML::DB::serializeToString(event);
-    toPostAuctionService.sendMessage("LOSS", str);
+    sendWinLoss("LOSS", event);
 }
 
 void
@@ -126,8 +249,7 @@ injectImpression(const Id & auctionId,
     event.uids = ids;
     event.metadata = impressionMeta;
 
-    string str = ML::DB::serializeToString(event);
-    toPostAuctionService.sendMessage("IMPRESSION", str);
+    sendMessage("IMPRESSION", event);
 }
     
 void
@@ -146,8 +268,7 @@ injectClick(const Id & auctionId,
     event.uids = ids;
     event.metadata = clickMeta;
 
-    string str = ML::DB::serializeToString(event);
-    toPostAuctionService.sendMessage("CLICK", str);
+    sendMessage("CLICK", event);
 }
 
 void
@@ -163,8 +284,7 @@ injectVisit(Date timestamp,
     event.channels = channels;
     event.metadata = visitMeta;
 
-    string str = ML::DB::serializeToString(event);
-    toPostAuctionService.sendMessage("VISIT", str);
+    sendMessage("VISIT", event);
 }
 
 } // namespace RTBKIT
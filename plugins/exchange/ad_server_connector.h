@@ -14,10 +14,17 @@
 #include "rtbkit/common/json_holder.h"
 #include "rtbkit/common/bid_request.h"
 #include "rtbkit/common/account_key.h"
+#include <boost/thread/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <mutex>
+#include <condition_variable>
 
 
 namespace RTBKIT {
 
+struct PostAuctionEvent;
+struct PostAuctionEventBatch;
+
 
 /*****************************************************************************/
 /* POST AUCTION PROXY                                                        */
@@ -38,6 +45,23 @@ struct PostAuctionProxy {
 
     virtual void shutdown();
 
+    /** Send WINs and LOSSes to the post auction service in batches of up
+        to maxBatchSize events in a single message, holding each one back
+        for at most maxBatchDelayUs microseconds.  The default batch size
+        of 1, or a delay of 0, sends each event as its own message as soon
+        as it's injected.  Must be called before start().
+
+        The other events are still sent one per message, after anything
+        that's batched.  The post auction service handles each auction's
+        events in the order that they were sent; visits are matched up
+        through the user ids instead, and aren't ordered with respect to
+        the other events.
+    */
+    void setBatching(size_t maxBatchSize, int maxBatchDelayUs);
+
+    /** Send any batched events now. */
+    void flush();
+
     /*************************************************************************/
     /* METHODS TO SEND MESSAGES ON                                           */
     /*************************************************************************/
@@ -99,10 +123,51 @@ struct PostAuctionProxy {
                      const JsonHolder & visitMeta,
                      const UserIds & ids);
 
+protected:
+    /** Send a message to the post auction service.  The lock is held. */
+    virtual void sendToPostAuctionService(const std::string & messageType,
+                                          const std::string & payload);
+
 private:
+    /** Are WINs and LOSSes batched? */
+    bool batching() const
+    {
+        return maxBatchSize > 1 && maxBatchDelayUs > 0;
+    }
+
+    /** Send a WIN or LOSS, either directly or by adding it to the current
+        batch. */
+    void sendWinLoss(const std::string & messageType,
+                     const PostAuctionEvent & event);
+
+    /** Send a message, making sure that it goes out after anything that
+        is currently batched. */
+    void sendMessage(const std::string & messageType,
+                     const PostAuctionEvent & event);
+
+    /** Send the current batch.  The lock must be held. */
+    void sendBatch();
+
+    /** Send each batch once its first event has waited for the maximum
+        delay. */
+    void runFlushThread();
+
     // Connection to the post auction loops
     ZmqNamedProxy toPostAuctionService;
 
+    typedef std::mutex Lock;
+    typedef std::unique_lock<Lock> Guard;
+    Lock lock;                    ///< Protects the batch and the socket
+
+    size_t maxBatchSize;
+    int maxBatchDelayUs;
+    std::unique_ptr<PostAuctionEventBatch> batch;
+    Date batchStart;              ///< When the first event was batched
+    std::condition_variable batchStarted;  ///< Wakes up the flush thread
+
+    volatile bool shutdown_;
+    boost::scoped_ptr<boost::thread> flushThread;
+
     // later... when we have multiple services
     //ZmqMultipleNamedClientBusProxy toPostAuctionServices;
 };
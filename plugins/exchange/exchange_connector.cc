@@ -8,6 +8,7 @@
 #include <boost/thread/thread.hpp>
 #include "exchange_connector.h"
 #include "rtbkit/core/router/router.h"
+#include "jml/arch/atomic_ops.h"
 
 
 namespace RTBKIT {
@@ -20,14 +21,18 @@ namespace RTBKIT {
 ExchangeConnector::
 ExchangeConnector(const std::string & name,
                   ServiceBase & parent)
-    : ServiceBase(name, parent)
+    : ServiceBase(name, parent),
+      numNoPotentialBidders(0),
+      router(0)
 {
 }
 
 ExchangeConnector::
 ExchangeConnector(const std::string & name,
                   std::shared_ptr<ServiceProxies> proxies)
-    : ServiceBase(name, proxies)
+    : ServiceBase(name, proxies),
+      numNoPotentialBidders(0),
+      router(0)
 {
 }
 
@@ -43,6 +48,30 @@ setRouter(Router * router)
     this->router = router;
 }
 
+const char *
+ExchangeConnector::
+admitAuction(Date now, Date deadline) const
+{
+    if (!router)
+        return 0;
+
+    auto reason = router->admission.admit(now, deadline);
+    if (reason == AdmissionController::DROP_NONE)
+        return 0;
+    return AdmissionController::print(reason);
+}
+
+bool
+ExchangeConnector::
+hasPotentialBidders(const BidRequest & request)
+{
+    if (!router || router->hasPotentialBidders(request))
+        return true;
+
+    ML::atomic_inc(numNoPotentialBidders);
+    return false;
+}
+
 void
 ExchangeConnector::
 start()
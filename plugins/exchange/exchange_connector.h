@@ -9,6 +9,7 @@
 
 #include "soa/service/service_base.h"
 #include "rtbkit/common/auction.h"
+#include "rtbkit/common/bid_request.h"
 
 namespace RTBKIT {
 
@@ -67,6 +68,23 @@ struct ExchangeConnector: public ServiceBase {
     */
     virtual void setAcceptBidRequestProbability(double prob) = 0;
 
+    /** Ask the router whether a bid request that arrived at now and needs
+        to be answered by deadline is worth starting on.  Returns null if
+        it is, or the reason for dropping it otherwise.  This should be
+        called before doing any expensive work like parsing the request.
+    */
+    const char * admitAuction(Date now, Date deadline) const;
+
+    /** Could any of the router's current agents possibly bid on the given
+        request?  If not, the exchange connector can answer with a no-bid
+        straight away without creating an auction for it.  Counts the
+        requests it says no to in numNoPotentialBidders.
+    */
+    bool hasPotentialBidders(const BidRequest & request);
+
+    /** Number of requests rejected by hasPotentialBidders(). */
+    uint64_t numNoPotentialBidders;
+
     /*************************************************************************/
     /* FACTORY INTERFACE                                                     */
     /*************************************************************************/
@@ -15,6 +15,8 @@
 #include "jml/utils/set_utils.h"
 #include "jml/utils/vector_utils.h"
 #include "jml/arch/timers.h"
+#include "rtbkit/common/auction_trace.h"
+#include "rtbkit/common/auction_pool.h"
 #include <set>
 
 #include <boost/foreach.hpp>
@@ -275,13 +277,41 @@ handleHttpPayload(const HttpHeader & header,
     Date expiry = firstData.plusSeconds
         (max(5.0, (timeAvailableMs - networkTimeMs)) / 1000.0);
 
+    // Drop it now if the router can't get it bid on in time with the delays
+    // that it's currently seeing.
+    const char * dropReason
+        = endpoint->admitAuction(now, firstData.plusSeconds
+                                 ((timeAvailableMs - networkTimeMs) / 1000.0));
+    if (dropReason) {
+        doEvent(ML::format("auctionEarlyDrop.admission.%s",
+                           dropReason).c_str());
+        dropAuction(ML::format("admission control: %s", dropReason));
+        return;
+    }
+
     try {
         auto bidRequest = parseBidRequest(header, payload);
 
-        auction.reset(new Auction(handleAuction, bidRequest,
-                                  bidRequest->toJsonStr(),
-                                  "datacratic",
-                                  firstData, expiry));
+        AuctionTrace::record(bidRequest->auctionId, AP_EXCHANGE_REQUEST,
+                             firstData);
+        AuctionTrace::record(bidRequest->auctionId, AP_EXCHANGE_PARSED);
+
+        // If none of the agents could bid on it then there's no point in
+        // stringifying it and sending it through the router.  We still
+        // need an auction to build the no-bid response from.
+        if (!endpoint->hasPotentialBidders(*bidRequest)) {
+            auction = AuctionPool::global().create(handleAuction, bidRequest,
+                                                   "", "datacratic",
+                                                   firstData, expiry);
+            doEvent("auctionEarlyDrop.noPotentialBidders");
+            dropAuction("no potential bidders");
+            return;
+        }
+
+        auction = AuctionPool::global().create(handleAuction, bidRequest,
+                                               bidRequest->toJsonStr(),
+                                               "datacratic",
+                                               firstData, expiry);
 
 #if 0
         static std::mutex lock;
@@ -379,6 +409,14 @@ sendResponse()
     
     cancelTimer();
 
+    if (AuctionTrace::sampled(auction->id)) {
+        int numBids = 0;
+        for (auto & responses: auction->getResponses())
+            if (!responses.empty() && responses[0].valid())
+                ++numBids;
+        AuctionTrace::record(auction->id, AP_EXCHANGE_RESPONSE, -1, numBids);
+    }
+
     endpoint->onAuctionDone(auction);
 
     //cerr << "sendResponse " << this << ": disconnected "
@@ -436,6 +474,9 @@ void
 HttpAuctionHandler::
 dropAuction(const std::string & reason)
 {
+    if (auction)
+        AuctionTrace::record(auction->id, AP_EXCHANGE_DROPPED);
+
     auto onSendFinished = [=] ()
         {
             if (random() % 1000 == 0) {
@@ -117,6 +117,7 @@ getServiceStatus() const
     result["connectionLoadFactor"]
         = xdiv<float>(numServingRequest(),
                       numConnections());
+    result["numNoPotentialBidders"] = (double)numNoPotentialBidders;
     
     map<string, int> peerCounts = numConnectionsByHost();
     
@@ -0,0 +1,231 @@
+/* auction_pool_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Test and benchmark for the pool of recycled auctions.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "rtbkit/common/auction_pool.h"
+#include "jml/arch/format.h"
+#include "jml/utils/environment.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+#include <iostream>
+#include <deque>
+#include <mutex>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+/// The benchmark is only run when asked for
+Env_Option<bool> runBenchmarks("RTBKIT_RUN_BENCHMARKS", false);
+
+namespace {
+
+std::shared_ptr<BidRequest> makeRequest(int auctionNum, int numSpots)
+{
+    auto result = std::make_shared<BidRequest>();
+    result->auctionId = Id(auctionNum + 1);
+    result->exchange = "test";
+    result->url = Url("http://datacratic.com/page" + to_string(auctionNum));
+    for (int i = 0;  i < numSpots;  ++i)
+        result->spots.push_back(AdSpot(Id(i + 1)));
+    return result;
+}
+
+std::shared_ptr<Auction>
+makeAuction(AuctionPool & pool, int auctionNum, int numSpots = 2)
+{
+    auto request = makeRequest(auctionNum, numSpots);
+    Date now = Date::now();
+    return pool.create(Auction::HandleAuction(), request,
+                       request->toJsonStr(), "datacratic",
+                       now, now.plusSeconds(0.1));
+}
+
+Auction::Response makeResponse(const std::string & agent, int priority)
+{
+    return Auction::Response(Auction::Price(USD_CPM(1), priority), 1,
+                             AccountKey("campaign:strategy"),
+                             false, agent);
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_auction_pool_recycles )
+{
+    AuctionPool pool(16);
+
+    int numFinished = 0;
+    Auction * first;
+
+    {
+        auto auction = makeAuction(pool, 0, 3);
+        first = auction.get();
+
+        auction->handleAuction = [&] (std::shared_ptr<Auction> a)
+            {
+                ++numFinished;
+            };
+        BOOST_CHECK_EQUAL(auction->setResponse(0, makeResponse("a", 1)),
+                          Auction::PENDING);
+        BOOST_CHECK_EQUAL(auction->setResponse(0, makeResponse("b", 2)),
+                          Auction::PENDING);
+        auction->agentAugmentations["a"] = "{}";
+        auction->augmentations.insertGlobal
+            (Augmentation(set<string>({ "tag" })));
+        BOOST_CHECK(auction->finish());
+        BOOST_CHECK_EQUAL(numFinished, 1);
+    }
+
+    AuctionPool::Stats stats = pool.stats();
+    BOOST_CHECK_EQUAL(stats.allocated, 1);
+    BOOST_CHECK_EQUAL(stats.released, 1);
+    BOOST_CHECK_EQUAL(stats.pooled, 1);
+
+    // A pooled auction doesn't keep its request or augmentations alive
+    BOOST_CHECK(!first->request);
+    BOOST_CHECK(first->augmentations.empty());
+    BOOST_CHECK(first->agentAugmentations.empty());
+    BOOST_CHECK(!first->handleAuction);
+
+    // Comes back as if it were new
+    auto auction = makeAuction(pool, 1, 1);
+    BOOST_CHECK_EQUAL(auction.get(), first);
+    BOOST_CHECK_EQUAL(auction->id, Id(2));
+    BOOST_CHECK_EQUAL(auction->numSpots(), 1);
+    BOOST_CHECK(!auction->tooLate());
+    BOOST_CHECK(!auction->getCurrentData()->hasValidResponse(0));
+    BOOST_CHECK(auction->agentAugmentations.empty());
+    BOOST_CHECK(auction->augmentations.empty());
+    BOOST_CHECK(!auction->handleAuction);
+
+    // shared_from_this works on the recycled auction
+    std::shared_ptr<Auction> seen;
+    auction->handleAuction = [&] (std::shared_ptr<Auction> a) { seen = a; };
+    BOOST_CHECK(auction->finish());
+    BOOST_CHECK_EQUAL(seen.get(), auction.get());
+    seen.reset();
+
+    stats = pool.stats();
+    BOOST_CHECK_EQUAL(stats.reused, 1);
+    BOOST_CHECK_EQUAL(stats.pooled, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_auction_pool_limits )
+{
+    AuctionPool pool(2);
+
+    {
+        vector<std::shared_ptr<Auction> > auctions;
+        for (unsigned i = 0;  i < 5;  ++i)
+            auctions.push_back(makeAuction(pool, i));
+    }
+
+    AuctionPool::Stats stats = pool.stats();
+    BOOST_CHECK_EQUAL(stats.allocated, 5);
+    BOOST_CHECK_EQUAL(stats.released, 5);
+    BOOST_CHECK_EQUAL(stats.freed, 3);
+    BOOST_CHECK_EQUAL(stats.pooled, 2);
+
+    // No pooling at all
+    AuctionPool unpooled(0);
+    makeAuction(unpooled, 0);
+    makeAuction(unpooled, 1);
+    stats = unpooled.stats();
+    BOOST_CHECK_EQUAL(stats.allocated, 2);
+    BOOST_CHECK_EQUAL(stats.reused, 0);
+    BOOST_CHECK_EQUAL(stats.released, 0);
+    BOOST_CHECK_EQUAL(stats.pooled, 0);
+}
+
+/* Several "exchange" threads create auctions and hand them to a single
+   "router" thread, which drops the last reference, as happens in the
+   router.  Set RTBKIT_RUN_BENCHMARKS=1 to run it.
+*/
+BOOST_AUTO_TEST_CASE( benchmark_auction_pool )
+{
+    if (!runBenchmarks)
+        return;
+
+    int numThreads = 4;
+    int numPerThread = 50000;
+
+    auto run = [&] (AuctionPool & pool)
+        {
+            std::mutex lock;
+            std::deque<std::shared_ptr<Auction> > queue;
+            int numDone = 0;
+            bool finished = false;
+
+            auto router = [&] ()
+                {
+                    for (;;) {
+                        std::shared_ptr<Auction> auction;
+                        {
+                            std::unique_lock<std::mutex> guard(lock);
+                            if (queue.empty()) {
+                                if (finished) return;
+                                continue;
+                            }
+                            auction = queue.front();
+                            queue.pop_front();
+                        }
+                        auction->setResponse(0, makeResponse("agent", 1));
+                        auction->finish();
+                        ++numDone;
+                    }
+                };
+
+            auto exchange = [&] (int thread)
+                {
+                    for (int i = 0;  i < numPerThread;  ++i) {
+                        auto auction
+                            = makeAuction(pool, thread * numPerThread + i);
+                        auction->handleAuction
+                            = [] (std::shared_ptr<Auction>) {};
+                        std::unique_lock<std::mutex> guard(lock);
+                        queue.push_back(auction);
+                    }
+                };
+
+            Date before = Date::now();
+
+            boost::thread routerThread(router);
+            boost::thread_group exchangeThreads;
+            for (int i = 0;  i < numThreads;  ++i)
+                exchangeThreads.create_thread(std::bind(exchange, i));
+            exchangeThreads.join_all();
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                finished = true;
+            }
+            routerThread.join();
+
+            BOOST_CHECK_EQUAL(numDone, numThreads * numPerThread);
+
+            return numDone / Date::now().secondsSince(before);
+        };
+
+    AuctionPool unpooled(0);
+    double unpooledRate = run(unpooled);
+
+    AuctionPool pooled(4096);
+    double pooledRate = run(pooled);
+
+    cerr << ML::format("auctions/second: %.0f without pool, %.0f with pool",
+                       unpooledRate, pooledRate)
+         << endl;
+    cerr << "pool: " << pooled.stats().toJson() << endl;
+
+    AuctionPool::Stats stats = pooled.stats();
+    BOOST_CHECK_EQUAL(stats.allocated + stats.reused,
+                      numThreads * numPerThread);
+    BOOST_CHECK_GT(stats.reused, 0);
+}
@@ -0,0 +1,157 @@
+/* auction_trace_test.cc
+   Copyright (c) 2013 Datacratic.  All rights reserved.
+
+   Tests for the sampled auction phase tracing.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "rtbkit/common/auction_trace.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+#include <map>
+
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+using namespace RTBKIT;
+
+
+BOOST_AUTO_TEST_CASE( test_trace_sampling )
+{
+    AuctionTrace::clear();
+
+    AuctionTrace::setSampleRate(0.0);
+    for (unsigned i = 0;  i < 1000;  ++i)
+        AuctionTrace::record(Id(i + 1), AP_ROUTER_NEW);
+    BOOST_CHECK_EQUAL(AuctionTrace::records().size(), 0);
+
+    AuctionTrace::setSampleRate(1.0);
+    for (unsigned i = 0;  i < 1000;  ++i)
+        AuctionTrace::record(Id(i + 1), AP_ROUTER_NEW);
+    BOOST_CHECK_EQUAL(AuctionTrace::records().size(), 1000);
+
+    // Small ids are spread out, so a tenth samples about a tenth of them
+    AuctionTrace::setSampleRate(0.1);
+    int numSampled = 0;
+    for (unsigned i = 0;  i < 10000;  ++i)
+        numSampled += AuctionTrace::sampled(Id(i + 1));
+    BOOST_CHECK_GT(numSampled, 800);
+    BOOST_CHECK_LT(numSampled, 1200);
+
+    AuctionTrace::clear();
+    BOOST_CHECK_EQUAL(AuctionTrace::records().size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_trace_auction_records )
+{
+    AuctionTrace::setSampleRate(1.0);
+    AuctionTrace::clear();
+
+    Id auction1("auction1"), auction2("auction2");
+    Date start = Date::now();
+
+    AuctionTrace::record(auction1, AP_ROUTER_NEW, start);
+    AuctionTrace::record(auction2, AP_ROUTER_NEW, start.plusSeconds(0.001));
+    AuctionTrace::record(auction1, AP_AGENT_BID, start.plusSeconds(0.003),
+                         4, 2);
+    AuctionTrace::record(auction1, AP_START_BIDDING, start.plusSeconds(0.002),
+                         -1, 1);
+
+    auto records = AuctionTrace::records(auction1);
+    BOOST_REQUIRE_EQUAL(records.size(), 3);
+
+    // Sorted by time, not by the order of recording
+    BOOST_CHECK_EQUAL(records[0].phase, AP_ROUTER_NEW);
+    BOOST_CHECK_EQUAL(records[1].phase, AP_START_BIDDING);
+    BOOST_CHECK_EQUAL(records[2].phase, AP_AGENT_BID);
+    BOOST_CHECK_EQUAL(records[2].agentSlot, 4);
+    BOOST_CHECK_EQUAL(records[2].payload, 2);
+
+    for (auto & r: records)
+        BOOST_CHECK_EQUAL(r.auction, auction1.hash());
+
+    BOOST_CHECK_EQUAL(AuctionTrace::records().size(), 4);
+
+    // JSON round trip
+    auto decoded = AuctionTrace::fromJson(AuctionTrace::toJson(records));
+    BOOST_REQUIRE_EQUAL(decoded.size(), records.size());
+    for (unsigned i = 0;  i < records.size();  ++i) {
+        BOOST_CHECK_EQUAL(decoded[i].auction, records[i].auction);
+        BOOST_CHECK_EQUAL(decoded[i].phase, records[i].phase);
+        BOOST_CHECK_EQUAL(decoded[i].agentSlot, records[i].agentSlot);
+        BOOST_CHECK_EQUAL(decoded[i].payload, records[i].payload);
+        BOOST_CHECK_EQUAL(decoded[i].thread, records[i].thread);
+        BOOST_CHECK_CLOSE(decoded[i].timestamp, records[i].timestamp, 1e-9);
+    }
+
+    // One slice between each pair of consecutive phases
+    Json::Value chrome = AuctionTrace::toChromeTrace(records);
+    const Json::Value & events = chrome["traceEvents"];
+    int numSlices = 0, numInstants = 0;
+    for (unsigned i = 0;  i < events.size();  ++i) {
+        if (events[i]["ph"].asString() == "X") {
+            ++numSlices;
+            BOOST_CHECK_GE(events[i]["dur"].asDouble(), 0.0);
+        }
+        else if (events[i]["ph"].asString() == "i")
+            ++numInstants;
+    }
+    BOOST_CHECK_EQUAL(numSlices, 2);
+    BOOST_CHECK_EQUAL(numInstants, 3);
+
+    AuctionTrace::clear();
+}
+
+BOOST_AUTO_TEST_CASE( test_trace_multithreaded )
+{
+    AuctionTrace::setSampleRate(1.0);
+    AuctionTrace::clear();
+
+    // Also checks that the ring buffers of new threads wrap around
+    AuctionTrace::setBufferSize(256);
+
+    int numThreads = 4;
+    int numRecords = 1000;
+
+    boost::thread_group threads;
+    for (int t = 0;  t < numThreads;  ++t) {
+        auto doThread = [=] ()
+            {
+                for (int i = 0;  i < numRecords;  ++i)
+                    AuctionTrace::record(Id(t * numRecords + i + 1),
+                                         AP_AGENT_BID, t, i);
+            };
+        threads.create_thread(doThread);
+    }
+
+    // Read while they're being written
+    for (unsigned i = 0;  i < 10;  ++i)
+        AuctionTrace::records();
+
+    threads.join_all();
+
+    auto records = AuctionTrace::records();
+    BOOST_CHECK_EQUAL(records.size(), numThreads * 256);
+
+    // Each of the threads kept its most recent records, in order
+    map<int, vector<AuctionTraceRecord> > byAgent;
+    for (auto & r: records)
+        byAgent[r.agentSlot].push_back(r);
+
+    BOOST_CHECK_EQUAL(byAgent.size(), numThreads);
+    for (auto & a: byAgent) {
+        BOOST_REQUIRE_EQUAL(a.second.size(), 256);
+        for (auto & r: a.second) {
+            BOOST_CHECK_EQUAL(r.thread, a.second[0].thread);
+            BOOST_CHECK_GE(r.payload, numRecords - 256);
+        }
+    }
+
+    AuctionTrace::setBufferSize(16384);
+    BOOST_CHECK_THROW(AuctionTrace::setBufferSize(1000), ML::Exception);
+    AuctionTrace::clear();
+}
@@ -186,3 +186,95 @@ BOOST_FIXTURE_TEST_CASE( test_merge, AugmentationFixture )
 
 }
 
+
+
+BOOST_FIXTURE_TEST_CASE( test_projection, AugmentationFixture )
+{
+    AugmentationList list;
+    list[AccountKey()] = { {tag0}, data0 };
+    list[accA] = { {tag1}, data1 };
+    list[accBB] = { {tag2}, data2 };
+    list[accBC];
+    list[accBBA] = { {tag1}, data1 };
+
+    // tag2 isn't used by any filter so it doesn't get an id.
+    AugmentationTagTable table;
+    unsigned id0 = table.intern(tag0);
+    unsigned id1 = table.intern(tag1);
+    BOOST_CHECK_EQUAL(table.intern(tag0), id0);
+    BOOST_CHECK_EQUAL(table.find(tag2), -1);
+
+    AugmentationProjection projection(list, table);
+
+    AccountKey acc0({ "A", "B" });
+    AccountKey acc1({ "C" });
+
+    for (const AccountKey& key : { AccountKey(), accA, accBB, accBC, accBBA,
+                                   acc0, acc1 })
+    {
+        auto aug = list.filterForAccount(key);
+
+        string expected = aug.toJson().toString();
+        while (!expected.empty() && expected[expected.size() - 1] == '\n')
+            expected.erase(expected.size() - 1);
+
+        BOOST_CHECK_EQUAL(projection.serializedForAccount(key), expected);
+
+        // Memoized: the same string is handed out each time.
+        BOOST_CHECK_EQUAL(&projection.serializedForAccount(key),
+                          &projection.serializedForAccount(key));
+
+        const AugmentationTagSet& tags = projection.tagsForAccount(key);
+        BOOST_CHECK_EQUAL(tags.count(id0), aug.tags.count(tag0));
+        BOOST_CHECK_EQUAL(tags.count(id1), aug.tags.count(tag1));
+    }
+
+    // Accounts that end up on the same node share their serialization.
+    BOOST_CHECK_EQUAL(&projection.serializedForAccount(acc0),
+                      &projection.serializedForAccount(accA));
+}
+
+
+BOOST_FIXTURE_TEST_CASE( test_tag_filter, AugmentationFixture )
+{
+    AugmentationTagTable table;
+
+    vector<string> none;
+    vector<string> include = { tag0, tag1 };
+    vector<string> exclude = { tag2 };
+
+    AugmentationTagFilter all;
+    all.compile(none, none, table);
+
+    AugmentationTagFilter filter;
+    filter.compile(include, exclude, table);
+
+    // Same rules as IncludeExclude<std::string>::anyIsIncluded
+    vector<pair<set<string>, bool> > cases = {
+        { {}, false },
+        { { tag0 }, true },
+        { { tag1, tag2 }, false },
+        { { tag2 }, false },
+        { { "unknown" }, false },
+        { { tag1, "unknown" }, true }
+    };
+
+    for (const auto& c : cases) {
+        AugmentationTagSet set = table.lookup(c.first);
+        BOOST_CHECK_EQUAL(filter.passes(set), c.second);
+        BOOST_CHECK(all.passes(set));
+    }
+
+    // Ids past the first word of the bitmask.
+    AugmentationTagSet high;
+    high.insert(130);
+    BOOST_CHECK(high.count(130));
+    BOOST_CHECK(!high.count(2));
+    BOOST_CHECK(!high.empty());
+
+    AugmentationTagSet low;
+    low.insert(2);
+    BOOST_CHECK(!low.intersects(high));
+    low.insert(high);
+    BOOST_CHECK(low.intersects(high));
+}
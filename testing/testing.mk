@@ -9,5 +9,7 @@
 $(eval $(call vowscoffee_test,bid_request_test,bid_request))
 $(eval $(call test,agent_configuration_test,rtb_router bidding_agent,boost))
 $(eval $(call test,augmentation_list_test,rtb,boost))
+$(eval $(call test,auction_trace_test,rtb,boost))
+$(eval $(call test,auction_pool_test,rtb boost_thread,boost))
 
 $(eval $(call library,integration_test_utils,generic_exchange_connector.cc mock_exchange.cc,rtb_router exchange))